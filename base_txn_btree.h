@@ -11,6 +11,7 @@
 #include <map>
 #include <type_traits>
 #include <memory>
+#include <atomic>
 
 // each Transaction implementation should specialize this for special
 // behavior- the default implementation is just nops
@@ -20,6 +21,17 @@ struct base_txn_btree_handler {
   static const bool has_background_task = false;
 };
 
+namespace private_ {
+  // shared by all base_txn_btree instantiations (and translation units, so
+  // this must not be static)
+  inline unsigned
+  next_table_id()
+  {
+    static std::atomic<unsigned> s_next_table_id(0);
+    return s_next_table_id.fetch_add(1, std::memory_order_acq_rel);
+  }
+}
+
 template <template <typename> class Transaction, typename P>
 class base_txn_btree {
 public:
@@ -34,6 +46,7 @@ public:
             const std::string &name = "<unknown>")
     : value_size_hint(value_size_hint),
       name(name),
+      table_id(private_::next_table_id()),
       been_destructed(false)
   {
     base_txn_btree_handler<Transaction>::on_construct();
@@ -67,6 +80,16 @@ public:
     underlying_btree.print();
   }
 
+  // every btree gets a process wide table id, in construction order. the
+  // logging subsystem writes table ids (not names) into the log, so
+  // recovery relies on tables being constructed in the same order on
+  // restart
+  inline unsigned
+  get_table_id() const
+  {
+    return table_id;
+  }
+
   /**
    * only call when you are sure there are no concurrent modifications on the
    * tree. is neither threadsafe nor transactional
@@ -147,9 +170,13 @@ protected:
           Transaction<Traits> *t,
           Callback *caller_callback,
           KeyReader *key_reader,
-          ValueReader *value_reader)
+          ValueReader *value_reader,
+          bool for_update,
+          bool ranged)
       : t(t), caller_callback(caller_callback),
-        key_reader(key_reader), value_reader(value_reader) {}
+        key_reader(key_reader), value_reader(value_reader),
+        for_update(for_update), ranged(ranged),
+        nkeys(0), fingerprint(0), stopped_at(nullptr) {}
 
     virtual void on_resp_node(const typename concurrent_btree::node_opaque_t *n, uint64_t version);
     virtual bool invoke(const typename concurrent_btree::string_type &k, typename concurrent_btree::value_type v,
@@ -160,13 +187,27 @@ protected:
     Callback *const caller_callback;
     KeyReader *const key_reader;
     ValueReader *const value_reader;
+    const bool for_update;
+
+  public:
+    // if ranged, the scan is kept for key-range validation (see
+    // transaction_base::SetRangeValidation()), and sums up the tuples it
+    // comes across. stopped_at is the last key read, if the caller
+    // stopped the scan
+    const bool ranged;
+    size_t nkeys;
+    uint64_t fingerprint;
+    std::string *stopped_at;
   };
 
+  // for_update read locks the records read (see
+  // transaction::do_tuple_read())
   template <typename Traits, typename ValueReader>
   inline bool
   do_search(Transaction<Traits> &t,
             const typename P::Key &k,
-            ValueReader &value_reader);
+            ValueReader &value_reader,
+            bool for_update = false);
 
   template <typename Traits, typename Callback,
             typename KeyReader, typename ValueReader>
@@ -176,7 +217,8 @@ protected:
                        const typename P::Key *upper,
                        Callback &callback,
                        KeyReader &key_reader,
-                       ValueReader &value_reader);
+                       ValueReader &value_reader,
+                       bool for_update = false);
 
   template <typename Traits, typename Callback,
             typename KeyReader, typename ValueReader>
@@ -186,7 +228,8 @@ protected:
                         const typename P::Key *lower,
                         Callback &callback,
                         KeyReader &key_reader,
-                        ValueReader &value_reader);
+                        ValueReader &value_reader,
+                        bool for_update = false);
 
   // expect_new indicates if we expect the record to not exist in the tree-
   // is just a hint that affects perf, not correctness. remove is put with nullptr
@@ -200,9 +243,56 @@ protected:
                    dbtuple::tuple_writer_t writer,
                    bool expect_new);
 
+  // a blind write of v to the record at k, whose writer computes the new
+  // record from the latest version at commit, under the tuple lock (e.g.
+  // typed_txn_btree::increment()). nothing is read, so such writes do not
+  // conflict with each other. a second one to the same record by the txn
+  // is folded into the first by merge(), and must have the same writer.
+  //
+  // returns false, having read the record as absent, if there is no record
+  // at k. value_reader is only used to find that out, in case the record
+  // looks removed
+  template <typename Traits, typename ValueReader>
+  bool do_tree_commutative_put(Transaction<Traits> &t,
+                               const std::string *k,
+                               const typename P::Value *v,
+                               dbtuple::tuple_writer_t writer,
+                               void (*merge)(typename P::Value *, const typename P::Value *),
+                               ValueReader &value_reader);
+
+  // the write half of do_tree_commutative_put(), to px, which stands for
+  // the record at k. btr is the tree px is in, or nullptr for a tuple
+  // kept outside of any tree, which commit must then never replace (the
+  // slices of typed_txn_btree::split() records)
+  template <typename Traits>
+  void do_commutative_write(Transaction<Traits> &t,
+                            dbtuple *px,
+                            const std::string *k,
+                            const typename P::Value *v,
+                            dbtuple::tuple_writer_t writer,
+                            void (*merge)(typename P::Value *, const typename P::Value *),
+                            concurrent_btree *btr);
+
+  // reads a tuple kept outside of the tree as part of t, so that it is
+  // validated at commit like any other read
+  template <typename Traits, typename ValueReader>
+  static inline bool
+  do_outside_tuple_read(Transaction<Traits> &t,
+                        const dbtuple *tuple,
+                        ValueReader &value_reader)
+  {
+    ++transaction_base::g_evt_split_slice_reads;
+    return t.do_tuple_read(tuple, value_reader);
+  }
+
+  // frees the latest version of a record, which is being purged along
+  // with its tree (or on its own, if kept outside of it)
+  static void release_purged_tuple(dbtuple *tuple);
+
   concurrent_btree underlying_btree;
   size_type value_size_hint;
   std::string name;
+  const unsigned table_id;
   bool been_destructed;
 };
 
@@ -217,7 +307,8 @@ bool
 base_txn_btree<Transaction, P>::do_search(
     Transaction<Traits> &t,
     const typename P::Key &k,
-    ValueReader &value_reader)
+    ValueReader &value_reader,
+    bool for_update)
 {
   t.ensure_active();
 
@@ -231,10 +322,11 @@ base_txn_btree<Transaction, P>::do_search(
   const bool found = this->underlying_btree.search(varkey(*key_str), underlying_v, &search_info);
   if (found) {
     const dbtuple * const tuple = reinterpret_cast<const dbtuple *>(underlying_v);
-    return t.do_tuple_read(tuple, value_reader);
+    return t.do_tuple_read(tuple, value_reader, for_update);
   } else {
     // not found, add to absent_set
-    t.do_node_read(search_info.first, search_info.second);
+    t.do_node_read(search_info.first, search_info.second,
+                   t.add_absent_range(&this->underlying_btree, key_str));
     return false;
   }
 }
@@ -279,22 +371,7 @@ base_txn_btree<Transaction, P>::purge_tree_walker::on_node_success()
     purge_stats_tuple_alloc_size_counts[tuple->alloc_size]++;
     //purge_stats_tuple_chain_counts[tuple->chain_length()]++;
 #endif
-    if (base_txn_btree_handler<Transaction>::has_background_task) {
-#ifdef CHECK_INVARIANTS
-      lock_guard<dbtuple> l(tuple, false);
-#endif
-      if (!tuple->is_deleting()) {
-        INVARIANT(tuple->is_latest());
-        tuple->clear_latest();
-        tuple->mark_deleting();
-        dbtuple::release(tuple);
-      } else {
-        // enqueued already to background gc by the writer of the delete
-      }
-    } else {
-      // XXX: this path is probably not right
-      dbtuple::release_no_rcu(tuple);
-    }
+    release_purged_tuple(tuple);
   }
 #ifdef TXN_BTREE_DUMP_PURGE_STATS
   purge_stats_nkeys_node.push_back(spec_values.size());
@@ -308,6 +385,28 @@ done:
   spec_values.clear();
 }
 
+template <template <typename> class Transaction, typename P>
+void
+base_txn_btree<Transaction, P>::release_purged_tuple(dbtuple *tuple)
+{
+  if (base_txn_btree_handler<Transaction>::has_background_task) {
+#ifdef CHECK_INVARIANTS
+    lock_guard<dbtuple> l(tuple, false);
+#endif
+    if (!tuple->is_deleting()) {
+      INVARIANT(tuple->is_latest());
+      tuple->clear_latest();
+      tuple->mark_deleting();
+      dbtuple::release(tuple);
+    } else {
+      // enqueued already to background gc by the writer of the delete
+    }
+  } else {
+    // XXX: this path is probably not right
+    dbtuple::release_no_rcu(tuple);
+  }
+}
+
 template <template <typename> class Transaction, typename P>
 void
 base_txn_btree<Transaction, P>::purge_tree_walker::on_node_failure()
@@ -338,8 +437,20 @@ void base_txn_btree<Transaction, P>::do_tree_put(
   dbtuple *px = nullptr;
   bool insert = false;
 retry:
-  if (expect_new) {
-    auto ret = t.try_insert_new_tuple(this->underlying_btree, k, v, writer);
+  if (expect_new &&
+      !Traits::read_own_writes &&
+      unlikely(transaction_base::IsDeferredInserts())) {
+    // if the key is absent, it goes into the tree at commit
+    typename concurrent_btree::value_type bv = 0;
+    if (!this->underlying_btree.search(varkey(*k), bv)) {
+      t.defer_insert_new_tuple(
+          this->underlying_btree, this->table_id, k, v, writer);
+      return;
+    }
+    px = reinterpret_cast<dbtuple *>(bv);
+  } else if (expect_new) {
+    auto ret = t.try_insert_new_tuple(
+        this->underlying_btree, this->table_id, k, v, writer);
     INVARIANT(!ret.second || ret.first);
     if (unlikely(ret.second)) {
       const transaction_base::abort_reason r = transaction_base::ABORT_REASON_WRITE_NODE_INTERFERENCE;
@@ -365,7 +476,8 @@ retry:
   INVARIANT(px);
   if (!insert) {
     // add to write set normally, as non-insert
-    t.write_set.emplace_back(px, k, v, writer, &this->underlying_btree, false);
+    t.write_set.emplace_back(
+        px, k, v, writer, &this->underlying_btree, this->table_id, false);
   } else {
     // should already exist in write set as insert
     // (because of try_insert_new_tuple())
@@ -376,6 +488,65 @@ retry:
   }
 }
 
+template <template <typename> class Transaction, typename P>
+template <typename Traits, typename ValueReader>
+bool
+base_txn_btree<Transaction, P>::do_tree_commutative_put(
+    Transaction<Traits> &t,
+    const std::string *k,
+    const typename P::Value *v,
+    dbtuple::tuple_writer_t writer,
+    void (*merge)(typename P::Value *, const typename P::Value *),
+    ValueReader &value_reader)
+{
+  INVARIANT(k);
+  INVARIANT(v);
+  t.ensure_active();
+  typename concurrent_btree::value_type bv = 0;
+  concurrent_btree::versioned_node_t search_info;
+  if (!this->underlying_btree.search(varkey(*k), bv, &search_info)) {
+    t.do_node_read(search_info.first, search_info.second,
+                   t.add_absent_range(&this->underlying_btree, k));
+    return false;
+  }
+  dbtuple * const px = reinterpret_cast<dbtuple *>(bv);
+  if (unlikely(px->is_deleting()) && !t.do_tuple_read(px, value_reader))
+    return false;
+  do_commutative_write(t, px, k, v, writer, merge, &this->underlying_btree);
+  return true;
+}
+
+template <template <typename> class Transaction, typename P>
+template <typename Traits>
+void
+base_txn_btree<Transaction, P>::do_commutative_write(
+    Transaction<Traits> &t,
+    dbtuple *px,
+    const std::string *k,
+    const typename P::Value *v,
+    dbtuple::tuple_writer_t writer,
+    void (*merge)(typename P::Value *, const typename P::Value *),
+    concurrent_btree *btr)
+{
+  auto it = t.find_write_set(px);
+  if (it != t.write_set.end()) {
+    // mixing with other writes to the record would need the order of the
+    // writes kept at commit
+    ALWAYS_ASSERT(it->is_commutative());
+    ALWAYS_ASSERT(it->get_writer() == writer);
+    ++transaction_base::g_evt_commutative_write_merges;
+    // the value of a commutative write is the caller's, to fold into
+    merge(const_cast<typename P::Value *>(
+            reinterpret_cast<const typename P::Value *>(it->get_value())), v);
+    return;
+  }
+  ++transaction_base::g_evt_commutative_writes;
+  if (!btr)
+    ++transaction_base::g_evt_split_slice_writes;
+  t.write_set.emplace_back(px, k, v, writer, btr, this->table_id, false);
+  t.write_set.back().set_commutative();
+}
+
 template <template <typename> class Transaction, typename P>
 template <typename Traits, typename Callback,
           typename KeyReader, typename ValueReader>
@@ -388,7 +559,7 @@ base_txn_btree<Transaction, P>
   VERBOSE(std::cerr << "on_resp_node(): <node=0x" << util::hexify(intptr_t(n))
                << ", version=" << version << ">" << std::endl);
   VERBOSE(std::cerr << "  " << concurrent_btree::NodeStringify(n) << std::endl);
-  t->do_node_read(n, version);
+  t->do_node_read(n, version, ranged);
 }
 
 template <template <typename> class Transaction, typename P>
@@ -406,9 +577,16 @@ base_txn_btree<Transaction, P>
                     << ", version=" << version << ">" << std::endl
                     << "  " << *((dbtuple *) v) << std::endl);
   const dbtuple * const tuple = reinterpret_cast<const dbtuple *>(v);
-  if (t->do_tuple_read(tuple, *value_reader))
-    return caller_callback->invoke(
-        (*key_reader)(k), value_reader->results());
+  if (ranged)
+    t->count_scanned(tuple, nkeys, fingerprint);
+  if (t->do_tuple_read(tuple, *value_reader, for_update) &&
+      !caller_callback->invoke((*key_reader)(k), value_reader->results())) {
+    if (ranged) {
+      stopped_at = t->string_allocator()();
+      stopped_at->assign(k.data(), k.size());
+    }
+    return false;
+  }
   return true;
 }
 
@@ -422,7 +600,8 @@ base_txn_btree<Transaction, P>::do_search_range_call(
     const typename P::Key *upper,
     Callback &callback,
     KeyReader &key_reader,
-    ValueReader &value_reader)
+    ValueReader &value_reader,
+    bool for_update)
 {
   t.ensure_active();
   if (upper)
@@ -446,7 +625,8 @@ base_txn_btree<Transaction, P>::do_search_range_call(
     return;
 
   txn_search_range_callback<Traits, Callback, KeyReader, ValueReader> c(
-			&t, &callback, &key_reader, &value_reader);
+			&t, &callback, &key_reader, &value_reader, for_update,
+      transaction_base::IsRangeValidation() && !t.is_snapshot());
 
   varkey uppervk;
   if (upper_str)
@@ -454,6 +634,15 @@ base_txn_btree<Transaction, P>::do_search_range_call(
   this->underlying_btree.search_range_call(
       varkey(*lower_str), upper_str ? &uppervk : nullptr,
       c, t.string_allocator()());
+
+  if (c.ranged) {
+    // read [lower, stopped_at]
+    if (c.stopped_at)
+      c.stopped_at->push_back('\0');
+    t.add_scan_range(&this->underlying_btree, t.copy_key(lower_str),
+                     c.stopped_at ? c.stopped_at : t.copy_key(upper_str),
+                     c.nkeys, c.fingerprint);
+  }
 }
 
 template <template <typename> class Transaction, typename P>
@@ -466,7 +655,8 @@ base_txn_btree<Transaction, P>::do_rsearch_range_call(
     const typename P::Key *lower,
     Callback &callback,
     KeyReader &key_reader,
-    ValueReader &value_reader)
+    ValueReader &value_reader,
+    bool for_update)
 {
   t.ensure_active();
 
@@ -482,7 +672,8 @@ base_txn_btree<Transaction, P>::do_rsearch_range_call(
     return;
 
   txn_search_range_callback<Traits, Callback, KeyReader, ValueReader> c(
-			&t, &callback, &key_reader, &value_reader);
+			&t, &callback, &key_reader, &value_reader, for_update,
+      transaction_base::IsRangeValidation() && !t.is_snapshot());
 
   varkey lowervk;
   if (lower_str)
@@ -490,6 +681,26 @@ base_txn_btree<Transaction, P>::do_rsearch_range_call(
   this->underlying_btree.rsearch_range_call(
       varkey(*upper_str), lower_str ? &lowervk : nullptr,
       c, t.string_allocator()());
+
+  if (c.ranged) {
+    // read [stopped_at, upper], or (lower, upper]. scan_range_t ranges are
+    // half-open the other way around
+    std::string * const upper_end = t.string_allocator()();
+    upper_end->assign(*upper_str);
+    upper_end->push_back('\0');
+    std::string *lower_begin = c.stopped_at;
+    if (!lower_begin) {
+      lower_begin = t.string_allocator()();
+      if (lower_str) {
+        lower_begin->assign(*lower_str);
+        lower_begin->push_back('\0');
+      } else {
+        lower_begin->clear();
+      }
+    }
+    t.add_scan_range(&this->underlying_btree, lower_begin, upper_end,
+                     c.nkeys, c.fingerprint);
+  }
 }
 
 #endif /* _NDB_BASE_TXN_BTREE_H_ */
@@ -7,9 +7,11 @@
 
 #include <map>
 #include <string>
+#include <functional>
 
 #include "abstract_ordered_index.h"
 #include "../str_arena.h"
+#include "../histogram.h"
 
 /**
  * Abstract interface for a DB. This is to facilitate writing
@@ -67,6 +69,16 @@ public:
 
   virtual void reset_ntxn_persisted() { }
 
+  // latency distributions of the persistence layer, by name (reset by
+  // reset_ntxn_persisted())
+  virtual std::map<std::string, log_linear_histogram>
+    get_persist_histograms() const { return {}; }
+
+  // if the db was opened as a follower of another (primary) process,
+  // applies the log the primary ships to the open indexes until the primary
+  // goes away, and returns true. otherwise returns false right away
+  virtual bool do_follow_log() { return false; }
+
   enum TxnProfileHint {
     HINT_DEFAULT,
 
@@ -125,6 +137,21 @@ public:
 
   virtual void print_txn_debug(void *txn) const {}
 
+  /**
+   * Runs step, a piece of txn which reads some records and writes what it
+   * computes from them. If these reads turn out to be stale at commit, the
+   * db may drop what step did and run it again, instead of aborting the
+   * txn. step must not insert, and the rest of the txn must not write the
+   * records step writes.
+   *
+   * step can throw abstract_abort_exception, like get() and put()
+   */
+  virtual void
+  run_repairable(void *txn, const std::function<void ()> &step)
+  {
+    step();
+  }
+
   virtual abstract_ordered_index *
   open_index(const std::string &name,
              size_t value_size_hint,
@@ -29,6 +29,21 @@ public:
       std::string &value,
       size_t max_bytes_read = std::string::npos) = 0;
 
+  /**
+   * Like get(), for a key the caller is going to put() in the same txn.
+   * The implementation may lock the record until the txn is over, so
+   * other txns cannot make this one abort on it. The default implementation
+   * calls get()
+   */
+  virtual bool get_for_update(
+      void *txn,
+      const std::string &key,
+      std::string &value,
+      size_t max_bytes_read = std::string::npos)
+  {
+    return get(txn, key, value, max_bytes_read);
+  }
+
   class scan_callback {
   public:
     virtual ~scan_callback() {}
@@ -54,6 +69,20 @@ public:
       scan_callback &callback,
       str_arena *arena = nullptr) = 0;
 
+  /**
+   * Like scan(), for records the caller is going to put() in the same txn
+   * (see get_for_update()). The default implementation calls scan()
+   */
+  virtual void scan_for_update(
+      void *txn,
+      const std::string &start_key,
+      const std::string *end_key,
+      scan_callback &callback,
+      str_arena *arena = nullptr)
+  {
+    scan(txn, start_key, end_key, callback, arena);
+  }
+
   /**
    * Search (*end_key, start_key] if end_key is not null, otherwise
    * search (-infty, start_key] (starting at start_key and traversing
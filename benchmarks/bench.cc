@@ -164,6 +164,16 @@ bench_worker::run()
 void
 bench_runner::run()
 {
+  if (db->do_follow_log()) {
+    // the primary loaded and ran the benchmark, we just followed along
+    if (verbose)
+      for (auto &p : open_tables) {
+        scoped_rcu_region guard;
+        cerr << "table " << p.first << " size " << p.second->size() << endl;
+      }
+    return;
+  }
+
   // load data
   const vector<bench_loader *> loaders = make_loaders();
   {
@@ -253,6 +263,7 @@ bench_runner::run()
     latency_numer_us += workers[i]->get_latency_numer_us();
   }
   const auto persisted_info = db->get_ntxn_persisted();
+  const auto persist_hists = db->get_persist_histograms();
 
   const unsigned long elapsed = t.lap(); // lap() must come after do_txn_finish(),
                                          // because do_txn_finish() potentially
@@ -338,6 +349,8 @@ bench_runner::run()
     cerr << "avg_per_core_persist_throughput: " << avg_per_core_persist_throughput << " ops/sec/core" << endl;
     cerr << "avg_latency: " << avg_latency_ms << " ms" << endl;
     cerr << "avg_persist_latency: " << avg_persist_latency_ms << " ms" << endl;
+    for (auto &p : persist_hists)
+      cerr << p.first << ": " << p.second << endl;
     cerr << "agg_abort_rate: " << agg_abort_rate << " aborts/sec" << endl;
     cerr << "avg_per_core_abort_rate: " << avg_per_core_abort_rate << " aborts/sec/core" << endl;
     cerr << "txn breakdown: " << format_list(agg_txn_counts.begin(), agg_txn_counts.end()) << endl;
@@ -71,11 +71,29 @@ main(int argc, char **argv)
   int nofsync = 0;
   int do_compress = 0;
   int fake_writes = 0;
+  int pipeline_writes = 0;
+  int direct_io = 0;
+  int numa_logging = 0;
+  int rebalance_loggers = 0;
+  size_t compress_nthreads = 0;
+  int compress_level = 0;
   int disable_gc = 0;
   int disable_snapshots = 0;
+  int hot_tuple_locking = 0;
+  int deferred_inserts = 0;
+  int range_validation = 0;
   vector<string> logfiles;
   vector<vector<unsigned>> assignments;
   string stats_server_sockfile;
+  string checkpoint_dir;
+  uint64_t checkpoint_interval_ms = 10000;
+  size_t checkpoint_nthreads = 1;
+  string log_ship_sockfile;
+  string log_follow_sockfile;
+  size_t log_segment_mb = txn_logger::g_default_segment_size >> 20;
+  uint64_t tick_us = ticker::DefaultTickUs;
+  uint64_t ro_epoch_multiplier =
+    transaction_proto2_static::DefaultReadOnlyEpochMultiplier;
   while (1) {
     static struct option long_options[] =
     {
@@ -100,14 +118,31 @@ main(int argc, char **argv)
       {"log-nofsync"                , no_argument       , &nofsync                   , 1}   ,
       {"log-compress"               , no_argument       , &do_compress               , 1}   ,
       {"log-fake-writes"            , no_argument       , &fake_writes               , 1}   ,
+      {"log-segment-mb"             , required_argument , 0                          , 'g'} ,
+      {"log-pipeline-writes"        , no_argument       , &pipeline_writes           , 1}   ,
+      {"log-direct-io"              , no_argument       , &direct_io                 , 1}   ,
+      {"log-numa"                   , no_argument       , &numa_logging              , 1}   ,
+      {"log-rebalance"              , no_argument       , &rebalance_loggers         , 1}   ,
+      {"log-compress-nthreads"      , required_argument , 0                          , 'P'} ,
+      {"log-compress-level"         , required_argument , 0                          , 'L'} ,
+      {"log-ship-sockfile"          , required_argument , 0                          , 'S'} ,
+      {"log-follow-sockfile"        , required_argument , 0                          , 'F'} ,
       {"disable-gc"                 , no_argument       , &disable_gc                , 1}   ,
       {"disable-snapshots"          , no_argument       , &disable_snapshots         , 1}   ,
+      {"hot-tuple-locking"          , no_argument       , &hot_tuple_locking         , 1}   ,
+      {"deferred-inserts"           , no_argument       , &deferred_inserts          , 1}   ,
+      {"range-validation"           , no_argument       , &range_validation          , 1}   ,
       {"stats-server-sockfile"      , required_argument , 0                          , 'x'} ,
       {"no-reset-counters"          , no_argument       , &no_reset_counters         , 1}   ,
+      {"checkpoint-dir"             , required_argument , 0                          , 'c'} ,
+      {"checkpoint-interval-ms"     , required_argument , 0                          , 'i'} ,
+      {"checkpoint-nthreads"        , required_argument , 0                          , 'k'} ,
+      {"tick-us"                    , required_argument , 0                          , 'T'} ,
+      {"ro-epoch-multiplier"        , required_argument , 0                          , 'R'} ,
       {0, 0, 0, 0}
     };
     int option_index = 0;
-    int c = getopt_long(argc, argv, "b:s:t:d:B:f:r:n:o:m:l:a:x:", long_options, &option_index);
+    int c = getopt_long(argc, argv, "b:s:t:d:B:f:r:n:o:m:l:a:g:x:c:i:k:T:R:P:L:S:F:", long_options, &option_index);
     if (c == -1)
       break;
 
@@ -181,10 +216,56 @@ main(int argc, char **argv)
           ParseCSVString<unsigned, RangeAwareParser<unsigned>>(optarg));
       break;
 
+    case 'g':
+      log_segment_mb = strtoul(optarg, NULL, 10);
+      ALWAYS_ASSERT(log_segment_mb > 0);
+      break;
+
     case 'x':
       stats_server_sockfile = optarg;
       break;
 
+    case 'c':
+      checkpoint_dir = optarg;
+      break;
+
+    case 'i':
+      checkpoint_interval_ms = strtoul(optarg, NULL, 10);
+      ALWAYS_ASSERT(checkpoint_interval_ms > 0);
+      break;
+
+    case 'k':
+      checkpoint_nthreads = strtoul(optarg, NULL, 10);
+      ALWAYS_ASSERT(checkpoint_nthreads > 0);
+      break;
+
+    case 'T':
+      tick_us = strtoul(optarg, NULL, 10);
+      ALWAYS_ASSERT(tick_us > 0);
+      break;
+
+    case 'R':
+      ro_epoch_multiplier = strtoul(optarg, NULL, 10);
+      ALWAYS_ASSERT(ro_epoch_multiplier > 0);
+      break;
+
+    case 'P':
+      compress_nthreads = strtoul(optarg, NULL, 10);
+      break;
+
+    case 'L':
+      compress_level = strtol(optarg, NULL, 10);
+      ALWAYS_ASSERT(compress_level >= 0 && compress_level <= 16);
+      break;
+
+    case 'S':
+      log_ship_sockfile = optarg;
+      break;
+
+    case 'F':
+      log_follow_sockfile = optarg;
+      break;
+
     case '?':
       /* getopt_long already printed an error message. */
       exit(1);
@@ -228,6 +309,68 @@ main(int argc, char **argv)
     cerr << "[WARNING] --log-nofsync has no effect with --log-fake-writes enabled" << endl;
   }
 
+  if (pipeline_writes && logfiles.empty()) {
+    cerr << "[ERROR] --log-pipeline-writes specified without logging enabled" << endl;
+    return 1;
+  }
+
+  if (pipeline_writes && (nofsync || fake_writes)) {
+    cerr << "[WARNING] --log-pipeline-writes has no effect without fsync" << endl;
+  }
+
+  if (direct_io && logfiles.empty()) {
+    cerr << "[ERROR] --log-direct-io specified without logging enabled" << endl;
+    return 1;
+  }
+
+  if (direct_io && ((log_segment_mb << 20) % txn_logger::g_direct_io_align)) {
+    cerr << "[ERROR] --log-segment-mb must be a multiple of the direct IO block size" << endl;
+    return 1;
+  }
+
+  if (numa_logging && logfiles.empty()) {
+    cerr << "[ERROR] --log-numa specified without logging enabled" << endl;
+    return 1;
+  }
+
+  if (rebalance_loggers && logfiles.empty()) {
+    cerr << "[ERROR] --log-rebalance specified without logging enabled" << endl;
+    return 1;
+  }
+
+  if (rebalance_loggers && logfiles.size() < 2) {
+    cerr << "[WARNING] --log-rebalance has no effect with a single logger" << endl;
+  }
+
+  if ((compress_nthreads || compress_level) && !do_compress) {
+    cerr << "[ERROR] --log-compress-nthreads/--log-compress-level specified without --log-compress" << endl;
+    return 1;
+  }
+
+  if (compress_level && !compress_nthreads) {
+    cerr << "[ERROR] --log-compress-level requires --log-compress-nthreads" << endl;
+    return 1;
+  }
+
+  if (direct_io && pipeline_writes) {
+    cerr << "[WARNING] --log-pipeline-writes has no effect with --log-direct-io enabled" << endl;
+  }
+
+  if (!log_ship_sockfile.empty() && logfiles.empty()) {
+    cerr << "[ERROR] --log-ship-sockfile specified without logging enabled" << endl;
+    return 1;
+  }
+
+  // the follower applies the primary's log, it does not write one
+  if (!log_follow_sockfile.empty() && !logfiles.empty()) {
+    cerr << "[ERROR] --log-follow-sockfile cannot be combined with --logfile" << endl;
+    return 1;
+  }
+
+  // must happen before any txns run
+  ticker::set_tick_us(tick_us);
+  transaction_proto2_static::SetReadOnlyEpochMultiplier(ro_epoch_multiplier);
+
 #ifndef ENABLE_EVENT_COUNTERS
   if (!stats_server_sockfile.empty()) {
     cerr << "[WARNING] --stats-server-sockfile with no event counters enabled is useless" << endl;
@@ -249,6 +392,24 @@ main(int argc, char **argv)
     return 1;
   }
 
+  if (!log_follow_sockfile.empty() && db_type != "ndb-proto2") {
+    cerr << "[ERROR] benchmark " << db_type
+         << " cannot follow a log" << endl;
+    return 1;
+  }
+
+  const set<string> can_checkpoint({"ndb-proto2"});
+  if (!checkpoint_dir.empty() && !can_checkpoint.count(db_type)) {
+    cerr << "[ERROR] benchmark " << db_type
+         << " does not have checkpointing implemented" << endl;
+    return 1;
+  }
+
+  if (!checkpoint_dir.empty() && disable_snapshots) {
+    cerr << "[ERROR] --checkpoint-dir requires snapshots" << endl;
+    return 1;
+  }
+
 #ifdef PROTO2_CAN_DISABLE_GC
   const set<string> has_gc({"ndb-proto1", "ndb-proto2"});
   if (disable_gc && !has_gc.count(db_type)) {
@@ -277,6 +438,29 @@ main(int argc, char **argv)
   }
 #endif
 
+  const set<string> has_ndb_txns({"ndb-proto1", "ndb-proto2"});
+  if (hot_tuple_locking && !has_ndb_txns.count(db_type)) {
+    cerr << "[ERROR] benchmark " << db_type
+         << " does not have hot tuple locking" << endl;
+    return 1;
+  }
+  if (hot_tuple_locking)
+    transaction_base::SetHotTupleLocking(true);
+  if (deferred_inserts && !has_ndb_txns.count(db_type)) {
+    cerr << "[ERROR] benchmark " << db_type
+         << " does not have deferred inserts" << endl;
+    return 1;
+  }
+  if (deferred_inserts)
+    transaction_base::SetDeferredInserts(true);
+  if (range_validation && !has_ndb_txns.count(db_type)) {
+    cerr << "[ERROR] benchmark " << db_type
+         << " does not have range validation" << endl;
+    return 1;
+  }
+  if (range_validation)
+    transaction_base::SetRangeValidation(true);
+
   if (db_type == "bdb") {
     const string cmd = "rm -rf " + basedir + "/db/*";
     // XXX(stephentu): laziness
@@ -294,7 +478,11 @@ main(int argc, char **argv)
 #endif
   } else if (db_type == "ndb-proto2") {
     db = new ndb_wrapper<transaction_proto2>(
-        logfiles, assignments, !nofsync, do_compress, fake_writes);
+        logfiles, assignments, !nofsync, do_compress, fake_writes,
+        log_segment_mb << 20, pipeline_writes, direct_io,
+        compress_nthreads, compress_level, numa_logging,
+        checkpoint_dir, checkpoint_interval_ms, checkpoint_nthreads,
+        log_ship_sockfile, log_follow_sockfile, rebalance_loggers);
     ALWAYS_ASSERT(!transaction_proto2_static::get_hack_status());
 #ifdef PROTO2_CAN_DISABLE_GC
     if (!disable_gc)
@@ -372,7 +560,15 @@ main(int argc, char **argv)
     cerr << "  assignments : " << assignments               << endl;
     cerr << "  disable-gc : " << disable_gc                 << endl;
     cerr << "  disable-snapshots : " << disable_snapshots   << endl;
+    cerr << "  hot-tuple-locking : " << hot_tuple_locking   << endl;
+    cerr << "  deferred-inserts : " << deferred_inserts     << endl;
+    cerr << "  range-validation : " << range_validation     << endl;
     cerr << "  stats-server-sockfile: " << stats_server_sockfile << endl;
+    cerr << "  checkpoint-dir : " << checkpoint_dir           << endl;
+    cerr << "  log-ship-sockfile : " << log_ship_sockfile     << endl;
+    cerr << "  log-follow-sockfile : " << log_follow_sockfile << endl;
+    cerr << "  tick-us : " << tick_us                         << endl;
+    cerr << "  ro-epoch-multiplier : " << ro_epoch_multiplier << endl;
 
     cerr << "system properties:" << endl;
     cerr << "  btree_internal_node_size: " << concurrent_btree::InternalNodeSize() << endl;
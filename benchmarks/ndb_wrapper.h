@@ -1,8 +1,15 @@
 #ifndef _NDB_WRAPPER_H_
 #define _NDB_WRAPPER_H_
 
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <memory>
+
 #include "abstract_db.h"
 #include "../txn_btree.h"
+#include "../txn_checkpoint.h"
+#include "../txn_follower.h"
 
 namespace private_ {
   struct ndbtxn {
@@ -44,7 +51,21 @@ public:
       const std::vector<std::vector<unsigned>> &assignments_given,
       bool call_fsync,
       bool use_compression,
-      bool fake_writes);
+      bool fake_writes,
+      size_t log_segment_size = txn_logger::g_default_segment_size,
+      bool pipeline_log_writes = false,
+      bool direct_log_io = false,
+      size_t log_compress_nthreads = 0,
+      int log_compress_level = 0,
+      bool numa_log_placement = false,
+      const std::string &checkpoint_dir = "",
+      uint64_t checkpoint_interval_ms = 0,
+      size_t checkpoint_nthreads = 1,
+      const std::string &log_ship_sockfile = "",
+      const std::string &log_follow_sockfile = "",
+      bool rebalance_loggers = false);
+
+  virtual ~ndb_wrapper();
 
   virtual ssize_t txn_max_batch_size() const OVERRIDE { return 100; }
 
@@ -84,6 +105,14 @@ public:
     txn_epoch_sync<Transaction>::reset_ntxn_persisted();
   }
 
+  virtual std::map<std::string, log_linear_histogram>
+  get_persist_histograms() const
+  {
+    return txn_epoch_sync<Transaction>::compute_persist_histograms();
+  }
+
+  virtual bool do_follow_log();
+
   virtual size_t
   sizeof_txn_object(uint64_t txn_flags) const;
 
@@ -95,6 +124,7 @@ public:
   virtual bool commit_txn(void *txn);
   virtual void abort_txn(void *txn);
   virtual void print_txn_debug(void *txn) const;
+  virtual void run_repairable(void *txn, const std::function<void ()> &step);
   virtual std::map<std::string, uint64_t> get_txn_counters(void *txn) const;
 
   virtual abstract_ordered_index *
@@ -105,6 +135,21 @@ public:
   virtual void
   close_index(abstract_ordered_index *idx);
 
+private:
+
+  // takes a checkpoint of all open indexes every checkpoint_interval_ms
+  void checkpoint_loop();
+
+  std::mutex open_btrs_lock;
+  std::vector<txn_btree<Transaction> *> open_btrs;
+
+  const uint64_t checkpoint_interval_ms;
+  std::unique_ptr<txn_checkpointer<Transaction>> checkpointer;
+  std::condition_variable checkpoint_cv;
+  bool checkpoint_stop;
+  std::thread checkpoint_thread;
+
+  const std::string log_follow_sockfile;
 };
 
 template <template <typename> class Transaction>
@@ -120,6 +165,10 @@ public:
       void *txn,
       const std::string &key,
       std::string &value, size_t max_bytes_read);
+  virtual bool get_for_update(
+      void *txn,
+      const std::string &key,
+      std::string &value, size_t max_bytes_read);
   virtual const char * put(
       void *txn,
       const std::string &key,
@@ -142,6 +191,12 @@ public:
       const std::string *end_key,
       scan_callback &callback,
       str_arena *arena);
+  virtual void scan_for_update(
+      void *txn,
+      const std::string &start_key,
+      const std::string *end_key,
+      scan_callback &callback,
+      str_arena *arena);
   virtual void rscan(
       void *txn,
       const std::string &start_key,
@@ -156,6 +211,13 @@ public:
       std::string &&key);
   virtual size_t size() const;
   virtual std::map<std::string, uint64_t> clear();
+
+  inline txn_btree<Transaction> &
+  get_btree()
+  {
+    return btr;
+  }
+
 private:
   std::string name;
   txn_btree<Transaction> btr;
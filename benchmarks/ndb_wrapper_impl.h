@@ -2,6 +2,8 @@
 #define _NDB_WRAPPER_IMPL_H_
 
 #include <stdint.h>
+#include <algorithm>
+#include <chrono>
 #include "ndb_wrapper.h"
 #include "../counter.h"
 #include "../rcu.h"
@@ -127,8 +129,35 @@ ndb_wrapper<Transaction>::ndb_wrapper(
     const std::vector<std::vector<unsigned>> &assignments_given,
     bool call_fsync,
     bool use_compression,
-    bool fake_writes)
+    bool fake_writes,
+    size_t log_segment_size,
+    bool pipeline_log_writes,
+    bool direct_log_io,
+    size_t log_compress_nthreads,
+    int log_compress_level,
+    bool numa_log_placement,
+    const std::string &checkpoint_dir,
+    uint64_t checkpoint_interval_ms,
+    size_t checkpoint_nthreads,
+    const std::string &log_ship_sockfile,
+    const std::string &log_follow_sockfile,
+    bool rebalance_loggers)
+  : checkpoint_interval_ms(checkpoint_interval_ms),
+    checkpoint_stop(false),
+    log_follow_sockfile(log_follow_sockfile)
 {
+  if (!checkpoint_dir.empty()) {
+    INVARIANT(checkpoint_interval_ms > 0);
+    checkpointer.reset(
+        new txn_checkpointer<Transaction>(checkpoint_dir, checkpoint_nthreads));
+    checkpoint_thread = std::thread(&ndb_wrapper::checkpoint_loop, this);
+    if (verbose) {
+      std::cerr << "[checkpointing]" << std::endl;
+      std::cerr << "  dir        : " << checkpoint_dir << std::endl;
+      std::cerr << "  interval_ms: " << checkpoint_interval_ms << std::endl;
+      std::cerr << "  nthreads   : " << checkpoint_nthreads << std::endl;
+    }
+  }
   if (logfiles.empty())
     return;
   std::vector<std::vector<unsigned>> assignments_used;
@@ -136,16 +165,104 @@ ndb_wrapper<Transaction>::ndb_wrapper(
       nthreads, logfiles, assignments_given, &assignments_used,
       call_fsync,
       use_compression,
-      fake_writes);
+      fake_writes,
+      log_segment_size,
+      pipeline_log_writes,
+      direct_log_io,
+      log_compress_nthreads,
+      log_compress_level,
+      numa_log_placement,
+      log_ship_sockfile,
+      rebalance_loggers);
   if (verbose) {
     std::cerr << "[logging subsystem]" << std::endl;
     std::cerr << "  assignments: " << assignments_used << std::endl;
     std::cerr << "  call fsync : " << call_fsync       << std::endl;
     std::cerr << "  compression: " << use_compression  << std::endl;
+    if (use_compression) {
+      std::cerr << "  compress_nthreads: " << log_compress_nthreads << std::endl;
+      std::cerr << "  compress_level   : " << log_compress_level << std::endl;
+    }
     std::cerr << "  fake_writes: " << fake_writes      << std::endl;
+    std::cerr << "  segment_sz : " << log_segment_size << std::endl;
+    std::cerr << "  pipelined  : " << pipeline_log_writes << std::endl;
+    std::cerr << "  direct_io  : " << direct_log_io    << std::endl;
+    std::cerr << "  rebalance  : " << rebalance_loggers << std::endl;
+    if (!log_ship_sockfile.empty())
+      std::cerr << "  ship to    : " << log_ship_sockfile << std::endl;
+    if (numa_log_placement) {
+      std::vector<int> nodes;
+      for (size_t i = 0; i < assignments_used.size(); i++)
+        nodes.push_back(txn_logger::LoggerNode(i));
+      std::cerr << "  numa nodes : " << nodes << std::endl;
+    }
+  }
+}
+
+template <template <typename> class Transaction>
+ndb_wrapper<Transaction>::~ndb_wrapper()
+{
+  if (!checkpointer)
+    return;
+  {
+    std::lock_guard<std::mutex> l(open_btrs_lock);
+    checkpoint_stop = true;
+  }
+  checkpoint_cv.notify_all();
+  checkpoint_thread.join();
+}
+
+template <template <typename> class Transaction>
+void
+ndb_wrapper<Transaction>::checkpoint_loop()
+{
+  // open_btrs_lock is held while checkpointing, so indexes cannot be closed
+  // out from under the checkpoint
+  std::unique_lock<std::mutex> l(open_btrs_lock);
+  for (;;) {
+    checkpoint_cv.wait_for(
+        l, std::chrono::milliseconds(checkpoint_interval_ms),
+        [this]() { return checkpoint_stop; });
+    if (checkpoint_stop)
+      return;
+    if (open_btrs.empty())
+      continue;
+    std::vector<typename txn_checkpointer<Transaction>::table> tables;
+    for (auto btr : open_btrs)
+      tables.emplace_back(btr);
+    const txn_checkpoint::stats s = checkpointer->checkpoint(tables);
+    if (verbose)
+      std::cerr << "[checkpoint] " << s << std::endl;
   }
 }
 
+template <template <typename> class Transaction>
+bool
+ndb_wrapper<Transaction>::do_follow_log()
+{
+  if (log_follow_sockfile.empty())
+    return false;
+  // the indexes were opened in the same order as by the primary, so their
+  // table ids match
+  std::vector<txn_btree<Transaction> *> btrs;
+  {
+    std::lock_guard<std::mutex> l(open_btrs_lock);
+    btrs = open_btrs;
+  }
+  txn_btree_replayer<Transaction> replayer(btrs, nthreads);
+  txn_log_follower follower(log_follow_sockfile, nthreads, std::ref(replayer));
+  if (verbose)
+    std::cerr << "[follower] waiting for a primary on "
+              << log_follow_sockfile << std::endl;
+  util::timer t;
+  const txn_log_follower::stats s = follower.wait_for_primary();
+  const double elapsed_sec = t.lap_ms() / 1000.0;
+  std::cerr << "[follower] " << s << std::endl;
+  std::cerr << "[follower] " << (double(s.nwrites_) / elapsed_sec)
+            << " writes/sec received" << std::endl;
+  return true;
+}
+
 template <template <typename> class Transaction>
 size_t
 ndb_wrapper<Transaction>::sizeof_txn_object(uint64_t txn_flags) const
@@ -215,6 +332,38 @@ ndb_wrapper<Transaction>::commit_txn(void *txn)
   return false;
 }
 
+template <template <typename> class Transaction>
+void
+ndb_wrapper<Transaction>::run_repairable(
+    void *txn, const std::function<void ()> &step)
+{
+  ndbtxn * const p = reinterpret_cast<ndbtxn *>(txn);
+  // the txn redoes the step from within commit(), which speaks
+  // transaction_abort_exception
+  auto redo = [step]() {
+    try {
+      step();
+    } catch (abstract_db::abstract_abort_exception &ex) {
+      throw transaction_abort_exception(transaction_base::ABORT_REASON_USER);
+    }
+  };
+#define MY_OP_X(a, b) \
+  case a: \
+    { \
+      auto t = cast< b >()(p); \
+      const auto mark = t->repair_mark(); \
+      step(); \
+      t->add_repair_step(mark, redo); \
+      return; \
+    }
+  switch (p->hint) {
+    TXN_PROFILE_HINT_OP(MY_OP_X)
+  default:
+    ALWAYS_ASSERT(false);
+  }
+#undef MY_OP_X
+}
+
 template <template <typename> class Transaction>
 void
 ndb_wrapper<Transaction>::abort_txn(void *txn)
@@ -280,13 +429,22 @@ template <template <typename> class Transaction>
 abstract_ordered_index *
 ndb_wrapper<Transaction>::open_index(const std::string &name, size_t value_size_hint, bool mostly_append)
 {
-  return new ndb_ordered_index<Transaction>(name, value_size_hint, mostly_append);
+  ndb_ordered_index<Transaction> * const idx =
+    new ndb_ordered_index<Transaction>(name, value_size_hint, mostly_append);
+  std::lock_guard<std::mutex> l(open_btrs_lock);
+  open_btrs.push_back(&idx->get_btree());
+  return idx;
 }
 
 template <template <typename> class Transaction>
 void
 ndb_wrapper<Transaction>::close_index(abstract_ordered_index *idx)
 {
+  {
+    std::lock_guard<std::mutex> l(open_btrs_lock);
+    auto btr = &static_cast<ndb_ordered_index<Transaction> *>(idx)->get_btree();
+    open_btrs.erase(std::find(open_btrs.begin(), open_btrs.end(), btr));
+  }
   delete idx;
 }
 
@@ -333,6 +491,36 @@ ndb_ordered_index<Transaction>::get(
   }
 }
 
+template <template <typename> class Transaction>
+bool
+ndb_ordered_index<Transaction>::get_for_update(
+    void *txn,
+    const std::string &key,
+    std::string &value, size_t max_bytes_read)
+{
+  ndbtxn * const p = reinterpret_cast<ndbtxn *>(txn);
+  try {
+#define MY_OP_X(a, b) \
+  case a: \
+    { \
+      auto t = cast< b >()(p); \
+      if (!btr.search_for_update(*t, key, value, max_bytes_read)) \
+        return false; \
+      return true; \
+    }
+    switch (p->hint) {
+      TXN_PROFILE_HINT_OP(MY_OP_X)
+    default:
+      ALWAYS_ASSERT(false);
+    }
+#undef MY_OP_X
+    INVARIANT(!value.empty());
+    return true;
+  } catch (transaction_abort_exception &ex) {
+    throw abstract_db::abstract_abort_exception();
+  }
+}
+
 // XXX: find way to remove code duplication below using C++ templates!
 
 template <template <typename> class Transaction>
@@ -500,6 +688,36 @@ ndb_ordered_index<Transaction>::scan(
   }
 }
 
+template <template <typename> class Transaction>
+void
+ndb_ordered_index<Transaction>::scan_for_update(
+    void *txn,
+    const std::string &start_key,
+    const std::string *end_key,
+    scan_callback &callback,
+    str_arena *arena)
+{
+  ndbtxn * const p = reinterpret_cast<ndbtxn *>(txn);
+  ndb_wrapper_search_range_callback<Transaction> c(callback);
+  try {
+#define MY_OP_X(a, b) \
+  case a: \
+    { \
+      auto t = cast< b >()(p); \
+      btr.search_range_call_for_update(*t, start_key, end_key, c); \
+      return; \
+    }
+    switch (p->hint) {
+      TXN_PROFILE_HINT_OP(MY_OP_X)
+    default:
+      ALWAYS_ASSERT(false);
+    }
+#undef MY_OP_X
+  } catch (transaction_abort_exception &ex) {
+    throw abstract_db::abstract_abort_exception();
+  }
+}
+
 template <template <typename> class Transaction>
 void
 ndb_ordered_index<Transaction>::rscan(
@@ -148,6 +148,8 @@ static int g_new_order_remote_item_pct = 1;
 static int g_new_order_fast_id_gen = 0;
 static int g_uniform_item_dist = 0;
 static int g_order_status_scan_hack = 0;
+static int g_get_for_update = 0;
+static int g_txn_repair = 0;
 static unsigned g_txn_workload_mix[] = { 45, 43, 4, 4, 4 }; // default TPC-C workload mix
 
 static aligned_padded_elem<spinlock> *g_partition_locks = nullptr;
@@ -192,6 +194,30 @@ FastNewOrderIdGen(unsigned warehouse, unsigned district)
   return NewOrderIdHolder(warehouse, district).fetch_add(1, memory_order_acq_rel);
 }
 
+// reads a record which the txn is about to write, locking it with
+// --get-for-update
+static inline bool
+GetForUpdate(abstract_ordered_index *idx, void *txn,
+             const string &key, string &value)
+{
+  return g_get_for_update ?
+    idx->get_for_update(txn, key, value) :
+    idx->get(txn, key, value);
+}
+
+// runs step, which reads a record and writes it back, letting the db redo
+// it at commit instead of aborting the txn with --txn-repair (see
+// abstract_db::run_repairable())
+template <typename Step>
+static inline void
+RunRepairable(abstract_db *db, void *txn, const Step &step)
+{
+  if (g_txn_repair)
+    db->run_repairable(txn, step);
+  else
+    step();
+}
+
 struct checker {
   // these sanity checks are just a few simple checks to make sure
   // the data is not entirely corrupted
@@ -1312,7 +1338,10 @@ tpcc_worker::txn_new_order()
     checker::SanityCheckWarehouse(&k_w, v_w);
 
     const district::key k_d(warehouse_id, districtID);
-    ALWAYS_ASSERT(tbl_district(warehouse_id)->get(txn, Encode(obj_key0, k_d), obj_v));
+    if (g_new_order_fast_id_gen)
+      ALWAYS_ASSERT(tbl_district(warehouse_id)->get(txn, Encode(obj_key0, k_d), obj_v));
+    else
+      ALWAYS_ASSERT(GetForUpdate(tbl_district(warehouse_id), txn, Encode(obj_key0, k_d), obj_v));
     district::value v_d_temp;
     const district::value *v_d = Decode(obj_v, v_d_temp);
     checker::SanityCheckDistrict(&k_d, v_d);
@@ -1361,20 +1390,22 @@ tpcc_worker::txn_new_order()
       checker::SanityCheckItem(&k_i, v_i);
 
       const stock::key k_s(ol_supply_w_id, ol_i_id);
-      ALWAYS_ASSERT(tbl_stock(ol_supply_w_id)->get(txn, Encode(obj_key0, k_s), obj_v));
-      stock::value v_s_temp;
-      const stock::value *v_s = Decode(obj_v, v_s_temp);
-      checker::SanityCheckStock(&k_s, v_s);
-
-      stock::value v_s_new(*v_s);
-      if (v_s_new.s_quantity - ol_quantity >= 10)
-        v_s_new.s_quantity -= ol_quantity;
-      else
-        v_s_new.s_quantity += -int32_t(ol_quantity) + 91;
-      v_s_new.s_ytd += ol_quantity;
-      v_s_new.s_remote_cnt += (ol_supply_w_id == warehouse_id) ? 0 : 1;
-
-      tbl_stock(ol_supply_w_id)->put(txn, Encode(str(), k_s), Encode(str(), v_s_new));
+      RunRepairable(db, txn, [=]() {
+        ALWAYS_ASSERT(GetForUpdate(tbl_stock(ol_supply_w_id), txn, Encode(obj_key0, k_s), obj_v));
+        stock::value v_s_temp;
+        const stock::value *v_s = Decode(obj_v, v_s_temp);
+        checker::SanityCheckStock(&k_s, v_s);
+
+        stock::value v_s_new(*v_s);
+        if (v_s_new.s_quantity - ol_quantity >= 10)
+          v_s_new.s_quantity -= ol_quantity;
+        else
+          v_s_new.s_quantity += -int32_t(ol_quantity) + 91;
+        v_s_new.s_ytd += ol_quantity;
+        v_s_new.s_remote_cnt += (ol_supply_w_id == warehouse_id) ? 0 : 1;
+
+        tbl_stock(ol_supply_w_id)->put(txn, Encode(str(), k_s), Encode(str(), v_s_new));
+      });
 
       const order_line::key k_ol(warehouse_id, districtID, k_no.no_o_id, ol_number);
       order_line::value v_ol;
@@ -1584,27 +1615,30 @@ tpcc_worker::txn_payment()
     ssize_t ret = 0;
 
     const warehouse::key k_w(warehouse_id);
-    ALWAYS_ASSERT(tbl_warehouse(warehouse_id)->get(txn, Encode(obj_key0, k_w), obj_v));
-    warehouse::value v_w_temp;
-    const warehouse::value *v_w = Decode(obj_v, v_w_temp);
-    checker::SanityCheckWarehouse(&k_w, v_w);
+    warehouse::value v_w;
+    RunRepairable(db, txn, [&]() {
+      ALWAYS_ASSERT(GetForUpdate(tbl_warehouse(warehouse_id), txn, Encode(obj_key0, k_w), obj_v));
+      Decode(obj_v, v_w);
+      checker::SanityCheckWarehouse(&k_w, &v_w);
 
-    warehouse::value v_w_new(*v_w);
-    v_w_new.w_ytd += paymentAmount;
-    tbl_warehouse(warehouse_id)->put(txn, Encode(str(), k_w), Encode(str(), v_w_new));
+      warehouse::value v_w_new(v_w);
+      v_w_new.w_ytd += paymentAmount;
+      tbl_warehouse(warehouse_id)->put(txn, Encode(str(), k_w), Encode(str(), v_w_new));
+    });
 
     const district::key k_d(warehouse_id, districtID);
-    ALWAYS_ASSERT(tbl_district(warehouse_id)->get(txn, Encode(obj_key0, k_d), obj_v));
-    district::value v_d_temp;
-    const district::value *v_d = Decode(obj_v, v_d_temp);
-    checker::SanityCheckDistrict(&k_d, v_d);
-
-    district::value v_d_new(*v_d);
-    v_d_new.d_ytd += paymentAmount;
-    tbl_district(warehouse_id)->put(txn, Encode(str(), k_d), Encode(str(), v_d_new));
+    district::value v_d;
+    RunRepairable(db, txn, [&]() {
+      ALWAYS_ASSERT(GetForUpdate(tbl_district(warehouse_id), txn, Encode(obj_key0, k_d), obj_v));
+      Decode(obj_v, v_d);
+      checker::SanityCheckDistrict(&k_d, &v_d);
+
+      district::value v_d_new(v_d);
+      v_d_new.d_ytd += paymentAmount;
+      tbl_district(warehouse_id)->put(txn, Encode(str(), k_d), Encode(str(), v_d_new));
+    });
 
     customer::key k_c;
-    customer::value v_c;
     if (RandomNumber(r, 1, 100) <= 60) {
       // cust by name
       uint8_t lastname_buf[CustomerLastNameMaxSize + 1];
@@ -1642,8 +1676,6 @@ tpcc_worker::txn_payment()
       k_c.c_w_id = customerWarehouseID;
       k_c.c_d_id = customerDistrictID;
       k_c.c_id = v_c_idx->c_id;
-      ALWAYS_ASSERT(tbl_customer(customerWarehouseID)->get(txn, Encode(obj_key0, k_c), obj_v));
-      Decode(obj_v, v_c);
 
     } else {
       // cust by ID
@@ -1651,31 +1683,34 @@ tpcc_worker::txn_payment()
       k_c.c_w_id = customerWarehouseID;
       k_c.c_d_id = customerDistrictID;
       k_c.c_id = customerID;
-      ALWAYS_ASSERT(tbl_customer(customerWarehouseID)->get(txn, Encode(obj_key0, k_c), obj_v));
-      Decode(obj_v, v_c);
-    }
-    checker::SanityCheckCustomer(&k_c, &v_c);
-    customer::value v_c_new(v_c);
-
-    v_c_new.c_balance -= paymentAmount;
-    v_c_new.c_ytd_payment += paymentAmount;
-    v_c_new.c_payment_cnt++;
-    if (strncmp(v_c.c_credit.data(), "BC", 2) == 0) {
-      char buf[501];
-      int n = snprintf(buf, sizeof(buf), "%d %d %d %d %d %f | %s",
-                       k_c.c_id,
-                       k_c.c_d_id,
-                       k_c.c_w_id,
-                       districtID,
-                       warehouse_id,
-                       paymentAmount,
-                       v_c.c_data.c_str());
-      v_c_new.c_data.resize_junk(
-          min(static_cast<size_t>(n), v_c_new.c_data.max_size()));
-      NDB_MEMCPY((void *) v_c_new.c_data.data(), &buf[0], v_c_new.c_data.size());
     }
+    RunRepairable(db, txn, [&]() {
+      customer::value v_c;
+      ALWAYS_ASSERT(GetForUpdate(tbl_customer(customerWarehouseID), txn, Encode(obj_key0, k_c), obj_v));
+      Decode(obj_v, v_c);
+      checker::SanityCheckCustomer(&k_c, &v_c);
+      customer::value v_c_new(v_c);
+
+      v_c_new.c_balance -= paymentAmount;
+      v_c_new.c_ytd_payment += paymentAmount;
+      v_c_new.c_payment_cnt++;
+      if (strncmp(v_c.c_credit.data(), "BC", 2) == 0) {
+        char buf[501];
+        int n = snprintf(buf, sizeof(buf), "%d %d %d %d %d %f | %s",
+                         k_c.c_id,
+                         k_c.c_d_id,
+                         k_c.c_w_id,
+                         districtID,
+                         warehouse_id,
+                         paymentAmount,
+                         v_c.c_data.c_str());
+        v_c_new.c_data.resize_junk(
+            min(static_cast<size_t>(n), v_c_new.c_data.max_size()));
+        NDB_MEMCPY((void *) v_c_new.c_data.data(), &buf[0], v_c_new.c_data.size());
+      }
 
-    tbl_customer(customerWarehouseID)->put(txn, Encode(str(), k_c), Encode(str(), v_c_new));
+      tbl_customer(customerWarehouseID)->put(txn, Encode(str(), k_c), Encode(str(), v_c_new));
+    });
 
     const history::key k_h(k_c.c_d_id, k_c.c_w_id, k_c.c_id, districtID, warehouse_id, ts);
     history::value v_h;
@@ -1683,8 +1718,8 @@ tpcc_worker::txn_payment()
     v_h.h_data.resize_junk(v_h.h_data.max_size());
     int n = snprintf((char *) v_h.h_data.data(), v_h.h_data.max_size() + 1,
                      "%.10s    %.10s",
-                     v_w->w_name.c_str(),
-                     v_d->d_name.c_str());
+                     v_w.w_name.c_str(),
+                     v_d.d_name.c_str());
     v_h.h_data.resize_junk(min(static_cast<size_t>(n), v_h.h_data.max_size()));
 
     const size_t history_sz = Size(v_h);
@@ -2145,6 +2180,8 @@ tpcc_do_test(abstract_db *db, int argc, char **argv)
       {"new-order-fast-id-gen"                , no_argument       , &g_new_order_fast_id_gen              , 1}   ,
       {"uniform-item-dist"                    , no_argument       , &g_uniform_item_dist                  , 1}   ,
       {"order-status-scan-hack"               , no_argument       , &g_order_status_scan_hack             , 1}   ,
+      {"get-for-update"                       , no_argument       , &g_get_for_update                     , 1}   ,
+      {"txn-repair"                           , no_argument       , &g_txn_repair                         , 1}   ,
       {"workload-mix"                         , required_argument , 0                                     , 'w'} ,
       {0, 0, 0, 0}
     };
@@ -2204,6 +2241,8 @@ tpcc_do_test(abstract_db *db, int argc, char **argv)
     cerr << "  new_order_fast_id_gen        : " << g_new_order_fast_id_gen << endl;
     cerr << "  uniform_item_dist            : " << g_uniform_item_dist << endl;
     cerr << "  order_status_scan_hack       : " << g_order_status_scan_hack << endl;
+    cerr << "  get_for_update               : " << g_get_for_update << endl;
+    cerr << "  txn_repair                   : " << g_txn_repair << endl;
     cerr << "  workload_mix                 : " <<
       format_list(g_txn_workload_mix,
                   g_txn_workload_mix + ARRAY_NELEMS(g_txn_workload_mix)) << endl;
@@ -28,6 +28,14 @@ public:
            !buf_[head_.load(std::memory_order_acquire)].load(std::memory_order_acquire);
   }
 
+  // whether an enq() would block right now. only meaningful to an enqueuer
+  // which knows it is the only one
+  inline bool
+  full() const
+  {
+    return buf_[head_.load(std::memory_order_acquire)].load(std::memory_order_acquire);
+  }
+
   // blocks until something enqs()
   inline void
   enq(Tp *p)
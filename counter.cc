@@ -90,6 +90,56 @@ event_counter::stat(const string &name, counter_data &d)
   return true;
 }
 
+map<string, histogram_registry::source_fn> &
+histogram_registry::sources()
+{
+  static map<string, source_fn> s_sources;
+  return s_sources;
+}
+
+spinlock &
+histogram_registry::sources_lock()
+{
+  static spinlock s_lock;
+  return s_lock;
+}
+
+void
+histogram_registry::add(const string &name, const source_fn &fn)
+{
+  lock_guard<spinlock> sl(sources_lock());
+  sources()[name] = fn;
+}
+
+bool
+histogram_registry::stat(const string &name, log_linear_histogram &h)
+{
+  source_fn fn;
+  {
+    lock_guard<spinlock> sl(sources_lock());
+    auto it = sources().find(name);
+    if (it == sources().end())
+      return false;
+    fn = it->second;
+  }
+  h = fn();
+  return true;
+}
+
+map<string, log_linear_histogram>
+histogram_registry::get_all()
+{
+  map<string, source_fn> fns;
+  {
+    lock_guard<spinlock> sl(sources_lock());
+    fns = sources();
+  }
+  map<string, log_linear_histogram> ret;
+  for (auto &p : fns)
+    ret[p.first] = p.second();
+  return ret;
+}
+
 #ifdef ENABLE_EVENT_COUNTERS
 event_counter::event_counter(const string &name)
   : ctx_(name, false)
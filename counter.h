@@ -7,12 +7,14 @@
 #include <vector>
 #include <map>
 #include <string>
+#include <functional>
 #include <stdint.h>
 
 #include "macros.h"
 #include "core.h"
 #include "util.h"
 #include "spinlock.h"
+#include "histogram.h"
 
 struct counter_data {
   enum Type { TYPE_COUNT, TYPE_AGG };
@@ -150,6 +152,29 @@ private:
 #endif
 };
 
+// histograms which are computed when asked for (eg by merging per-core
+// histograms), by name. unlike the event counters, these are not compiled
+// out without ENABLE_EVENT_COUNTERS, so whoever keeps the underlying
+// histograms decides what they cost
+class histogram_registry {
+public:
+  typedef std::function<log_linear_histogram ()> source_fn;
+
+  // replaces any previous source by the same name
+  static void add(const std::string &name, const source_fn &fn);
+
+  // WARNING: an expensive operation!
+  static bool
+  stat(const std::string &name, log_linear_histogram &h);
+
+  // WARNING: an expensive operation!
+  static std::map<std::string, log_linear_histogram> get_all();
+
+private:
+  static std::map<std::string, source_fn> &sources();
+  static spinlock &sources_lock();
+};
+
 inline std::ostream &
 operator<<(std::ostream &o, const counter_data &d)
 {
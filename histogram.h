@@ -0,0 +1,136 @@
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <algorithm>
+#include <ostream>
+#include <cstring>
+#include <stdint.h>
+
+#include "macros.h"
+
+/**
+ * Log-linear histogram of (non-negative) values, such as latencies in us.
+ *
+ * Each power of two is split into 2^SubBits equal buckets, so a value is
+ * recorded with a relative error of at most 1/2^SubBits, and values of
+ * 2^MaxBits or more all land in the last bucket.
+ *
+ * Not thread-safe: each histogram is meant to be written by one thread (eg
+ * per core), and merged with operator+=() by a reader. As with the event
+ * counters, a reader racing with the writer just sees a slightly stale
+ * histogram.
+ */
+class log_linear_histogram {
+public:
+  static const unsigned SubBits = 3;
+  static const unsigned MaxBits = 40;
+  static const size_t NBuckets = (MaxBits - SubBits + 1) << SubBits;
+
+  log_linear_histogram()
+  {
+    clear();
+  }
+
+  inline void
+  clear()
+  {
+    NDB_MEMSET(&buckets_[0], 0, sizeof(buckets_));
+    count_ = sum_ = max_ = 0;
+  }
+
+  // records n occurrences of v
+  inline ALWAYS_INLINE void
+  add(uint64_t v, uint64_t n = 1)
+  {
+    buckets_[bucket_of(v)] += n;
+    count_ += n;
+    sum_ += v * n;
+    if (n)
+      max_ = std::max(max_, v);
+  }
+
+  inline log_linear_histogram &
+  operator+=(const log_linear_histogram &that)
+  {
+    for (size_t i = 0; i < NBuckets; i++)
+      buckets_[i] += that.buckets_[i];
+    count_ += that.count_;
+    sum_   += that.sum_;
+    max_    = std::max(max_, that.max_);
+    return *this;
+  }
+
+  inline uint64_t count() const { return count_; }
+  inline uint64_t sum() const { return sum_; }
+  inline uint64_t max() const { return max_; }
+
+  inline double
+  avg() const
+  {
+    return count_ ? double(sum_) / double(count_) : 0.0;
+  }
+
+  // the smallest value v such that at least p% of the values are <= v, up
+  // to the resolution of the buckets. p is in [0, 100]
+  uint64_t
+  percentile(double p) const
+  {
+    if (!count_)
+      return 0;
+    uint64_t rank = uint64_t(p / 100.0 * double(count_) + 0.5);
+    rank = std::max(rank, uint64_t(1));
+    uint64_t acc = 0;
+    for (size_t i = 0; i < NBuckets; i++) {
+      acc += buckets_[i];
+      if (acc >= rank)
+        // the last bucket is unbounded
+        return (i == NBuckets - 1) ? max_ : std::min(bucket_max(i), max_);
+    }
+    return max_;
+  }
+
+  static inline size_t
+  bucket_of(uint64_t v)
+  {
+    if (v < (1UL << SubBits))
+      return v;
+    const unsigned msb = 63 - __builtin_clzll(v);
+    if (unlikely(msb >= MaxBits))
+      return NBuckets - 1;
+    return ((msb - SubBits + 1) << SubBits) +
+           ((v >> (msb - SubBits)) & ((1UL << SubBits) - 1));
+  }
+
+  // the largest value which lands in bucket i
+  static inline uint64_t
+  bucket_max(size_t i)
+  {
+    INVARIANT(i < NBuckets);
+    if (i < (1UL << SubBits))
+      return i;
+    const unsigned msb = (i >> SubBits) + SubBits - 1;
+    const uint64_t width = 1UL << (msb - SubBits);
+    return (1UL << msb) + (i & ((1UL << SubBits) - 1)) * width + width - 1;
+  }
+
+private:
+  uint64_t buckets_[NBuckets];
+  uint64_t count_;
+  uint64_t sum_;
+  uint64_t max_;
+};
+
+inline std::ostream &
+operator<<(std::ostream &o, const log_linear_histogram &h)
+{
+  o << "count=" << h.count()
+    << ", avg=" << h.avg()
+    << ", p50=" << h.percentile(50)
+    << ", p90=" << h.percentile(90)
+    << ", p99=" << h.percentile(99)
+    << ", p99.9=" << h.percentile(99.9)
+    << ", max=" << h.max();
+  return o;
+}
+
+#endif /* _HISTOGRAM_H_ */
@@ -1663,10 +1663,16 @@ tpcc_worker<Database, AllowReadOnlyScans>::txn_payment()
       v_c.c_data.resize_junk(
           min(static_cast<size_t>(n), v_c.c_data.max_size()));
       NDB_MEMCPY((void *) v_c.c_data.data(), &buf[0], v_c.c_data.size());
+      tables.tbl_customer(customerWarehouseID)->put(txn, k_c, v_c);
+    } else {
+      // c_data is untouched, so only write (and log) the payment fields
+      tables.tbl_customer(customerWarehouseID)->put(txn, k_c, v_c,
+          GUARDED_FIELDS(
+            customer::value::c_balance_field,
+            customer::value::c_ytd_payment_field,
+            customer::value::c_payment_cnt_field));
     }
 
-    tables.tbl_customer(customerWarehouseID)->put(txn, k_c, v_c);
-
     const history::key k_h(k_c.c_d_id, k_c.c_w_id, k_c.c_id, districtID, warehouse_id, ts);
     history::value v_h;
     v_h.h_amount = paymentAmount;
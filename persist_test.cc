@@ -133,6 +133,8 @@ fillvalue(std::string &s, uint64_t idx, size_t sz, PRNG &prng)
 static const size_t g_nrecords = 1000000;
 static const size_t g_ntxns_worker = 1000000;
 static const size_t g_nmax_loggers = 16;
+static const size_t g_direct_io_align = 4096; // in bytes
+static const size_t g_direct_io_prealloc = (1<<30); // in bytes
 
 static vector<uint64_t> g_database;
 static atomic<uint64_t> g_ntxns_committed(0);
@@ -142,6 +144,7 @@ static atomic<uint64_t> g_bytes_written[g_nmax_loggers];
 static size_t g_nworkers = 1;
 static int g_verbose = 0;
 static int g_fsync_background = 0;
+static int g_direct_io = 0; // O_DIRECT|O_DSYNC instead of fdatasync()
 static size_t g_readset = 30;
 static size_t g_writeset = 16;
 static size_t g_keysize = 8; // in bytes
@@ -278,24 +281,25 @@ struct pbuffer {
   size_t curoff_; // current offset into buf_, either for writing
                   // or during the dep computation phase
   size_t remaining_; // number of deps remaining to compute
-  std::string buf_; // the actual buffer, of size g_buffer_size
+  uint8_t *buf_; // the actual buffer, of size g_buffer_size (block aligned,
+                 // for O_DIRECT)
 
   inline uint8_t *
   pointer()
   {
-    return (uint8_t *) buf_.data() + curoff_;
+    return buf_ + curoff_;
   }
 
   inline logbuf_header *
   header()
   {
-    return (logbuf_header *) buf_.data();
+    return (logbuf_header *) buf_;
   }
 
   inline const logbuf_header *
   header() const
   {
-    return (const logbuf_header *) buf_.data();
+    return (const logbuf_header *) buf_;
   }
 };
 
@@ -335,7 +339,7 @@ protected:
     // block until we get a buf
     pbuffer *ret = g_all_buffers[id].deq();
     ret->io_scheduled_ = false;
-    ret->buf_.assign(g_buffer_size, 0);
+    memset(ret->buf_, 0, g_buffer_size);
     ret->curoff_ = sizeof(logbuf_header);
     ret->remaining_ = 0;
     return ret;
@@ -349,6 +353,9 @@ public:
     for (size_t i = 0; i < g_nworkers; i++) {
       for (size_t j = 0; j < g_perthread_buffers; j++) {
         struct pbuffer *p = new pbuffer;
+        void *buf;
+        ALWAYS_ASSERT(!posix_memalign(&buf, g_direct_io_align, g_buffer_size));
+        p->buf_ = (uint8_t *) buf;
         g_all_buffers[i].enq(p);
       }
     }
@@ -649,9 +656,13 @@ private:
         for (auto px : pxs) {
           INVARIANT(px);
           INVARIANT(!px->io_scheduled_);
-          iovs[nwritten].iov_base = (void *) px->buf_.data();
-          iovs[nwritten].iov_len = px->curoff_;
-          nbytes_written[sense] += px->curoff_;
+          // O_DIRECT writes whole blocks. the padding is zeros, since
+          // getbuffer() clears the buffer
+          const size_t pxlen = g_direct_io ?
+            iceil(px->curoff_, g_direct_io_align) : px->curoff_;
+          iovs[nwritten].iov_base = (void *) px->buf_;
+          iovs[nwritten].iov_len = pxlen;
+          nbytes_written[sense] += pxlen;
           px->io_scheduled_ = true;
           px->curoff_ = sizeof(logbuf_header);
           px->remaining_ = px->header()->nentries_;
@@ -693,7 +704,8 @@ private:
           INVARIANT(channel->can_post());
         dosense = !sense;
       } else {
-        int ret = fdatasync(fd);
+        // with O_DIRECT, the file was opened O_DSYNC
+        int ret = g_direct_io ? 0 : fdatasync(fd);
         if (ret == -1) {
           perror("fdatasync");
           exit(1);
@@ -959,7 +971,7 @@ protected:
               changed = true;
               p = nextp;
               px->remaining_--;
-              px->curoff_ = intptr_t(p) - intptr_t(px->buf_.data());
+              px->curoff_ = intptr_t(p) - intptr_t(px->buf_);
               g_ntxns_committed++;
             } else {
               // done, no further entries will be satisfied
@@ -1075,6 +1087,7 @@ main(int argc, char **argv)
     {
       {"verbose"     , no_argument       , &g_verbose , 1}   ,
       {"fsync-back"  , no_argument       , &g_fsync_background, 1},
+      {"direct-io"   , no_argument       , &g_direct_io, 1},
       {"num-threads" , required_argument , 0          , 't'} ,
       {"strategy"    , required_argument , 0          , 's'} ,
       {"readset"     , required_argument , 0          , 'r'} ,
@@ -1145,6 +1158,7 @@ main(int argc, char **argv)
   ALWAYS_ASSERT(g_valuesize >= 0);
   ALWAYS_ASSERT(!logfiles.empty());
   ALWAYS_ASSERT(logfiles.size() <= g_nmax_loggers);
+  ALWAYS_ASSERT(!g_direct_io || !g_fsync_background);
   ALWAYS_ASSERT(
       assignments.empty() ||
       database_simulation::AssignmentsValid(
@@ -1159,6 +1173,7 @@ main(int argc, char **argv)
          << ", logfiles=" << logfiles
          << ", strategy=" << strategy
          << ", fsync_background=" << g_fsync_background
+         << ", direct_io=" << g_direct_io
          << ", assignments=" << assignments
          << "}" << endl;
 
@@ -1171,11 +1186,19 @@ main(int argc, char **argv)
 
   vector<int> fds;
   for (auto &fname : logfiles) {
-    int fd = open(fname.c_str(), O_CREAT|O_WRONLY|O_TRUNC, 0664);
+    const int flags = O_CREAT|O_WRONLY|O_TRUNC |
+      (g_direct_io ? (O_DIRECT|O_DSYNC) : 0);
+    int fd = open(fname.c_str(), flags, 0664);
     if (fd == -1) {
       perror("open");
       return 1;
     }
+    // preallocate, so O_DSYNC writes don't need to grow the file
+    if (g_direct_io && fallocate(fd, 0, 0, g_direct_io_prealloc) == -1 &&
+        errno != EOPNOTSUPP) {
+      perror("fallocate");
+      return 1;
+    }
     fds.push_back(fd);
   }
 
@@ -207,6 +207,8 @@ Size(const T &t)
   &generic_serializer< serializer< tpe, true > >::skip,
 #define DESCRIPTOR_VALUE_FAILSAFE_SKIP_FN_X(tpe, name) \
   &generic_serializer< serializer< tpe, true > >::failsafe_skip,
+#define DESCRIPTOR_VALUE_ADD_FN_X(tpe, name) \
+  generic_adder< tpe >::fn(),
 #define DESCRIPTOR_VALUE_MAX_NBYTES_X(tpe, name) \
   serializer< tpe, true >::max_nbytes(),
 #define DESCRIPTOR_VALUE_OFFSETOF_X(tpe, name) \
@@ -458,6 +460,14 @@ Size(const T &t)
       }; \
       return failsafe_skip_fns[i]; \
     } \
+    static inline generic_add_fn \
+    add_fn(size_t i) \
+    { \
+      static generic_add_fn add_fns[] = { \
+        APPLY_X_AND_Y(valuefields, DESCRIPTOR_VALUE_ADD_FN_X) \
+      }; \
+      return add_fns[i]; \
+    } \
     static inline constexpr size_t \
     nfields() \
     { \
@@ -2,6 +2,7 @@
 #define _NDB_BENCH_SERIALIZER_H_
 
 #include <stdint.h>
+#include <type_traits>
 #include "../macros.h"
 #include "../varint.h"
 
@@ -11,6 +12,7 @@ typedef const uint8_t *(*generic_failsafe_read_fn)(const uint8_t *, size_t, uint
 typedef size_t (*generic_nbytes_fn)(const uint8_t *);
 typedef size_t (*generic_skip_fn)(const uint8_t *, uint8_t *);
 typedef size_t (*generic_failsafe_skip_fn)(const uint8_t *, size_t, uint8_t *);
+typedef void (*generic_add_fn)(uint8_t *, const uint8_t *);
 
 // wraps a real serializer, exposing generic functions
 template <typename Serializer>
@@ -63,6 +65,37 @@ struct generic_serializer {
   }
 };
 
+// adds the obj at delta to the obj at obj. only numeric types add up: fn()
+// is nullptr for the others
+template <typename T, bool IsNumeric = std::is_arithmetic<T>::value>
+struct generic_adder {
+  static inline generic_add_fn
+  fn()
+  {
+    return nullptr;
+  }
+};
+
+template <typename T>
+struct generic_adder<T, true> {
+  static inline void
+  add(uint8_t *obj, const uint8_t *delta)
+  {
+    // the objs live in packed structs
+    T a, b;
+    NDB_MEMCPY(&a, obj, sizeof(T));
+    NDB_MEMCPY(&b, delta, sizeof(T));
+    a += b;
+    NDB_MEMCPY(obj, &a, sizeof(T));
+  }
+
+  static inline generic_add_fn
+  fn()
+  {
+    return &add;
+  }
+};
+
 template <typename T, bool Compress>
 struct serializer {
   typedef T obj_type;
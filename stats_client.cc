@@ -25,6 +25,8 @@ int
 main(int argc, char **argv)
 {
   if (argc != 3) {
+    // counterspec is a ':' separated list of counter names. a name
+    // starting with '@' is a histogram instead (see histogram_registry)
     cerr << "[usage] " << argv[0] << " sockfile counterspec" << endl;
     return 1;
   }
@@ -51,9 +53,13 @@ main(int argc, char **argv)
   int r;
   timer loop_timer;
   for (;;) {
-    for (auto &name : counter_names) {
+    for (auto &spec : counter_names) {
+      const bool is_hist = !spec.empty() && spec[0] == '@';
+      const string name = is_hist ? spec.substr(1) : spec;
       uint8_t buf[1 + name.size()];
-      buf[0] = (uint8_t) stats_command::GET_COUNTER_VALUE;
+      buf[0] = (uint8_t) (is_hist ?
+          stats_command::GET_HISTOGRAM_VALUE :
+          stats_command::GET_COUNTER_VALUE);
       memcpy(&buf[1], name.data(), name.size());
       pkt.assign((const char *) &buf[0], sizeof(buf));
       if ((r = pkt.sendpkt(fd))) {
@@ -66,6 +72,19 @@ main(int argc, char **argv)
         perror("recv - disconnecting");
         return 1;
       }
+      if (is_hist) {
+        const get_histogram_value_t *resp =
+          (const get_histogram_value_t *) pkt.data();
+        cout << name                          << " "
+             << resp->timestamp_us_           << " "
+             << resp->h_.count()              << " "
+             << resp->h_.sum()                << " "
+             << resp->h_.max()                << " "
+             << resp->h_.percentile(50)       << " "
+             << resp->h_.percentile(99)       << " "
+             << resp->h_.percentile(99.9)     << endl;
+        continue;
+      }
       const get_counter_value_t *resp = (const get_counter_value_t *) pkt.data();
       cout << name                << " "
            << resp->timestamp_us_ << " "
@@ -4,13 +4,21 @@
 #include "macros.h"
 #include "fileutils.h"
 
-enum class stats_command : uint8_t { GET_COUNTER_VALUE = 0x1 };
+enum class stats_command : uint8_t {
+  GET_COUNTER_VALUE = 0x1,
+  GET_HISTOGRAM_VALUE = 0x2, // see histogram_registry
+};
 
 struct get_counter_value_t {
   uint64_t timestamp_us_; // usec
   counter_data d_;
 };
 
+struct get_histogram_value_t {
+  uint64_t timestamp_us_; // usec
+  log_linear_histogram h_;
+};
+
 class packet {
 public:
   static const size_t MAX_DATA = 0xFFFF - 4;
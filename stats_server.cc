@@ -59,6 +59,17 @@ stats_server::handle_cmd_get_counter_value(const string &name, packet &pkt)
   return true;
 }
 
+bool
+stats_server::handle_cmd_get_histogram_value(const string &name, packet &pkt)
+{
+  get_histogram_value_t ret;
+  ret.timestamp_us_ = timer::cur_usec();
+  if (!histogram_registry::stat(name, ret.h_))
+    cerr << "could not find histogram " << name << endl;
+  pkt.assign((const char *) &ret, sizeof(ret));
+  return true;
+}
+
 void
 stats_server::serve_client(int fd)
 {
@@ -86,6 +97,16 @@ stats_server::serve_client(int fd)
         pkt.sendpkt(fd);
         break;
       }
+    case static_cast<uint8_t>(stats_command::GET_HISTOGRAM_VALUE):
+      {
+        scratch.assign(pkt.data() + 1, pkt.size() - 1);
+        if (!handle_cmd_get_histogram_value(scratch, pkt)) {
+          cerr << "error on handle_cmd_get_histogram_value(), dropping" << endl;
+          return;
+        }
+        pkt.sendpkt(fd);
+        break;
+      }
     default:
       cerr << "bad command- dropping connection" << endl;
       return;
@@ -3,7 +3,11 @@
 #include <unordered_map>
 #include <tuple>
 #include <set>
+#include <mutex>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <lz4hc.h>
 
 #include "circbuf.h"
 #include "pxqueue.h"
@@ -17,6 +21,9 @@
 #include "small_unordered_map.h"
 #include "static_unordered_map.h"
 #include "counter.h"
+#include "fileutils.h"
+#include "txn_recovery.h"
+#include "txn_follower.h"
 #include "record/encoder.h"
 #include "record/inline_str.h"
 #include "record/cursor.h"
@@ -199,8 +206,10 @@ CircbufTest()
   circbuf<int, ARRAY_NELEMS(values)> b;
   ALWAYS_ASSERT(b.empty());
   for (size_t i = 0; i < ARRAY_NELEMS(values); i++) {
+    ALWAYS_ASSERT(!b.full());
     b.enq(&values[i]);
   }
+  ALWAYS_ASSERT(b.full());
   vector<int *> pxs;
   b.peekall(pxs);
   ALWAYS_ASSERT(pxs.size() == ARRAY_NELEMS(values));
@@ -229,6 +238,115 @@ CircbufTest()
   cout << "circbuf test passed" << endl;
 }
 
+void
+HistogramTest()
+{
+  typedef log_linear_histogram h_t;
+
+  // buckets cover the values in order, without gaps
+  for (size_t i = 0; i + 1 < h_t::NBuckets; i++) {
+    ALWAYS_ASSERT(h_t::bucket_of(h_t::bucket_max(i)) == i);
+    ALWAYS_ASSERT(h_t::bucket_of(h_t::bucket_max(i) + 1) == i + 1);
+  }
+  ALWAYS_ASSERT(h_t::bucket_of(numeric_limits<uint64_t>::max()) ==
+                h_t::NBuckets - 1);
+
+  h_t h;
+  ALWAYS_ASSERT(h.percentile(99) == 0);
+  for (uint64_t v = 1; v <= 1000; v++)
+    h.add(v);
+  ALWAYS_ASSERT(h.count() == 1000);
+  ALWAYS_ASSERT(h.max() == 1000);
+  ALWAYS_ASSERT(h.avg() == 500.5);
+  // values are recorded to within 1/2^SubBits
+  const uint64_t p50 = h.percentile(50), p99 = h.percentile(99);
+  ALWAYS_ASSERT(p50 >= 500 && p50 <= 500 + 500 / (1 << h_t::SubBits));
+  ALWAYS_ASSERT(p99 >= 990 && p99 <= 1000);
+  ALWAYS_ASSERT(h.percentile(100) == 1000);
+
+  h_t h1;
+  h1.add(1UL << 50);
+  h1 += h;
+  ALWAYS_ASSERT(h1.count() == 1001);
+  ALWAYS_ASSERT(h1.percentile(50) == p50);
+  ALWAYS_ASSERT(h1.percentile(100) == (1UL << 50));
+
+  h1.clear();
+  ALWAYS_ASSERT(!h1.count() && !h1.max());
+  h1.add(7, 3);
+  h1.add(1000, 0);
+  ALWAYS_ASSERT(h1.count() == 3 && h1.sum() == 21 && h1.max() == 7);
+
+  histogram_registry::add("test_hist", [&h1]() { return h1; });
+  h_t h2;
+  ALWAYS_ASSERT(histogram_registry::stat("test_hist", h2));
+  ALWAYS_ASSERT(h2.count() == 3 && h2.percentile(100) == 7);
+  ALWAYS_ASSERT(!histogram_registry::stat("no_such_hist", h2));
+
+  cout << "histogram test passed" << endl;
+}
+
+void
+LoggerAssignmentTest()
+{
+  typedef vector<vector<unsigned>> assignments_t;
+  vector<int> nodes;
+
+  // one logger per node
+  ALWAYS_ASSERT(txn_logger::NumaAssignments(
+        2, {0, 0, 0, 0, 1, 1, 1, 1}, nodes) ==
+      assignments_t({{0, 1, 2, 3}, {4, 5, 6, 7}}));
+  ALWAYS_ASSERT(nodes == vector<int>({0, 1}));
+
+  // a node's workers are split over its loggers
+  ALWAYS_ASSERT(txn_logger::NumaAssignments(
+        4, {0, 0, 0, 0, 1, 1, 1, 1}, nodes) ==
+      assignments_t({{0, 1}, {2, 3}, {4, 5}, {6, 7}}));
+  ALWAYS_ASSERT(nodes == vector<int>({0, 0, 1, 1}));
+
+  // spare loggers go to the busiest node
+  ALWAYS_ASSERT(txn_logger::NumaAssignments(
+        3, {0, 0, 0, 0, 0, 0, 1, 1}, nodes) ==
+      assignments_t({{0, 1, 2}, {3, 4, 5}, {6, 7}}));
+  ALWAYS_ASSERT(nodes == vector<int>({0, 0, 1}));
+
+  // fewer loggers than nodes
+  ALWAYS_ASSERT(txn_logger::NumaAssignments(
+        2, {0, 1, 2, 3, 0, 1, 2, 3}, nodes) ==
+      assignments_t({{0, 2, 4, 6}, {1, 3, 5, 7}}));
+  ALWAYS_ASSERT(nodes == vector<int>({0, 1}));
+
+  // more loggers than workers
+  ALWAYS_ASSERT(txn_logger::NumaAssignments(4, {1, 0}, nodes) ==
+      assignments_t({{1}, {0}}));
+  ALWAYS_ASSERT(nodes == vector<int>({0, 1}));
+
+  // rebalancing moves the worker which evens out the loggers best
+  const uint64_t m = 1 << 20;
+  unsigned w = 0, to = 0;
+  ALWAYS_ASSERT(txn_logger::PickMigration(
+        {{0, 1, 2}, {3}}, {m, m, m, m}, {}, w, to));
+  ALWAYS_ASSERT(w == 0 && to == 1);
+  ALWAYS_ASSERT(txn_logger::PickMigration(
+        {{0, 1, 2}, {3}}, {m / 10, 8 * m / 10, 3 * m / 10, 2 * m / 10}, {},
+        w, to));
+  ALWAYS_ASSERT(w == 2 && to == 1);
+
+  // ... but not if the loggers are even enough, if the only worker left
+  // to move would make them trade places, if there is too little log to
+  // bother, or if the loggers are on different nodes
+  ALWAYS_ASSERT(!txn_logger::PickMigration(
+        {{0, 1}, {2, 3}}, {m, m, m, m}, {}, w, to));
+  ALWAYS_ASSERT(!txn_logger::PickMigration(
+        {{0}, {1, 2}}, {4 * m, m, m}, {}, w, to));
+  ALWAYS_ASSERT(!txn_logger::PickMigration(
+        {{0, 1, 2}, {3}}, {10, 10, 10, 0}, {}, w, to));
+  ALWAYS_ASSERT(!txn_logger::PickMigration(
+        {{0, 1, 2}, {3}}, {m, m, m, m}, {0, 1}, w, to));
+
+  cout << "logger assignment test passed" << endl;
+}
+
 void
 CounterTest()
 {
@@ -954,6 +1072,362 @@ Test()
 
 }
 
+namespace recoverytest {
+
+typedef tuple<unsigned, string, string> write_t; // (table id, key, value)
+typedef vector<pair<uint64_t, vector<write_t>>> txns_t;
+typedef map<pair<unsigned, string>, string> db_t;
+
+// pads log with zeros to the next direct IO block
+static void
+pad_block(string &log)
+{
+  log.resize(util::iceil(log.size(), txn_logger::g_direct_io_align), '\0');
+}
+
+static string
+new_segment(uint16_t flags = 0)
+{
+  txn_logger::log_segment_header hdr;
+  hdr.magic_ = txn_logger::g_log_segment_magic;
+  hdr.version_ = txn_logger::g_log_format_version;
+  hdr.flags_ = flags;
+  hdr.logger_id_ = 0;
+  hdr.checksum_ = txn_logger::ComputeChecksum(hdr);
+  string log((const char *) &hdr, sizeof(hdr));
+  if (flags & txn_logger::log_segment_header::FLAGS_DIRECT_IO)
+    pad_block(log);
+  return log;
+}
+
+static void
+append_header(string &log, uint64_t nentries, uint64_t last_tid,
+              const string &data)
+{
+  txn_logger::logbuf_header hdr;
+  hdr.nentries_ = nentries;
+  hdr.last_tid_ = last_tid;
+  hdr.nbytes_ = data.size();
+  hdr.checksum_ =
+    txn_logger::ComputeChecksum(hdr, (const uint8_t *) data.data());
+  log.append((const char *) &hdr, sizeof(hdr));
+  log.append(data);
+}
+
+static string
+encode_txns(const txns_t &txns)
+{
+  string data;
+  uint8_t buf[5];
+  for (auto &txn : txns) {
+    data.append((const char *) &txn.first, sizeof(txn.first));
+    data.append((const char *) buf, write_uvint32(buf, txn.second.size()) - buf);
+    for (auto &w : txn.second) {
+      data.append((const char *) buf, write_uvint32(buf, get<0>(w)) - buf);
+      data.append((const char *) buf, write_uvint32(buf, get<1>(w).size()) - buf);
+      data.append(get<1>(w));
+      data.append((const char *) buf, write_uvint32(buf, get<2>(w).size()) - buf);
+      data.append(get<2>(w));
+    }
+  }
+  return data;
+}
+
+// appends a log buffer in the format written by txn_logger
+static void
+append_buffer(string &log, const txns_t &txns)
+{
+  append_header(log, txns.size(), txns.back().first, encode_txns(txns));
+}
+
+// same, but the txns are one LZ4HC compressed chunk, as written by a
+// compression pool
+static void
+append_compressed_buffer(string &log, const txns_t &txns, int level)
+{
+  const string raw = encode_txns(txns);
+  unique_ptr<char[]> state(new char[LZ4_sizeofStateHC()]);
+  string data(sizeof(uint32_t) + LZ4_compressBound(raw.size()), '\0');
+  const int ret = LZ4_compressHC2_limitedOutput_withStateHC(
+      state.get(), raw.data(), &data[sizeof(uint32_t)], raw.size(),
+      data.size() - sizeof(uint32_t), level);
+  ALWAYS_ASSERT(ret > 0);
+  const uint32_t clen = ret;
+  NDB_MEMCPY(&data[0], &clen, sizeof(clen));
+  data.resize(sizeof(uint32_t) + ret);
+  append_header(log, txns.size(), txns.back().first, data);
+}
+
+static void
+write_file(const string &fname, const string &contents)
+{
+  const int fd = open(fname.c_str(), O_CREAT|O_WRONLY|O_TRUNC, 0664);
+  ALWAYS_ASSERT(fd >= 0);
+  ALWAYS_ASSERT(fileutils::writeall(fd, contents.data(), contents.size()) == 0);
+  close(fd);
+}
+
+static db_t
+recover(const vector<string> &logfiles, uint64_t durable_epoch,
+        txn_log_recovery::stats &s, uint64_t checkpoint_tid = 0)
+{
+  mutex lock;
+  db_t m;
+  s = txn_log_recovery::Recover(
+      logfiles, 4,
+      [&](unsigned, unsigned table_id, const string &k, const string &v, uint64_t) {
+        std::lock_guard<mutex> l(lock);
+        ALWAYS_ASSERT(!m.count(make_pair(table_id, k)));
+        if (!v.empty())
+          m[make_pair(table_id, k)] = v;
+      },
+      checkpoint_tid, durable_epoch);
+  return m;
+}
+
+void
+Test()
+{
+  typedef transaction_proto2_static p;
+  const string fname0 = "/tmp/silo-recoverytest-0.log";
+  const string fname1 = "/tmp/silo-recoverytest-1.log";
+  string log0 = new_segment(), log1 = new_segment();
+
+  // core 1 writes epochs 5 and 6, core 2 writes epoch 6 (to another logger)
+  append_buffer(log0, {
+      {p::MakeTid(1, 1, 5), {write_t(0, "a", "a0"), write_t(0, "b", "b0")}},
+      {p::MakeTid(1, 2, 5), {write_t(0, "a", "a1"), write_t(1, "a", "x0")}},
+  });
+  const size_t log0_first_buffer_end = log0.size();
+  append_buffer(log0, {
+      {p::MakeTid(1, 3, 6), {write_t(0, "a", "a2"), write_t(1, "a", "")}},
+  });
+  append_buffer(log1, {
+      {p::MakeTid(2, 1, 6), {write_t(0, "c", "c0")}},
+  });
+
+  // torn tail: a buffer with only part of its txns
+  string torn;
+  append_buffer(torn, {
+      {p::MakeTid(2, 2, 7), {write_t(0, "c", "c1")}},
+      {p::MakeTid(2, 3, 7), {write_t(0, "e", "e0")}},
+  });
+  torn.resize(torn.size() - 4);
+
+  write_file(fname0, log0);
+  write_file(fname1, log1 + torn);
+
+  const db_t db_e5({
+      {{0, "a"}, "a1"}, {{0, "b"}, "b0"}, {{1, "a"}, "x0"}});
+  const db_t db_e6({
+      {{0, "a"}, "a2"}, {{0, "b"}, "b0"}, {{0, "c"}, "c0"}});
+
+  txn_log_recovery::stats s;
+
+  // computed frontier: both cores have seen epoch 6, so only epoch 5 is
+  // known to be complete
+  ALWAYS_ASSERT(recover({fname0, fname1}, txn_log_recovery::ComputeDurableEpoch, s) == db_e5);
+  ALWAYS_ASSERT(s.durable_epoch_ == 5);
+  ALWAYS_ASSERT(s.nbuffers_ == 3);
+  ALWAYS_ASSERT(s.ntxns_ == 4);
+  ALWAYS_ASSERT(s.ntxns_discarded_ == 2);
+  ALWAYS_ASSERT(s.nbytes_truncated_ == torn.size());
+
+  // explicit frontier
+  ALWAYS_ASSERT(recover({fname0, fname1}, 6, s) == db_e6);
+  ALWAYS_ASSERT(s.ntxns_discarded_ == 0);
+
+  // durable epoch marker
+  append_header(log1, 0, 6, "");
+  write_file(fname1, log1 + torn);
+  ALWAYS_ASSERT(recover({fname0, fname1}, txn_log_recovery::ComputeDurableEpoch, s) == db_e6);
+  ALWAYS_ASSERT(s.durable_epoch_ == 6);
+
+  // a checkpoint covering all of epoch 5 leaves only epoch 6 to replay
+  ALWAYS_ASSERT(recover({fname0, fname1}, 6, s,
+                        p::MakeTid(p::CoreMask, p::NumIdMask >> p::NumIdShift, 5)) == db_t({
+      {{0, "a"}, "a2"}, {{0, "c"}, "c0"}}));
+  ALWAYS_ASSERT(s.nwrites_skipped_ == 4);
+
+  // corrupting a buffer drops it, and everything after it
+  log0[log0_first_buffer_end + sizeof(txn_logger::logbuf_header) + 1] ^= 0x1;
+  write_file(fname0, log0);
+  ALWAYS_ASSERT(recover({fname0, fname1}, 6, s) == db_t({
+      {{0, "a"}, "a1"}, {{0, "b"}, "b0"}, {{1, "a"}, "x0"}, {{0, "c"}, "c0"}}));
+  ALWAYS_ASSERT(s.nbuffers_ == 2);
+  ALWAYS_ASSERT(s.nbytes_truncated_ == (log0.size() - log0_first_buffer_end) + torn.size());
+
+  // the zeros of a preallocated segment are not a torn write
+  write_file(fname1, log1 + string(4096, '\0'));
+  ALWAYS_ASSERT(recover({fname1}, 6, s) == db_t({{{0, "c"}, "c0"}}));
+  ALWAYS_ASSERT(s.nbytes_truncated_ == 0);
+
+  // with an is_full_fn, the deltas (here, values starting with '+') of a
+  // key are replayed in TID order, starting from its latest full record
+  string delta_log = new_segment();
+  append_buffer(delta_log, {
+      {p::MakeTid(1, 1, 5), {write_t(0, "a", "a0"), write_t(0, "b", "+b0")}},
+      {p::MakeTid(1, 2, 5), {write_t(0, "a", "+a1")}},
+      {p::MakeTid(1, 3, 5), {write_t(0, "a", "a2"), write_t(0, "b", "+b1")}},
+      {p::MakeTid(1, 4, 5), {write_t(0, "a", "+a3")}},
+  });
+  write_file(fname0, delta_log);
+  {
+    mutex lock;
+    map<pair<unsigned, string>, vector<string>> chains;
+    s = txn_log_recovery::Recover(
+        {fname0}, 4,
+        [&](unsigned, unsigned table_id, const string &k, const string &v, uint64_t) {
+          std::lock_guard<mutex> l(lock);
+          chains[make_pair(table_id, k)].push_back(v);
+        },
+        0, 5,
+        [](unsigned, const string &v) { return v[0] != '+'; });
+    ALWAYS_ASSERT(chains == (map<pair<unsigned, string>, vector<string>>({
+        {{0, "a"}, {"a2", "+a3"}}, {{0, "b"}, {"+b0", "+b1"}}})));
+    ALWAYS_ASSERT(s.nkeys_replayed_ == 4);
+  }
+
+  // with direct IO, the header and each buffer are padded to a block
+  string dlog = new_segment(txn_logger::log_segment_header::FLAGS_DIRECT_IO);
+  append_buffer(dlog, {
+      {p::MakeTid(1, 1, 5), {write_t(0, "a", "a0")}},
+  });
+  pad_block(dlog);
+  append_header(dlog, 0, 5, "");
+  pad_block(dlog);
+  append_buffer(dlog, {
+      {p::MakeTid(1, 2, 6), {write_t(0, "b", "b0")}},
+  });
+  pad_block(dlog);
+  write_file(fname0, dlog + string(4096, '\0'));
+  ALWAYS_ASSERT(recover({fname0}, txn_log_recovery::ComputeDurableEpoch, s) == db_t({
+      {{0, "a"}, "a0"}}));
+  ALWAYS_ASSERT(s.nbuffers_ == 2);
+  ALWAYS_ASSERT(s.durable_epoch_ == 5);
+  ALWAYS_ASSERT(s.nbytes_truncated_ == 0);
+
+  // a compressed chunk may hold more than one horizon's worth of txns
+  string clog = new_segment(txn_logger::log_segment_header::FLAGS_COMPRESSED);
+  txns_t ctxns;
+  db_t cdb;
+  for (unsigned i = 0; i < 4096; i++) {
+    const string k = "k" + to_string(i), v = string(64, 'a' + (i % 26));
+    ctxns.push_back({p::MakeTid(1, i + 1, 5), {write_t(0, k, v)}});
+    cdb[make_pair(0, k)] = v;
+  }
+  ALWAYS_ASSERT(encode_txns(ctxns).size() > txn_logger::g_horizon_buffer_size);
+  append_compressed_buffer(clog, ctxns, 4);
+  append_header(clog, 0, 5, "");
+  write_file(fname0, clog);
+  ALWAYS_ASSERT(recover({fname0}, txn_log_recovery::ComputeDurableEpoch, s) == cdb);
+  ALWAYS_ASSERT(s.nbuffers_ == 1);
+
+  // segments are listed in order
+  const string base = "/tmp/silo-recoverytest-seg";
+  for (auto segno : {10, 0, 2})
+    write_file(txn_logger::SegmentName(base, segno), "");
+  write_file(base + ".x", "");
+  ALWAYS_ASSERT(txn_logger::ListSegments(base) == vector<string>({
+      base + ".0", base + ".2", base + ".10"}));
+  for (auto &seg : txn_logger::ListSegments(base))
+    unlink(seg.c_str());
+  unlink((base + ".x").c_str());
+
+  unlink(fname0.c_str());
+  unlink(fname1.c_str());
+  cout << "recovery test passed" << endl;
+}
+
+static void
+send_all(int fd, const string &s)
+{
+  ALWAYS_ASSERT(fileutils::writeall(fd, s.data(), s.size()) == 0);
+}
+
+// a primary (in a child process) ships two streams to a follower
+void
+FollowerTest()
+{
+  typedef transaction_proto2_static p;
+  const string sockfile = "/tmp/silo-followertest.sock";
+
+  mutex lock;
+  db_t db;
+  txn_log_follower f(
+      sockfile, 4,
+      [&](unsigned, unsigned table_id, const string &k, const string &v, uint64_t) {
+        std::lock_guard<mutex> l(lock);
+        if (v.empty())
+          db.erase(make_pair(table_id, k));
+        else
+          db[make_pair(table_id, k)] = v;
+      });
+  auto snapshot = [&]() {
+    std::lock_guard<mutex> l(lock);
+    return db;
+  };
+
+  // stream 1 is padded for direct IO. both streams are complete up to
+  // epoch 5 at first, and stream 1 already holds an epoch 6 buffer
+  string s0, s1;
+  append_buffer(s0, {
+      {p::MakeTid(1, 1, 5), {write_t(0, "a", "a0")}},
+  });
+  append_header(s0, 0, 5, "");
+  append_buffer(s1, {
+      {p::MakeTid(2, 1, 5), {write_t(0, "b", "b0")}},
+  });
+  pad_block(s1);
+  append_buffer(s1, {
+      {p::MakeTid(2, 2, 6), {write_t(0, "b", "b1"), write_t(0, "a", "")}},
+  });
+  pad_block(s1);
+  append_header(s1, 0, 5, "");
+  pad_block(s1);
+  string s0_next, s1_next;
+  append_header(s0_next, 0, 6, "");
+  append_header(s1_next, 0, 6, "");
+  pad_block(s1_next);
+
+  int go[2];
+  ALWAYS_ASSERT(pipe(go) == 0);
+  const pid_t pid = fork();
+  ALWAYS_ASSERT(pid >= 0);
+  if (!pid) {
+    const int fd0 = txn_logger::ConnectFollower(sockfile, 0, 2, 0);
+    const int fd1 = txn_logger::ConnectFollower(
+        sockfile, 1, 2, txn_logger::log_segment_header::FLAGS_DIRECT_IO);
+    send_all(fd0, s0);
+    send_all(fd1, s1);
+    char c;
+    ALWAYS_ASSERT(read(go[0], &c, 1) == 1);
+    send_all(fd0, s0_next);
+    send_all(fd1, s1_next);
+    _exit(0);
+  }
+
+  // epoch 6 is not applied before both streams are complete up to it
+  ALWAYS_ASSERT(f.wait_for_epoch(5) == 5);
+  ALWAYS_ASSERT(snapshot() == db_t({{{0, "a"}, "a0"}, {{0, "b"}, "b0"}}));
+  ALWAYS_ASSERT(write(go[1], "x", 1) == 1);
+
+  const txn_log_follower::stats s = f.wait_for_primary();
+  ALWAYS_ASSERT(s.applied_epoch_ == 6);
+  ALWAYS_ASSERT(s.nstreams_ == 2);
+  ALWAYS_ASSERT(s.nbuffers_ == 3);
+  ALWAYS_ASSERT(s.nwrites_ == 4);
+  ALWAYS_ASSERT(snapshot() == db_t({{{0, "b"}, "b1"}}));
+
+  int status;
+  ALWAYS_ASSERT(waitpid(pid, &status, 0) == pid);
+  ALWAYS_ASSERT(WIFEXITED(status) && !WEXITSTATUS(status));
+  close(go[0]);
+  close(go[1]);
+  cout << "follower test passed" << endl;
+}
+}
+
 class main_thread : public ndb_thread {
 public:
   main_thread(int argc, char **argv)
@@ -970,6 +1444,10 @@ public:
     cerr << "PID: " << getpid() << endl;
 
     CircbufTest();
+    HistogramTest();
+    LoggerAssignmentTest();
+    recoverytest::Test();
+    recoverytest::FollowerTest();
 
     // initialize the numa allocator subsystem with the number of CPUs running
     // + reasonable size per core
@@ -193,6 +193,8 @@ typedef struct _U64_S { U64 v; } _PACKED U64_S;
 #define HASH_MASK (HASHTABLESIZE - 1)
 
 #define MAX_NB_ATTEMPTS 256
+#define DEFAULT_COMPRESSIONLEVEL 9   // 1 << (9-1) == MAX_NB_ATTEMPTS
+#define MAX_COMPRESSIONLEVEL 16
 
 #define ML_BITS  4
 #define ML_MASK  (size_t)((1U<<ML_BITS)-1)
@@ -253,6 +255,7 @@ typedef struct
     HTYPE hashTable[HASHTABLESIZE];
     U16 chainTable[MAXD];
     const BYTE* nextToUpdate;
+    int maxAttempts;
 } LZ4HC_Data_Structure;
 
 
@@ -345,6 +348,7 @@ static inline int LZ4_InitHC (LZ4HC_Data_Structure* hc4, const BYTE* base)
     hc4->base = base;
     hc4->inputBuffer = base;
     hc4->end = base;
+    hc4->maxAttempts = MAX_NB_ATTEMPTS;
     return 1;
 }
 
@@ -427,7 +431,7 @@ static forceinline int LZ4HC_InsertAndFindBestMatch (LZ4HC_Data_Structure* hc4,
     HTYPE* const HashTable = hc4->hashTable;
     const BYTE* ref;
     INITBASE(base,hc4->base);
-    int nbAttempts=MAX_NB_ATTEMPTS;
+    int nbAttempts=hc4->maxAttempts;
     size_t repl=0, ml=0;
     U16 delta=0;  // useless assignment, to remove an uninitialization warning
 
@@ -495,7 +499,7 @@ static forceinline int LZ4HC_InsertAndGetWiderMatch (LZ4HC_Data_Structure* hc4,
     HTYPE* const HashTable = hc4->hashTable;
     INITBASE(base,hc4->base);
     const BYTE*  ref;
-    int nbAttempts = MAX_NB_ATTEMPTS;
+    int nbAttempts = hc4->maxAttempts;
     int delta = (int)(ip-startLimit);
 
     // First Match
@@ -582,3 +586,37 @@ return : the number of bytes written in buffer 'dest', or 0 if the compression f
 #define LIMITED_OUTPUT
 #include "lz4hc_encoder.h"
 
+
+/*
+int LZ4_sizeofStateHC(void)
+
+Size of the state LZ4_compressHC2_limitedOutput_withStateHC() needs.
+*/
+int LZ4_sizeofStateHC(void) { return sizeof(LZ4HC_Data_Structure); }
+
+
+/*
+int LZ4_compressHC2_limitedOutput_withStateHC(
+                 void* state,
+                 const char* source,
+                 char* dest,
+                 int inputSize,
+                 int maxOutputSize,
+                 int compressionLevel)
+
+Same as LZ4_compressHC_limitedOutput(), but uses the caller's 'state' (of
+LZ4_sizeofStateHC() bytes, pointer aligned) instead of allocating one, and
+tries up to 2^(compressionLevel-1) matches per position.
+compressionLevel <= 0 selects the default (9), and levels above 16 are
+treated as 16.
+*/
+int LZ4_compressHC2_limitedOutput_withStateHC (void* state, const char* source, char* dest, int inputSize, int maxOutputSize, int compressionLevel)
+{
+    LZ4HC_Data_Structure* hc4 = (LZ4HC_Data_Structure*)state;
+    if (((size_t)state) & (sizeof(void*)-1)) return 0;   // state is not pointer aligned
+    if (compressionLevel <= 0) compressionLevel = DEFAULT_COMPRESSIONLEVEL;
+    if (compressionLevel > MAX_COMPRESSIONLEVEL) compressionLevel = MAX_COMPRESSIONLEVEL;
+    LZ4_InitHC(hc4, (const BYTE*)source);
+    hc4->maxAttempts = 1 << (compressionLevel-1);
+    return LZ4_compressHC_limitedOutput_continue(state, source, dest, inputSize, maxOutputSize);
+}
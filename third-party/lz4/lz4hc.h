@@ -63,6 +63,19 @@ LZ4_compress_limitedOutput() :
 */
 
 
+int LZ4_sizeofStateHC(void);
+int LZ4_compressHC2_limitedOutput_withStateHC (void* state, const char* source, char* dest, int inputSize, int maxOutputSize, int compressionLevel);
+/*
+LZ4_compressHC2_limitedOutput_withStateHC() :
+    Same as LZ4_compressHC_limitedOutput(), but uses the caller's 'state' instead of allocating one.
+    'state' must be LZ4_sizeofStateHC() bytes, and aligned on a pointer boundary.
+    compressionLevel : trades speed for ratio. Each position tries up to 2^(compressionLevel-1) matches.
+                       Values <= 0 select the default (9), and values > 16 are treated as 16.
+    return : the number of output bytes written in buffer 'dest'
+             or 0 if compression fails.
+*/
+
+
 /* Note :
 Decompression functions are provided within LZ4 source code (see "lz4.h") (BSD license)
 */
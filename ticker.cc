@@ -1,3 +1,4 @@
 #include "ticker.h"
 
+std::atomic<uint64_t> ticker::s_tick_us(ticker::DefaultTickUs);
 ticker ticker::s_instance;
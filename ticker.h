@@ -13,11 +13,27 @@ class ticker {
 public:
 
 #ifdef CHECK_INVARIANTS
-  static const uint64_t tick_us = 1 * 1000; /* 1 ms */
+  static const uint64_t DefaultTickUs = 1 * 1000; /* 1 ms */
 #else
-  static const uint64_t tick_us = 40 * 1000; /* 40 ms */
+  static const uint64_t DefaultTickUs = 40 * 1000; /* 40 ms */
 #endif
 
+  // the length of a tick (epoch). this is the latency floor of group
+  // commit, and may be changed at any time- the ticker (and the loops
+  // paced by it) pick up the new value at their next iteration
+  static inline uint64_t
+  tick_us()
+  {
+    return s_tick_us.load(std::memory_order_acquire);
+  }
+
+  static inline void
+  set_tick_us(uint64_t us)
+  {
+    ALWAYS_ASSERT(us > 0);
+    s_tick_us.store(us, std::memory_order_release);
+  }
+
   ticker()
     : current_tick_(1), last_tick_inclusive_(0)
   {
@@ -177,6 +193,8 @@ public:
 
 private:
 
+  static std::atomic<uint64_t> s_tick_us;
+
   void
   tickerloop()
   {
@@ -186,7 +204,7 @@ private:
     for (;;) {
 
       const uint64_t last_loop_usec = loop_timer.lap();
-      const uint64_t delay_time_usec = tick_us;
+      const uint64_t delay_time_usec = tick_us();
       if (last_loop_usec < delay_time_usec) {
         const uint64_t sleep_ns = (delay_time_usec - last_loop_usec) * 1000;
         t.tv_sec  = sleep_ns / ONE_SECOND_NS;
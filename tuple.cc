@@ -59,6 +59,7 @@ dbtuple::VersionInfoStr(version_t v)
   buf << (IsWriteIntent(v) ? "WR" : "-") << " | ";
   buf << (IsModifying(v) ? "MOD" : "-") << " | ";
   buf << (IsLatest(v) ? "LATEST" : "-") << " | ";
+  buf << (IsHot(v) ? "HOT" : "-") << " | ";
   buf << Version(v);
   buf << "]";
   return buf.str();
@@ -96,7 +96,10 @@ private:
   static const version_t HDR_LATEST_SHIFT = 4;
   static const version_t HDR_LATEST_MASK = 0x1 << HDR_LATEST_SHIFT;
 
-  static const version_t HDR_VERSION_SHIFT = 5;
+  static const version_t HDR_HOT_SHIFT = 5;
+  static const version_t HDR_HOT_MASK = 0x1 << HDR_HOT_SHIFT;
+
+  static const version_t HDR_VERSION_SHIFT = 6;
   static const version_t HDR_VERSION_MASK = ((version_t)-1) << HDR_VERSION_SHIFT;
 
 public:
@@ -118,12 +121,17 @@ public:
 #endif
 
   // NB(stephentu): ABA problem happens after some multiple of
-  // 2^(NBits(version_t)-6) concurrent modifications- somewhat low probability
+  // 2^(NBits(version_t)-7) concurrent modifications- somewhat low probability
   // event, so we let it happen
   //
+  // the hot bit marks a tuple which txns keep aborting on, so txns lock it
+  // as they read it instead of validating it at commit (see
+  // transaction_base::g_hot_tuple_locking). it is only a hint, and changing
+  // it does not change the version
+  //
   // <-- low bits
-  // [ locked | deleting | write_intent | modifying | latest | version ]
-  // [  0..1  |   1..2   |    2..3      |   3..4    |  4..5  |  5..32  ]
+  // [ locked | deleting | write_intent | modifying | latest |  hot  | version ]
+  // [  0..1  |   1..2   |    2..3      |   3..4    |  4..5  | 5..6  |  6..32  ]
   volatile version_t hdr;
 
 #ifdef TUPLE_LOCK_OWNERSHIP_CHECKING
@@ -375,6 +383,51 @@ public:
     return hdr;
   }
 
+  // like lock(), but gives up (returning false) once spins tries to take
+  // the lock fail. if patient, the tries during which the tuple is locked
+  // with write intent do not count: such a lock is held by a committing
+  // writer, which takes its locks in order, so only waiting on a lock
+  // taken for reading (see transaction_base::g_tuple_lock_spins) can be
+  // part of a deadlock
+  inline bool
+  try_lock(bool write_intent, unsigned spins, bool patient = false)
+  {
+    CheckMagic();
+    const version_t lockmask = write_intent ?
+      (HDR_LOCKED_MASK | HDR_WRITE_INTENT_MASK) :
+      (HDR_LOCKED_MASK);
+    version_t v = hdr;
+    while (IsLocked(v) ||
+           !__sync_bool_compare_and_swap(&hdr, v, v | lockmask)) {
+      if (!(patient && IsWriteIntent(v)) && !spins--)
+        return false;
+      nop_pause();
+      v = hdr;
+    }
+#ifdef TUPLE_LOCK_OWNERSHIP_CHECKING
+    lock_owner = std::this_thread::get_id();
+    AddTupleToLockRegion(this);
+    INVARIANT(is_lock_owner());
+#endif
+    COMPILER_MEMORY_FENCE;
+    INVARIANT(IsLocked(hdr));
+    INVARIANT(!write_intent || IsWriteIntent(hdr));
+    INVARIANT(!IsModifying(hdr));
+    return true;
+  }
+
+  // turns a lock taken without write intent into one with it
+  inline void
+  upgrade_lock()
+  {
+    CheckMagic();
+    INVARIANT(is_locked());
+    INVARIANT(is_lock_owner());
+    INVARIANT(!is_write_intent());
+    hdr |= HDR_WRITE_INTENT_MASK;
+    COMPILER_MEMORY_FENCE;
+  }
+
   inline void
   unlock()
   {
@@ -499,6 +552,40 @@ public:
     hdr &= ~HDR_LATEST_MASK;
   }
 
+  inline bool
+  is_hot() const
+  {
+    return IsHot(hdr);
+  }
+
+  static inline bool
+  IsHot(version_t v)
+  {
+    return v & HDR_HOT_MASK;
+  }
+
+  // whoever holds the lock may be changing hdr, so a locked tuple is never
+  // marked (and neither is an old version). returns true if this call
+  // marked the tuple
+  inline bool
+  try_mark_hot()
+  {
+    CheckMagic();
+    const version_t v = hdr;
+    if (IsLocked(v) || !IsLatest(v) || IsHot(v))
+      return false;
+    return __sync_bool_compare_and_swap(&hdr, v, v | HDR_HOT_MASK);
+  }
+
+  inline void
+  clear_hot()
+  {
+    CheckMagic();
+    INVARIANT(is_locked());
+    INVARIANT(is_lock_owner());
+    hdr &= ~HDR_HOT_MASK;
+  }
+
   static inline version_t
   Version(version_t v)
   {
@@ -557,9 +644,10 @@ public:
   {
     COMPILER_MEMORY_FENCE;
     // are the versions the same, modulo the
-    // {locked, write_intent, latest} bits?
+    // {locked, write_intent, latest, hot} bits?
     const version_t MODULO_BITS =
-      (HDR_LOCKED_MASK | HDR_WRITE_INTENT_MASK | HDR_LATEST_MASK);
+      (HDR_LOCKED_MASK | HDR_WRITE_INTENT_MASK | HDR_LATEST_MASK |
+       HDR_HOT_MASK);
     return (hdr & ~MODULO_BITS) == (version & ~MODULO_BITS);
   }
 
@@ -567,7 +655,7 @@ public:
   writer_check_version(version_t version) const
   {
     COMPILER_MEMORY_FENCE;
-    return hdr == version;
+    return (hdr & ~HDR_HOT_MASK) == (version & ~HDR_HOT_MASK);
   }
 
   inline ALWAYS_INLINE struct dbtuple *
@@ -990,15 +1078,17 @@ public:
   // internally anyways, so we might as well grab more usable space (really
   // just internal vs external fragmentation)
 
+  // reserve_sz leaves room for the record to grow up to that size in place
   static inline dbtuple *
-  alloc_first(size_type sz, bool acquire_lock)
+  alloc_first(size_type sz, bool acquire_lock, size_type reserve_sz = 0)
   {
     INVARIANT(sz <= std::numeric_limits<node_size_type>::max());
     const size_t max_alloc_sz =
       std::numeric_limits<node_size_type>::max() + sizeof(dbtuple);
     const size_t alloc_sz =
       std::min(
-          util::round_up<size_t, allocator::LgAllocAlignment>(sizeof(dbtuple) + sz),
+          util::round_up<size_t, allocator::LgAllocAlignment>(
+            sizeof(dbtuple) + std::max(sz, reserve_sz)),
           max_alloc_sz);
     char *p = reinterpret_cast<char *>(rcu::s_instance.alloc(alloc_sz));
     INVARIANT(p);
@@ -62,6 +62,54 @@ event_counter transaction_base::g_evt_dbtuple_write_search_failed
 event_counter transaction_base::g_evt_dbtuple_write_insert_failed
     ("dbtuple_write_insert_failed");
 
+event_counter transaction_base::g_evt_hot_tuple_marks("hot_tuple_marks");
+event_counter transaction_base::g_evt_hot_tuple_cools("hot_tuple_cools");
+event_counter transaction_base::g_evt_hot_tuple_read_locks("hot_tuple_read_locks");
+event_counter transaction_base::g_evt_hot_tuple_read_lock_timeouts
+    ("hot_tuple_read_lock_timeouts");
+event_counter transaction_base::g_evt_txn_commits_optimistic("txn_commits_optimistic");
+event_counter transaction_base::g_evt_txn_aborts_optimistic("txn_aborts_optimistic");
+event_counter transaction_base::g_evt_txn_commits_locking("txn_commits_locking");
+event_counter transaction_base::g_evt_txn_aborts_locking("txn_aborts_locking");
+event_counter transaction_base::g_evt_for_update_locks("for_update_locks");
+event_counter transaction_base::g_evt_for_update_lock_timeouts("for_update_lock_timeouts");
+event_counter transaction_base::g_evt_txn_repairs("txn_repairs");
+event_counter transaction_base::g_evt_txn_repair_steps("txn_repair_steps");
+event_counter transaction_base::g_evt_txn_unrepairable_reads("txn_unrepairable_reads");
+event_counter transaction_base::g_evt_deferred_inserts("deferred_inserts");
+event_counter transaction_base::g_evt_deferred_insert_conflicts("deferred_insert_conflicts");
+event_counter transaction_base::g_evt_range_validations("range_validations");
+event_counter transaction_base::g_evt_range_validation_failures("range_validation_failures");
+event_counter transaction_base::g_evt_commutative_writes("commutative_writes");
+event_counter transaction_base::g_evt_commutative_write_merges("commutative_write_merges");
+event_counter transaction_base::g_evt_split_slice_writes("split_slice_writes");
+event_counter transaction_base::g_evt_split_slice_reads("split_slice_reads");
+
+bool transaction_base::g_hot_tuple_locking = false;
+bool transaction_base::g_deferred_inserts = false;
+bool transaction_base::g_range_validation = false;
+percore<transaction_base::hot_tuple_tracker>
+  transaction_base::g_hot_tuple_trackers;
+
+void
+transaction_base::NoteAbortOn(const dbtuple *tuple)
+{
+  hot_tuple_tracker &t = g_hot_tuple_trackers.my();
+  hot_tuple_tracker::slot &s =
+    t.slots_[(uintptr_t(tuple) / sizeof(dbtuple)) % hot_tuple_tracker::NSlots];
+  if (s.tuple_ != tuple) {
+    s.tuple_ = tuple;
+    s.naborts_ = 0;
+  }
+  if (++s.naborts_ < g_hot_tuple_abort_threshold)
+    return;
+  s.naborts_ = 0;
+  // the tuple may be locked right now, in which case the next abort on it
+  // tries again
+  if (const_cast<dbtuple *>(tuple)->try_mark_hot())
+    ++g_evt_hot_tuple_marks;
+}
+
 event_counter transaction_base::evt_local_search_lookups("local_search_lookups");
 event_counter transaction_base::evt_local_search_write_set_hits("local_search_write_set_hits");
 event_counter transaction_base::evt_dbtuple_latest_replacement("dbtuple_latest_replacement");
@@ -9,6 +9,7 @@
 #include <map>
 #include <iostream>
 #include <vector>
+#include <functional>
 #include <string>
 #include <utility>
 #include <stdexcept>
@@ -22,6 +23,7 @@
 #include "btree_choice.h"
 #include "core.h"
 #include "counter.h"
+#include "histogram.h"
 #include "macros.h"
 #include "varkey.h"
 #include "util.h"
@@ -152,8 +154,128 @@ public:
     return flags;
   }
 
+  // read locks. a txn may lock a tuple as it reads it (without write
+  // intent, so other readers carry on), and keep it locked until the txn
+  // is over, so the tuple cannot change under it and the txn does not
+  // have to abort on it at commit. if the txn writes the tuple, commit
+  // turns the lock into its write lock. a read lock is given up on after
+  // g_tuple_lock_spins tries, in which case the txn reads the tuple
+  // optimistically as usual
+  //
+  // a txn holding read locks takes them out of order, so each wait on a
+  // lock held for reading is bounded, and a committing txn which cannot
+  // get one aborts (see dbtuple::try_lock())
+  static const unsigned g_tuple_lock_spins = 1 << 10;
+
+  // hybrid OCC. with hot tuple locking on, each core keeps track of the
+  // tuples its txns abort on, and once one of them was to blame for
+  // g_hot_tuple_abort_threshold of them, it is marked hot (see
+  // dbtuple::try_mark_hot()). a txn which reads a hot tuple read locks it.
+  // one in g_hot_tuple_cool_period read locks clears the mark, so a tuple
+  // has to keep earning it
+  static const unsigned g_hot_tuple_abort_threshold = 4;
+  static const uint64_t g_hot_tuple_cool_period = 256;
+
+  // transaction repair. a txn may split (part of) its work into steps,
+  // each of which reads some records and writes what it computes from
+  // them, independently of the other steps (see
+  // transaction::add_repair_step()). when reads fail validation at
+  // commit, and each of them belongs to a step, the txn does not abort:
+  // commit gives back its write locks, forgets the reads and writes of the
+  // steps which failed, runs those steps again, and tries to commit once
+  // more, up to g_max_txn_repairs times. the records the txn inserted stay
+  // locked throughout
+  //
+  // a step must not insert records, and the rest of the txn must not write
+  // the records a step writes. a step may throw
+  // transaction_abort_exception, which aborts the txn
+  typedef std::function<void ()> repair_fn;
+  static const unsigned g_max_txn_repairs = 3;
+
+  // lookups in read/write sets larger than this go through a hash index
+  // (see transaction::tuple_set_index) instead of a linear scan
+  static const size_t g_tuple_set_index_threshold = 32;
+
+  static inline void
+  SetHotTupleLocking(bool enabled)
+  {
+    g_hot_tuple_locking = enabled;
+  }
+
+  static inline bool
+  IsHotTupleLocking()
+  {
+    return g_hot_tuple_locking;
+  }
+
+  // deferred inserts. normally an insert puts its (locked) tuple into the
+  // btree right away, where it bumps the versions of the nodes it lands
+  // in- so concurrent scans of these nodes abort, and the tuple has to be
+  // taken out again if the txn aborts. with deferred inserts on, an insert
+  // of a key which is absent only allocates the tuple, and commit puts it
+  // into the btree before taking any locks, aborting if someone else
+  // inserted the key meanwhile
+  //
+  // the txn does not see its own deferred inserts, so they only apply to
+  // txns whose traits have read_own_writes off. must be set before any
+  // txns run
+  static inline void
+  SetDeferredInserts(bool enabled)
+  {
+    g_deferred_inserts = enabled;
+  }
+
+  static inline bool
+  IsDeferredInserts()
+  {
+    return g_deferred_inserts;
+  }
+
+  // key-range validation. phantoms are caught by checking that the btree
+  // nodes a txn scanned (or missed a key in) kept their versions, so an
+  // insert anywhere in a node aborts every txn which read part of it. with
+  // range validation on, a txn also keeps the key ranges it read (see
+  // transaction::scan_range_t), and at commit, a node which changed is let
+  // go if every read of it belonged to such a range, and none of the ranges
+  // gained (or lost) a key. must be set before any txns run
+  static inline void
+  SetRangeValidation(bool enabled)
+  {
+    g_range_validation = enabled;
+  }
+
+  static inline bool
+  IsRangeValidation()
+  {
+    return g_range_validation;
+  }
+
 protected:
 
+  // per core: which tuple was blamed for recent aborts, by hash of the
+  // tuple (see NoteAbortOn())
+  struct hot_tuple_tracker {
+    static const size_t NSlots = 256;
+    struct slot {
+      const dbtuple *tuple_;
+      unsigned naborts_;
+    };
+    slot slots_[NSlots];
+    uint64_t nread_locks_; // read locks taken, to cool tuples down
+    hot_tuple_tracker() : nread_locks_(0)
+    {
+      NDB_MEMSET(&slots_[0], 0, sizeof(slots_));
+    }
+  };
+
+  // called with the rcu region of the aborting txn still held
+  static void NoteAbortOn(const dbtuple *tuple);
+
+  static bool g_hot_tuple_locking;
+  static bool g_deferred_inserts;
+  static bool g_range_validation;
+  static percore<hot_tuple_tracker> g_hot_tuple_trackers CACHE_ALIGNED;
+
   // the read set is a mapping from (tuple -> tid_read).
   // "write_set" is used to indicate if this read tuple
   // also belongs in the write set.
@@ -182,12 +304,13 @@ protected:
   // the write set is logically a mapping from (tuple -> value_to_write).
   struct write_record_t {
     enum {
-      FLAGS_INSERT  = 0x1,
-      FLAGS_DOWRITE = 0x1 << 1,
+      FLAGS_INSERT   = 0x1,
+      FLAGS_DOWRITE  = 0x1 << 1,
+      FLAGS_DEFERRED = 0x1 << 2, // an insert not in the btree yet
     };
 
     constexpr inline write_record_t()
-      : tuple(), k(), r(), w(), btr()
+      : tuple(), k(), r(), w(), btr(), table_id(), commutative()
     {}
 
     // all inputs are assumed to be stable
@@ -196,12 +319,15 @@ protected:
                           const void *r,
                           dbtuple::tuple_writer_t w,
                           concurrent_btree *btr,
+                          unsigned table_id,
                           bool insert)
       : tuple(tuple),
         k(k),
         r(r),
         w(w),
-        btr(btr)
+        btr(btr),
+        table_id(table_id),
+        commutative(false)
     {
       this->btr.set_flags(insert ? FLAGS_INSERT : 0);
     }
@@ -231,11 +357,60 @@ protected:
       INVARIANT(!do_write());
       btr.or_flags(FLAGS_DOWRITE);
     }
+    inline void
+    clear_do_write()
+    {
+      btr.set_flags(btr.get_flags() & ~FLAGS_DOWRITE);
+    }
+    inline bool
+    is_deferred() const
+    {
+      return btr.get_flags() & FLAGS_DEFERRED;
+    }
+    inline void
+    set_deferred()
+    {
+      INVARIANT(is_insert());
+      btr.or_flags(FLAGS_DEFERRED);
+    }
+    inline void
+    clear_deferred()
+    {
+      btr.set_flags(btr.get_flags() & ~FLAGS_DEFERRED);
+    }
+    // turns a deferred insert into a write to tuple, which the txn
+    // inserted earlier
+    inline void
+    redirect(dbtuple *tuple)
+    {
+      INVARIANT(is_deferred());
+      this->tuple = tuple;
+      btr.set_flags(btr.get_flags() & ~(FLAGS_INSERT | FLAGS_DEFERRED));
+    }
+    // a blind write, whose writer computes the new record from whatever
+    // the latest version is at commit (see
+    // base_txn_btree::do_tree_commutative_put())
+    inline bool
+    is_commutative() const
+    {
+      return commutative;
+    }
+    inline void
+    set_commutative()
+    {
+      INVARIANT(!is_insert());
+      commutative = true;
+    }
     inline concurrent_btree *
     get_btree() const
     {
       return btr.get();
     }
+    inline unsigned
+    get_table_id() const
+    {
+      return table_id;
+    }
     inline const string_type &
     get_key() const
     {
@@ -256,14 +431,19 @@ protected:
     const string_type *k;
     const void *r;
     dbtuple::tuple_writer_t w;
-    marked_ptr<concurrent_btree> btr; // first bit for inserted, 2nd for dowrite
+    marked_ptr<concurrent_btree> btr; // first bit for inserted, 2nd for dowrite,
+                                      // 3rd for deferred
+    unsigned table_id; // of the base_txn_btree owning btr (used for logging)
+    bool commutative;
   };
 
   friend std::ostream &
   operator<<(std::ostream &o, const write_record_t &r);
 
   // the absent set is a mapping from (btree_node -> version_number).
-  struct absent_record_t { uint64_t version; };
+  // ranged if each read of the node is part of a key range the txn keeps
+  // (see g_range_validation)
+  struct absent_record_t { uint64_t version; bool ranged; };
 
   friend std::ostream &
   operator<<(std::ostream &o, const absent_record_t &r);
@@ -330,6 +510,30 @@ protected:
   static event_counter g_evt_dbtuple_write_search_failed;
   static event_counter g_evt_dbtuple_write_insert_failed;
 
+  static event_counter g_evt_hot_tuple_marks;
+  static event_counter g_evt_hot_tuple_cools;
+  static event_counter g_evt_hot_tuple_read_locks;
+  static event_counter g_evt_hot_tuple_read_lock_timeouts;
+  // by mode, with hot tuple locking on: a txn which locked a tuple as it
+  // read it counts as locking, any other one as optimistic
+  static event_counter g_evt_txn_commits_optimistic;
+  static event_counter g_evt_txn_aborts_optimistic;
+  static event_counter g_evt_txn_commits_locking;
+  static event_counter g_evt_txn_aborts_locking;
+  static event_counter g_evt_for_update_locks;
+  static event_counter g_evt_for_update_lock_timeouts;
+  static event_counter g_evt_txn_repairs;
+  static event_counter g_evt_txn_repair_steps;
+  static event_counter g_evt_txn_unrepairable_reads;
+  static event_counter g_evt_deferred_inserts;
+  static event_counter g_evt_deferred_insert_conflicts;
+  static event_counter g_evt_range_validations;
+  static event_counter g_evt_range_validation_failures;
+  static event_counter g_evt_commutative_writes;
+  static event_counter g_evt_commutative_write_merges;
+  static event_counter g_evt_split_slice_writes;
+  static event_counter g_evt_split_slice_reads;
+
   static event_counter evt_local_search_lookups;
   static event_counter evt_local_search_write_set_hits;
   static event_counter evt_dbtuple_latest_replacement;
@@ -390,7 +594,9 @@ operator<<(
     << ", value=" << util::hexify(r.get_value())
     << ", insert=" << r.is_insert()
     << ", do_write=" << r.do_write()
+    << ", commutative=" << r.is_commutative()
     << ", btree=" << r.get_btree()
+    << ", table_id=" << r.get_table_id()
     << "]";
   return o;
 }
@@ -398,7 +604,7 @@ operator<<(
 inline ALWAYS_INLINE std::ostream &
 operator<<(std::ostream &o, const transaction_base::absent_record_t &r)
 {
-  o << "[v=" << r.version << "]";
+  o << "[v=" << r.version << ", ranged=" << r.ranged << "]";
   return o;
 }
 
@@ -636,6 +842,19 @@ public:
     abort_impl(ABORT_REASON_USER);
   }
 
+  // (# of reads, # of writes) so far
+  typedef std::pair<size_t, size_t> repair_mark_t;
+
+  inline repair_mark_t
+  repair_mark() const
+  {
+    return repair_mark_t(read_set.size(), write_set.size());
+  }
+
+  // a step (see transaction_base::repair_fn) made the reads and writes
+  // since mark was taken, and fn redoes it
+  void add_repair_step(const repair_mark_t &mark, repair_fn fn);
+
   void dump_debug_info() const;
 
 #ifdef DIE_ON_ABORT
@@ -713,18 +932,137 @@ protected:
   std::pair< dbtuple *, bool >
   try_insert_new_tuple(
       concurrent_btree &btr,
+      unsigned table_id,
       const std::string *key,
       const void *value,
       dbtuple::tuple_writer_t writer);
 
+  // adds an insert of key to the write_set, which commit puts into btr
+  // (see g_deferred_inserts)
+  void
+  defer_insert_new_tuple(
+      concurrent_btree &btr,
+      unsigned table_id,
+      const std::string *key,
+      const void *value,
+      dbtuple::tuple_writer_t writer);
+
+  // a locked tuple holding value, for an insert of key into btr
+  dbtuple *
+  alloc_new_tuple(
+      concurrent_btree &btr,
+      const std::string *key,
+      const void *value,
+      dbtuple::tuple_writer_t writer);
+
+  // frees a tuple from alloc_new_tuple() which never made it into a btree
+  static void release_new_tuple(dbtuple *tuple);
+
+  // puts tuple into btr under key, keeping the absent_set up to date.
+  // returns false, and does nothing, if key is in btr already. sets
+  // node_interference if the insert changed a node in the absent_set
+  // behind the txn's back
+  bool
+  insert_new_tuple(
+      concurrent_btree &btr,
+      const std::string &key,
+      dbtuple *tuple,
+      bool &node_interference);
+
+  // called by commit(), before locking anything. returns false, with
+  // reason set, if the txn has to abort
+  bool publish_deferred_inserts();
+
   // reads the contents of tuple into v
-  // within this transaction context
+  // within this transaction context. if for_update, the tuple is read
+  // locked (see read_lock()), since the caller is about to write it
   template <typename ValueReader>
   bool
-  do_tuple_read(const dbtuple *tuple, ValueReader &value_reader);
+  do_tuple_read(const dbtuple *tuple, ValueReader &value_reader,
+                bool for_update = false);
 
+  // ranged if the read is part of a range in scan_ranges
   void
-  do_node_read(const typename concurrent_btree::node_opaque_t *n, uint64_t version);
+  do_node_read(const typename concurrent_btree::node_opaque_t *n, uint64_t version,
+               bool ranged = false);
+
+  // a range of keys the txn read from btr_, for key-range validation (see
+  // g_range_validation): [lower_, upper_), where a null upper_ is +inf, or
+  // just lower_ if point_. nkeys_ and fingerprint_ sum up the tuples found
+  // in the range (see count_scanned())
+  struct scan_range_t {
+    const concurrent_btree *btr_;
+    const std::string *lower_;
+    const std::string *upper_;
+    bool point_;
+    size_t nkeys_;
+    uint64_t fingerprint_;
+  };
+
+  inline bool
+  is_own_insert(const dbtuple *tuple)
+  {
+    if (likely(tuple->version != dbtuple::MAX_TID))
+      return false;
+    auto it = find_write_set(const_cast<dbtuple *>(tuple));
+    return it != write_set.end() && it->is_insert();
+  }
+
+  // adds tuple, found in a scan range, to its sums. leaves out the tuples
+  // the txn inserted, which may not have been there when it scanned
+  inline void
+  count_scanned(const dbtuple *tuple, size_t &nkeys, uint64_t &fingerprint)
+  {
+    if (unlikely(is_own_insert(tuple)))
+      return;
+    // the 64-bit finalizer of murmur3, so different sets of tuples do not
+    // sum up the same
+    uint64_t h = reinterpret_cast<uintptr_t>(tuple);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdUL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53UL;
+    h ^= h >> 33;
+    nkeys++;
+    fingerprint += h;
+  }
+
+  // keys handed to the txn need only outlive the call, but scan_ranges
+  // keeps them until commit
+  inline const std::string *
+  copy_key(const std::string *key)
+  {
+    if (!key)
+      return nullptr;
+    std::string * const ret = string_allocator()();
+    ret->assign(key->data(), key->size());
+    return ret;
+  }
+
+  // records that key is absent from btr. returns true if range validation
+  // keeps track of it
+  inline bool
+  add_absent_range(const concurrent_btree *btr, const std::string *key)
+  {
+    if (likely(!g_range_validation) || is_snapshot())
+      return false;
+    scan_ranges.push_back(scan_range_t{btr, copy_key(key), nullptr, true, 0, 0});
+    return true;
+  }
+
+  // lower and upper must last until commit (see copy_key())
+  inline void
+  add_scan_range(const concurrent_btree *btr,
+                 const std::string *lower, const std::string *upper,
+                 size_t nkeys, uint64_t fingerprint)
+  {
+    scan_ranges.push_back(
+        scan_range_t{btr, lower, upper, false, nkeys, fingerprint});
+  }
+
+  // re-scans scan_ranges, at commit. returns true if they are as the txn
+  // found them
+  bool scan_ranges_unchanged();
 
 public:
   // expected public overrides
@@ -773,11 +1111,101 @@ protected:
 protected:
   inline void clear();
 
-  // SLOW accessor methods- used for invariant checking
+  // an open addressing index over a read or write set, from a tuple to its
+  // *first* entry in the set. the sets only grow at the end (except in
+  // repair(), which resets the indexes), so an index catches up with its
+  // set on lookup. the slots live in a string from the txn's arena
+  class tuple_set_index {
+  public:
+    tuple_set_index() : buf(nullptr), lgslots(0), nslots(0), nindexed(0) {}
+
+    inline void
+    reset()
+    {
+      nslots = 0;
+      nindexed = 0;
+    }
+
+    // returns set.size() if tuple is not in set
+    template <typename Set>
+    size_t
+    find(const Set &set, const dbtuple *tuple, string_allocator_type &sa)
+    {
+      if (unlikely(2 * set.size() > nslots))
+        // keep the load factor <= 1/2
+        rebuild(set.size(), sa);
+      for (; nindexed < set.size(); nindexed++)
+        insert(set[nindexed].get_tuple(), nindexed);
+      for (size_t i = hash(tuple);; i = (i + 1) & (nslots - 1)) {
+        const slot &s = slots()[i];
+        if (s.tuple_ == tuple)
+          return s.pos_;
+        if (!s.tuple_)
+          return set.size();
+      }
+    }
+
+  private:
+    struct slot {
+      const dbtuple *tuple_;
+      size_t pos_;
+    };
+
+    inline slot *
+    slots() const
+    {
+      return reinterpret_cast<slot *>(&(*buf)[0]);
+    }
+
+    inline size_t
+    hash(const dbtuple *tuple) const
+    {
+      return ((reinterpret_cast<uintptr_t>(tuple) >> 4) *
+              0x9e3779b97f4a7c15UL) >> (64 - lgslots);
+    }
+
+    void
+    rebuild(size_t n, string_allocator_type &sa)
+    {
+      INVARIANT(n);
+      lgslots = 64 - __builtin_clzll(4 * n - 1);
+      nslots = 1UL << lgslots;
+      if (!buf)
+        buf = sa();
+      buf->assign(nslots * sizeof(slot), 0);
+      nindexed = 0;
+    }
+
+    void
+    insert(const dbtuple *tuple, size_t pos)
+    {
+      for (size_t i = hash(tuple);; i = (i + 1) & (nslots - 1)) {
+        slot &s = slots()[i];
+        if (s.tuple_ == tuple)
+          // keep the first entry
+          return;
+        if (!s.tuple_) {
+          s.tuple_ = tuple;
+          s.pos_ = pos;
+          return;
+        }
+      }
+    }
+
+    std::string *buf;
+    unsigned lgslots;
+    size_t nslots; // 1 << lgslots, or 0 before the first rebuild()
+    size_t nindexed;
+  };
+
+  // accessor methods- linear scans on small sets
 
   typename read_set_map::iterator
   find_read_set(const dbtuple *tuple)
   {
+    if (unlikely(read_set.size() > g_tuple_set_index_threshold))
+      return read_set.begin() +
+        read_set_index.find(read_set, tuple, string_allocator());
     // linear scan- returns the *first* entry found
     // (a tuple can exist in the read_set more than once)
     typename read_set_map::iterator it     = read_set.begin();
@@ -797,6 +1225,9 @@ protected:
   typename write_set_map::iterator
   find_write_set(dbtuple *tuple)
   {
+    if (unlikely(write_set.size() > g_tuple_set_index_threshold))
+      return write_set.begin() +
+        write_set_index.find(write_set, tuple, string_allocator());
     // linear scan- returns the *first* entry found
     // (a tuple can exist in the write_set more than once)
     typename write_set_map::iterator it     = write_set.begin();
@@ -817,10 +1248,62 @@ protected:
   handle_last_tuple_in_group(
       dbtuple_write_info &info, bool did_group_insert);
 
+  inline bool
+  is_read_valid(const dbtuple_write_info_vec &write_dbtuples,
+                const read_record_t &r) const
+  {
+    return sorted_dbtuples_contains(write_dbtuples, r.get_tuple()) ?
+      r.get_tuple()->is_latest_version(r.get_tid()) :
+      r.get_tuple()->stable_is_latest_version(r.get_tid());
+  }
+
+  // called by commit() with the write locks held, when the read at
+  // read_set[first_failed] did not validate. returns false if the txn
+  // cannot be repaired, in which case nothing changed. otherwise, the
+  // write locks are given up, the reads and writes of the failed steps are
+  // dropped, and the steps ran again- unless one of them aborted the txn
+  bool repair(dbtuple_write_info_vec &write_dbtuples, size_t first_failed);
+
+  // locks tuple for reading until the txn is over. returns true if it is
+  // locked by this txn, false if the lock was given up on
+  inline bool
+  read_lock(const dbtuple *tuple);
+
+  // read locks tuple if it is hot (see g_hot_tuple_locking)
+  inline void
+  maybe_read_lock(const dbtuple *tuple);
+
+  // unlocks the tuples locked for reading, and counts the txn in its mode
+  inline void
+  release_read_locks(bool committed);
+
   read_set_map read_set;
   write_set_map write_set;
   absent_set_map absent_set;
 
+  // see g_range_validation
+  typename util::vec<scan_range_t, 4>::type scan_ranges;
+
+  // see find_read_set() and find_write_set()
+  tuple_set_index read_set_index;
+  tuple_set_index write_set_index;
+
+  // the tuples locked by read_lock(). an entry is null once its lock was
+  // turned into a write lock at commit
+  typename util::vec<dbtuple *, 4>::type read_locks;
+
+  // the reads in read_set[rbegin_, rend_) and the writes in
+  // write_set[wbegin_, wend_) belong to the step which fn_ redoes. the
+  // steps are in order
+  struct repair_step {
+    size_t rbegin_;
+    size_t rend_;
+    size_t wbegin_;
+    size_t wend_;
+    repair_fn fn_;
+  };
+  std::vector<repair_step> repair_steps;
+
   string_allocator_type *sa;
 
   unmanaged<scoped_rcu_region> rcu_guard_;
@@ -860,6 +1343,10 @@ struct txn_epoch_sync {
     compute_ntxn_persisted() { return {0, 0.0}; }
   // reset the persisted counters
   static inline void reset_ntxn_persisted() {}
+  // distributions collected by the persistence layer, by name (reset along
+  // with the persisted counters)
+  static inline std::map<std::string, log_linear_histogram>
+    compute_persist_histograms() { return {}; }
 };
 
 #endif /* _NDB_TXN_H_ */
@@ -8,6 +8,8 @@
 #include "txn_proto2_impl.h"
 #include "txn_btree.h"
 #include "typed_txn_btree.h"
+#include "txn_checkpoint.h"
+#include "txn_recovery.h"
 #include "thread.h"
 #include "util.h"
 #include "macros.h"
@@ -286,6 +288,454 @@ test_absent_key_race()
   }
 }
 
+namespace test_read_for_update_ns {
+  template <template <typename> class TxnType>
+  class counting_callback : public txn_btree<TxnType>::search_range_callback {
+  public:
+    counting_callback() : n(0) {}
+    virtual bool
+    invoke(const typename txn_btree<TxnType>::keystring_type &k,
+           const typename txn_btree<TxnType>::string_type &v)
+    {
+      n++;
+      return true;
+    }
+    size_t n;
+  };
+}
+
+template <template <typename> class TxnType, typename Traits>
+static void
+test_read_for_update()
+{
+  using namespace test_read_for_update_ns;
+  for (size_t txn_flags_idx = 0;
+       txn_flags_idx < ARRAY_NELEMS(TxnFlags);
+       txn_flags_idx++) {
+    const uint64_t txn_flags = TxnFlags[txn_flags_idx];
+    txn_btree<TxnType> btr;
+    typename Traits::StringAllocator arena;
+
+    {
+      TxnType<Traits> t(txn_flags, arena);
+      for (size_t i = 0; i < 4; i++)
+        btr.insert_object(t, u64_varkey(i), rec(0));
+      AssertSuccessfulCommit(t);
+    }
+
+    {
+      TxnType<Traits>
+        t0(txn_flags, arena), t1(txn_flags, arena);
+      string v0, v1;
+      ALWAYS_ASSERT_COND_IN_TXN(t0, btr.search_for_update(t0, u64_varkey(0), v0));
+
+      // others can still read the record, but not write it
+      ALWAYS_ASSERT_COND_IN_TXN(t1, btr.search(t1, u64_varkey(0), v1));
+      ALWAYS_ASSERT_COND_IN_TXN(t1, v0 == v1);
+      btr.insert_object(t1, u64_varkey(0), rec(2));
+      AssertFailedCommit(t1);
+
+      // the writer which locked it commits w/o locking it again
+      btr.insert_object(t0, u64_varkey(0), rec(1));
+      AssertSuccessfulCommit(t0);
+    }
+
+    {
+      TxnType<Traits>
+        t0(txn_flags, arena), t1(txn_flags, arena);
+      counting_callback<TxnType> c;
+      const string lower = u64_varkey(1).str(), upper = u64_varkey(3).str();
+      btr.search_range_call_for_update(t0, lower, &upper, c);
+      ALWAYS_ASSERT_COND_IN_TXN(t0, c.n == 2);
+      btr.insert_object(t1, u64_varkey(2), rec(2));
+      AssertFailedCommit(t1);
+      btr.insert_object(t0, u64_varkey(1), rec(1));
+      AssertSuccessfulCommit(t0);
+    }
+
+    {
+      TxnType<Traits> t(txn_flags, arena);
+      string v;
+      for (size_t i = 0; i < 4; i++) {
+        ALWAYS_ASSERT_COND_IN_TXN(t, btr.search(t, u64_varkey(i), v));
+        ALWAYS_ASSERT_COND_IN_TXN(t, ((const rec *) v.data())->v == (i < 2 ? 1 : 0));
+      }
+      AssertSuccessfulCommit(t);
+    }
+
+    txn_epoch_sync<TxnType>::sync();
+    txn_epoch_sync<TxnType>::finish();
+  }
+  cerr << "test_read_for_update passed" << endl;
+}
+
+template <template <typename> class TxnType, typename Traits>
+static void
+test_txn_repair()
+{
+  for (size_t txn_flags_idx = 0;
+       txn_flags_idx < ARRAY_NELEMS(TxnFlags);
+       txn_flags_idx++) {
+    const uint64_t txn_flags = TxnFlags[txn_flags_idx];
+    txn_btree<TxnType> btr;
+    typename Traits::StringAllocator arena;
+
+    {
+      TxnType<Traits> t(txn_flags, arena);
+      for (size_t i = 0; i < 3; i++)
+        btr.insert_object(t, u64_varkey(i), rec(0));
+      AssertSuccessfulCommit(t);
+    }
+
+    // adds one to key k, as a step which t can redo
+    size_t nruns = 0;
+    auto incr = [&](TxnType<Traits> &t, uint64_t k) {
+      const auto mark = t.repair_mark();
+      auto fn = [&btr, &t, &nruns, k]() {
+        string v;
+        ALWAYS_ASSERT(btr.search(t, u64_varkey(k), v));
+        const uint64_t x = ((const rec *) v.data())->v;
+        if (x >= 100)
+          throw transaction_abort_exception(transaction_base::ABORT_REASON_USER);
+        btr.insert_object(t, u64_varkey(k), rec(x + 1));
+        nruns++;
+      };
+      fn();
+      t.add_repair_step(mark, fn);
+    };
+
+    {
+      TxnType<Traits>
+        t0(txn_flags, arena), t1(txn_flags, arena);
+      btr.insert_object(t0, u64_varkey(10), rec(10));
+      incr(t0, 0);
+      incr(t0, 1);
+      btr.insert_object(t1, u64_varkey(0), rec(5));
+      AssertSuccessfulCommit(t1);
+      // only the step which read key 0 runs again
+      AssertSuccessfulCommit(t0);
+      ALWAYS_ASSERT(nruns == 3);
+    }
+
+    {
+      // key 2 is not read by a step, so this cannot be repaired
+      TxnType<Traits>
+        t0(txn_flags, arena), t1(txn_flags, arena);
+      string v;
+      ALWAYS_ASSERT_COND_IN_TXN(t0, btr.search(t0, u64_varkey(2), v));
+      incr(t0, 0);
+      btr.insert_object(t1, u64_varkey(2), rec(1));
+      AssertSuccessfulCommit(t1);
+      AssertFailedCommit(t0);
+    }
+
+    {
+      // a step may abort the txn when it runs again
+      TxnType<Traits>
+        t0(txn_flags, arena), t1(txn_flags, arena);
+      btr.insert_object(t0, u64_varkey(11), rec(11));
+      incr(t0, 1);
+      btr.insert_object(t1, u64_varkey(1), rec(100));
+      AssertSuccessfulCommit(t1);
+      AssertFailedCommit(t0);
+    }
+
+    {
+      TxnType<Traits> t(txn_flags, arena);
+      string v;
+      ALWAYS_ASSERT_COND_IN_TXN(t, btr.search(t, u64_varkey(0), v));
+      ALWAYS_ASSERT_COND_IN_TXN(t, ((const rec *) v.data())->v == 6);
+      ALWAYS_ASSERT_COND_IN_TXN(t, btr.search(t, u64_varkey(1), v));
+      ALWAYS_ASSERT_COND_IN_TXN(t, ((const rec *) v.data())->v == 100);
+      ALWAYS_ASSERT_COND_IN_TXN(t, btr.search(t, u64_varkey(2), v));
+      ALWAYS_ASSERT_COND_IN_TXN(t, ((const rec *) v.data())->v == 1);
+      ALWAYS_ASSERT_COND_IN_TXN(t, btr.search(t, u64_varkey(10), v));
+      ALWAYS_ASSERT_COND_IN_TXN(t, !btr.search(t, u64_varkey(11), v));
+      AssertSuccessfulCommit(t);
+    }
+
+    txn_epoch_sync<TxnType>::sync();
+    txn_epoch_sync<TxnType>::finish();
+  }
+  cerr << "test_txn_repair passed" << endl;
+}
+
+template <template <typename> class TxnType, typename Traits>
+static void
+test_large_txn()
+{
+  for (size_t txn_flags_idx = 0;
+       txn_flags_idx < ARRAY_NELEMS(TxnFlags);
+       txn_flags_idx++) {
+    const uint64_t txn_flags = TxnFlags[txn_flags_idx];
+    txn_btree<TxnType> btr;
+    typename Traits::StringAllocator arena;
+    const size_t n = 4 * transaction_base::g_tuple_set_index_threshold;
+
+    {
+      TxnType<Traits> t(txn_flags, arena);
+      for (size_t i = 0; i < n; i += 2)
+        btr.insert_object(t, u64_varkey(i), rec(i));
+      AssertSuccessfulCommit(t);
+    }
+
+    {
+      // large enough for the read and write sets to be indexed
+      TxnType<Traits> t(txn_flags, arena);
+      string v;
+      for (size_t i = 0; i < n; i++) {
+        if (i % 2 == 0) {
+          ALWAYS_ASSERT_COND_IN_TXN(t, btr.search(t, u64_varkey(i), v));
+          ALWAYS_ASSERT_COND_IN_TXN(t, ((const rec *) v.data())->v == i);
+        }
+        btr.insert_object(t, u64_varkey(i), rec(i + 1));
+        ALWAYS_ASSERT_COND_IN_TXN(t, btr.search(t, u64_varkey(i), v));
+        ALWAYS_ASSERT_COND_IN_TXN(t, ((const rec *) v.data())->v == i + 1);
+      }
+      for (size_t i = 0; i < n; i++) {
+        ALWAYS_ASSERT_COND_IN_TXN(t, btr.search(t, u64_varkey(i), v));
+        ALWAYS_ASSERT_COND_IN_TXN(t, ((const rec *) v.data())->v == i + 1);
+      }
+      ALWAYS_ASSERT_COND_IN_TXN(t, !btr.search(t, u64_varkey(n), v));
+      AssertSuccessfulCommit(t);
+    }
+
+    {
+      TxnType<Traits> t(txn_flags, arena);
+      string v;
+      for (size_t i = 0; i < n; i++) {
+        ALWAYS_ASSERT_COND_IN_TXN(t, btr.search(t, u64_varkey(i), v));
+        ALWAYS_ASSERT_COND_IN_TXN(t, ((const rec *) v.data())->v == i + 1);
+      }
+      AssertSuccessfulCommit(t);
+    }
+
+    txn_epoch_sync<TxnType>::sync();
+    txn_epoch_sync<TxnType>::finish();
+  }
+  cerr << "test_large_txn passed" << endl;
+}
+
+// deferred inserts need txns which do not read their own writes
+struct deferred_insert_traits : public default_transaction_traits {
+  static const bool read_own_writes = false;
+};
+
+template <template <typename> class TxnType, typename Traits>
+static void
+test_deferred_inserts()
+{
+  using namespace test_read_for_update_ns;
+  transaction_base::SetDeferredInserts(true);
+  for (size_t txn_flags_idx = 0;
+       txn_flags_idx < ARRAY_NELEMS(TxnFlags);
+       txn_flags_idx++) {
+    const uint64_t txn_flags = TxnFlags[txn_flags_idx];
+    txn_btree<TxnType> btr;
+    typename Traits::StringAllocator arena;
+    auto count = [&](uint64_t lower, uint64_t upper) {
+      TxnType<Traits> t(txn_flags, arena);
+      counting_callback<TxnType> c;
+      const u64_varkey u(upper);
+      btr.search_range_call(t, u64_varkey(lower), &u, c);
+      AssertSuccessfulCommit(t);
+      return c.n;
+    };
+
+    {
+      // a scan over a key being inserted does not see it, and does not
+      // abort on it
+      TxnType<Traits>
+        t0(txn_flags, arena), t1(txn_flags, arena);
+      btr.insert_object(t0, u64_varkey(5), rec(5));
+      counting_callback<TxnType> c;
+      const u64_varkey u(10);
+      btr.search_range_call(t1, u64_varkey(0), &u, c);
+      ALWAYS_ASSERT_COND_IN_TXN(t1, c.n == 0);
+      btr.insert_object(t1, u64_varkey(20), rec(20));
+      AssertSuccessfulCommit(t1);
+      AssertSuccessfulCommit(t0);
+      ALWAYS_ASSERT(count(0, 10) == 1);
+    }
+
+    {
+      // the first to commit an insert of a key wins
+      TxnType<Traits>
+        t0(txn_flags, arena), t1(txn_flags, arena);
+      btr.insert_object(t0, u64_varkey(7), rec(1));
+      btr.insert_object(t1, u64_varkey(7), rec(2));
+      AssertSuccessfulCommit(t0);
+      AssertFailedCommit(t1);
+    }
+
+    {
+      // the latest of two inserts of a key by a txn wins
+      TxnType<Traits> t(txn_flags, arena);
+      btr.insert_object(t, u64_varkey(8), rec(1));
+      btr.insert_object(t, u64_varkey(8), rec(2));
+      AssertSuccessfulCommit(t);
+    }
+
+    {
+      // an aborted insert leaves nothing behind
+      TxnType<Traits> t(txn_flags, arena);
+      btr.insert_object(t, u64_varkey(9), rec(9));
+      t.abort();
+      ALWAYS_ASSERT(count(9, 10) == 0);
+    }
+
+    {
+      // inserts still abort scans which committed after them
+      TxnType<Traits>
+        t0(txn_flags, arena), t1(txn_flags, arena);
+      counting_callback<TxnType> c;
+      const u64_varkey u(30);
+      btr.search_range_call(t0, u64_varkey(20), &u, c);
+      ALWAYS_ASSERT_COND_IN_TXN(t0, c.n == 1);
+      btr.insert_object(t1, u64_varkey(25), rec(25));
+      AssertSuccessfulCommit(t1);
+      btr.insert_object(t0, u64_varkey(100), rec(100));
+      AssertFailedCommit(t0);
+    }
+
+    {
+      // but not the txn doing the scan and the insert
+      TxnType<Traits> t(txn_flags, arena);
+      counting_callback<TxnType> c;
+      const u64_varkey u(50);
+      btr.search_range_call(t, u64_varkey(40), &u, c);
+      ALWAYS_ASSERT_COND_IN_TXN(t, c.n == 0);
+      btr.insert_object(t, u64_varkey(45), rec(45));
+      AssertSuccessfulCommit(t);
+    }
+
+    {
+      TxnType<Traits> t(txn_flags, arena);
+      const uint64_t expect[][2] = {
+        {5, 5}, {7, 1}, {8, 2}, {20, 20}, {25, 25}, {45, 45}};
+      string v;
+      for (auto &e : expect) {
+        ALWAYS_ASSERT_COND_IN_TXN(t, btr.search(t, u64_varkey(e[0]), v));
+        ALWAYS_ASSERT_COND_IN_TXN(t, ((const rec *) v.data())->v == e[1]);
+      }
+      ALWAYS_ASSERT_COND_IN_TXN(t, !btr.search(t, u64_varkey(100), v));
+      AssertSuccessfulCommit(t);
+    }
+    ALWAYS_ASSERT(count(0, 200) == 6);
+
+    txn_epoch_sync<TxnType>::sync();
+    txn_epoch_sync<TxnType>::finish();
+  }
+  transaction_base::SetDeferredInserts(false);
+  cerr << "test_deferred_inserts passed" << endl;
+}
+
+template <template <typename> class TxnType, typename Traits>
+static void
+test_range_validation()
+{
+  using namespace test_read_for_update_ns;
+  transaction_base::SetRangeValidation(true);
+  for (size_t txn_flags_idx = 0;
+       txn_flags_idx < ARRAY_NELEMS(TxnFlags);
+       txn_flags_idx++) {
+    const uint64_t txn_flags = TxnFlags[txn_flags_idx];
+    txn_btree<TxnType> btr;
+    typename Traits::StringAllocator arena;
+
+    {
+      // few enough keys to share a leaf
+      TxnType<Traits> t(txn_flags, arena);
+      for (size_t i = 10; i <= 80; i += 10)
+        btr.insert_object(t, u64_varkey(i), rec(i));
+      AssertSuccessfulCommit(t);
+    }
+
+    {
+      // an insert next to a scan, but outside of it, does not abort it
+      TxnType<Traits>
+        t0(txn_flags, arena), t1(txn_flags, arena);
+      counting_callback<TxnType> c;
+      const u64_varkey u(40);
+      btr.search_range_call(t0, u64_varkey(20), &u, c);
+      ALWAYS_ASSERT_COND_IN_TXN(t0, c.n == 2);
+      btr.insert_object(t1, u64_varkey(55), rec(55));
+      AssertSuccessfulCommit(t1);
+      btr.insert_object(t0, u64_varkey(20), rec(21));
+      AssertSuccessfulCommit(t0);
+    }
+
+    {
+      // an insert inside of it does
+      TxnType<Traits>
+        t0(txn_flags, arena), t1(txn_flags, arena);
+      counting_callback<TxnType> c;
+      const u64_varkey u(40);
+      btr.search_range_call(t0, u64_varkey(20), &u, c);
+      ALWAYS_ASSERT_COND_IN_TXN(t0, c.n == 2);
+      btr.insert_object(t1, u64_varkey(35), rec(35));
+      AssertSuccessfulCommit(t1);
+      btr.insert_object(t0, u64_varkey(20), rec(22));
+      AssertFailedCommit(t0);
+    }
+
+    {
+      // likewise for a key read as absent
+      TxnType<Traits>
+        t0(txn_flags, arena), t1(txn_flags, arena);
+      string v;
+      ALWAYS_ASSERT_COND_IN_TXN(t0, !btr.search(t0, u64_varkey(65), v));
+      btr.insert_object(t1, u64_varkey(66), rec(66));
+      AssertSuccessfulCommit(t1);
+      btr.insert_object(t0, u64_varkey(10), rec(11));
+      AssertSuccessfulCommit(t0);
+    }
+
+    {
+      TxnType<Traits>
+        t0(txn_flags, arena), t1(txn_flags, arena);
+      string v;
+      ALWAYS_ASSERT_COND_IN_TXN(t0, !btr.search(t0, u64_varkey(67), v));
+      btr.insert_object(t1, u64_varkey(67), rec(67));
+      AssertSuccessfulCommit(t1);
+      btr.insert_object(t0, u64_varkey(10), rec(12));
+      AssertFailedCommit(t0);
+    }
+
+    {
+      // the txn's own inserts into a range it scanned do not count
+      TxnType<Traits>
+        t0(txn_flags, arena), t1(txn_flags, arena);
+      counting_callback<TxnType> c;
+      const u64_varkey u(40);
+      btr.search_range_call(t0, u64_varkey(20), &u, c);
+      ALWAYS_ASSERT_COND_IN_TXN(t0, c.n == 3);
+      btr.insert_object(t0, u64_varkey(36), rec(36));
+      btr.insert_object(t1, u64_varkey(75), rec(75));
+      AssertSuccessfulCommit(t1);
+      AssertSuccessfulCommit(t0);
+    }
+
+    {
+      TxnType<Traits> t(txn_flags, arena);
+      counting_callback<TxnType> c;
+      btr.search_range_call(t, u64_varkey(0), nullptr, c);
+      ALWAYS_ASSERT_COND_IN_TXN(t, c.n == 14);
+      string v;
+      ALWAYS_ASSERT_COND_IN_TXN(t, btr.search(t, u64_varkey(20), v));
+      ALWAYS_ASSERT_COND_IN_TXN(t, ((const rec *) v.data())->v == 21);
+      ALWAYS_ASSERT_COND_IN_TXN(t, btr.search(t, u64_varkey(10), v));
+      ALWAYS_ASSERT_COND_IN_TXN(t, ((const rec *) v.data())->v == 11);
+      AssertSuccessfulCommit(t);
+    }
+
+    txn_epoch_sync<TxnType>::sync();
+    txn_epoch_sync<TxnType>::finish();
+  }
+  transaction_base::SetRangeValidation(false);
+  cerr << "test_range_validation passed" << endl;
+}
+
 template <template <typename> class TxnType, typename Traits>
 static void
 test_inc_value_size()
@@ -390,6 +840,129 @@ test_read_only_snapshot()
   }
 }
 
+template <template <typename> class TxnType, typename Traits>
+static void
+test_checkpoint()
+{
+  txn_btree<TxnType> btr0, btr1;
+  typename Traits::StringAllocator arena;
+  const size_t N = 3 * txn_checkpoint::g_chunk_nkeys + 7;
+  for (size_t i = 0; i < N; i++) {
+    TxnType<Traits> t(0, arena);
+    btr0.insert_object(t, u64_varkey(i), rec(i));
+    if (i < 10)
+      btr1.insert_object(t, u64_varkey(i), rec(i + 1));
+    AssertSuccessfulCommit(t);
+  }
+  for (size_t i = 0; i < N; i += 10) {
+    TxnType<Traits> t(0, arena);
+    btr0.remove(t, u64_varkey(i));
+    AssertSuccessfulCommit(t);
+  }
+
+  // see test_read_only_snapshot()
+  txn_epoch_sync<TxnType>::sync();
+
+  char dirbuf[] = "/tmp/silo-ckpttest-XXXXXX";
+  ALWAYS_ASSERT(mkdtemp(dirbuf));
+  const string dir(dirbuf);
+
+  typedef txn_checkpointer<TxnType, Traits> checkpointer;
+  const vector<typename checkpointer::table> tables({
+      typename checkpointer::table(
+          &btr0, {u64_varkey(N / 3).str(), u64_varkey(N / 2).str()}),
+      typename checkpointer::table(&btr1),
+  });
+
+  checkpointer c(dir, 2);
+  for (size_t round = 1; round <= 2; round++) {
+    const txn_checkpoint::stats cs = c.checkpoint(tables);
+    ALWAYS_ASSERT(cs.seq_ == round);
+    ALWAYS_ASSERT(cs.nfiles_ == 4);
+    ALWAYS_ASSERT(cs.nkeys_ == (N - (N + 9) / 10) + 10);
+    ALWAYS_ASSERT(cs.last_consistent_tid_ > 0);
+
+    mutex lock;
+    map<pair<unsigned, string>, string> db;
+    txn_checkpoint::stats ls;
+    ALWAYS_ASSERT(txn_checkpoint::Load(
+        dir, 3,
+        [&](unsigned, unsigned table_id, const string &k, const string &v, uint64_t tid) {
+          ALWAYS_ASSERT(tid == cs.last_consistent_tid_);
+          std::lock_guard<mutex> l(lock);
+          ALWAYS_ASSERT(db.emplace(make_pair(table_id, k), v).second);
+        }, &ls));
+    ALWAYS_ASSERT(ls.seq_ == round);
+    ALWAYS_ASSERT(ls.last_consistent_tid_ == cs.last_consistent_tid_);
+    ALWAYS_ASSERT(ls.nkeys_ == cs.nkeys_);
+    ALWAYS_ASSERT(db.size() == cs.nkeys_);
+    for (size_t i = 0; i < N; i++) {
+      auto it = db.find(make_pair(btr0.get_table_id(), u64_varkey(i).str()));
+      if (i % 10 == 0) {
+        ALWAYS_ASSERT(it == db.end());
+        continue;
+      }
+      ALWAYS_ASSERT(it != db.end());
+      AssertByteEquality(rec(i), it->second);
+    }
+    for (size_t i = 0; i < 10; i++) {
+      auto it = db.find(make_pair(btr1.get_table_id(), u64_varkey(i).str()));
+      ALWAYS_ASSERT(it != db.end());
+      AssertByteEquality(rec(i + 1), it->second);
+    }
+
+    // the previous checkpoint's files are gone
+    if (round > 1)
+      ALWAYS_ASSERT(access(txn_checkpoint::FileName(
+            dir, round - 1, btr0.get_table_id(), 0).c_str(), F_OK) == -1);
+  }
+
+  txn_checkpoint::manifest m;
+  ALWAYS_ASSERT(txn_checkpoint::ReadManifest(dir, m));
+  for (auto &e : m.entries_)
+    unlink(txn_checkpoint::FileName(dir, m.seq_, e.table_id_, e.range_id_).c_str());
+  unlink((dir + "/CHECKPOINT").c_str());
+  rmdir(dir.c_str());
+
+  txn_epoch_sync<TxnType>::sync();
+  txn_epoch_sync<TxnType>::finish();
+
+  // the removes above left gc work on this thread which points into btr0,
+  // so reap it before btr0 goes away
+  transaction_proto2_static::PurgeThreadOutstandingGCTasks();
+}
+
+template <template <typename> class TxnType, typename Traits>
+static void
+test_durability_token()
+{
+  // the test binary runs without logging, so everything committed is
+  // trivially durable
+  txn_btree<TxnType> btr;
+  typename Traits::StringAllocator arena;
+  {
+    TxnType<Traits> t(0, arena);
+    btr.insert_object(t, u64_varkey(0), rec(0));
+    AssertSuccessfulCommit(t);
+    const txn_logger::durability_token tok = t.get_durability_token();
+    ALWAYS_ASSERT(tok.is_durable());
+    bool fired = false;
+    txn_logger::on_durable(tok, [&fired]() { fired = true; });
+    ALWAYS_ASSERT(fired);
+  }
+  // see test_read_only_snapshot()
+  txn_epoch_sync<TxnType>::sync();
+  {
+    TxnType<Traits> t(transaction_base::TXN_FLAG_READ_ONLY, arena);
+    string v;
+    ALWAYS_ASSERT_COND_IN_TXN(t, btr.search(t, u64_varkey(0), v));
+    AssertSuccessfulCommit(t);
+    ALWAYS_ASSERT(t.get_durability_token().is_durable());
+  }
+  txn_epoch_sync<TxnType>::sync();
+  txn_epoch_sync<TxnType>::finish();
+}
+
 namespace test_long_keys_ns {
 
 static inline string
@@ -616,6 +1189,19 @@ private:
   size_t n;
 };
 
+// v, as the logger would write it for a put of Fields
+template <uint64_t Fields>
+static string
+log_delta(const testrec::value *v)
+{
+  typedef typed_txn_btree_<schema<testrec>> codec;
+  string ret(codec::tuple_writer<Fields>(
+        dbtuple::TUPLE_WRITER_COMPUTE_DELTA_NEEDED, v, nullptr, 0), '\0');
+  codec::tuple_writer<Fields>(
+      dbtuple::TUPLE_WRITER_DO_DELTA_WRITE, v, (uint8_t *) &ret[0], ret.size());
+  return ret;
+}
+
 }
 
 template <template <typename> class TxnType, typename Traits>
@@ -683,12 +1269,299 @@ test_typed_btree()
     AssertSuccessfulCommit(t);
   }
 
+  // gc entries from read-only epoch 0 are never reaped by
+  // PurgeThreadOutstandingGCTasks(), so get the remove below out of it
+  txn_epoch_sync<TxnType>::sync();
+
+  {
+    // replaying field deltas rebuilds the full record
+    typedef typed_txn_btree_<schema<testrec>> codec;
+    const testrec::key k1(2, 2);
+    const string k1_bytes = schema<testrec>::key_encoder_type().write(&k1);
+    const testrec::value v1(4, 5, "world");
+    testrec::value v2(v1);
+    v2.v1 = 6;
+    const string d1 = log_delta<codec::AllFieldsMask>(&v1);
+    const string d2 = log_delta<1UL << testrec::value::v1_field>(&v2);
+    ALWAYS_ASSERT(codec::IsFullDelta(d1));
+    ALWAYS_ASSERT(!codec::IsFullDelta(d2));
+    ALWAYS_ASSERT(d2.size() < d1.size());
+
+    typed_txn_btree_replayer<TxnType, Traits> r(1);
+    r.add(&btr);
+    ALWAYS_ASSERT(!r.is_full(btr.get_table_id(), d2));
+    r(0, btr.get_table_id(), k1_bytes, d1, 0);
+    r(0, btr.get_table_id(), k1_bytes, d2, 0);
+    {
+      txn_type t(0, arena);
+      testrec::value v;
+      ALWAYS_ASSERT_COND_IN_TXN(t, btr.search(t, k1, v));
+      ALWAYS_ASSERT_COND_IN_TXN(t, v == v2);
+      AssertSuccessfulCommit(t);
+    }
+    r(0, btr.get_table_id(), k1_bytes, string(), 0);
+    {
+      txn_type t(0, arena);
+      testrec::value v;
+      ALWAYS_ASSERT_COND_IN_TXN(t, !btr.search(t, k1, v));
+      AssertSuccessfulCommit(t);
+    }
+  }
+
   txn_epoch_sync<TxnType>::sync();
   txn_epoch_sync<TxnType>::finish();
 
+  // see test_checkpoint()
+  transaction_proto2_static::PurgeThreadOutstandingGCTasks();
+
   cerr << "test_typed_btree() passed" << endl;
 }
 
+// increments need txns which do not read their own writes
+struct increment_traits : public default_transaction_traits {
+  static const bool read_own_writes = false;
+};
+
+template <template <typename> class TxnType, typename Traits>
+static void
+test_typed_increment()
+{
+  using namespace test_typed_btree_ns;
+
+  typedef typed_txn_btree<TxnType, schema<testrec>> ttxn_btree_type;
+  typedef typed_txn_btree_<schema<testrec>> codec;
+  ttxn_btree_type btr;
+  typename Traits::StringAllocator arena;
+  typedef TxnType<Traits> txn_type;
+
+  const testrec::key k0(1, 1), k1(1, 2), k2(1, 3);
+  const testrec::value amounts(2, 1, "");
+
+  {
+    txn_type t(0, arena);
+    btr.insert(t, k0, testrec::value(10, 100, "hello"));
+    btr.insert(t, k1, testrec::value(0, 0, "world"));
+    AssertSuccessfulCommit(t);
+  }
+
+  {
+    // concurrent increments of a record both commit, and add up
+    txn_type t0(0, arena), t1(0, arena);
+    ALWAYS_ASSERT_COND_IN_TXN(t0, btr.increment(t0, k0, amounts, FIELDS(0, 1)));
+    ALWAYS_ASSERT_COND_IN_TXN(t0, btr.increment(t0, k0, amounts, FIELDS(0, 1)));
+    ALWAYS_ASSERT_COND_IN_TXN(t1, btr.increment(t1, k0, amounts, FIELDS(0)));
+    AssertSuccessfulCommit(t1);
+    AssertSuccessfulCommit(t0);
+  }
+
+  {
+    // but they still invalidate readers of the record
+    txn_type t0(0, arena), t1(0, arena);
+    testrec::value v;
+    ALWAYS_ASSERT_COND_IN_TXN(t0, btr.search(t0, k0, v));
+    ALWAYS_ASSERT_COND_IN_TXN(t0, v == testrec::value(16, 102, "hello"));
+    ALWAYS_ASSERT_COND_IN_TXN(t1, btr.increment(t1, k0, amounts, FIELDS(1)));
+    AssertSuccessfulCommit(t1);
+    btr.put(t0, k1, v);
+    AssertFailedCommit(t0);
+  }
+
+  {
+    // there is nothing to increment once a record is gone
+    txn_type t0(0, arena), t1(0, arena);
+    ALWAYS_ASSERT_COND_IN_TXN(t0, !btr.increment(t0, k2, amounts, FIELDS(0)));
+    ALWAYS_ASSERT_COND_IN_TXN(t0, btr.increment(t0, k1, amounts, FIELDS(0)));
+    btr.remove(t1, k1);
+    AssertSuccessfulCommit(t1);
+    AssertFailedCommit(t0);
+  }
+
+  {
+    txn_type t(0, arena);
+    testrec::value v;
+    ALWAYS_ASSERT_COND_IN_TXN(t, btr.search(t, k0, v));
+    ALWAYS_ASSERT_COND_IN_TXN(t, v == testrec::value(16, 103, "hello"));
+    ALWAYS_ASSERT_COND_IN_TXN(t, !btr.search(t, k1, v));
+    AssertSuccessfulCommit(t);
+  }
+
+  {
+    // increments are logged as the amounts added, and replay as such
+    const size_t n = codec::increment_writer<1UL << testrec::value::v0_field>(
+        dbtuple::TUPLE_WRITER_COMPUTE_DELTA_NEEDED, &amounts, nullptr, 0);
+    string delta(n, '\0');
+    codec::increment_writer<1UL << testrec::value::v0_field>(
+        dbtuple::TUPLE_WRITER_DO_DELTA_WRITE, &amounts, (uint8_t *) &delta[0], n);
+    ALWAYS_ASSERT(codec::IsIncrementDelta(delta));
+    ALWAYS_ASSERT(!codec::IsFullDelta(delta));
+    ALWAYS_ASSERT(codec::DeltaFields(delta) == 1UL << testrec::value::v0_field);
+
+    typed_txn_btree_replayer<TxnType, Traits> r(1);
+    r.add(&btr);
+    const string k0_bytes = schema<testrec>::key_encoder_type().write(&k0);
+    r(0, btr.get_table_id(), k0_bytes, delta, 0);
+    txn_type t(0, arena);
+    testrec::value v;
+    ALWAYS_ASSERT_COND_IN_TXN(t, btr.search(t, k0, v));
+    ALWAYS_ASSERT_COND_IN_TXN(t, v == testrec::value(18, 103, "hello"));
+    AssertSuccessfulCommit(t);
+  }
+
+  txn_epoch_sync<TxnType>::sync();
+  txn_epoch_sync<TxnType>::finish();
+  transaction_proto2_static::PurgeThreadOutstandingGCTasks();
+
+  cerr << "test_typed_increment() passed" << endl;
+}
+
+namespace test_split_record_ns {
+
+  static const size_t nworkers = 4;
+  static const size_t nincrements = 2000;
+
+  template <template <typename> class TxnType, typename Traits>
+  class worker : public ndb_thread {
+  public:
+    typedef typed_txn_btree<TxnType, schema<testrec>> ttxn_btree_type;
+    worker(ttxn_btree_type &btr, const testrec::key &k)
+      : btr(&btr), k(k), aborts(0) {}
+    virtual void run()
+    {
+      const testrec::value amounts(1, 0, "");
+      for (size_t i = 0; i < nincrements; i++) {
+        typename Traits::StringAllocator arena;
+        TxnType<Traits> t(0, arena);
+        try {
+          ALWAYS_ASSERT_COND_IN_TXN(t, btr->increment(t, k, amounts, FIELDS(0)));
+          t.commit(true);
+        } catch (transaction_abort_exception &e) {
+          aborts++;
+        }
+      }
+    }
+    size_t get_aborts() const { return aborts; }
+  private:
+    ttxn_btree_type *const btr;
+    const testrec::key k;
+    size_t aborts;
+  };
+
+}
+
+template <template <typename> class Protocol>
+class split_scan_callback : public typed_txn_btree<Protocol, schema<testrec>>::search_range_callback {
+public:
+  virtual bool
+  invoke(const testrec::key &key,
+         const testrec::value &value)
+  {
+    values.push_back(value);
+    return true;
+  }
+  vector<testrec::value> values;
+};
+
+template <template <typename> class TxnType, typename Traits>
+static void
+test_split_record()
+{
+  using namespace test_typed_btree_ns;
+  using namespace test_split_record_ns;
+
+  typedef typed_txn_btree<TxnType, schema<testrec>> ttxn_btree_type;
+  ttxn_btree_type btr;
+  typename Traits::StringAllocator arena;
+  typedef TxnType<Traits> txn_type;
+
+  const testrec::key k0(10, 3), k1(1, 1);
+  const testrec::value amounts(2, 1, "");
+
+  {
+    txn_type t(0, arena);
+    for (size_t i = 0; i < ARRAY_NELEMS(scan_values); i++)
+      btr.insert(t, scan_values[i].first, scan_values[i].second);
+    btr.insert(t, k1, testrec::value(0, 0, "other"));
+    AssertSuccessfulCommit(t);
+  }
+  btr.split(k0, FIELDS(0));
+
+  {
+    // increments of a split field, and of the rest of the record
+    txn_type t0(0, arena), t1(0, arena);
+    ALWAYS_ASSERT_COND_IN_TXN(t0, btr.increment(t0, k0, amounts, FIELDS(0)));
+    ALWAYS_ASSERT_COND_IN_TXN(t0, btr.increment(t0, k0, amounts, FIELDS(0)));
+    ALWAYS_ASSERT_COND_IN_TXN(t1, btr.increment(t1, k0, amounts, FIELDS(0)));
+    ALWAYS_ASSERT_COND_IN_TXN(t1, btr.increment(t1, k0, amounts, FIELDS(1)));
+    AssertSuccessfulCommit(t1);
+    AssertSuccessfulCommit(t0);
+  }
+
+  {
+    // readers add up the slices, and conflict with increments they miss
+    txn_type t0(0, arena), t1(0, arena);
+    testrec::value v;
+    ALWAYS_ASSERT_COND_IN_TXN(t0, btr.search(t0, k0, v));
+    ALWAYS_ASSERT_COND_IN_TXN(t0, v == testrec::value(123456 + 3 + 6, 11, "C"));
+    ALWAYS_ASSERT_COND_IN_TXN(t1, btr.increment(t1, k0, amounts, FIELDS(0)));
+    AssertSuccessfulCommit(t1);
+    btr.put(t0, k1, v);
+    AssertFailedCommit(t0);
+  }
+
+  {
+    // but readers of the other fields do not
+    txn_type t0(0, arena), t1(0, arena);
+    testrec::value v;
+    ALWAYS_ASSERT_COND_IN_TXN(t0, btr.search(t0, k0, v, FIELDS(1, 2)));
+    ALWAYS_ASSERT_COND_IN_TXN(t0, v.v1 == 11 && v.v2 == "C");
+    ALWAYS_ASSERT_COND_IN_TXN(t1, btr.increment(t1, k0, amounts, FIELDS(0)));
+    AssertSuccessfulCommit(t1);
+    btr.put(t0, k0, testrec::value(0, 12, "c"), FIELDS(1, 2));
+    AssertSuccessfulCommit(t0);
+  }
+
+  {
+    // scans add up the slices too
+    txn_type t(0, arena);
+    split_scan_callback<TxnType> cb;
+    btr.search_range_call(t, testrec::key(10, 0), nullptr, cb, true);
+    AssertSuccessfulCommit(t);
+    ALWAYS_ASSERT(cb.values.size() == ARRAY_NELEMS(scan_values));
+    for (size_t i = 0; i < ARRAY_NELEMS(scan_values); i++) {
+      const testrec::value &v = cb.values[i];
+      if (scan_values[i].first == k0)
+        ALWAYS_ASSERT(v == testrec::value(123456 + 3 + 10, 12, "c"));
+      else
+        ALWAYS_ASSERT(v == scan_values[i].second);
+    }
+  }
+
+  {
+    // increments from all cores at once
+    vector<unique_ptr<worker<TxnType, Traits>>> workers;
+    for (size_t i = 0; i < nworkers; i++)
+      workers.emplace_back(new worker<TxnType, Traits>(btr, k0));
+    for (auto &w : workers)
+      w->start();
+    for (auto &w : workers)
+      w->join();
+    for (auto &w : workers)
+      ALWAYS_ASSERT(!w->get_aborts());
+    txn_type t(0, arena);
+    testrec::value v;
+    ALWAYS_ASSERT_COND_IN_TXN(t, btr.search(t, k0, v));
+    ALWAYS_ASSERT_COND_IN_TXN(
+        t, v.v0 == int32_t(123456 + 3 + 10 + nworkers * nincrements));
+    AssertSuccessfulCommit(t);
+  }
+
+  txn_epoch_sync<TxnType>::sync();
+  txn_epoch_sync<TxnType>::finish();
+  transaction_proto2_static::PurgeThreadOutstandingGCTasks();
+
+  cerr << "test_split_record() passed" << endl;
+}
+
 template <template <typename> class Protocol>
 class txn_btree_worker : public ndb_thread {
 public:
@@ -908,6 +1781,105 @@ mp_test1()
   }
 }
 
+namespace mp_test_hot_tuple_ns {
+  // read-modify-write of two counters, one of which every txn contends on,
+  // with hot tuple locking
+
+  const size_t nworkers = 4;
+  const size_t niters = 5000;
+
+  template <template <typename> class TxnType, typename Traits>
+  class worker : public txn_btree_worker<TxnType> {
+  public:
+    worker(unsigned id, txn_btree<TxnType> &btr, uint64_t txn_flags)
+      : txn_btree_worker<TxnType>(btr, txn_flags), id(id), naborts(0) {}
+    ~worker() {}
+    virtual void run()
+    {
+      for (size_t i = 0; i < niters; i++) {
+      retry:
+        typename Traits::StringAllocator arena;
+        TxnType<Traits> t(this->txn_flags, arena);
+        try {
+          string v;
+          // the hot counter is read first, so the read lock has to be
+          // upgraded at commit time
+          ALWAYS_ASSERT_COND_IN_TXN(t, this->btr->search(t, u64_varkey(0), v));
+          rec hot = *((const rec *) v.data());
+          ALWAYS_ASSERT_COND_IN_TXN(t, this->btr->search(t, u64_varkey(1 + id), v));
+          rec mine = *((const rec *) v.data());
+          hot.v++;
+          mine.v++;
+          this->btr->insert_object(t, u64_varkey(0), hot);
+          this->btr->insert_object(t, u64_varkey(1 + id), mine);
+          t.commit(true);
+        } catch (transaction_abort_exception &e) {
+          naborts++;
+          goto retry;
+        }
+      }
+    }
+    size_t get_naborts() const { return naborts; }
+  private:
+    unsigned id;
+    size_t naborts;
+  };
+}
+
+template <template <typename> class TxnType, typename Traits>
+static void
+mp_test_hot_tuple()
+{
+  using namespace mp_test_hot_tuple_ns;
+
+  const bool was = transaction_base::IsHotTupleLocking();
+  transaction_base::SetHotTupleLocking(true);
+  {
+    txn_btree<TxnType> btr;
+    typename Traits::StringAllocator arena;
+    {
+      TxnType<Traits> t(0, arena);
+      for (size_t i = 0; i <= nworkers; i++)
+        btr.insert_object(t, u64_varkey(i), rec(0));
+      AssertSuccessfulCommit(t);
+    }
+
+    vector<unique_ptr<worker<TxnType, Traits>>> workers;
+    for (size_t i = 0; i < nworkers; i++)
+      workers.emplace_back(new worker<TxnType, Traits>(i, btr, 0));
+    for (auto &w : workers)
+      w->start();
+    size_t naborts = 0;
+    for (auto &w : workers) {
+      w->join();
+      naborts += w->get_naborts();
+    }
+
+    {
+      TxnType<Traits> t(0, arena);
+      string v;
+      ALWAYS_ASSERT_COND_IN_TXN(t, btr.search(t, u64_varkey(0), v));
+      ALWAYS_ASSERT_COND_IN_TXN(t, ((const rec *) v.data())->v == niters * nworkers);
+      for (size_t i = 1; i <= nworkers; i++) {
+        ALWAYS_ASSERT_COND_IN_TXN(t, btr.search(t, u64_varkey(i), v));
+        ALWAYS_ASSERT_COND_IN_TXN(t, ((const rec *) v.data())->v == niters);
+      }
+      AssertSuccessfulCommit(t);
+    }
+
+    counter_data d;
+    cerr << "hot tuple naborts: " << naborts;
+    if (event_counter::stat("hot_tuple_read_locks", d))
+      cerr << ", read locks: " << d.count_;
+    cerr << endl;
+
+    txn_epoch_sync<TxnType>::sync();
+    txn_epoch_sync<TxnType>::finish();
+  }
+  transaction_base::SetHotTupleLocking(was);
+  cerr << "mp_test_hot_tuple passed" << endl;
+}
+
 namespace mp_test2_ns {
 
   static const uint64_t ctr_key = 0;
@@ -1883,12 +2855,21 @@ void txn_btree_test()
 {
   cerr << "Test proto2" << endl;
   test_typed_btree<transaction_proto2, default_stable_transaction_traits>();
+  test_typed_increment<transaction_proto2, increment_traits>();
+  test_split_record<transaction_proto2, increment_traits>();
   test1<transaction_proto2, default_transaction_traits>();
   test2<transaction_proto2, default_transaction_traits>();
   test_absent_key_race<transaction_proto2, default_transaction_traits>();
+  test_read_for_update<transaction_proto2, default_transaction_traits>();
+  test_txn_repair<transaction_proto2, default_transaction_traits>();
+  test_large_txn<transaction_proto2, default_transaction_traits>();
+  test_deferred_inserts<transaction_proto2, deferred_insert_traits>();
+  test_range_validation<transaction_proto2, default_transaction_traits>();
   test_inc_value_size<transaction_proto2, default_transaction_traits>();
   test_multi_btree<transaction_proto2, default_transaction_traits>();
   test_read_only_snapshot<transaction_proto2, default_transaction_traits>();
+  test_checkpoint<transaction_proto2, default_transaction_traits>();
+  test_durability_token<transaction_proto2, default_transaction_traits>();
   test_long_keys<transaction_proto2, default_transaction_traits>();
   test_long_keys2<transaction_proto2, default_transaction_traits>();
   test_insert_same_key<transaction_proto2, default_transaction_traits>();
@@ -1896,6 +2877,7 @@ void txn_btree_test()
   //mp_stress_test_allocator<transaction_proto2, default_transaction_traits>();
   mp_stress_test_insert_removes<transaction_proto2, default_transaction_traits>();
   mp_test1<transaction_proto2, default_transaction_traits>();
+  mp_test_hot_tuple<transaction_proto2, default_transaction_traits>();
   mp_test2<transaction_proto2, default_transaction_traits>();
   mp_test3<transaction_proto2, default_transaction_traits>();
   mp_test_simple_write_skew<transaction_proto2, default_transaction_traits>();
@@ -311,6 +311,30 @@ public:
     return this->do_search(t, k, r);
   }
 
+  // like search(), but for a record the txn is going to write: the record
+  // is locked until the txn is over, so other txns cannot change it and
+  // make this txn abort at commit
+  template <typename Traits>
+  inline bool
+  search_for_update(Transaction<Traits> &t,
+                    const key_type &k,
+                    value_type &v,
+                    size_type max_bytes_read = string_type::npos)
+  {
+    single_value_reader_type r(&v, max_bytes_read);
+    return this->do_search(t, k, r, true);
+  }
+
+  template <typename Traits>
+  inline bool
+  search_for_update(Transaction<Traits> &t,
+                    const varkey &k,
+                    value_type &v,
+                    size_t max_bytes_read = string_type::npos)
+  {
+    return search_for_update(t, to_string_type(k), v, max_bytes_read);
+  }
+
   template <typename Traits>
   inline void
   search_range_call(Transaction<Traits> &t,
@@ -324,6 +348,21 @@ public:
     this->do_search_range_call(t, lower, upper, callback, kr, vr);
   }
 
+  // see search_for_update(). locks each record the scan reads (only
+  // records, so inserts into the range still abort this txn at commit)
+  template <typename Traits>
+  inline void
+  search_range_call_for_update(Transaction<Traits> &t,
+                               const key_type &lower,
+                               const key_type *upper,
+                               search_range_callback &callback,
+                               size_type max_bytes_read = string_type::npos)
+  {
+    key_reader_type kr;
+    value_reader_type vr(max_bytes_read);
+    this->do_search_range_call(t, lower, upper, callback, kr, vr, true);
+  }
+
   template <typename Traits>
   inline void
   rsearch_range_call(Transaction<Traits> &t,
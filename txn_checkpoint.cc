@@ -0,0 +1,393 @@
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "txn_checkpoint.h"
+#include "record/serializer.h"
+#include "fileutils.h"
+#include "core.h"
+
+using namespace std;
+using namespace util;
+
+event_counter
+  txn_checkpoint::g_evt_checkpoints("checkpoints");
+event_counter
+  txn_checkpoint::g_evt_checkpoint_nkeys("checkpoint_nkeys");
+event_counter
+  txn_checkpoint::g_evt_checkpoint_nbytes("checkpoint_nbytes");
+event_counter
+  txn_checkpoint::g_evt_checkpoint_chunk_aborts("checkpoint_chunk_aborts");
+event_counter
+  txn_checkpoint::g_evt_checkpoint_cpu_us("checkpoint_cpu_us");
+event_avg_counter
+  txn_checkpoint::g_evt_avg_checkpoint_bytes_per_sec("avg_checkpoint_bytes_per_sec");
+event_avg_counter
+  txn_checkpoint::g_evt_avg_checkpoint_chunk_latency_us("avg_checkpoint_chunk_latency_us");
+event_avg_counter
+  txn_checkpoint::g_evt_avg_checkpoint_snapshot_lag_epochs("avg_checkpoint_snapshot_lag_epochs");
+event_avg_counter
+  txn_checkpoint::g_evt_avg_checkpoint_wait_persist_ms("avg_checkpoint_wait_persist_ms");
+
+static const size_t g_write_buffer_size = 1 << 20;
+
+static inline string
+manifest_name(const string &dir)
+{
+  return dir + "/CHECKPOINT";
+}
+
+static void
+sync_dir(const string &dir)
+{
+  const int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd == -1) {
+    perror("open");
+    ALWAYS_ASSERT(false);
+  }
+  if (fsync(fd) == -1) {
+    perror("fsync");
+    ALWAYS_ASSERT(false);
+  }
+  close(fd);
+}
+
+string
+txn_checkpoint::FileName(const string &dir, uint64_t seq,
+                         unsigned table_id, unsigned range_id)
+{
+  ostringstream oss;
+  oss << dir << "/ckpt." << seq << "." << table_id << "." << range_id;
+  return oss.str();
+}
+
+txn_checkpoint::file_writer::file_writer(
+    const string &fname, unsigned table_id,
+    unsigned range_id, uint64_t seq)
+  : nkeys_(0), nbytes_(0)
+{
+  fd_ = open(fname.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0664);
+  if (fd_ == -1) {
+    perror("open");
+    ALWAYS_ASSERT(false);
+  }
+  buf_.reserve(g_write_buffer_size);
+  XXH32_resetState(&state_, 0);
+  checkpoint_file_header hdr;
+  hdr.magic_ = g_checkpoint_magic;
+  hdr.version_ = g_checkpoint_format_version;
+  hdr.flags_ = 0;
+  hdr.table_id_ = table_id;
+  hdr.range_id_ = range_id;
+  hdr.seq_ = seq;
+  buf_.append((const char *) &hdr, sizeof(hdr));
+}
+
+txn_checkpoint::file_writer::~file_writer()
+{
+  close(fd_);
+}
+
+void
+txn_checkpoint::file_writer::encode(
+    string &buf, const char *k, size_t klen, const char *v, size_t vlen)
+{
+  serializer<uint32_t, true> vs_uint32_t;
+  uint8_t tmp[serializer<uint32_t, true>::max_nbytes()];
+  buf.append((const char *) tmp, vs_uint32_t.write(tmp, klen) - tmp);
+  buf.append(k, klen);
+  buf.append((const char *) tmp, vs_uint32_t.write(tmp, vlen) - tmp);
+  buf.append(v, vlen);
+}
+
+void
+txn_checkpoint::file_writer::append(const string &buf, size_t nkeys)
+{
+  XXH32_update(&state_, buf.data(), buf.size());
+  write_raw(buf.data(), buf.size());
+  nkeys_ += nkeys;
+}
+
+void
+txn_checkpoint::file_writer::write_raw(const void *p, size_t n)
+{
+  if (buf_.size() + n > g_write_buffer_size)
+    flush();
+  if (n >= g_write_buffer_size) {
+    if (fileutils::writeall(fd_, (const char *) p, n) == -1) {
+      perror("write");
+      ALWAYS_ASSERT(false);
+    }
+    nbytes_ += n;
+    return;
+  }
+  buf_.append((const char *) p, n);
+}
+
+void
+txn_checkpoint::file_writer::flush()
+{
+  if (buf_.empty())
+    return;
+  if (fileutils::writeall(fd_, buf_.data(), buf_.size()) == -1) {
+    perror("write");
+    ALWAYS_ASSERT(false);
+  }
+  nbytes_ += buf_.size();
+  buf_.clear();
+}
+
+size_t
+txn_checkpoint::file_writer::finish(uint64_t snapshot_tid)
+{
+  checkpoint_file_trailer trl;
+  trl.nkeys_ = nkeys_;
+  trl.snapshot_tid_ = snapshot_tid;
+  XXH32_update(&state_, &trl, offsetof(checkpoint_file_trailer, checksum_));
+  trl.checksum_ = XXH32_intermediateDigest(&state_);
+  write_raw(&trl, sizeof(trl));
+  flush();
+  if (fdatasync(fd_) == -1) {
+    perror("fdatasync");
+    ALWAYS_ASSERT(false);
+  }
+  return nbytes_;
+}
+
+uint32_t
+txn_checkpoint::compute_checksum(
+    const checkpoint_manifest_header &hdr,
+    const vector<checkpoint_manifest_entry> &entries)
+{
+  XXH32_stateSpace_t state;
+  XXH32_resetState(&state, 0);
+  XXH32_update(&state, &hdr, offsetof(checkpoint_manifest_header, checksum_));
+  if (!entries.empty())
+    XXH32_update(&state, entries.data(),
+                 entries.size() * sizeof(checkpoint_manifest_entry));
+  return XXH32_intermediateDigest(&state);
+}
+
+bool
+txn_checkpoint::ReadManifest(const string &dir, manifest &m)
+{
+  const string fname = manifest_name(dir);
+  const int fd = open(fname.c_str(), O_RDONLY);
+  if (fd == -1) {
+    if (errno == ENOENT)
+      return false;
+    perror("open");
+    ALWAYS_ASSERT(false);
+  }
+  checkpoint_manifest_header hdr;
+  // the manifest is renamed into place only after it is synced, so a
+  // manifest which does not check out is not something a crash can produce
+  if (fileutils::readall(fd, (char *) &hdr, sizeof(hdr)) != 0 ||
+      hdr.magic_ != g_manifest_magic) {
+    cerr << "[checkpoint] " << fname << ": not a checkpoint manifest" << endl;
+    ALWAYS_ASSERT(false);
+  }
+  if (hdr.version_ != g_checkpoint_format_version) {
+    cerr << "[checkpoint] " << fname << ": unsupported format version "
+         << hdr.version_ << endl;
+    ALWAYS_ASSERT(false);
+  }
+  m.seq_ = hdr.seq_;
+  m.last_consistent_tid_ = hdr.last_consistent_tid_;
+  m.entries_.resize(hdr.nfiles_);
+  if (hdr.nfiles_ &&
+      fileutils::readall(
+        fd, (char *) m.entries_.data(),
+        hdr.nfiles_ * sizeof(checkpoint_manifest_entry)) != 0) {
+    cerr << "[checkpoint] " << fname << ": truncated manifest" << endl;
+    ALWAYS_ASSERT(false);
+  }
+  ALWAYS_ASSERT(hdr.checksum_ == compute_checksum(hdr, m.entries_));
+  close(fd);
+  return true;
+}
+
+uint64_t
+txn_checkpoint::next_seq(const string &dir)
+{
+  manifest m;
+  return ReadManifest(dir, m) ? m.seq_ + 1 : 1;
+}
+
+void
+txn_checkpoint::commit_manifest(const string &dir, const manifest &m)
+{
+  manifest old;
+  const bool has_old = ReadManifest(dir, old);
+  INVARIANT(!has_old || old.seq_ < m.seq_);
+
+  // the range files must be durable before the manifest can point at them
+  sync_dir(dir);
+
+  checkpoint_manifest_header hdr;
+  hdr.magic_ = g_manifest_magic;
+  hdr.version_ = g_checkpoint_format_version;
+  hdr.flags_ = 0;
+  hdr.seq_ = m.seq_;
+  hdr.last_consistent_tid_ = m.last_consistent_tid_;
+  hdr.nfiles_ = m.entries_.size();
+  hdr.checksum_ = compute_checksum(hdr, m.entries_);
+
+  const string fname = manifest_name(dir);
+  const string tmpname = fname + ".tmp";
+  const int fd = open(tmpname.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0664);
+  if (fd == -1) {
+    perror("open");
+    ALWAYS_ASSERT(false);
+  }
+  if (fileutils::writeall(fd, (const char *) &hdr, sizeof(hdr)) == -1 ||
+      (!m.entries_.empty() &&
+       fileutils::writeall(
+         fd, (const char *) m.entries_.data(),
+         m.entries_.size() * sizeof(checkpoint_manifest_entry)) == -1)) {
+    perror("write");
+    ALWAYS_ASSERT(false);
+  }
+  if (fdatasync(fd) == -1) {
+    perror("fdatasync");
+    ALWAYS_ASSERT(false);
+  }
+  close(fd);
+  if (rename(tmpname.c_str(), fname.c_str()) == -1) {
+    perror("rename");
+    ALWAYS_ASSERT(false);
+  }
+  sync_dir(dir);
+
+  if (!has_old)
+    return;
+  for (auto &e : old.entries_) {
+    const string oldname = FileName(dir, old.seq_, e.table_id_, e.range_id_);
+    if (unlink(oldname.c_str()) == -1 && errno != ENOENT)
+      perror("unlink");
+  }
+}
+
+bool
+txn_checkpoint::Load(
+    const string &dir,
+    size_t npartitions,
+    const txn_log_recovery::replay_fn &fn,
+    stats *s)
+{
+  if (!npartitions)
+    npartitions = coreid::num_cpus_online();
+  INVARIANT(npartitions > 0);
+
+  timer t;
+  manifest m;
+  if (!ReadManifest(dir, m))
+    return false;
+
+  vector<size_t> nkeys(npartitions, 0);
+  vector<thread> loaders;
+  for (size_t i = 0; i < npartitions; i++)
+    loaders.emplace_back(
+        &txn_checkpoint::load_files,
+        i, &dir, &m, npartitions, &fn, &nkeys[i]);
+  for (auto &th : loaders)
+    th.join();
+
+  if (s) {
+    s->seq_ = m.seq_;
+    s->last_consistent_tid_ = m.last_consistent_tid_;
+    s->nfiles_ = m.entries_.size();
+    s->nkeys_ = 0;
+    for (auto n : nkeys)
+      s->nkeys_ += n;
+    s->nbytes_ = 0;
+    s->ms_ = t.lap_ms();
+  }
+  return true;
+}
+
+void
+txn_checkpoint::load_files(
+    unsigned partition,
+    const string *dir,
+    const manifest *m,
+    size_t npartitions,
+    const txn_log_recovery::replay_fn *fn,
+    size_t *nkeys)
+{
+  serializer<uint32_t, true> vs_uint32_t;
+  string key, value;
+  size_t n = 0;
+  for (size_t i = partition; i < m->entries_.size(); i += npartitions) {
+    const checkpoint_manifest_entry &e = m->entries_[i];
+    const string fname = FileName(*dir, m->seq_, e.table_id_, e.range_id_);
+    const int fd = open(fname.c_str(), O_RDONLY);
+    if (fd == -1) {
+      perror("open");
+      ALWAYS_ASSERT(false);
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+      perror("fstat");
+      ALWAYS_ASSERT(false);
+    }
+    const size_t fsize = st.st_size;
+    // range files are synced before the manifest is written, so they are
+    // always complete
+    ALWAYS_ASSERT(fsize >= sizeof(checkpoint_file_header) +
+                           sizeof(checkpoint_file_trailer));
+    void * const px = mmap(nullptr, fsize, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (px == MAP_FAILED) {
+      perror("mmap");
+      ALWAYS_ASSERT(false);
+    }
+    madvise(px, fsize, MADV_SEQUENTIAL);
+
+    const uint8_t * const begin = (const uint8_t *) px;
+    const uint8_t * const end = begin + fsize - sizeof(checkpoint_file_trailer);
+    checkpoint_file_header hdr;
+    checkpoint_file_trailer trl;
+    NDB_MEMCPY(&hdr, begin, sizeof(hdr));
+    NDB_MEMCPY(&trl, end, sizeof(trl));
+    ALWAYS_ASSERT(hdr.magic_ == g_checkpoint_magic);
+    ALWAYS_ASSERT(hdr.version_ == g_checkpoint_format_version);
+    ALWAYS_ASSERT(hdr.seq_ == m->seq_);
+    ALWAYS_ASSERT(hdr.table_id_ == e.table_id_);
+    ALWAYS_ASSERT(hdr.range_id_ == e.range_id_);
+
+    const uint8_t *p = begin + sizeof(hdr);
+    XXH32_stateSpace_t state;
+    XXH32_resetState(&state, 0);
+    XXH32_update(&state, p, end - p);
+    XXH32_update(&state, &trl, offsetof(checkpoint_file_trailer, checksum_));
+    if (XXH32_intermediateDigest(&state) != trl.checksum_) {
+      cerr << "[checkpoint] " << fname << ": checksum mismatch" << endl;
+      ALWAYS_ASSERT(false);
+    }
+
+    size_t nrecords = 0;
+    while (p < end) {
+      uint32_t klen, vlen;
+      ALWAYS_ASSERT((p = vs_uint32_t.failsafe_read(p, end - p, &klen)));
+      ALWAYS_ASSERT(size_t(end - p) >= klen);
+      key.assign((const char *) p, klen);
+      p += klen;
+      ALWAYS_ASSERT((p = vs_uint32_t.failsafe_read(p, end - p, &vlen)));
+      ALWAYS_ASSERT(size_t(end - p) >= vlen);
+      value.assign((const char *) p, vlen);
+      p += vlen;
+      (*fn)(partition, e.table_id_, key, value, m->last_consistent_tid_);
+      nrecords++;
+    }
+    ALWAYS_ASSERT(nrecords == trl.nkeys_);
+    n += nrecords;
+
+    munmap(px, fsize);
+    close(fd);
+  }
+  *nkeys = n;
+}
@@ -0,0 +1,495 @@
+#ifndef _NDB_TXN_CHECKPOINT_H_
+#define _NDB_TXN_CHECKPOINT_H_
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <limits>
+#include <time.h>
+
+#include <xxhash.h>
+
+#include "macros.h"
+#include "counter.h"
+#include "ticker.h"
+#include "util.h"
+#include "txn.h"
+#include "txn_btree.h"
+#include "txn_proto2_impl.h"
+#include "txn_recovery.h"
+
+// fuzzy checkpoints of txn_btrees, taken while the workload keeps running
+//
+// every table is cut into key ranges (by caller supplied split keys), and a
+// pool of threads streams the ranges out to one checkpoint file each. a
+// range is read by a sequence of read-only snapshot txns, each covering at
+// most g_chunk_nkeys keys, so that no single txn holds up RCU reclamation
+// (or grows its string arena) for long.
+//
+// different chunks may observe different snapshots, which is why the
+// checkpoint is fuzzy: every key holds its value as of *some* snapshot tid
+// >= the checkpoint's last_consistent_tid (the min over all chunks).
+// recovery loads the checkpoint, then replays, on top of it, the log writes
+// with TID > last_consistent_tid (see txn_log_recovery::Recover()).
+// replaying those writes in TID order overwrites every key which changed
+// after its chunk's snapshot, so the result is the same as replaying the
+// whole log.
+//
+// a checkpoint only becomes visible once its manifest is renamed into
+// place, and the manifest is not written until the log has persisted every
+// epoch which any chunk read from. until then, the previous checkpoint (if
+// any) stays the current one.
+//
+// on disk, checkpoint number seq of a directory looks like:
+//
+//   <dir>/CHECKPOINT                          - manifest of the current seq
+//   <dir>/ckpt.<seq>.<table_id>.<range_id>    - one per key range
+//
+// where a range file is:
+//
+//   [checkpoint_file_header]
+//   ([varint klen][key][varint vlen][value])*
+//   [checkpoint_file_trailer]
+//
+// and the manifest is:
+//
+//   [checkpoint_manifest_header][checkpoint_manifest_entry]*
+class txn_checkpoint {
+public:
+
+  static const uint32_t g_checkpoint_magic = 0x54504b43; // "CKPT"
+  static const uint32_t g_manifest_magic = 0x54464e4d; // "MNFT"
+  static const uint16_t g_checkpoint_format_version = 1;
+
+  // max number of keys a single snapshot txn reads. must stay well below
+  // str_arena::NStrs, since every record read allocates an arena string
+  static const size_t g_chunk_nkeys = 512;
+
+  struct checkpoint_file_header {
+    uint32_t magic_;
+    uint16_t version_;
+    uint16_t flags_; // reserved
+    uint32_t table_id_;
+    uint32_t range_id_;
+    uint64_t seq_;
+  } PACKED;
+
+  struct checkpoint_file_trailer {
+    uint64_t nkeys_;
+    // min snapshot tid over the chunks which make up this file
+    uint64_t snapshot_tid_;
+    // XXH32 over the records and the trailer fields above
+    uint32_t checksum_;
+  } PACKED;
+
+  struct checkpoint_manifest_header {
+    uint32_t magic_;
+    uint16_t version_;
+    uint16_t flags_; // reserved
+    uint64_t seq_;
+    uint64_t last_consistent_tid_;
+    uint32_t nfiles_;
+    // XXH32 over the header fields above and the entries
+    uint32_t checksum_;
+  } PACKED;
+
+  struct checkpoint_manifest_entry {
+    uint32_t table_id_;
+    uint32_t range_id_;
+  } PACKED;
+
+  struct manifest {
+    uint64_t seq_;
+    uint64_t last_consistent_tid_;
+    std::vector<checkpoint_manifest_entry> entries_;
+    manifest() : seq_(0), last_consistent_tid_(0) {}
+  };
+
+  struct stats {
+    uint64_t seq_;
+    uint64_t last_consistent_tid_;
+    size_t nfiles_;
+    size_t nkeys_;
+    size_t nbytes_;
+    double ms_;
+
+    stats()
+      : seq_(0), last_consistent_tid_(0), nfiles_(0),
+        nkeys_(0), nbytes_(0), ms_(0.0) {}
+  };
+
+  // reads the manifest of the current checkpoint in dir. returns false if
+  // dir has no complete checkpoint
+  static bool
+  ReadManifest(const std::string &dir, manifest &m);
+
+  // loads the current checkpoint in dir using npartitions threads (0 means
+  // one per online cpu), invoking fn once per key. keys are handed out with
+  // tid = the checkpoint's last_consistent_tid.
+  //
+  // returns false (and does not invoke fn) if dir has no complete
+  // checkpoint. otherwise, the log should then be replayed with
+  // checkpoint_tid = s->last_consistent_tid_
+  static bool
+  Load(const std::string &dir,
+       size_t npartitions,
+       const txn_log_recovery::replay_fn &fn,
+       stats *s = nullptr);
+
+  static std::string
+  FileName(const std::string &dir, uint64_t seq,
+           unsigned table_id, unsigned range_id);
+
+protected:
+
+  // buffered, checksummed writer for a single range file
+  class file_writer {
+  public:
+    file_writer(const std::string &fname, unsigned table_id,
+                unsigned range_id, uint64_t seq);
+    ~file_writer();
+
+    file_writer(const file_writer &) = delete;
+    file_writer &operator=(const file_writer &) = delete;
+
+    // appends nkeys records, which were encoded into buf by encode()
+    void append(const std::string &buf, size_t nkeys);
+
+    // writes the trailer, then flushes and syncs the file. returns the size
+    // of the file
+    size_t finish(uint64_t snapshot_tid);
+
+    inline size_t nkeys() const { return nkeys_; }
+
+    static void encode(std::string &buf,
+                       const char *k, size_t klen,
+                       const char *v, size_t vlen);
+
+  private:
+    void flush();
+    void write_raw(const void *p, size_t n);
+
+    int fd_;
+    std::string buf_;
+    XXH32_stateSpace_t state_;
+    size_t nkeys_;
+    size_t nbytes_;
+  };
+
+  // seq to use for the next checkpoint in dir
+  static uint64_t next_seq(const std::string &dir);
+
+  // makes m the current checkpoint of dir, then removes the files of the
+  // checkpoint it replaces
+  static void commit_manifest(const std::string &dir, const manifest &m);
+
+  static uint32_t compute_checksum(const checkpoint_manifest_header &hdr,
+                                   const std::vector<checkpoint_manifest_entry> &entries);
+
+  static void load_files(unsigned partition,
+                         const std::string *dir,
+                         const manifest *m,
+                         size_t npartitions,
+                         const txn_log_recovery::replay_fn *fn,
+                         size_t *nkeys);
+
+  static inline uint64_t
+  thread_cpu_us()
+  {
+    struct timespec ts;
+    ALWAYS_ASSERT(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0);
+    return uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+  }
+
+  // counters
+
+  static event_counter g_evt_checkpoints;
+  static event_counter g_evt_checkpoint_nkeys;
+  static event_counter g_evt_checkpoint_nbytes;
+  static event_counter g_evt_checkpoint_chunk_aborts;
+  // cpu time the checkpoint threads spent reading and encoding, which is
+  // taken away from the workload
+  static event_counter g_evt_checkpoint_cpu_us;
+  static event_avg_counter g_evt_avg_checkpoint_bytes_per_sec;
+  // how long each snapshot txn holds up RCU reclamation
+  static event_avg_counter g_evt_avg_checkpoint_chunk_latency_us;
+  // how many epochs old the snapshot of each chunk is. old versions of
+  // records must be kept around for at least this long
+  static event_avg_counter g_evt_avg_checkpoint_snapshot_lag_epochs;
+  static event_avg_counter g_evt_avg_checkpoint_wait_persist_ms;
+};
+
+static inline std::ostream &
+operator<<(std::ostream &o, const txn_checkpoint::stats &s)
+{
+  o << "{seq=" << s.seq_
+    << ", last_consistent_tid=" << g_proto_version_str(s.last_consistent_tid_)
+    << ", nfiles=" << s.nfiles_
+    << ", nkeys=" << s.nkeys_
+    << ", nbytes=" << s.nbytes_
+    << ", ms=" << s.ms_ << "}";
+  return o;
+}
+
+template <template <typename> class Transaction,
+          typename Traits = default_transaction_traits>
+class txn_checkpointer : public txn_checkpoint {
+public:
+
+  struct table {
+    txn_btree<Transaction> *btr_;
+    // the table is checkpointed as the ranges [-inf, splits_[0]),
+    // [splits_[0], splits_[1]), ..., [splits_.back(), +inf). must be sorted
+    std::vector<std::string> splits_;
+    table(txn_btree<Transaction> *btr,
+          const std::vector<std::string> &splits = {})
+      : btr_(btr), splits_(splits) {}
+  };
+
+  // checkpoints into dir (which must exist) with nthreads threads. the
+  // threads live as long as the checkpointer does, since core ids cannot
+  // be recycled
+  txn_checkpointer(const std::string &dir, size_t nthreads)
+    : dir_(dir), round_(0), nactive_(0), stop_(false),
+      seq_(0), ranges_(nullptr), next_range_(0)
+  {
+    INVARIANT(nthreads > 0);
+    for (size_t i = 0; i < nthreads; i++)
+      workers_.emplace_back(&txn_checkpointer::worker, this);
+  }
+
+  ~txn_checkpointer()
+  {
+    {
+      std::lock_guard<std::mutex> l(lock_);
+      stop_ = true;
+    }
+    start_cv_.notify_all();
+    for (auto &th : workers_)
+      th.join();
+  }
+
+  txn_checkpointer(const txn_checkpointer &) = delete;
+  txn_checkpointer &operator=(const txn_checkpointer &) = delete;
+
+  // takes a checkpoint of tables while other txns keep running. returns
+  // once the checkpoint is the current one of dir.
+  //
+  // not thread-safe, and only one checkpointer may use a dir at a time
+  stats
+  checkpoint(const std::vector<table> &tables)
+  {
+    util::timer t;
+    stats s;
+    s.seq_ = next_seq(dir_);
+
+    std::vector<range> ranges;
+    for (auto &tbl : tables) {
+      const unsigned table_id = tbl.btr_->get_table_id();
+      for (size_t i = 0; i <= tbl.splits_.size(); i++) {
+        range r;
+        r.btr_ = tbl.btr_;
+        r.table_id_ = table_id;
+        r.range_id_ = i;
+        r.lower_ = i ? tbl.splits_[i - 1] : std::string();
+        r.upper_ = (i < tbl.splits_.size()) ? &tbl.splits_[i] : nullptr;
+        INVARIANT(!r.upper_ || r.lower_ <= *r.upper_);
+        ranges.push_back(r);
+      }
+    }
+
+    {
+      std::unique_lock<std::mutex> l(lock_);
+      seq_ = s.seq_;
+      ranges_ = &ranges;
+      next_range_.store(0, std::memory_order_release);
+      nactive_ = workers_.size();
+      round_++;
+      start_cv_.notify_all();
+      done_cv_.wait(l, [this]() { return !nactive_; });
+      ranges_ = nullptr;
+    }
+
+    manifest m;
+    m.seq_ = s.seq_;
+    m.last_consistent_tid_ = ranges.empty() ?
+      0 : std::numeric_limits<uint64_t>::max();
+    uint64_t max_snapshot_tid = 0;
+    for (auto &r : ranges) {
+      m.last_consistent_tid_ = std::min(m.last_consistent_tid_, r.min_snapshot_tid_);
+      max_snapshot_tid = std::max(max_snapshot_tid, r.max_snapshot_tid_);
+      m.entries_.push_back({r.table_id_, r.range_id_});
+      s.nkeys_ += r.nkeys_;
+      s.nbytes_ += r.nbytes_;
+    }
+
+    // the checkpoint may contain writes from epochs which are not yet
+    // durable in the log. if we crashed with it as the current checkpoint,
+    // recovery would see those writes, but not the rest of their epochs
+    if (txn_logger::IsPersistenceEnabled()) {
+      util::timer wt;
+      txn_logger::wait_until_epoch_persisted(
+          transaction_proto2_static::EpochId(max_snapshot_tid));
+      g_evt_avg_checkpoint_wait_persist_ms.offer(wt.lap_ms());
+    }
+
+    commit_manifest(dir_, m);
+    if (txn_logger::IsPersistenceEnabled())
+      txn_logger::AdvanceCheckpointTid(m.last_consistent_tid_);
+
+    s.last_consistent_tid_ = m.last_consistent_tid_;
+    s.nfiles_ = ranges.size();
+    s.ms_ = t.lap_ms();
+    ++g_evt_checkpoints;
+    if (s.ms_ > 0.0)
+      g_evt_avg_checkpoint_bytes_per_sec.offer(
+          double(s.nbytes_) / (s.ms_ / 1000.0));
+    return s;
+  }
+
+private:
+
+  typedef typename txn_btree<Transaction>::keystring_type keystring_type;
+  typedef typename txn_btree<Transaction>::string_type string_type;
+
+  struct range {
+    txn_btree<Transaction> *btr_;
+    unsigned table_id_;
+    unsigned range_id_;
+    std::string lower_;
+    const std::string *upper_;
+
+    // outputs
+    uint64_t min_snapshot_tid_;
+    uint64_t max_snapshot_tid_;
+    size_t nkeys_;
+    size_t nbytes_;
+
+    range()
+      : btr_(nullptr), table_id_(0), range_id_(0), upper_(nullptr),
+        min_snapshot_tid_(std::numeric_limits<uint64_t>::max()),
+        max_snapshot_tid_(0), nkeys_(0), nbytes_(0) {}
+  };
+
+  // buffers a chunk, since it must not reach the file if its txn aborts
+  class chunk_callback : public txn_btree<Transaction>::search_range_callback {
+  public:
+    chunk_callback() : n_(0) {}
+
+    virtual bool
+    invoke(const keystring_type &k, const string_type &v)
+    {
+      file_writer::encode(buf_, k.data(), k.length(), v.data(), v.length());
+      last_key_.assign(k.data(), k.length());
+      return ++n_ < g_chunk_nkeys;
+    }
+
+    inline void
+    clear()
+    {
+      buf_.clear();
+      n_ = 0;
+    }
+
+    std::string buf_;
+    size_t n_;
+    std::string last_key_;
+  };
+
+  void
+  worker()
+  {
+    typename Traits::StringAllocator arena;
+    uint64_t last_round = 0;
+    for (;;) {
+      std::vector<range> *ranges;
+      uint64_t seq;
+      {
+        std::unique_lock<std::mutex> l(lock_);
+        start_cv_.wait(l, [&]() { return stop_ || round_ != last_round; });
+        if (stop_)
+          return;
+        last_round = round_;
+        ranges = ranges_;
+        seq = seq_;
+      }
+      const uint64_t cpu_start = thread_cpu_us();
+      size_t idx;
+      while ((idx = next_range_.fetch_add(1, std::memory_order_acq_rel)) < ranges->size())
+        do_range(seq, (*ranges)[idx], arena);
+      g_evt_checkpoint_cpu_us += thread_cpu_us() - cpu_start;
+      {
+        std::lock_guard<std::mutex> l(lock_);
+        if (!--nactive_)
+          done_cv_.notify_all();
+      }
+    }
+  }
+
+  void
+  do_range(uint64_t seq, range &r, typename Traits::StringAllocator &arena)
+  {
+    file_writer w(FileName(dir_, seq, r.table_id_, r.range_id_),
+                  r.table_id_, r.range_id_, seq);
+    std::string lower = r.lower_;
+    chunk_callback cb;
+    for (;;) {
+      cb.clear();
+      util::timer t;
+      uint64_t snapshot_tid;
+      try {
+        arena.reset();
+        Transaction<Traits> txn(transaction_base::TXN_FLAG_READ_ONLY, arena);
+        r.btr_->search_range_call(txn, lower, r.upper_, cb);
+        snapshot_tid = txn.snapshot_tid();
+        txn.commit(true);
+      } catch (transaction_abort_exception &ex) {
+        // snapshot txns only abort if their snapshot became unreadable, so
+        // just retry the chunk at a newer snapshot
+        ++g_evt_checkpoint_chunk_aborts;
+        continue;
+      }
+      // snapshots disabled (see transaction_proto2::snapshot_tid())
+      ALWAYS_ASSERT(snapshot_tid != dbtuple::MAX_TID);
+      g_evt_avg_checkpoint_chunk_latency_us.offer(t.lap());
+      g_evt_avg_checkpoint_snapshot_lag_epochs.offer(
+          ticker::s_instance.global_current_tick() -
+          transaction_proto2_static::EpochId(snapshot_tid));
+      w.append(cb.buf_, cb.n_);
+      r.min_snapshot_tid_ = std::min(r.min_snapshot_tid_, snapshot_tid);
+      r.max_snapshot_tid_ = std::max(r.max_snapshot_tid_, snapshot_tid);
+      if (cb.n_ < g_chunk_nkeys)
+        break;
+      // resume right after the last key we read
+      lower = cb.last_key_;
+      lower.push_back('\0');
+    }
+    r.nkeys_ = w.nkeys();
+    r.nbytes_ = w.finish(r.min_snapshot_tid_);
+    g_evt_checkpoint_nkeys += r.nkeys_;
+    g_evt_checkpoint_nbytes += r.nbytes_;
+  }
+
+  const std::string dir_;
+
+  std::mutex lock_;
+  std::condition_variable start_cv_;
+  std::condition_variable done_cv_;
+  uint64_t round_;
+  size_t nactive_;
+  bool stop_;
+
+  // the current round's work, protected by lock_
+  uint64_t seq_;
+  std::vector<range> *ranges_;
+  std::atomic<size_t> next_range_;
+
+  std::vector<std::thread> workers_;
+};
+
+#endif /* _NDB_TXN_CHECKPOINT_H_ */
@@ -0,0 +1,321 @@
+#include <iostream>
+#include <algorithm>
+#include <limits>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "txn_follower.h"
+#include "core.h"
+#include "fileutils.h"
+#include "util.h"
+
+using namespace std;
+using namespace util;
+
+typedef transaction_proto2_static proto;
+
+txn_log_follower::txn_log_follower(
+    const string &sockfile,
+    size_t npartitions,
+    const replay_fn &fn,
+    const is_full_fn &is_full)
+  : sockfile_(sockfile), fn_(fn), is_full_(is_full), listen_fd_(-1),
+    stop_(false), nstreams_(0),
+    nbuffers_(0), ntxns_(0), nwrites_(0), nkeys_replayed_(0)
+{
+  if (!npartitions)
+    npartitions = coreid::num_cpus_online();
+  INVARIANT(npartitions > 0);
+
+  struct sockaddr_un addr;
+  ALWAYS_ASSERT(sockfile_.size() < sizeof(addr.sun_path));
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, sockfile_.c_str());
+  listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd_ == -1) {
+    perror("socket");
+    ALWAYS_ASSERT(false);
+  }
+  unlink(sockfile_.c_str());
+  if (::bind(listen_fd_, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+    perror("bind");
+    ALWAYS_ASSERT(false);
+  }
+  if (listen(listen_fd_, txn_logger::g_nmax_loggers) == -1) {
+    perror("listen");
+    ALWAYS_ASSERT(false);
+  }
+
+  for (size_t i = 0; i < npartitions; i++)
+    partitions_.emplace_back(new partition);
+  for (size_t i = 0; i < npartitions; i++)
+    appliers_.emplace_back(&txn_log_follower::applier, this, i);
+  acceptor_ = thread(&txn_log_follower::acceptor, this);
+}
+
+txn_log_follower::~txn_log_follower()
+{
+  {
+    std::lock_guard<std::mutex> l(lock_);
+    stop_ = true;
+    // wakes up the acceptor and the receivers
+    shutdown(listen_fd_, SHUT_RDWR);
+    for (auto &s : streams_)
+      shutdown(s->fd_, SHUT_RDWR);
+  }
+  cv_.notify_all();
+  acceptor_.join();
+  // the acceptor is gone, so streams_ does not change any more
+  for (auto &s : streams_) {
+    s->receiver_.join();
+    close(s->fd_);
+  }
+  for (auto &th : appliers_)
+    th.join();
+  close(listen_fd_);
+  unlink(sockfile_.c_str());
+}
+
+uint64_t
+txn_log_follower::applied_epoch() const
+{
+  std::lock_guard<std::mutex> l(lock_);
+  return min_applied_epoch();
+}
+
+uint64_t
+txn_log_follower::wait_for_epoch(uint64_t e)
+{
+  std::unique_lock<std::mutex> l(lock_);
+  cv_.wait(l, [this, e]() {
+    const uint64_t applied = min_applied_epoch();
+    return stop_ || applied >= e || (done() && applied == frontier());
+  });
+  return min_applied_epoch();
+}
+
+txn_log_follower::stats
+txn_log_follower::wait_for_primary()
+{
+  wait_for_epoch(numeric_limits<uint64_t>::max());
+  return get_stats();
+}
+
+txn_log_follower::stats
+txn_log_follower::get_stats() const
+{
+  stats s;
+  {
+    std::lock_guard<std::mutex> l(lock_);
+    s.nstreams_ = streams_.size();
+    s.applied_epoch_ = min_applied_epoch();
+  }
+  s.nbuffers_ = nbuffers_.load(memory_order_acquire);
+  s.ntxns_ = ntxns_.load(memory_order_acquire);
+  s.nwrites_ = nwrites_.load(memory_order_acquire);
+  s.nkeys_replayed_ = nkeys_replayed_.load(memory_order_acquire);
+  return s;
+}
+
+uint64_t
+txn_log_follower::frontier() const
+{
+  // a stream which has not connected yet may still have anything to say
+  if (!nstreams_ || streams_.size() < nstreams_)
+    return 0;
+  uint64_t e = numeric_limits<uint64_t>::max();
+  for (auto &s : streams_)
+    e = min(e, s->marker_epoch_);
+  return e;
+}
+
+bool
+txn_log_follower::done() const
+{
+  if (!nstreams_ || streams_.size() < nstreams_)
+    return false;
+  for (auto &s : streams_)
+    if (!s->closed_)
+      return false;
+  return true;
+}
+
+uint64_t
+txn_log_follower::min_applied_epoch() const
+{
+  uint64_t e = numeric_limits<uint64_t>::max();
+  for (auto &p : partitions_)
+    e = min(e, p->applied_epoch_);
+  return e;
+}
+
+void
+txn_log_follower::acceptor()
+{
+  for (;;) {
+    const int fd = accept(listen_fd_, nullptr, nullptr);
+    if (fd == -1) {
+      std::lock_guard<std::mutex> l(lock_);
+      if (stop_)
+        return;
+      perror("accept");
+      ALWAYS_ASSERT(false);
+    }
+    txn_logger::log_stream_header hdr;
+    if (fileutils::readall(fd, (char *) &hdr, sizeof(hdr))) {
+      // went away before saying hello
+      close(fd);
+      continue;
+    }
+    if (hdr.seg_.magic_ != txn_logger::g_log_segment_magic ||
+        hdr.seg_.checksum_ != txn_logger::ComputeChecksum(hdr.seg_)) {
+      cerr << "[follower] not a log stream" << endl;
+      ALWAYS_ASSERT(false);
+    }
+    if (hdr.seg_.version_ != txn_logger::g_log_format_version) {
+      cerr << "[follower] unsupported log format version "
+           << hdr.seg_.version_ << endl;
+      ALWAYS_ASSERT(false);
+    }
+    std::lock_guard<std::mutex> l(lock_);
+    if (stop_) {
+      close(fd);
+      return;
+    }
+    if (!nstreams_)
+      nstreams_ = hdr.nstreams_;
+    ALWAYS_ASSERT(hdr.nstreams_ == nstreams_);
+    ALWAYS_ASSERT(streams_.size() < nstreams_);
+    streams_.emplace_back(new stream(fd));
+    stream * const s = streams_.back().get();
+    const uint16_t flags = hdr.seg_.flags_;
+    s->receiver_ = thread(&txn_log_follower::receiver, this, s, flags);
+    if (streams_.size() == nstreams_) {
+      // the primary is all here, which may move the frontier
+      cv_.notify_all();
+      return;
+    }
+  }
+}
+
+void
+txn_log_follower::receiver(stream *s, uint16_t flags)
+{
+  // buffers shipped with O_DIRECT are padded out to a block
+  const size_t align =
+    (flags & txn_logger::log_segment_header::FLAGS_DIRECT_IO) ?
+      txn_logger::g_direct_io_align : 1;
+  const bool use_compression =
+    flags & txn_logger::log_segment_header::FLAGS_COMPRESSED;
+  unique_ptr<uint8_t[]> decompress_buf(
+      use_compression ? new uint8_t[txn_logger::g_buffer_size] : nullptr);
+  const size_t hdrsz = sizeof(txn_logger::logbuf_header);
+  vector<uint8_t> data;
+  log_write_vec scratch;
+  vector<log_write_vec> routed(partitions_.size());
+
+  for (;;) {
+    txn_logger::logbuf_header hdr;
+    if (fileutils::readall(s->fd_, (char *) &hdr, hdrsz))
+      break;
+    // the payload and the padding after it
+    const size_t nbytes = iceil(hdrsz + hdr.nbytes_, align) - hdrsz;
+    ALWAYS_ASSERT(nbytes <= 2 * txn_logger::g_buffer_size);
+    data.resize(nbytes);
+    if (nbytes && fileutils::readall(s->fd_, (char *) data.data(), nbytes))
+      break;
+    // unlike a file, a stream cannot have torn writes
+    ALWAYS_ASSERT(hdr.checksum_ == txn_logger::ComputeChecksum(hdr, data.data()));
+
+    if (!hdr.nentries_) {
+      // durable epoch marker
+      bool moved = false;
+      {
+        std::lock_guard<std::mutex> l(lock_);
+        if (hdr.last_tid_ > s->marker_epoch_) {
+          const uint64_t e0 = frontier();
+          s->marker_epoch_ = hdr.last_tid_;
+          moved = frontier() > e0;
+        }
+      }
+      if (moved)
+        cv_.notify_all();
+      continue;
+    }
+
+    const uint64_t epoch = proto::EpochId(hdr.last_tid_);
+    scratch.clear();
+    txn_log_recovery::decode_buffer(hdr, data.data(), decompress_buf.get(), scratch);
+    nbuffers_.fetch_add(1, memory_order_acq_rel);
+    ntxns_.fetch_add(hdr.nentries_, memory_order_acq_rel);
+    nwrites_.fetch_add(scratch.size(), memory_order_acq_rel);
+
+    for (auto &w : scratch)
+      routed[txn_log_recovery::partition_of(w, routed.size())].emplace_back(move(w));
+    for (size_t i = 0; i < routed.size(); i++) {
+      if (routed[i].empty())
+        continue;
+      partition &p = *partitions_[i];
+      std::lock_guard<std::mutex> l(p.lock_);
+      log_write_vec &pending = p.pending_[epoch];
+      if (pending.empty())
+        pending.swap(routed[i]);
+      else
+        move(routed[i].begin(), routed[i].end(), back_inserter(pending));
+      routed[i].clear();
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> l(lock_);
+    s->closed_ = true;
+  }
+  cv_.notify_all();
+}
+
+void
+txn_log_follower::applier(unsigned i)
+{
+  partition &p = *partitions_[i];
+  vector<log_write_vec> batch;
+  vector<log_write *> writes;
+  for (;;) {
+    uint64_t target;
+    {
+      std::unique_lock<std::mutex> l(lock_);
+      cv_.wait(l, [this, &p]() {
+        return stop_ || frontier() > p.applied_epoch_ || done();
+      });
+      if (stop_)
+        return;
+      target = frontier();
+      if (target <= p.applied_epoch_)
+        // done, and everything durable is applied
+        return;
+    }
+
+    {
+      std::lock_guard<std::mutex> l(p.lock_);
+      const auto end = p.pending_.upper_bound(target);
+      for (auto it = p.pending_.begin(); it != end; ++it)
+        batch.emplace_back(move(it->second));
+      p.pending_.erase(p.pending_.begin(), end);
+    }
+    for (auto &ws : batch)
+      for (auto &w : ws)
+        writes.push_back(&w);
+    nkeys_replayed_.fetch_add(
+        txn_log_recovery::replay_writes(i, writes, fn_, is_full_),
+        memory_order_acq_rel);
+    writes.clear();
+    batch.clear();
+
+    {
+      std::lock_guard<std::mutex> l(lock_);
+      p.applied_epoch_ = target;
+    }
+    cv_.notify_all();
+  }
+}
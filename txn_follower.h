@@ -0,0 +1,153 @@
+#ifndef _NDB_TXN_FOLLOWER_H_
+#define _NDB_TXN_FOLLOWER_H_
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include "macros.h"
+#include "txn_recovery.h"
+
+// a hot standby, which applies the log of a primary to its own tables as
+// the primary's loggers ship it (see txn_logger::Init())
+//
+// the follower listens on a UNIX domain socket, and each logger of the
+// primary connects to it with a stream of its own. one receiver thread per
+// stream verifies and decodes log buffers as they arrive (just as recovery
+// does), routing each write to an apply partition by (table id, key) hash.
+// the durable epoch markers in a stream tell how far the stream is
+// complete, so once every stream delivered all of its txns with epoch
+// <= e, one apply thread per partition hands the writes of the epochs up
+// to e to the replay callback, and the applied epoch moves up to e. txns
+// past the last marker are never applied, since the primary may not have
+// made them durable.
+//
+// the partitions apply an epoch independently of each other, so a reader
+// on the follower sees everything up to applied_epoch(), and perhaps part
+// of the epochs after it. a follower serves a single run of the primary:
+// once all of the streams are closed, it is done
+class txn_log_follower {
+public:
+
+  typedef txn_log_recovery::replay_fn replay_fn;
+  typedef txn_log_recovery::is_full_fn is_full_fn;
+
+  struct stats {
+    size_t nstreams_;       // streams connected
+    size_t nbuffers_;       // log buffers received (excluding markers)
+    size_t ntxns_;          // txns received
+    size_t nwrites_;        // writes received
+    size_t nkeys_replayed_; // # of replay callback invocations
+    uint64_t applied_epoch_;
+
+    stats()
+      : nstreams_(0), nbuffers_(0), ntxns_(0), nwrites_(0),
+        nkeys_replayed_(0), applied_epoch_(0) {}
+  };
+
+  // listens on sockfile (replacing whatever is there), and applies with
+  // npartitions apply threads (0 means one per online cpu). fn and is_full
+  // are as for txn_log_recovery::Recover(), and see the same writes, for a
+  // table which starts out empty (or holds a checkpoint older than the
+  // primary's log)
+  txn_log_follower(const std::string &sockfile,
+                   size_t npartitions,
+                   const replay_fn &fn,
+                   const is_full_fn &is_full = is_full_fn());
+
+  // stops following right away, without waiting for the primary
+  ~txn_log_follower();
+
+  txn_log_follower(const txn_log_follower &) = delete;
+  txn_log_follower &operator=(const txn_log_follower &) = delete;
+
+  // all txns of the primary with epoch <= applied_epoch() are applied
+  uint64_t applied_epoch() const;
+
+  // blocks until applied_epoch() >= e, or until the primary is gone and
+  // everything it made durable is applied. returns applied_epoch()
+  uint64_t wait_for_epoch(uint64_t e);
+
+  // blocks until the primary is gone and everything it made durable is
+  // applied
+  stats wait_for_primary();
+
+  stats get_stats() const;
+
+private:
+
+  typedef txn_log_recovery::log_write log_write;
+  typedef txn_log_recovery::log_write_vec log_write_vec;
+
+  struct stream {
+    int fd_;
+    uint64_t marker_epoch_; // protected by lock_
+    bool closed_;           // protected by lock_
+    std::thread receiver_;
+    stream(int fd) : fd_(fd), marker_epoch_(0), closed_(false) {}
+  };
+
+  struct partition {
+    std::mutex lock_;
+    // writes received, but not applied yet, by epoch
+    std::map<uint64_t, log_write_vec> pending_;
+    uint64_t applied_epoch_; // protected by txn_log_follower::lock_
+    partition() : applied_epoch_(0) {}
+  };
+
+  void acceptor();
+
+  void receiver(stream *s, uint16_t flags);
+
+  void applier(unsigned p);
+
+  // lock_ must be held. the epoch every stream is complete up to
+  uint64_t frontier() const;
+
+  // lock_ must be held. every stream is closed, so the frontier will not
+  // move any more
+  bool done() const;
+
+  // lock_ must be held
+  uint64_t min_applied_epoch() const;
+
+  const std::string sockfile_;
+  const replay_fn fn_;
+  const is_full_fn is_full_;
+  int listen_fd_;
+
+  mutable std::mutex lock_;
+  std::condition_variable cv_;
+  bool stop_;
+  size_t nstreams_; // expected, as told by the first stream (0 until then)
+  std::vector<std::unique_ptr<stream>> streams_;
+  std::vector<std::unique_ptr<partition>> partitions_;
+
+  std::thread acceptor_;
+  std::vector<std::thread> appliers_;
+
+  std::atomic<size_t> nbuffers_;
+  std::atomic<size_t> ntxns_;
+  std::atomic<size_t> nwrites_;
+  std::atomic<size_t> nkeys_replayed_;
+};
+
+static inline std::ostream &
+operator<<(std::ostream &o, const txn_log_follower::stats &s)
+{
+  o << "{nstreams=" << s.nstreams_
+    << ", nbuffers=" << s.nbuffers_
+    << ", ntxns=" << s.ntxns_
+    << ", nwrites=" << s.nwrites_
+    << ", nkeys_replayed=" << s.nkeys_replayed_
+    << ", applied_epoch=" << s.applied_epoch_ << "}";
+  return o;
+}
+
+#endif /* _NDB_TXN_FOLLOWER_H_ */
@@ -69,10 +69,16 @@ transaction<Protocol, Traits>::abort_impl(abort_reason reason)
     dbtuple * const tuple = it->get_tuple();
     if (it->is_insert()) {
       INVARIANT(tuple->is_locked());
+      if (unlikely(it->is_deferred())) {
+        // never made it into the btree
+        release_new_tuple(tuple);
+        continue;
+      }
       this->cleanup_inserted_tuple_marker(tuple, it->get_key(), it->get_btree());
       tuple->unlock();
     }
   }
+  release_read_locks(false);
 
   clear();
 }
@@ -215,7 +221,18 @@ transaction<Protocol, Traits>::handle_last_tuple_in_group(
       // again in sorted order
       return false; // signal abort
     }
-    const dbtuple::version_t v = tuple->lock(true); // lock for write
+    // lock for write. some other txn may hold a read lock on the tuple,
+    // and be waiting for a lock we hold, so give up after a while (see
+    // g_tuple_lock_spins)
+    auto it = std::find(read_locks.begin(), read_locks.end(), tuple);
+    if (unlikely(it != read_locks.end())) {
+      // locked it as we read it
+      tuple->upgrade_lock();
+      *it = nullptr;
+    } else if (unlikely(!tuple->try_lock(true, g_tuple_lock_spins, true))) {
+      return false; // signal abort
+    }
+    const dbtuple::version_t v = tuple->unstable_version();
     INVARIANT(dbtuple::IsLatest(v) == tuple->is_latest());
     last.mark_locked();
     if (unlikely(!dbtuple::IsLatest(v) ||
@@ -223,6 +240,9 @@ transaction<Protocol, Traits>::handle_last_tuple_in_group(
       // XXX(stephentu): overly conservative (with the can_read_tid() check)
       return false; // signal abort
     }
+    if (unlikely(last.entry->is_commutative() && tuple->is_deleting()))
+      // the record went away, and there is nothing to apply the write to
+      return false; // signal abort
     last.entry->set_do_write();
   }
   return true;
@@ -255,7 +275,18 @@ transaction<Protocol, Traits>::commit(bool doThrow)
 
   dbtuple_write_info_vec write_dbtuples;
   std::pair<bool, tid_t> commit_tid(false, 0);
+  const dbtuple *culprit = nullptr; // the tuple to blame for an abort
+  unsigned nrepairs = 0;
+
+  if (unlikely(g_deferred_inserts) && !write_set.empty() &&
+      unlikely(!publish_deferred_inserts())) {
+    abort_impl(reason);
+    if (doThrow)
+      throw transaction_abort_exception(reason);
+    return false;
+  }
 
+retry:
   // copy write tuples to vector for sorting
   if (!write_set.empty()) {
     PERF_DECL(
@@ -301,6 +332,7 @@ transaction<Protocol, Traits>::commit(bool doThrow)
           // on boundary
           if (unlikely(!handle_last_tuple_in_group(*last_px, inserted_last_run))) {
             abort_trap((reason = ABORT_REASON_WRITE_NODE_INTERFERENCE));
+            culprit = last_px->get_tuple();
             goto do_abort;
           }
           inserted_last_run = false;
@@ -319,6 +351,7 @@ transaction<Protocol, Traits>::commit(bool doThrow)
       if (likely(last_px) &&
           unlikely(!handle_last_tuple_in_group(*last_px, inserted_last_run))) {
         abort_trap((reason = ABORT_REASON_WRITE_NODE_INTERFERENCE));
+        culprit = last_px->get_tuple();
         goto do_abort;
       }
       commit_tid.first = true;
@@ -348,11 +381,7 @@ transaction<Protocol, Traits>::commit(bool doThrow)
                             << " at snapshot_tid "
                             << g_proto_version_str(cast()->snapshot_tid())
                             << std::endl);
-          const bool found = sorted_dbtuples_contains(
-              write_dbtuples, it->get_tuple());
-          if (likely(found ?
-                it->get_tuple()->is_latest_version(it->get_tid()) :
-                it->get_tuple()->stable_is_latest_version(it->get_tid())))
+          if (likely(is_read_valid(write_dbtuples, *it)))
             continue;
 
           VERBOSE(std::cerr << "validating dbtuple " << util::hexify(it->get_tuple()) << " at snapshot_tid "
@@ -362,13 +391,30 @@ transaction<Protocol, Traits>::commit(bool doThrow)
 
           //std::cerr << "failed tuple: " << *it->get_tuple() << std::endl;
 
+          if (unlikely(!repair_steps.empty()) &&
+              nrepairs < g_max_txn_repairs &&
+              repair(write_dbtuples, it - read_set.begin())) {
+            if (unlikely(state == TXN_ABRT)) {
+              // a step aborted the txn, and cleaned up after it
+              if (doThrow)
+                throw transaction_abort_exception(reason);
+              return false;
+            }
+            nrepairs++;
+            write_dbtuples.clear();
+            commit_tid = std::make_pair(false, 0);
+            goto retry;
+          }
+
           abort_trap((reason = ABORT_REASON_READ_NODE_INTEREFERENCE));
+          culprit = it->get_tuple();
           goto do_abort;
         }
       }
 
       // check btree versions have not changed
       if (!absent_set.empty()) {
+        bool validate_ranges = false;
         typename absent_set_map::iterator it     = absent_set.begin();
         typename absent_set_map::iterator it_end = absent_set.end();
         for (; it != it_end; ++it) {
@@ -376,10 +422,19 @@ transaction<Protocol, Traits>::commit(bool doThrow)
           if (unlikely(v != it->second.version)) {
             VERBOSE(std::cerr << "expected node " << util::hexify(it->first) << " at v="
                               << it->second.version << ", got v=" << v << std::endl);
+            if (it->second.ranged) {
+              // the keys we read may still be as they were
+              validate_ranges = true;
+              continue;
+            }
             abort_trap((reason = ABORT_REASON_NODE_SCAN_READ_VERSION_CHANGED));
             goto do_abort;
           }
         }
+        if (unlikely(validate_ranges) && !scan_ranges_unchanged()) {
+          abort_trap((reason = ABORT_REASON_NODE_SCAN_READ_VERSION_CHANGED));
+          goto do_abort;
+        }
       }
     }
 
@@ -417,7 +472,9 @@ transaction<Protocol, Traits>::commit(bool doThrow)
             ret.head_->lock(true);
             unlock_head = true;
             // need to unlink tuple from underlying btree, replacing
-            // with ret.rest_ (atomically)
+            // with ret.rest_ (atomically). tuples outside of any btree
+            // are allocated big enough to never get here
+            INVARIANT(it->get_btree());
             typename concurrent_btree::value_type old_v = 0;
             if (it->get_btree()->insert(
                   varkey(it->get_key()), (typename concurrent_btree::value_type) ret.head_, &old_v, NULL))
@@ -450,6 +507,7 @@ transaction<Protocol, Traits>::commit(bool doThrow)
       }
     }
   }
+  release_read_locks(true);
   state = TXN_COMMITED;
   if (commit_tid.first)
     cast()->on_tid_finish(commit_tid.second);
@@ -478,6 +536,9 @@ do_abort:
       INVARIANT(!it->is_insert());
     }
   }
+  release_read_locks(false);
+  if (unlikely(g_hot_tuple_locking) && culprit)
+    NoteAbortOn(culprit);
 
   state = TXN_ABRT;
   if (commit_tid.first)
@@ -496,8 +557,8 @@ do_abort:
 }
 
 template <template <typename> class Protocol, typename Traits>
-std::pair< dbtuple *, bool >
-transaction<Protocol, Traits>::try_insert_new_tuple(
+dbtuple *
+transaction<Protocol, Traits>::alloc_new_tuple(
     concurrent_btree &btr,
     const std::string *key,
     const void *value,
@@ -522,25 +583,36 @@ transaction<Protocol, Traits>::try_insert_new_tuple(
   tuple->key.assign(key->data(), key->size());
   tuple->tree = (void *) &btr;
 #endif
+  return tuple;
+}
 
+template <template <typename> class Protocol, typename Traits>
+void
+transaction<Protocol, Traits>::release_new_tuple(dbtuple *tuple)
+{
+  tuple->clear_latest();
+  tuple->unlock();
+  dbtuple::release_no_rcu(tuple);
+}
+
+template <template <typename> class Protocol, typename Traits>
+bool
+transaction<Protocol, Traits>::insert_new_tuple(
+    concurrent_btree &btr,
+    const std::string &key,
+    dbtuple *tuple,
+    bool &node_interference)
+{
   // XXX: underlying btree api should return the existing value if insert
   // fails- this would allow us to avoid having to do another search
   typename concurrent_btree::insert_info_t insert_info;
   if (unlikely(!btr.insert_if_absent(
-          varkey(*key), (typename concurrent_btree::value_type) tuple, &insert_info))) {
+          varkey(key), (typename concurrent_btree::value_type) tuple, &insert_info))) {
     VERBOSE(std::cerr << "insert_if_absent failed for key: " << util::hexify(key) << std::endl);
-    tuple->clear_latest();
-    tuple->unlock();
-    dbtuple::release_no_rcu(tuple);
-    ++transaction_base::g_evt_dbtuple_write_insert_failed;
-    return std::pair< dbtuple *, bool >(nullptr, false);
+    return false;
   }
   VERBOSE(std::cerr << "insert_if_absent suceeded for key: " << util::hexify(key) << std::endl
                     << "  new dbtuple is " << util::hexify(tuple) << std::endl);
-  // update write_set
-  // too expensive to be practical
-  // INVARIANT(find_write_set(tuple) == write_set.end());
-  write_set.emplace_back(tuple, key, value, writer, &btr, true);
 
   // update node #s
   INVARIANT(insert_info.node);
@@ -548,8 +620,12 @@ transaction<Protocol, Traits>::try_insert_new_tuple(
     auto it = absent_set.find(insert_info.node);
     if (it != absent_set.end()) {
       if (unlikely(it->second.version != insert_info.old_version)) {
+        if (it->second.ranged)
+          // left for scan_ranges_unchanged() to sort out at commit
+          return true;
         abort_trap((reason = ABORT_REASON_WRITE_NODE_INTERFERENCE));
-        return std::make_pair(tuple, true);
+        node_interference = true;
+        return true;
       }
       VERBOSE(std::cerr << "bump node=" << util::hexify(it->first) << " from v=" << insert_info.old_version
                         << " -> v=" << insert_info.new_version << std::endl);
@@ -558,14 +634,89 @@ transaction<Protocol, Traits>::try_insert_new_tuple(
       SINGLE_THREADED_INVARIANT(concurrent_btree::ExtractVersionNumber(it->first) == it->second);
     }
   }
-  return std::make_pair(tuple, false);
+  return true;
+}
+
+template <template <typename> class Protocol, typename Traits>
+std::pair< dbtuple *, bool >
+transaction<Protocol, Traits>::try_insert_new_tuple(
+    concurrent_btree &btr,
+    unsigned table_id,
+    const std::string *key,
+    const void *value,
+    dbtuple::tuple_writer_t writer)
+{
+  dbtuple * const tuple = alloc_new_tuple(btr, key, value, writer);
+  bool node_interference = false;
+  if (unlikely(!insert_new_tuple(btr, *key, tuple, node_interference))) {
+    release_new_tuple(tuple);
+    ++transaction_base::g_evt_dbtuple_write_insert_failed;
+    return std::pair< dbtuple *, bool >(nullptr, false);
+  }
+  // update write_set
+  // too expensive to be practical
+  // INVARIANT(find_write_set(tuple) == write_set.end());
+  write_set.emplace_back(tuple, key, value, writer, &btr, table_id, true);
+  return std::make_pair(tuple, node_interference);
+}
+
+template <template <typename> class Protocol, typename Traits>
+void
+transaction<Protocol, Traits>::defer_insert_new_tuple(
+    concurrent_btree &btr,
+    unsigned table_id,
+    const std::string *key,
+    const void *value,
+    dbtuple::tuple_writer_t writer)
+{
+  dbtuple * const tuple = alloc_new_tuple(btr, key, value, writer);
+  write_set.emplace_back(tuple, key, value, writer, &btr, table_id, true);
+  write_set.back().set_deferred();
+  ++transaction_base::g_evt_deferred_inserts;
+}
+
+template <template <typename> class Protocol, typename Traits>
+bool
+transaction<Protocol, Traits>::publish_deferred_inserts()
+{
+  for (size_t i = 0; i < write_set.size(); i++) {
+    write_record_t &w = write_set[i];
+    if (likely(!w.is_deferred()))
+      continue;
+    bool node_interference = false;
+    if (likely(insert_new_tuple(
+            *w.get_btree(), w.get_key(), w.get_tuple(), node_interference))) {
+      w.clear_deferred();
+      if (unlikely(node_interference))
+        return false;
+      continue;
+    }
+
+    // the key is there already. we may have inserted it ourselves, in
+    // which case this is just another write to it
+    typename concurrent_btree::value_type bv = 0;
+    dbtuple *mine = nullptr;
+    if (w.get_btree()->search(varkey(w.get_key()), bv))
+      for (size_t j = 0; j < i && !mine; j++)
+        if (write_set[j].is_insert() &&
+            write_set[j].get_tuple() == reinterpret_cast<dbtuple *>(bv))
+          mine = write_set[j].get_tuple();
+    if (!mine) {
+      ++transaction_base::g_evt_deferred_insert_conflicts;
+      reason = ABORT_REASON_INSERT_NODE_INTERFERENCE;
+      return false;
+    }
+    release_new_tuple(w.get_tuple());
+    w.redirect(mine);
+  }
+  return true;
 }
 
 template <template <typename> class Protocol, typename Traits>
 template <typename ValueReader>
 bool
 transaction<Protocol, Traits>::do_tuple_read(
-    const dbtuple *tuple, ValueReader &value_reader)
+    const dbtuple *tuple, ValueReader &value_reader, bool for_update)
 {
   INVARIANT(tuple);
   ++evt_local_search_lookups;
@@ -591,6 +742,16 @@ transaction<Protocol, Traits>::do_tuple_read(
     }
   }
 
+  if (unlikely(for_update) && !is_snapshot_txn) {
+    // read-only txns do not write, so they have nothing to lock for
+    if (likely(read_lock(tuple)))
+      ++g_evt_for_update_locks;
+    else
+      ++g_evt_for_update_lock_timeouts;
+  } else if (unlikely(g_hot_tuple_locking) && !is_snapshot_txn) {
+    maybe_read_lock(tuple);
+  }
+
   // do the actual tuple read
   dbtuple::ReadStatus stat;
   {
@@ -607,6 +768,8 @@ transaction<Protocol, Traits>::do_tuple_read(
   if (unlikely(!cast()->can_read_tid(start_t))) {
     const transaction_base::abort_reason r = transaction_base::ABORT_REASON_FUTURE_TID_READ;
     abort_impl(r);
+    if (unlikely(g_hot_tuple_locking))
+      NoteAbortOn(tuple);
     throw transaction_abort_exception(r);
   }
   INVARIANT(stat == dbtuple::READ_EMPTY ||
@@ -621,18 +784,234 @@ transaction<Protocol, Traits>::do_tuple_read(
   return !v_empty;
 }
 
+template <template <typename> class Protocol, typename Traits>
+void
+transaction<Protocol, Traits>::add_repair_step(
+    const repair_mark_t &mark, repair_fn fn)
+{
+  INVARIANT(mark.first <= read_set.size());
+  INVARIANT(mark.second <= write_set.size());
+  if (mark.first == read_set.size())
+    // nothing to repair
+    return;
+  INVARIANT(!is_snapshot());
+  INVARIANT(repair_steps.empty() ||
+            (repair_steps.back().rend_ <= mark.first &&
+             repair_steps.back().wend_ <= mark.second));
+  repair_steps.push_back(repair_step{
+      mark.first, read_set.size(), mark.second, write_set.size(),
+      std::move(fn)});
+}
+
+template <template <typename> class Protocol, typename Traits>
+bool
+transaction<Protocol, Traits>::repair(
+    dbtuple_write_info_vec &write_dbtuples, size_t first_failed)
+{
+  // find the steps the failed reads belong to
+  std::vector<bool> failed(repair_steps.size(), false);
+  for (size_t i = first_failed, s = 0; i < read_set.size(); i++) {
+    if (i != first_failed && is_read_valid(write_dbtuples, read_set[i]))
+      continue;
+    while (s < repair_steps.size() && repair_steps[s].rend_ <= i)
+      s++;
+    if (s == repair_steps.size() || i < repair_steps[s].rbegin_) {
+      ++g_evt_txn_unrepairable_reads;
+      return false;
+    }
+    failed[s] = true;
+  }
+
+  // give back the write locks (including the ones turned from read locks,
+  // which are lost), but keep the records we inserted locked
+  for (auto &w : write_dbtuples)
+    if (w.is_locked() && !w.is_insert())
+      w.get_tuple()->unlock();
+  for (auto &w : write_set)
+    w.clear_do_write();
+
+  // drop the reads and writes of the failed steps, moving the rest down
+  std::vector<repair_step> steps;
+  std::vector<repair_fn> redo;
+  size_t ri = 0, rj = 0, wi = 0, wj = 0;
+  auto keep_up_to = [&](size_t rend, size_t wend) {
+    for (; ri < rend; ri++, rj++)
+      if (ri != rj)
+        read_set[rj] = read_set[ri];
+    for (; wi < wend; wi++, wj++)
+      if (wi != wj)
+        write_set[wj] = write_set[wi];
+  };
+  for (size_t s = 0; s < repair_steps.size(); s++) {
+    repair_step &st = repair_steps[s];
+    keep_up_to(st.rbegin_, st.wbegin_);
+    if (failed[s]) {
+#ifdef CHECK_INVARIANTS
+      for (size_t k = st.wbegin_; k < st.wend_; k++)
+        INVARIANT(!write_set[k].is_insert());
+#endif
+      ri = st.rend_;
+      wi = st.wend_;
+      redo.emplace_back(std::move(st.fn_));
+      continue;
+    }
+    steps.push_back(repair_step{
+        rj, rj + (st.rend_ - st.rbegin_), wj, wj + (st.wend_ - st.wbegin_),
+        std::move(st.fn_)});
+  }
+  keep_up_to(read_set.size(), write_set.size());
+  while (read_set.size() > rj)
+    read_set.pop_back();
+  while (write_set.size() > wj)
+    write_set.pop_back();
+  read_set_index.reset();
+  write_set_index.reset();
+  repair_steps.swap(steps);
+
+  // the steps which run again go last, after the ones which stay
+  ++g_evt_txn_repairs;
+  for (auto &fn : redo) {
+    const repair_mark_t mark = repair_mark();
+    try {
+      fn();
+    } catch (transaction_abort_exception &ex) {
+      if (state != TXN_ABRT)
+        abort_impl(ABORT_REASON_USER);
+      return true;
+    }
+    ++g_evt_txn_repair_steps;
+    add_repair_step(mark, std::move(fn));
+  }
+  return true;
+}
+
+template <template <typename> class Protocol, typename Traits>
+bool
+transaction<Protocol, Traits>::scan_ranges_unchanged()
+{
+  // sums up the tuples in a range, like the scan which read it did
+  class counter : public concurrent_btree::low_level_search_range_callback {
+  public:
+    counter(transaction *t) : t(t), nkeys(0), fingerprint(0) {}
+
+    virtual void
+    on_resp_node(const typename concurrent_btree::node_opaque_t *n, uint64_t version)
+    {
+    }
+
+    virtual bool
+    invoke(const typename concurrent_btree::string_type &k,
+           typename concurrent_btree::value_type v,
+           const typename concurrent_btree::node_opaque_t *n, uint64_t version)
+    {
+      t->count_scanned(reinterpret_cast<const dbtuple *>(v), nkeys, fingerprint);
+      return true;
+    }
+
+    transaction *const t;
+    size_t nkeys;
+    uint64_t fingerprint;
+  };
+
+  ++g_evt_range_validations;
+  for (auto &r : scan_ranges) {
+    if (r.point_) {
+      typename concurrent_btree::value_type v = 0;
+      if (r.btr_->search(varkey(*r.lower_), v) &&
+          !is_own_insert(reinterpret_cast<const dbtuple *>(v))) {
+        ++g_evt_range_validation_failures;
+        return false;
+      }
+      continue;
+    }
+    counter c(this);
+    varkey uppervk;
+    if (r.upper_)
+      uppervk = varkey(*r.upper_);
+    r.btr_->search_range_call(
+        varkey(*r.lower_), r.upper_ ? &uppervk : nullptr, c);
+    if (c.nkeys != r.nkeys_ || c.fingerprint != r.fingerprint_) {
+      ++g_evt_range_validation_failures;
+      return false;
+    }
+  }
+  return true;
+}
+
+template <template <typename> class Protocol, typename Traits>
+bool
+transaction<Protocol, Traits>::read_lock(const dbtuple *tuple)
+{
+  dbtuple * const px = const_cast<dbtuple *>(tuple);
+  if (std::find(read_locks.begin(), read_locks.end(), px) != read_locks.end())
+    return true;
+  // a record which is being inserted is locked by its inserter until it
+  // commits- which may well be this txn
+  if (unlikely(px->version == dbtuple::MAX_TID))
+    return false;
+  if (unlikely(!px->try_lock(false, g_tuple_lock_spins)))
+    return false;
+  read_locks.push_back(px);
+  return true;
+}
+
+template <template <typename> class Protocol, typename Traits>
+void
+transaction<Protocol, Traits>::maybe_read_lock(const dbtuple *tuple)
+{
+  if (likely(!tuple->is_hot()))
+    return;
+  const size_t n = read_locks.size();
+  if (unlikely(!read_lock(tuple))) {
+    ++g_evt_hot_tuple_read_lock_timeouts;
+    return;
+  }
+  if (read_locks.size() == n)
+    // held it already
+    return;
+  dbtuple * const px = read_locks.back();
+  ++g_evt_hot_tuple_read_locks;
+  if (unlikely(!(++g_hot_tuple_trackers.my().nread_locks_ %
+                 g_hot_tuple_cool_period))) {
+    px->clear_hot();
+    ++g_evt_hot_tuple_cools;
+  }
+}
+
+template <template <typename> class Protocol, typename Traits>
+void
+transaction<Protocol, Traits>::release_read_locks(bool committed)
+{
+  if (unlikely(g_hot_tuple_locking)) {
+    if (committed)
+      ++(read_locks.empty() ? g_evt_txn_commits_optimistic : g_evt_txn_commits_locking);
+    else
+      ++(read_locks.empty() ? g_evt_txn_aborts_optimistic : g_evt_txn_aborts_locking);
+  }
+  if (likely(read_locks.empty()))
+    return;
+  for (auto px : read_locks)
+    if (px)
+      px->unlock();
+  read_locks.clear();
+}
+
 template <template <typename> class Protocol, typename Traits>
 void
 transaction<Protocol, Traits>::do_node_read(
-    const typename concurrent_btree::node_opaque_t *n, uint64_t v)
+    const typename concurrent_btree::node_opaque_t *n, uint64_t v, bool ranged)
 {
   INVARIANT(n);
   if (is_snapshot())
     return;
   auto it = absent_set.find(n);
   if (it == absent_set.end()) {
-    absent_set[n].version = v;
-  } else if (it->second.version != v) {
+    absent_record_t &r = absent_set[n];
+    r.version = v;
+    r.ranged = ranged;
+  } else if (it->second.version == v) {
+    it->second.ranged &= ranged;
+  } else {
     const transaction_base::abort_reason r =
       transaction_base::ABORT_REASON_NODE_SCAN_READ_VERSION_CHANGED;
     abort_impl(r);
@@ -1,13 +1,26 @@
 #include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <map>
 #include <thread>
+#include <chrono>
 #include <fcntl.h>
 #include <unistd.h>
+#include <dirent.h>
 #include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <limits.h>
 #include <numa.h>
 
+#include <xxhash.h>
+#include <lz4hc.h>
+
 #include "txn_proto2_impl.h"
 #include "counter.h"
+#include "fileutils.h"
 #include "util.h"
 
 using namespace std;
@@ -18,8 +31,18 @@ using namespace util;
 bool txn_logger::g_persist = false;
 bool txn_logger::g_call_fsync = true;
 bool txn_logger::g_use_compression = false;
+size_t txn_logger::g_compress_nthreads = 0;
+int txn_logger::g_compress_level = 0;
 bool txn_logger::g_fake_writes = false;
+bool txn_logger::g_pipeline_writes = false;
+bool txn_logger::g_direct_io = false;
+int txn_logger::g_logger_nodes[txn_logger::g_nmax_loggers];
 size_t txn_logger::g_nworkers = 0;
+size_t txn_logger::g_nloggers = 0;
+bool txn_logger::g_rebalance = false;
+atomic<int> txn_logger::g_owners[NMAXCORES];
+atomic<int> txn_logger::g_migrations[NMAXCORES];
+atomic<uint64_t> txn_logger::g_assignment_gen(0);
 txn_logger::epoch_array
   txn_logger::per_thread_sync_epochs_[txn_logger::g_nmax_loggers];
 aligned_padded_elem<atomic<uint64_t>>
@@ -28,6 +51,18 @@ percore<txn_logger::persist_ctx>
   txn_logger::g_persist_ctxs;
 percore<txn_logger::persist_stats>
   txn_logger::g_persist_stats;
+percore<txn_logger::durable_callbacks>
+  txn_logger::g_durable_callbacks;
+size_t txn_logger::g_segment_size = txn_logger::g_default_segment_size;
+txn_logger::segment_ctx
+  txn_logger::g_segment_ctxs[txn_logger::g_nmax_loggers];
+mutex txn_logger::g_segments_lock;
+condition_variable txn_logger::g_segments_cv;
+atomic<uint64_t> txn_logger::g_checkpoint_tid(0);
+txn_logger::sync_ctx *txn_logger::g_sync_ctxs = nullptr;
+txn_logger::compress_pool *txn_logger::g_compress_pools = nullptr;
+txn_logger::buffer_pool *txn_logger::g_buffer_pools = nullptr;
+size_t txn_logger::g_nbuffer_pools = 0;
 event_counter
   txn_logger::g_evt_log_buffer_epoch_boundary("log_buffer_epoch_boundary");
 event_counter
@@ -40,17 +75,53 @@ event_counter
   txn_logger::g_evt_logger_writev_limit_met("logger_writev_limit_met");
 event_counter
   txn_logger::g_evt_logger_max_lag_wait("logger_max_lag_wait");
+event_counter
+  txn_logger::g_evt_logger_segment_rotations("logger_segment_rotations");
+event_counter
+  txn_logger::g_evt_logger_segment_not_ready("logger_segment_not_ready");
+event_counter
+  txn_logger::g_evt_logger_segments_removed("logger_segments_removed");
+event_counter
+  txn_logger::g_evt_logger_pipeline_stalls("logger_pipeline_stalls");
+event_counter
+  txn_logger::g_evt_durable_callbacks("durable_callbacks");
+event_counter
+  txn_logger::g_evt_logger_idle_buffer_pushes("logger_idle_buffer_pushes");
+event_counter
+  txn_logger::g_evt_log_buffer_pool_borrows("log_buffer_pool_borrows");
+event_counter
+  txn_logger::g_evt_log_buffer_pool_allocs("log_buffer_pool_allocs");
+event_counter
+  txn_logger::g_evt_log_buffer_pool_frees("log_buffer_pool_frees");
+event_counter
+  txn_logger::g_evt_log_backpressure_stalls("log_backpressure_stalls");
+event_counter
+  txn_logger::g_evt_log_backpressure_parks("log_backpressure_parks");
+event_counter
+  txn_logger::g_evt_logger_worker_migrations("logger_worker_migrations");
 event_avg_counter
   txn_logger::g_evt_avg_log_buffer_compress_time_us("avg_log_buffer_compress_time_us");
+event_avg_counter
+  txn_logger::g_evt_avg_log_buffer_compress_ratio_pct("avg_log_buffer_compress_ratio_pct");
+event_avg_counter
+  txn_logger::g_evt_avg_log_buffer_compress_queue_us("avg_log_buffer_compress_queue_us");
 event_avg_counter
   txn_logger::g_evt_avg_log_entry_ntxns("avg_log_entry_ntxns_per_entry");
 event_avg_counter
   txn_logger::g_evt_avg_logger_bytes_per_writev("avg_logger_bytes_per_writev");
 event_avg_counter
   txn_logger::g_evt_avg_logger_bytes_per_sec("avg_logger_bytes_per_sec");
+event_avg_counter
+  txn_logger::g_evt_avg_logger_segment_prepare_ms("avg_logger_segment_prepare_ms");
+event_avg_counter
+  txn_logger::g_evt_avg_logger_sync_ms("avg_logger_sync_ms");
+event_avg_counter
+  txn_logger::g_evt_avg_log_backpressure_stall_us("avg_log_backpressure_stall_us");
 
 static event_avg_counter
   evt_avg_log_buffer_iov_len("avg_log_buffer_iov_len");
+static event_counter
+  evt_log_bytes_shipped("log_bytes_shipped");
 
 void
 txn_logger::Init(
@@ -60,7 +131,15 @@ txn_logger::Init(
     vector<vector<unsigned>> *assignments_used,
     bool call_fsync,
     bool use_compression,
-    bool fake_writes)
+    bool fake_writes,
+    size_t segment_size,
+    bool pipeline_writes,
+    bool direct_io,
+    size_t compress_nthreads,
+    int compress_level,
+    bool numa_aware,
+    const string &ship_sockfile,
+    bool rebalance)
 {
   INVARIANT(!g_persist);
   INVARIANT(g_nworkers == 0);
@@ -68,29 +147,74 @@ txn_logger::Init(
   INVARIANT(!logfiles.empty());
   INVARIANT(logfiles.size() <= g_nmax_loggers);
   INVARIANT(!use_compression || g_perthread_buffers > 1); // need 1 as scratch buf
+  INVARIANT(segment_size > sizeof(log_segment_header));
+  INVARIANT(!direct_io || segment_size % g_direct_io_align == 0);
+  INVARIANT(!compress_nthreads || use_compression);
+  INVARIANT(compress_level >= 0);
+  g_segment_size = segment_size;
+  g_fake_writes = fake_writes;
+  g_call_fsync = call_fsync;
+  g_direct_io = direct_io;
   vector<int> fds;
   for (auto &fname : logfiles) {
-    int fd = open(fname.c_str(), O_CREAT|O_WRONLY|O_TRUNC, 0664);
-    if (fd == -1) {
-      perror("open");
-      ALWAYS_ASSERT(false);
-    }
-    fds.push_back(fd);
+    for (auto &old : ListSegments(fname))
+      if (unlink(old.c_str()) == -1) {
+        perror("unlink");
+        ALWAYS_ASSERT(false);
+      }
+    segment_ctx &ctx = g_segment_ctxs[fds.size()];
+    ctx.logfile_ = fname;
+    ctx.flags_ = (use_compression ? log_segment_header::FLAGS_COMPRESSED : 0) |
+                 (direct_io ? log_segment_header::FLAGS_DIRECT_IO : 0);
+    ctx.next_segno_ = 1;
+    fds.push_back(create_segment(ctx, fds.size(), 0));
   }
   g_persist = true;
-  g_call_fsync = call_fsync;
+  for (auto &p : compute_persist_histograms()) {
+    const string name = p.first;
+    histogram_registry::add(name, [name]() {
+      return compute_persist_histograms()[name];
+    });
+  }
   g_use_compression = use_compression;
-  g_fake_writes = fake_writes;
+  g_pipeline_writes =
+    pipeline_writes && call_fsync && !fake_writes && !direct_io;
+  if (g_pipeline_writes)
+    g_sync_ctxs = new sync_ctx[g_nmax_loggers];
+  g_compress_nthreads = use_compression ? compress_nthreads : 0;
+  g_compress_level = compress_level;
+  if (g_compress_nthreads)
+    g_compress_pools = new compress_pool[g_nmax_loggers];
   g_nworkers = nworkers;
 
   for (size_t i = 0; i < g_nmax_loggers; i++)
     for (size_t j = 0; j < g_nworkers; j++)
       per_thread_sync_epochs_[i].epochs_[j].store(0, memory_order_release);
 
+  for (size_t i = 0; i < g_nmax_loggers; i++)
+    g_logger_nodes[i] = -1;
+  if (numa_aware && numa_available() < 0) {
+    cerr << "[WARNING] libnuma is not available, ignoring numa_aware" << endl;
+    numa_aware = false;
+  }
+  vector<int> worker_nodes;
+  if (numa_aware) {
+    const int ncpus = numa_num_configured_cpus();
+    for (size_t i = 0; i < g_nworkers; i++) {
+      const int node = numa_node_of_cpu(i % ncpus);
+      ALWAYS_ASSERT(node >= 0);
+      worker_nodes.push_back(node);
+    }
+  }
+
   vector<thread> writers;
   vector<vector<unsigned>> assignments(assignments_given);
 
-  if (assignments.empty()) {
+  if (assignments.empty() && numa_aware) {
+    vector<int> logger_nodes;
+    assignments = NumaAssignments(fds.size(), worker_nodes, logger_nodes);
+    copy(logger_nodes.begin(), logger_nodes.end(), &g_logger_nodes[0]);
+  } else if (assignments.empty()) {
     // compute assuming homogenous disks
     if (g_nworkers <= fds.size()) {
       // each thread gets its own logging worker
@@ -111,28 +235,486 @@ txn_logger::Init(
 
   INVARIANT(AssignmentsValid(assignments, fds.size(), g_nworkers));
 
+  g_nloggers = assignments.size();
+  g_rebalance = rebalance && g_nloggers > 1;
+  for (size_t i = 0; i < assignments.size(); i++)
+    for (auto w : assignments[i]) {
+      g_owners[w].store(i, memory_order_release);
+      g_migrations[w].store(-1, memory_order_release);
+    }
+
+  g_nbuffer_pools = numa_aware ? numa_max_node() + 2 : 1;
+  g_buffer_pools = new buffer_pool[g_nbuffer_pools];
+  for (size_t i = 1; i < g_nbuffer_pools; i++)
+    g_buffer_pools[i].node_ = i - 1;
+  for (size_t k = 0; k < NMAXCORES; k++)
+    g_persist_ctxs[k].pool_ = &g_buffer_pools[0];
+
+  if (numa_aware) {
+    for (size_t i = 0; i < assignments.size(); i++) {
+      if (!assignments_given.empty()) {
+        // keep the given assignment, and run each logger where most of its
+        // cores are
+        map<int, size_t> counts;
+        size_t best = 0;
+        for (auto w : assignments[i])
+          if (++counts[worker_nodes[w]] > best) {
+            best = counts[worker_nodes[w]];
+            g_logger_nodes[i] = worker_nodes[w];
+          }
+      }
+      for (auto w : assignments[i])
+        for (size_t k = w; k < NMAXCORES; k += g_nworkers) {
+          persist_ctx &ctx = g_persist_ctxs[k];
+          INVARIANT(!ctx.init_);
+          ctx.node_ = g_logger_nodes[i];
+          ctx.pool_ = &g_buffer_pools[ctx.node_ + 1];
+        }
+    }
+  }
+
   for (size_t i = 0; i < assignments.size(); i++) {
-    writers.emplace_back(
-        &txn_logger::writer,
-        i, fds[i], assignments[i]);
+    const int ship_fd = ship_sockfile.empty() ? -1 :
+      ConnectFollower(ship_sockfile, i, assignments.size(),
+                      g_segment_ctxs[i].flags_);
+    writers.emplace_back(&txn_logger::writer, i, fds[i], ship_fd);
     writers.back().detach();
+    if (g_pipeline_writes) {
+      thread syncer_thread(&txn_logger::syncer, i);
+      syncer_thread.detach();
+    }
+    for (size_t j = 0; j < g_compress_nthreads; j++) {
+      thread compressor_thread(&txn_logger::compressor, i);
+      compressor_thread.detach();
+    }
   }
 
-  thread persist_thread(&txn_logger::persister, assignments);
+  thread persist_thread(&txn_logger::persister);
   persist_thread.detach();
 
+  thread segment_thread(&txn_logger::segment_manager, fds.size());
+  segment_thread.detach();
+
   if (assignments_used)
     *assignments_used = assignments;
 }
 
+vector<vector<unsigned>>
+txn_logger::NumaAssignments(
+    size_t nloggers,
+    const vector<int> &worker_nodes,
+    vector<int> &logger_nodes)
+{
+  INVARIANT(nloggers > 0);
+  map<int, vector<unsigned>> workers_by_node;
+  for (size_t i = 0; i < worker_nodes.size(); i++)
+    workers_by_node[worker_nodes[i]].push_back(i);
+
+  vector<vector<unsigned>> assignments;
+  logger_nodes.clear();
+
+  if (nloggers < workers_by_node.size()) {
+    // not every node can have a logger, so logger i takes every
+    // nloggers-th node, and runs on the one with the most workers
+    assignments.resize(nloggers);
+    logger_nodes.resize(nloggers, -1);
+    vector<size_t> best(nloggers, 0);
+    size_t n = 0;
+    for (auto &p : workers_by_node) {
+      const size_t i = n++ % nloggers;
+      assignments[i].insert(
+          assignments[i].end(), p.second.begin(), p.second.end());
+      if (p.second.size() > best[i]) {
+        best[i] = p.second.size();
+        logger_nodes[i] = p.first;
+      }
+    }
+    for (auto &a : assignments)
+      sort(a.begin(), a.end());
+    return assignments;
+  }
+
+  // each node gets a logger, and each spare logger goes to the node with
+  // the most workers per logger (but never more loggers than workers)
+  map<int, size_t> nloggers_by_node;
+  for (auto &p : workers_by_node)
+    nloggers_by_node[p.first] = 1;
+  for (size_t spare = nloggers - workers_by_node.size(); spare; spare--) {
+    int best = -1;
+    size_t best_nworkers = 0, best_nloggers = 1;
+    for (auto &p : workers_by_node) {
+      const size_t l = nloggers_by_node[p.first];
+      if (l >= p.second.size())
+        continue;
+      if (p.second.size() * best_nloggers > best_nworkers * l) {
+        best = p.first;
+        best_nworkers = p.second.size();
+        best_nloggers = l;
+      }
+    }
+    if (best == -1)
+      break;
+    nloggers_by_node[best]++;
+  }
+
+  for (auto &p : workers_by_node) {
+    const vector<unsigned> &ws = p.second;
+    const size_t l = nloggers_by_node[p.first];
+    for (size_t i = 0; i < l; i++) {
+      assignments.emplace_back(
+          ws.begin() + i * ws.size() / l,
+          ws.begin() + (i + 1) * ws.size() / l);
+      logger_nodes.push_back(p.first);
+    }
+  }
+  return assignments;
+}
+
+bool
+txn_logger::PickMigration(
+    const vector<vector<unsigned>> &assignments,
+    const vector<uint64_t> &worker_epoch_bytes,
+    const vector<int> &logger_nodes,
+    unsigned &worker, unsigned &to)
+{
+  const size_t nloggers = assignments.size();
+  vector<uint64_t> loads(nloggers, 0);
+  for (size_t i = 0; i < nloggers; i++)
+    for (auto w : assignments[i]) {
+      INVARIANT(w < worker_epoch_bytes.size());
+      loads[i] += worker_epoch_bytes[w];
+    }
+  auto node_of = [&logger_nodes](size_t i) {
+    return i < logger_nodes.size() ? logger_nodes[i] : -1;
+  };
+
+  // the busiest and the idlest logger of each node
+  map<int, pair<size_t, size_t>> extremes;
+  for (size_t i = 0; i < nloggers; i++) {
+    auto it = extremes.find(node_of(i));
+    if (it == extremes.end()) {
+      extremes[node_of(i)] = make_pair(i, i);
+      continue;
+    }
+    if (loads[i] > loads[it->second.first])
+      it->second.first = i;
+    if (loads[i] < loads[it->second.second])
+      it->second.second = i;
+  }
+
+  // of the nodes where a move is worth it, the one with the widest gap
+  bool found = false;
+  uint64_t best_gap = 0;
+  for (auto &p : extremes) {
+    const size_t from = p.second.first, dst = p.second.second;
+    if (from == dst || loads[from] < g_rebalance_min_epoch_bytes)
+      continue;
+    const uint64_t gap = loads[from] - loads[dst];
+    if (gap * 100 <= loads[dst] * g_rebalance_threshold_pct || gap <= best_gap)
+      continue;
+    // moving a worker with rate r leaves the two at a distance of
+    // |gap - 2r|, and one with r >= gap would only make them trade places
+    bool found_here = false;
+    uint64_t best_dist = 0;
+    unsigned best_worker = 0;
+    for (auto w : assignments[from]) {
+      const uint64_t r = worker_epoch_bytes[w];
+      if (!r || r >= gap)
+        continue;
+      const uint64_t dist = (2 * r > gap) ? (2 * r - gap) : (gap - 2 * r);
+      if (!found_here || dist < best_dist) {
+        found_here = true;
+        best_dist = dist;
+        best_worker = w;
+      }
+    }
+    if (!found_here)
+      continue;
+    found = true;
+    best_gap = gap;
+    worker = best_worker;
+    to = dst;
+  }
+  return found;
+}
+
+vector<vector<unsigned>>
+txn_logger::CurrentAssignments()
+{
+  vector<vector<unsigned>> assignments(g_nloggers);
+  for (size_t w = 0; w < g_nworkers; w++)
+    assignments[g_owners[w].load(memory_order_acquire)].push_back(w);
+  return assignments;
+}
+
+int
+txn_logger::ConnectFollower(
+    const string &sockfile,
+    unsigned id, unsigned nstreams, uint16_t flags)
+{
+  struct sockaddr_un addr;
+  ALWAYS_ASSERT(sockfile.size() < sizeof(addr.sun_path));
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, sockfile.c_str());
+
+  static const size_t nretries = 100;
+  int fd = -1;
+  for (size_t i = 0; fd == -1; i++) {
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+      perror("socket");
+      ALWAYS_ASSERT(false);
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0)
+      break;
+    if ((errno != ENOENT && errno != ECONNREFUSED) || i == nretries) {
+      perror("connect");
+      ALWAYS_ASSERT(false);
+    }
+    close(fd);
+    fd = -1;
+    this_thread::sleep_for(chrono::milliseconds(100));
+  }
+
+  log_stream_header hdr;
+  NDB_MEMSET(&hdr, 0, sizeof(hdr));
+  hdr.seg_.magic_ = g_log_segment_magic;
+  hdr.seg_.version_ = g_log_format_version;
+  hdr.seg_.flags_ = flags;
+  hdr.seg_.logger_id_ = id;
+  hdr.seg_.checksum_ = ComputeChecksum(hdr.seg_);
+  hdr.nstreams_ = nstreams;
+  if (fileutils::writeall(fd, (const char *) &hdr, sizeof(hdr)) == -1) {
+    perror("write");
+    ALWAYS_ASSERT(false);
+  }
+  return fd;
+}
+
+uint32_t
+txn_logger::ComputeChecksum(const log_segment_header &hdr)
+{
+  return XXH32(&hdr, offsetof(log_segment_header, checksum_), 0);
+}
+
+uint32_t
+txn_logger::ComputeChecksum(const logbuf_header &hdr, const uint8_t *data)
+{
+  XXH32_stateSpace_t state;
+  XXH32_resetState(&state, 0);
+  XXH32_update(&state, &hdr, offsetof(logbuf_header, checksum_));
+  if (hdr.nbytes_)
+    XXH32_update(&state, data, hdr.nbytes_);
+  return XXH32_intermediateDigest(&state);
+}
+
+// splits path into its directory and file name
+static void
+split_path(const string &path, string &dir, string &base)
+{
+  const size_t slash = path.rfind('/');
+  if (slash == string::npos) {
+    dir = ".";
+    base = path;
+  } else {
+    dir = slash ? path.substr(0, slash) : "/";
+    base = path.substr(slash + 1);
+  }
+}
+
+string
+txn_logger::SegmentName(const string &logfile, unsigned segno)
+{
+  ostringstream oss;
+  oss << logfile << "." << segno;
+  return oss.str();
+}
+
+vector<string>
+txn_logger::ListSegments(const string &logfile)
+{
+  string dir, prefix;
+  split_path(logfile, dir, prefix);
+  prefix += ".";
+  vector<pair<unsigned, string>> segs;
+  DIR * const dp = opendir(dir.c_str());
+  if (!dp)
+    return {};
+  struct dirent *ent;
+  while ((ent = readdir(dp))) {
+    const string name = ent->d_name;
+    if (name.compare(0, prefix.size(), prefix) ||
+        name.size() == prefix.size() ||
+        name.find_first_not_of("0123456789", prefix.size()) != string::npos)
+      continue;
+    const unsigned segno = strtoul(name.c_str() + prefix.size(), nullptr, 10);
+    segs.emplace_back(segno, SegmentName(logfile, segno));
+  }
+  closedir(dp);
+  sort(segs.begin(), segs.end());
+  vector<string> ret;
+  for (auto &p : segs)
+    ret.emplace_back(move(p.second));
+  return ret;
+}
+
+void
+txn_logger::AdvanceCheckpointTid(uint64_t tid)
+{
+  uint64_t cur = g_checkpoint_tid.load(memory_order_acquire);
+  while (cur < tid &&
+         !g_checkpoint_tid.compare_exchange_weak(cur, tid, memory_order_acq_rel))
+    ;
+  g_segments_cv.notify_all();
+}
+
+int
+txn_logger::create_segment(const segment_ctx &ctx, unsigned id, unsigned segno)
+{
+  const string fname = SegmentName(ctx.logfile_, segno);
+  int flags = O_CREAT|O_WRONLY|O_TRUNC;
+  if (g_direct_io)
+    flags |= O_DIRECT | (g_call_fsync ? O_DSYNC : 0);
+  const int fd = open(fname.c_str(), flags, 0664);
+  if (fd == -1) {
+    perror("open");
+    ALWAYS_ASSERT(false);
+  }
+  // preallocating (and zeroing) the segment up front means appends to it
+  // don't need to allocate blocks or update the file size, so fdatasync()
+  // has no metadata to flush. not all file systems support this, which is
+  // fine
+  if (!g_fake_writes && fallocate(fd, 0, 0, g_segment_size) == -1 &&
+      errno != EOPNOTSUPP) {
+    perror("fallocate");
+    ALWAYS_ASSERT(false);
+  }
+  // O_DIRECT needs an aligned buffer, and the header padded out to a block
+  const size_t hdrsz = segment_header_size();
+  void *hdrbuf;
+  ALWAYS_ASSERT(!posix_memalign(&hdrbuf, g_direct_io_align, hdrsz));
+  NDB_MEMSET(hdrbuf, 0, hdrsz);
+  log_segment_header &hdr = *reinterpret_cast<log_segment_header *>(hdrbuf);
+  hdr.magic_ = g_log_segment_magic;
+  hdr.version_ = g_log_format_version;
+  hdr.flags_ = ctx.flags_;
+  hdr.logger_id_ = id;
+  hdr.checksum_ = ComputeChecksum(hdr);
+  if (fileutils::writeall(fd, (const char *) hdrbuf, hdrsz) == -1) {
+    perror("write");
+    ALWAYS_ASSERT(false);
+  }
+  free(hdrbuf);
+  if (fdatasync(fd) == -1) {
+    perror("fdatasync");
+    ALWAYS_ASSERT(false);
+  }
+  // make the new directory entry durable, so a recovery never misses a
+  // segment which was written to
+  string dir, base;
+  split_path(fname, dir, base);
+  const int dfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (dfd == -1 || fsync(dfd) == -1) {
+    perror("fsync");
+    ALWAYS_ASSERT(false);
+  }
+  close(dfd);
+  return fd;
+}
+
+void
+txn_logger::maybe_rotate_segment(unsigned id, segment &seg)
+{
+  if (seg.nbytes_ < g_segment_size)
+    return;
+  segment_ctx &ctx = g_segment_ctxs[id];
+  {
+    std::lock_guard<std::mutex> l(g_segments_lock);
+    if (ctx.next_fd_ == -1) {
+      // the segment manager is behind, so keep growing this segment
+      ++g_evt_logger_segment_not_ready;
+      return;
+    }
+    ctx.retired_.push_back(seg);
+    seg.segno_++;
+    seg.fd_ = ctx.next_fd_;
+    seg.nbytes_ = segment_header_size();
+    seg.max_tid_ = 0;
+    ctx.next_fd_ = -1;
+  }
+  g_segments_cv.notify_all();
+  ++g_evt_logger_segment_rotations;
+}
+
+void
+txn_logger::segment_manager(size_t nloggers)
+{
+  vector<segment> retired;
+  for (;;) {
+    vector<unsigned> need_next;
+    {
+      std::unique_lock<std::mutex> l(g_segments_lock);
+      g_segments_cv.wait_for(l, chrono::microseconds(ticker::tick_us()));
+      for (size_t i = 0; i < nloggers; i++) {
+        segment_ctx &ctx = g_segment_ctxs[i];
+        for (auto &seg : ctx.retired_)
+          ctx.closed_.push_back(seg);
+        retired.insert(retired.end(), ctx.retired_.begin(), ctx.retired_.end());
+        ctx.retired_.clear();
+        if (ctx.next_fd_ == -1)
+          need_next.push_back(i);
+      }
+    }
+
+    // trim the preallocated space a retired segment did not use. its
+    // contents were already synced by the writer
+    for (auto &seg : retired) {
+      if (ftruncate(seg.fd_, seg.nbytes_) == -1) {
+        perror("ftruncate");
+        ALWAYS_ASSERT(false);
+      }
+      close(seg.fd_);
+    }
+    retired.clear();
+
+    for (auto i : need_next) {
+      segment_ctx &ctx = g_segment_ctxs[i];
+      timer t;
+      const int fd = create_segment(ctx, i, ctx.next_segno_++);
+      g_evt_avg_logger_segment_prepare_ms.offer(t.lap_ms());
+      std::lock_guard<std::mutex> l(g_segments_lock);
+      ctx.next_fd_ = fd;
+    }
+
+    const uint64_t checkpoint_tid = g_checkpoint_tid.load(memory_order_acquire);
+    for (size_t i = 0; i < nloggers; i++) {
+      segment_ctx &ctx = g_segment_ctxs[i];
+      auto it = ctx.closed_.begin();
+      for (; it != ctx.closed_.end() && it->max_tid_ <= checkpoint_tid; ++it) {
+        const string fname = SegmentName(ctx.logfile_, it->segno_);
+        if (unlink(fname.c_str()) == -1) {
+          perror("unlink");
+          ALWAYS_ASSERT(false);
+        }
+        ++g_evt_logger_segments_removed;
+      }
+      ctx.closed_.erase(ctx.closed_.begin(), it);
+    }
+  }
+}
+
 void
-txn_logger::persister(
-    vector<vector<unsigned>> assignments)
+txn_logger::persister()
 {
   timer loop_timer;
+  uint64_t last_trim_us = timer::cur_usec();
+  uint64_t last_rebalance_us = last_trim_us;
+  vector<uint64_t> last_nbytes(g_nworkers, 0);
+  uint64_t last_epoch = ticker::s_instance.global_current_tick();
   for (;;) {
     const uint64_t last_loop_usec = loop_timer.lap();
-    const uint64_t delay_time_usec = ticker::tick_us;
+    const uint64_t delay_time_usec = ticker::tick_us();
     if (last_loop_usec < delay_time_usec) {
       const uint64_t sleep_ns = (delay_time_usec - last_loop_usec) * 1000;
       struct timespec t;
@@ -140,13 +722,206 @@ txn_logger::persister(
       t.tv_nsec = sleep_ns % ONE_SECOND_NS;
       nanosleep(&t, nullptr);
     }
-    advance_system_sync_epoch(assignments);
+    advance_system_sync_epoch();
+    fire_durable_callbacks(system_sync_epoch_->load(memory_order_acquire));
+    const uint64_t now_us = timer::cur_usec();
+    if (now_us - last_trim_us >= g_buffer_pool_trim_ms * 1000) {
+      trim_buffer_pools();
+      last_trim_us = now_us;
+    }
+    if (g_rebalance &&
+        now_us - last_rebalance_us >= g_rebalance_interval_ms * 1000) {
+      rebalance(last_nbytes, last_epoch);
+      last_rebalance_us = now_us;
+    }
   }
 }
 
 void
-txn_logger::advance_system_sync_epoch(
-    const vector<vector<unsigned>> &assignments)
+txn_logger::owned_workers(unsigned id, vector<unsigned> &workers)
+{
+  workers.clear();
+  for (size_t w = 0; w < g_nworkers; w++)
+    if (g_owners[w].load(memory_order_acquire) == int(id))
+      workers.push_back(w);
+}
+
+void
+txn_logger::rebalance(vector<uint64_t> &last_nbytes, uint64_t &last_epoch)
+{
+  // one migration at a time, and the rates are only measured once it is
+  // done, so they see the effect of the last move
+  for (size_t w = 0; w < g_nworkers; w++)
+    if (g_migrations[w].load(memory_order_acquire) != -1)
+      return;
+  const uint64_t epoch = ticker::s_instance.global_current_tick();
+  vector<uint64_t> nbytes(g_nworkers, 0);
+  for (size_t k = 0; k < NMAXCORES; k++)
+    nbytes[k % g_nworkers] +=
+      g_persist_stats[k].nbytes_logged_.load(memory_order_acquire);
+  const uint64_t nepochs = epoch - last_epoch;
+  vector<uint64_t> rates(g_nworkers, 0);
+  for (size_t w = 0; nepochs && w < g_nworkers; w++)
+    rates[w] = (nbytes[w] - last_nbytes[w]) / nepochs;
+  last_nbytes.swap(nbytes);
+  last_epoch = epoch;
+  if (!nepochs)
+    return;
+
+  unsigned worker, to;
+  if (!PickMigration(CurrentAssignments(), rates,
+        vector<int>(&g_logger_nodes[0], &g_logger_nodes[g_nloggers]),
+        worker, to))
+    return;
+  g_migrations[worker].store(to, memory_order_release);
+}
+
+void
+txn_logger::pin_logger_thread(unsigned id)
+{
+  const int node = g_logger_nodes[id];
+  if (node < 0)
+    return;
+  ALWAYS_ASSERT(!numa_run_on_node(node));
+  // is numa_run_on_node() guaranteed to take effect immediately?
+  ALWAYS_ASSERT(!sched_yield());
+}
+
+char *
+txn_logger::alloc_on_node(size_t nbytes, int node)
+{
+  void * const p = numa_alloc_onnode(nbytes, node);
+  ALWAYS_ASSERT(p);
+  return (char *) p;
+}
+
+static_assert(sizeof(atomic<uint32_t>) == sizeof(int), "bad futex word");
+
+static inline void
+futex_wait(atomic<uint32_t> &word, uint32_t expected)
+{
+  // EAGAIN (word != expected) and EINTR are both fine, as callers recheck
+  syscall(SYS_futex, &word, FUTEX_WAIT_PRIVATE, expected,
+          nullptr, nullptr, 0);
+}
+
+static inline void
+futex_wake_all(atomic<uint32_t> &word)
+{
+  syscall(SYS_futex, &word, FUTEX_WAKE_PRIVATE, INT_MAX,
+          nullptr, nullptr, 0);
+}
+
+void
+txn_logger::wait_for_persist_space(persist_ctx &ctx)
+{
+  const uint64_t start_us = timer::cur_usec();
+  bool full = true;
+  for (size_t i = 0; i < g_backpressure_spin_iters && full; i++) {
+    nop_pause();
+    full = ctx.persist_buffers_.full();
+  }
+  if (full) {
+    ++g_evt_log_backpressure_parks;
+    for (;;) {
+      // release_buffers() bumps nreleased_ before checking parked_, so
+      // either it sees parked_ and wakes us, or we see the new nreleased_
+      // (and the futex wait returns right away)
+      ctx.parked_.store(true, memory_order_seq_cst);
+      const uint32_t v = ctx.nreleased_.load(memory_order_seq_cst);
+      if (!ctx.persist_buffers_.full())
+        break;
+      futex_wait(ctx.nreleased_, v);
+    }
+    ctx.parked_.store(false, memory_order_release);
+  }
+  const uint64_t stall_us = timer::cur_usec() - start_us;
+  g_persist_stats[ctx.core_id_].stall_us_.add(stall_us);
+  ++g_evt_log_backpressure_stalls;
+  g_evt_avg_log_backpressure_stall_us.offer(stall_us);
+}
+
+// offset of a pooled pbuffer into its allocation
+static inline size_t
+pooled_buffer_offset(bool direct_io)
+{
+  return direct_io ?
+    txn_logger::g_direct_io_align - sizeof(txn_logger::pbuffer) : 0;
+}
+
+txn_logger::pbuffer *
+txn_logger::borrow_buffer(persist_ctx &ctx)
+{
+  buffer_pool &pool = *ctx.pool_;
+  pbuffer *px = nullptr;
+  {
+    std::lock_guard<spinlock> l(pool.lock_);
+    if (!pool.free_.empty()) {
+      px = pool.free_.back();
+      pool.free_.pop_back();
+      pool.low_water_ = min(pool.low_water_, pool.free_.size());
+    } else {
+      pool.nallocated_++;
+    }
+  }
+  if (!px) {
+    char *mem;
+    if (pool.node_ >= 0) {
+      mem = alloc_on_node(buffer_stride(), pool.node_);
+    } else {
+      void *p;
+      ALWAYS_ASSERT(!posix_memalign(&p, g_direct_io_align, buffer_stride()));
+      mem = (char *) p;
+    }
+    px = new (mem + pooled_buffer_offset(g_direct_io))
+      pbuffer(ctx.core_id_, g_buffer_size, true);
+    ++g_evt_log_buffer_pool_allocs;
+  }
+  INVARIANT(px->pooled_);
+  INVARIANT(!px->header()->nentries_);
+  px->core_id_ = ctx.core_id_;
+  ++g_evt_log_buffer_pool_borrows;
+  return px;
+}
+
+void
+txn_logger::return_buffer(pbuffer *px)
+{
+  INVARIANT(px->pooled_);
+  buffer_pool &pool = *persist_ctx_for(px->core_id_, INITMODE_NONE).pool_;
+  std::lock_guard<spinlock> l(pool.lock_);
+  pool.free_.push_back(px);
+}
+
+void
+txn_logger::trim_buffer_pools()
+{
+  vector<pbuffer *> unused;
+  for (size_t i = 0; i < g_nbuffer_pools; i++) {
+    buffer_pool &pool = g_buffer_pools[i];
+    {
+      // the first low_water_ buffers of free_ have not been touched since
+      // the last trim
+      std::lock_guard<spinlock> l(pool.lock_);
+      const size_t n = min(pool.low_water_, pool.free_.size());
+      unused.assign(pool.free_.begin(), pool.free_.begin() + n);
+      pool.free_.erase(pool.free_.begin(), pool.free_.begin() + n);
+      pool.nallocated_ -= n;
+      pool.low_water_ = pool.free_.size();
+    }
+    for (auto px : unused) {
+      char * const mem = (char *) px - pooled_buffer_offset(g_direct_io);
+      if (pool.node_ >= 0)
+        numa_free(mem, buffer_stride());
+      else
+        free(mem);
+    }
+    g_evt_log_buffer_pool_frees += unused.size();
+  }
+}
+
+void
+txn_logger::advance_system_sync_epoch()
 {
   uint64_t min_so_far = numeric_limits<uint64_t>::max();
   const uint64_t best_tick_ex =
@@ -155,43 +930,69 @@ txn_logger::advance_system_sync_epoch(
   const uint64_t best_tick_inc =
     best_tick_ex ? (best_tick_ex - 1) : 0;
 
-  for (size_t i = 0; i < assignments.size(); i++)
-    for (auto j : assignments[i])
-      for (size_t k = j; k < NMAXCORES; k += g_nworkers) {
-        persist_ctx &ctx = persist_ctx_for(k, INITMODE_NONE);
-        // we need to arbitrarily advance threads which are not "doing
-        // anything", so they don't drag down the persistence of the system. if
-        // we can see that a thread is NOT in a guarded section AND its
-        // core->logger queue is empty, then that means we can advance its sync
-        // epoch up to best_tick_inc, b/c it is guaranteed that the next time
-        // it does any actions will be in epoch > best_tick_inc
-        if (!ctx.persist_buffers_.peek()) {
-          spinlock &l = ticker::s_instance.lock_for(k);
-          if (!l.is_locked()) {
-            bool did_lock = false;
-            for (size_t c = 0; c < 3; c++) {
-              if (l.try_lock()) {
-                did_lock = true;
-                break;
-              }
-            }
-            if (did_lock) {
-              if (!ctx.persist_buffers_.peek()) {
-                min_so_far = min(min_so_far, best_tick_inc);
-                per_thread_sync_epochs_[i].epochs_[k].store(
-                    best_tick_inc, memory_order_release);
-                l.unlock();
-                continue;
-              }
+  for (size_t k = 0; k < NMAXCORES; k++) {
+    // the persister may race with a handover, but any logger is fine
+    // to note that an idle core has nothing left to log
+    const unsigned i = g_owners[k % g_nworkers].load(memory_order_acquire);
+    persist_ctx &ctx = persist_ctx_for(k, INITMODE_NONE);
+    // we need to arbitrarily advance threads which are not "doing
+    // anything", so they don't drag down the persistence of the system. if
+    // we can see that a thread is NOT in a guarded section AND its
+    // core->logger queue is empty, then that means we can advance its sync
+    // epoch up to best_tick_inc, b/c it is guaranteed that the next time
+    // it does any actions will be in epoch > best_tick_inc
+    if (!ctx.persist_buffers_.peek()) {
+      spinlock &l = ticker::s_instance.lock_for(k);
+      if (!l.is_locked()) {
+        bool did_lock = false;
+        for (size_t c = 0; c < 3; c++) {
+          if (l.try_lock()) {
+            did_lock = true;
+            break;
+          }
+        }
+        if (did_lock) {
+          if (!ctx.persist_buffers_.peek()) {
+            // the core's current buffer is only pushed at an epoch
+            // boundary or once it is full, so an idle core can still
+            // be sitting on txns which were never logged. push them on
+            // its behalf (the core cannot touch its buffers while we
+            // hold its lock), and advance it once they are written
+            pbuffer * const px = ctx.all_buffers_.peek();
+            const bool has_pending =
+              (px && px->header()->nentries_) ||
+              (IsWorkerCompression() && ctx.horizon_ &&
+               ctx.horizon_->header()->nentries_);
+            if (!has_pending) {
+              min_so_far = min(min_so_far, best_tick_inc);
+              per_thread_sync_epochs_[i].epochs_[k].store(
+                  best_tick_inc, memory_order_release);
               l.unlock();
+              continue;
+            }
+            // XXX: a pending horizon is left for the core to compress
+            // and push, so it holds back the system until the core
+            // runs again
+            if (px && px->header()->nentries_) {
+              pbuffer * const px0 = ctx.all_buffers_.deq();
+              INVARIANT(px == px0);
+              non_atomic_fetch_add(
+                  g_persist_stats[k].ntxns_pushed_,
+                  px0->header()->nentries_);
+              ctx.persist_buffers_.enq(px0);
+              ++g_evt_logger_idle_buffer_pushes;
             }
           }
+          l.unlock();
         }
-        min_so_far = min(
-            per_thread_sync_epochs_[i].epochs_[k].load(
-              memory_order_acquire),
-            min_so_far);
       }
+    }
+    uint64_t e = 0;
+    for (size_t j = 0; j < g_nloggers; j++)
+      e = max(e, per_thread_sync_epochs_[j].epochs_[k].load(
+            memory_order_acquire));
+    min_so_far = min(e, min_so_far);
+  }
 
   const uint64_t syssync =
     system_sync_epoch_->load(memory_order_acquire);
@@ -212,6 +1013,7 @@ txn_logger::advance_system_sync_epoch(
         non_atomic_fetch_add(
             ps.latency_numer_,
             (now_us - start_us) * ntxns_in_epoch);
+        ps.durable_latency_us_.add(now_us - start_us, ntxns_in_epoch);
         pes.ntxns_.store(0, memory_order_release);
         pes.earliest_start_us_.store(0, memory_order_release);
     }
@@ -221,23 +1023,93 @@ txn_logger::advance_system_sync_epoch(
 }
 
 void
-txn_logger::writer(
-    unsigned id, int fd,
-    vector<unsigned> assignment)
+txn_logger::ship(unsigned id, int &ship_fd, struct iovec *iovs, size_t niovs)
 {
-
-  if (g_pin_loggers_to_numa_nodes) {
-    ALWAYS_ASSERT(!numa_run_on_node(id % numa_num_configured_nodes()));
-    ALWAYS_ASSERT(!sched_yield());
+  INVARIANT(ship_fd != -1);
+  struct msghdr msg;
+  NDB_MEMSET(&msg, 0, sizeof(msg));
+  msg.msg_iov = iovs;
+  msg.msg_iovlen = niovs;
+  while (msg.msg_iovlen) {
+    // a vanished follower must not take the primary down with SIGPIPE
+    const ssize_t ret = sendmsg(ship_fd, &msg, MSG_NOSIGNAL);
+    if (unlikely(ret == -1)) {
+      if (errno == EINTR)
+        continue;
+      perror("sendmsg");
+      cerr << "[WARNING] logger " << id
+           << " lost its follower, and stops shipping" << endl;
+      close(ship_fd);
+      ship_fd = -1;
+      return;
+    }
+    evt_log_bytes_shipped.inc(ret);
+    // skip past what was sent
+    size_t n = ret;
+    while (msg.msg_iovlen && n >= msg.msg_iov->iov_len) {
+      n -= msg.msg_iov->iov_len;
+      msg.msg_iov++;
+      msg.msg_iovlen--;
+    }
+    if (n) {
+      msg.msg_iov->iov_base = (uint8_t *) msg.msg_iov->iov_base + n;
+      msg.msg_iov->iov_len -= n;
+    }
   }
+}
+
+void
+txn_logger::writer(unsigned id, int fd, int ship_fd)
+{
+
+  pin_logger_thread(id);
 
+  vector<unsigned> assignment;
+  uint64_t assignment_gen = g_assignment_gen.load(memory_order_acquire);
+  owned_workers(id, assignment);
+
+  // the last iovec is reserved for the durable epoch marker
   vector<iovec> iovs(
-      min(size_t(IOV_MAX), g_nworkers * g_perthread_buffers));
+      min(size_t(IOV_MAX), g_nworkers * g_perthread_buffers + 1));
+  const size_t max_nbufs = iovs.size() - 1;
   vector<pbuffer *> pxs;
   timer loop_timer;
 
-  // XXX: sense is not useful for now, unless we want to
-  // fsync in the background...
+  // batches[sense] holds the buffers of the batch being built, and
+  // batches[!sense] those of the batch (if any) whose sync is in flight
+  vector<pbuffer *> batches[2];
+  sync_ctx * const sctx = g_pipeline_writes ? &g_sync_ctxs[id] : nullptr;
+
+  // jobs[i] compresses the i-th buffer of the batch. the compressed copies
+  // are only needed until the batch is written, so their output buffers
+  // are reused by the next batch
+  compress_pool * const pool =
+    g_compress_nthreads ? &g_compress_pools[id] : nullptr;
+  vector<compress_job> jobs(pool ? max_nbufs : 0);
+
+  // with O_DIRECT, the marker is written as a whole (aligned) block
+  const size_t markersz =
+    g_direct_io ? g_direct_io_align : sizeof(logbuf_header);
+  void *markerbuf;
+  ALWAYS_ASSERT(!posix_memalign(&markerbuf, g_direct_io_align, markersz));
+  NDB_MEMSET(markerbuf, 0, markersz);
+  logbuf_header &marker = *reinterpret_cast<logbuf_header *>(markerbuf);
+
+  // the largest epoch of a marker shipped so far. the markers shipped
+  // while idle are kept apart from the one which is written to disk
+  uint64_t shipped_epoch = 0;
+  void *idle_markerbuf = nullptr;
+  if (ship_fd != -1) {
+    ALWAYS_ASSERT(!posix_memalign(&idle_markerbuf, g_direct_io_align, markersz));
+    NDB_MEMSET(idle_markerbuf, 0, markersz);
+  }
+
+  segment seg;
+  seg.segno_ = 0;
+  seg.fd_ = fd;
+  seg.nbytes_ = segment_header_size();
+  seg.max_tid_ = 0;
+
   bool sense = false; // cur is at sense, prev is at !sense
   uint64_t epoch_prefixes[2][NMAXCORES];
 
@@ -250,10 +1122,10 @@ txn_logger::writer(
   for (;;) {
 
     const uint64_t last_loop_usec = loop_timer.lap();
-    const uint64_t delay_time_usec = ticker::tick_us;
+    const uint64_t delay_time_usec = ticker::tick_us();
     // don't allow this loop to proceed less than an epoch's worth of time,
     // so we can batch IO
-    if (last_loop_usec < delay_time_usec && nbufswritten < iovs.size()) {
+    if (last_loop_usec < delay_time_usec && nbufswritten < max_nbufs) {
       const uint64_t sleep_ns = (delay_time_usec - last_loop_usec) * 1000;
       struct timespec t;
       t.tv_sec  = sleep_ns / ONE_SECOND_NS;
@@ -261,6 +1133,37 @@ txn_logger::writer(
       nanosleep(&t, nullptr);
     }
 
+    if (g_rebalance) {
+      // hand over the workers the persister moved away from us. everything
+      // we picked up of them must be synced and released first, so the new
+      // logger starts at the head of their queues, and our entries in
+      // per_thread_sync_epochs_ for them stay true
+      bool drained = false;
+      for (auto w : assignment) {
+        const int to = g_migrations[w].load(memory_order_acquire);
+        if (to == -1)
+          continue;
+        if (!drained && g_pipeline_writes && !batches[!sense].empty()) {
+          {
+            std::unique_lock<std::mutex> l(sctx->lock_);
+            sctx->cv_.wait(l, [sctx]() { return !sctx->pending_; });
+          }
+          release_buffers(id, batches[!sense]);
+        }
+        drained = true;
+        g_owners[w].store(to, memory_order_release);
+        g_migrations[w].store(-1, memory_order_release);
+        ++g_evt_logger_worker_migrations;
+      }
+      if (drained)
+        g_assignment_gen.fetch_add(1, memory_order_acq_rel);
+      const uint64_t gen = g_assignment_gen.load(memory_order_acquire);
+      if (gen != assignment_gen) {
+        assignment_gen = gen;
+        owned_workers(id, assignment);
+      }
+    }
+
     // we need g_persist_stats[cur_sync_epoch_ex % g_nmax_loggers]
     // to remain untouched (until the syncer can catch up), so we
     // cannot read any buffers with epoch >=
@@ -275,11 +1178,15 @@ txn_logger::writer(
         ctx.persist_buffers_.peekall(pxs);
         for (auto px : pxs) {
           INVARIANT(px);
-          INVARIANT(!px->io_scheduled_);
-          INVARIANT(nbufswritten <= iovs.size());
+          if (px->io_scheduled_) {
+            // still waiting on the sync of the previous batch
+            INVARIANT(g_pipeline_writes);
+            continue;
+          }
+          INVARIANT(nbufswritten <= max_nbufs);
           INVARIANT(px->header()->nentries_);
           INVARIANT(px->core_id_ == k);
-          if (nbufswritten == iovs.size()) {
+          if (nbufswritten == max_nbufs) {
             ++g_evt_logger_writev_limit_met;
             goto process;
           }
@@ -288,7 +1195,29 @@ txn_logger::writer(
             ++g_evt_logger_max_lag_wait;
             break;
           }
-          iovs[nbufswritten].iov_base = (void *) &px->buf_start_[0];
+          seg.max_tid_ = max(seg.max_tid_, px->header()->last_tid_);
+          if (pool) {
+            // the iovec is filled in once the job is done
+            compress_job &job = jobs[nbufswritten];
+            if (unlikely(!job.out_)) {
+              void *out;
+              ALWAYS_ASSERT(!posix_memalign(
+                    &out, g_direct_io_align, compress_outbuf_size()));
+              job.out_ = (uint8_t *) out;
+            }
+            job.px_ = px;
+            job.queued_us_ = timer::cur_usec();
+            {
+              std::lock_guard<std::mutex> l(pool->lock_);
+              pool->q_.push_back(&job);
+              pool->npending_++;
+            }
+            pool->cv_.notify_one();
+          } else {
+            px->header()->nbytes_ = px->datasize();
+            px->header()->checksum_ =
+              ComputeChecksum(*px->header(), px->datastart());
+            iovs[nbufswritten].iov_base = (void *) &px->buf_start_[0];
 
 #ifdef LOGGER_UNSAFE_REDUCE_BUFFER_SIZE
   #define PXLEN(px) (((px)->curoff_ < 4) ? (px)->curoff_ : ((px)->curoff_ / 4))
@@ -296,13 +1225,18 @@ txn_logger::writer(
   #define PXLEN(px) ((px)->curoff_)
 #endif
 
-          const size_t pxlen = PXLEN(px);
+            const size_t pxlen = g_direct_io ?
+              iceil(PXLEN(px), g_direct_io_align) : PXLEN(px);
 
-          iovs[nbufswritten].iov_len = pxlen;
-          evt_avg_log_buffer_iov_len.offer(pxlen);
+            iovs[nbufswritten].iov_len = pxlen;
+            evt_avg_log_buffer_iov_len.offer(pxlen);
+            nbyteswritten += pxlen;
+          }
           px->io_scheduled_ = true;
+          batches[sense].push_back(px);
           nbufswritten++;
-          nbyteswritten += pxlen;
+          non_atomic_fetch_add(
+              g_persist_stats[k].nbytes_logged_, uint64_t(px->curoff_));
 
 #ifdef CHECK_INVARIANTS
           auto last_tid_cid = transaction_proto2_static::CoreId(px->header()->last_tid_);
@@ -334,25 +1268,70 @@ txn_logger::writer(
 
   process:
     if (!nbufswritten) {
+      // every buffer of ours with epoch <= cur_sync_epoch_ex - 1 was
+      // shipped before it could become durable, so the follower may
+      // apply that far
+      if (ship_fd != -1 && cur_sync_epoch_ex - 1 > shipped_epoch) {
+        logbuf_header &m = *reinterpret_cast<logbuf_header *>(idle_markerbuf);
+        m.last_tid_ = shipped_epoch = cur_sync_epoch_ex - 1;
+        m.checksum_ = ComputeChecksum(m, nullptr);
+        struct iovec iov;
+        iov.iov_base = idle_markerbuf;
+        iov.iov_len = markersz;
+        ship(id, ship_fd, &iov, 1);
+      }
+      if (g_pipeline_writes && !batches[!sense].empty()) {
+        std::unique_lock<std::mutex> l(sctx->lock_, std::try_to_lock);
+        if (l.owns_lock() && !sctx->pending_) {
+          l.unlock();
+          release_buffers(id, batches[!sense]);
+        }
+      }
       // XXX: should probably sleep here
       nop_pause();
       continue;
     }
 
+    if (pool) {
+      {
+        std::unique_lock<std::mutex> l(pool->lock_);
+        pool->done_cv_.wait(l, [pool]() { return !pool->npending_; });
+      }
+      for (size_t i = 0; i < nbufswritten; i++) {
+        iovs[i].iov_base = jobs[i].out_;
+        iovs[i].iov_len = jobs[i].outlen_;
+        evt_avg_log_buffer_iov_len.offer(jobs[i].outlen_);
+        nbyteswritten += jobs[i].outlen_;
+      }
+    }
+
     const bool dosense = sense;
 
+    // everything <= cur_sync_epoch_ex - 1 was already durable before any of
+    // these buffers were picked up, so it is safe to tell recovery
+    size_t niovs = nbufswritten;
+    if (cur_sync_epoch_ex - 1 > marker.last_tid_) {
+      marker.last_tid_ = cur_sync_epoch_ex - 1;
+      marker.checksum_ = ComputeChecksum(marker, nullptr);
+      iovs[niovs].iov_base = markerbuf;
+      iovs[niovs].iov_len = markersz;
+      niovs++;
+      nbyteswritten += markersz;
+    }
+
     if (!g_fake_writes) {
 #ifdef ENABLE_EVENT_COUNTERS
       timer write_timer;
 #endif
-      const ssize_t ret = writev(fd, &iovs[0], nbufswritten);
+      const ssize_t ret = writev(seg.fd_, &iovs[0], niovs);
       if (unlikely(ret == -1)) {
         perror("writev");
         ALWAYS_ASSERT(false);
       }
 
-      if (g_call_fsync) {
-        const int fret = fdatasync(fd);
+      // with O_DIRECT, the segment was opened O_DSYNC
+      if (g_call_fsync && !g_pipeline_writes && !g_direct_io) {
+        const int fret = fdatasync(seg.fd_);
         if (unlikely(fret == -1)) {
           perror("fdatasync");
           ALWAYS_ASSERT(false);
@@ -367,41 +1346,56 @@ txn_logger::writer(
         g_evt_avg_logger_bytes_per_sec.offer(bytes_per_sec);
       }
 #endif
+
+      seg.nbytes_ += nbyteswritten;
     }
 
-    // update metadata from previous write
-    //
-    // return all buffers that have been io_scheduled_ - we can do this as
-    // soon as write returns. we take care to return to the proper buffer
-    epoch_array &ea = per_thread_sync_epochs_[id];
-    for (auto idx: assignment) {
-      for (size_t k = idx; k < NMAXCORES; k += g_nworkers) {
-        const uint64_t x0 = ea.epochs_[k].load(memory_order_acquire);
-        const uint64_t x1 = epoch_prefixes[dosense][k];
-        if (x1 > x0)
-          ea.epochs_[k].store(x1, memory_order_release);
+    // ship the batch before it can be published as durable (by us, or by
+    // our syncer), so the follower gets a stream's buffers of an epoch
+    // before any marker covering that epoch
+    if (ship_fd != -1) {
+      if (niovs > nbufswritten)
+        shipped_epoch = max(shipped_epoch, marker.last_tid_);
+      ship(id, ship_fd, &iovs[0], niovs);
+    }
 
-        persist_ctx &ctx = persist_ctx_for(k, INITMODE_NONE);
-        pbuffer *px, *px0;
-        while ((px = ctx.persist_buffers_.peek()) && px->io_scheduled_) {
-#ifdef LOGGER_STRIDE_OVER_BUFFER
-          {
-            const size_t pxlen = PXLEN(px);
-            const size_t stridelen = 1;
-            for (size_t p = 0; p < pxlen; p += stridelen)
-              if ((&px->buf_start_[0])[p] & 0xF)
-                non_atomic_fetch_add(ea.dummy_work_, 1UL);
-          }
-#endif
-          px0 = ctx.persist_buffers_.deq();
-          INVARIANT(px == px0);
-          INVARIANT(px->header()->nentries_);
-          px0->reset();
-          INVARIANT(ctx.init_);
-          INVARIANT(px0->core_id_ == k);
-          ctx.all_buffers_.enq(px0);
+    if (g_pipeline_writes) {
+      // wait for the previous batch to be synced before handing this one
+      // off. the wait is normally short, since it overlapped with building
+      // and writing this batch
+      {
+        std::unique_lock<std::mutex> l(sctx->lock_);
+        if (sctx->pending_) {
+          ++g_evt_logger_pipeline_stalls;
+          sctx->cv_.wait(l, [sctx]() { return !sctx->pending_; });
         }
+        sctx->pending_ = true;
+        sctx->fd_ = seg.fd_;
+        sctx->epoch_prefixes_ = &epoch_prefixes[dosense][0];
       }
+      sctx->cv_.notify_all();
+      release_buffers(id, batches[!dosense]);
+
+      if (seg.nbytes_ >= g_segment_size) {
+        // a segment is only retired once everything written to it is
+        // synced
+        {
+          std::unique_lock<std::mutex> l(sctx->lock_);
+          sctx->cv_.wait(l, [sctx]() { return !sctx->pending_; });
+        }
+        release_buffers(id, batches[dosense]);
+        maybe_rotate_segment(id, seg);
+      }
+    } else {
+      if (!g_fake_writes)
+        maybe_rotate_segment(id, seg);
+
+      // update metadata from previous write
+      //
+      // return all buffers that have been io_scheduled_ - we can do this as
+      // soon as write returns
+      publish_sync_epochs(id, &epoch_prefixes[dosense][0]);
+      release_buffers(id, batches[dosense]);
     }
 
     // bump the sense
@@ -409,6 +1403,185 @@ txn_logger::writer(
   }
 }
 
+void
+txn_logger::syncer(unsigned id)
+{
+  pin_logger_thread(id);
+
+  sync_ctx &sctx = g_sync_ctxs[id];
+  for (;;) {
+    int fd;
+    const uint64_t *epoch_prefixes;
+    {
+      std::unique_lock<std::mutex> l(sctx.lock_);
+      sctx.cv_.wait(l, [&sctx]() { return sctx.pending_; });
+      fd = sctx.fd_;
+      epoch_prefixes = sctx.epoch_prefixes_;
+    }
+
+    timer sync_timer;
+    const int fret = fdatasync(fd);
+    if (unlikely(fret == -1)) {
+      perror("fdatasync");
+      ALWAYS_ASSERT(false);
+    }
+    g_evt_avg_logger_sync_ms.offer(sync_timer.lap_ms());
+
+    // the batch is durable: let the persister see it right away, without
+    // waiting for the writer to come around
+    publish_sync_epochs(id, epoch_prefixes);
+
+    {
+      std::lock_guard<std::mutex> l(sctx.lock_);
+      sctx.pending_ = false;
+    }
+    sctx.cv_.notify_all();
+  }
+}
+
+void
+txn_logger::compressor(unsigned id)
+{
+  pin_logger_thread(id);
+
+  // allocated once pinned, so it is local to the logger's node
+  void *state;
+  ALWAYS_ASSERT(!posix_memalign(&state, CACHELINE_SIZE, compress_state_size()));
+
+  compress_pool &pool = g_compress_pools[id];
+  for (;;) {
+    compress_job *job;
+    {
+      std::unique_lock<std::mutex> l(pool.lock_);
+      pool.cv_.wait(l, [&pool]() { return !pool.q_.empty(); });
+      job = pool.q_.front();
+      pool.q_.pop_front();
+    }
+    g_evt_avg_log_buffer_compress_queue_us.offer(
+        timer::cur_usec() - job->queued_us_);
+
+    compress_buffer(*job, state);
+
+    bool last;
+    {
+      std::lock_guard<std::mutex> l(pool.lock_);
+      last = !--pool.npending_;
+    }
+    if (last)
+      pool.done_cv_.notify_all();
+  }
+}
+
+size_t
+txn_logger::compress_outbuf_size()
+{
+  const size_t sz = sizeof(logbuf_header) + sizeof(uint32_t) +
+    LZ4_compressBound(g_buffer_size - sizeof(logbuf_header));
+  return g_direct_io ? iceil(sz, g_direct_io_align) : sz;
+}
+
+size_t
+txn_logger::compress_state_size()
+{
+  return g_compress_level ? LZ4_sizeofStateHC() : LZ4_create_size();
+}
+
+void
+txn_logger::compress_buffer(compress_job &job, void *state)
+{
+  const pbuffer * const px = job.px_;
+  logbuf_header &hdr = *reinterpret_cast<logbuf_header *>(job.out_);
+  uint8_t * const data = job.out_ + sizeof(hdr);
+  const size_t maxlen =
+    compress_outbuf_size() - sizeof(hdr) - sizeof(uint32_t);
+  const size_t rawlen = px->datasize();
+  INVARIANT(rawlen);
+  INVARIANT(LZ4_compressBound(rawlen) <= int(maxlen));
+
+#ifdef ENABLE_EVENT_COUNTERS
+  timer tt;
+#endif
+  const char * const src =
+    (const char *) &px->buf_start_[0] + sizeof(logbuf_header);
+  char * const dst = (char *) data + sizeof(uint32_t);
+  const int ret = g_compress_level ?
+    LZ4_compressHC2_limitedOutput_withStateHC(
+        state, src, dst, rawlen, maxlen, g_compress_level) :
+    LZ4_compress_heap_limitedOutput(state, src, dst, rawlen, maxlen);
+  ALWAYS_ASSERT(ret > 0);
+#ifdef ENABLE_EVENT_COUNTERS
+  g_evt_avg_log_buffer_compress_time_us.offer(tt.lap());
+  g_evt_log_buffer_bytes_before_compress.inc(rawlen);
+  g_evt_log_buffer_bytes_after_compress.inc(ret);
+  g_evt_avg_log_buffer_compress_ratio_pct.offer(ret * 100 / rawlen);
+#endif
+
+  serializer<uint32_t, false> s_uint32_t;
+  s_uint32_t.write(data, ret);
+  hdr.nentries_ = px->header()->nentries_;
+  hdr.last_tid_ = px->header()->last_tid_;
+  hdr.nbytes_ = sizeof(uint32_t) + ret;
+  hdr.checksum_ = ComputeChecksum(hdr, data);
+
+  job.outlen_ = sizeof(hdr) + hdr.nbytes_;
+  if (g_direct_io) {
+    const size_t padded = iceil(job.outlen_, g_direct_io_align);
+    NDB_MEMSET(job.out_ + job.outlen_, 0, padded - job.outlen_);
+    job.outlen_ = padded;
+  }
+}
+
+void
+txn_logger::publish_sync_epochs(
+    unsigned id,
+    const uint64_t *epoch_prefixes)
+{
+  epoch_array &ea = per_thread_sync_epochs_[id];
+  for (size_t k = 0; k < NMAXCORES; k++) {
+    const uint64_t x0 = ea.epochs_[k].load(memory_order_acquire);
+    const uint64_t x1 = epoch_prefixes[k];
+    if (x1 > x0)
+      ea.epochs_[k].store(x1, memory_order_release);
+  }
+}
+
+void
+txn_logger::release_buffers(unsigned id, vector<pbuffer *> &pxs)
+{
+  // we take care to return to the proper buffer. pxs is in queue order for
+  // each core, so each buffer is at the head of its core's queue by the
+  // time we get to it
+#ifdef LOGGER_STRIDE_OVER_BUFFER
+  epoch_array &ea = per_thread_sync_epochs_[id];
+#endif
+  for (auto px : pxs) {
+    persist_ctx &ctx = persist_ctx_for(px->core_id_, INITMODE_NONE);
+#ifdef LOGGER_STRIDE_OVER_BUFFER
+    {
+      const size_t pxlen = PXLEN(px);
+      const size_t stridelen = 1;
+      for (size_t p = 0; p < pxlen; p += stridelen)
+        if ((&px->buf_start_[0])[p] & 0xF)
+          non_atomic_fetch_add(ea.dummy_work_, 1UL);
+    }
+#endif
+    pbuffer * const px0 = ctx.persist_buffers_.deq();
+    INVARIANT(px == px0);
+    INVARIANT(px0->io_scheduled_);
+    INVARIANT(px0->header()->nentries_);
+    px0->reset();
+    INVARIANT(ctx.init_);
+    if (px0->pooled_)
+      return_buffer(px0);
+    else
+      ctx.all_buffers_.enq(px0);
+    ctx.nreleased_.fetch_add(1, memory_order_seq_cst);
+    if (unlikely(ctx.parked_.load(memory_order_seq_cst)))
+      futex_wake_all(ctx.nreleased_);
+  }
+  pxs.clear();
+}
+
 tuple<uint64_t, uint64_t, double>
 txn_logger::compute_ntxns_persisted_statistics()
 {
@@ -436,6 +1609,8 @@ txn_logger::clear_ntxns_persisted_statistics()
     ps.ntxns_pushed_.store(0, memory_order_release);
     ps.ntxns_committed_.store(0, memory_order_release);
     ps.latency_numer_.store(0, memory_order_release);
+    ps.stall_us_.clear();
+    ps.durable_latency_us_.clear();
     for (size_t e = 0; e < g_max_lag_epochs; e++) {
       auto &pes = ps.d_[e];
       pes.ntxns_.store(0, memory_order_release);
@@ -444,6 +1619,18 @@ txn_logger::clear_ntxns_persisted_statistics()
   }
 }
 
+map<string, log_linear_histogram>
+txn_logger::compute_persist_histograms()
+{
+  log_linear_histogram durable_latency_us, stall_us;
+  for (size_t i = 0; i < g_persist_stats.size(); i++) {
+    durable_latency_us += g_persist_stats[i].durable_latency_us_;
+    stall_us += g_persist_stats[i].stall_us_;
+  }
+  return {{"durable_latency_us", durable_latency_us},
+          {"log_stall_us", stall_us}};
+}
+
 void
 txn_logger::wait_for_idle_state()
 {
@@ -469,6 +1656,50 @@ txn_logger::wait_until_current_point_persisted()
   while (system_sync_epoch_->load(memory_order_acquire) < e)
     nop_pause();
 }
+
+void
+txn_logger::wait_until_epoch_persisted(uint64_t e)
+{
+  while (system_sync_epoch_->load(memory_order_acquire) < e)
+    nop_pause();
+}
+
+void
+txn_logger::on_durable(const durability_token &tok, function<void()> fn)
+{
+  if (!IsPersistenceEnabled()) {
+    fn();
+    return;
+  }
+  durable_callbacks &cbs = g_durable_callbacks.my();
+  std::lock_guard<spinlock> l(cbs.lock_);
+  cbs.q_.emplace_back(tok.epoch_, move(fn));
+  cbs.size_.store(cbs.q_.size(), memory_order_release);
+}
+
+void
+txn_logger::fire_durable_callbacks(uint64_t sync_epoch)
+{
+  vector<function<void()>> ready;
+  for (size_t i = 0; i < g_durable_callbacks.size(); i++) {
+    durable_callbacks &cbs = g_durable_callbacks[i];
+    if (!cbs.size_.load(memory_order_acquire))
+      continue;
+    {
+      // run the callbacks outside of the lock, so they can register more
+      std::lock_guard<spinlock> l(cbs.lock_);
+      while (!cbs.q_.empty() && cbs.q_.front().first <= sync_epoch) {
+        ready.emplace_back(move(cbs.q_.front().second));
+        cbs.q_.pop_front();
+      }
+      cbs.size_.store(cbs.q_.size(), memory_order_release);
+    }
+    for (auto &fn : ready)
+      fn();
+    g_evt_durable_callbacks += ready.size();
+    ready.clear();
+  }
+}
 /*}}}*/
 
                 /** garbage collection subsystem **/
@@ -487,7 +1718,7 @@ transaction_proto2_static::InitGC()
 static void
 sleep_ro_epoch()
 {
-  const uint64_t sleep_ns = transaction_proto2_static::ReadOnlyEpochUsec * 1000;
+  const uint64_t sleep_ns = transaction_proto2_static::ReadOnlyEpochUsec() * 1000;
   struct timespec t;
   t.tv_sec  = sleep_ns / ONE_SECOND_NS;
   t.tv_nsec = sleep_ns % ONE_SECOND_NS;
@@ -506,10 +1737,15 @@ transaction_proto2_static::PurgeThreadOutstandingGCTasks()
   uint64_t e;
   if (!ctx.queue_.get_latest_epoch(e))
     return;
-  // wait until we can clean up e
+  // wait until we can clean up e. as in on_post_rcu_region_completion(),
+  // the global last tick is one ahead of what is safe to clean up
   for (;;) {
     const uint64_t last_tick_ex = ticker::s_instance.global_last_tick_exclusive();
-    const uint64_t ro_tick_ex = to_read_only_tick(last_tick_ex);
+    if (unlikely(!last_tick_ex)) {
+      sleep_ro_epoch();
+      continue;
+    }
+    const uint64_t ro_tick_ex = to_read_only_tick(last_tick_ex - 1);
     if (unlikely(!ro_tick_ex)) {
       sleep_ro_epoch();
       continue;
@@ -636,7 +1872,7 @@ transaction_proto2_static::clean_up_to_including(threadctx &ctx, uint64_t ro_tic
         ctx.queue_.enqueue(
             delete_entry(
               nullptr,
-              MakeTid(CoreMask, NumIdMask >> NumIdShift, (my_ro_tick + 1) * ReadOnlyEpochMultiplier - 1),
+              MakeTid(CoreMask, NumIdMask >> NumIdShift, (my_ro_tick + 1) * ReadOnlyEpochMultiplier() - 1),
               delent.tuple(),
               marked_ptr<string>(),
               nullptr),
@@ -5,6 +5,11 @@
 #include <atomic>
 #include <vector>
 #include <set>
+#include <deque>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
 
 #include <lz4.h>
 
@@ -13,6 +18,7 @@
 #include "txn_btree.h"
 #include "macros.h"
 #include "circbuf.h"
+#include "histogram.h"
 #include "spinbarrier.h"
 #include "record/serializer.h"
 
@@ -34,10 +40,17 @@ public:
 
   static const size_t g_nmax_loggers = 16;
   static const size_t g_perthread_buffers = 256; // 256 outstanding buffers
+  static const size_t g_perthread_reserved_buffers = 4; // see buffer_pool
+  static const uint64_t g_buffer_pool_trim_ms = 1000;
+  static const uint64_t g_rebalance_interval_ms = 1000; // see PickMigration()
+  static const unsigned g_rebalance_threshold_pct = 20;
+  static const size_t g_rebalance_min_epoch_bytes = (1<<16);
+  static const size_t g_backpressure_spin_iters = 1 << 12; // before sleeping
   static const size_t g_buffer_size = (1<<20); // in bytes
   static const size_t g_horizon_buffer_size = 2 * (1<<16); // in bytes
   static const size_t g_max_lag_epochs = 128; // cannot lag more than 128 epochs
-  static const bool   g_pin_loggers_to_numa_nodes = false;
+  static const size_t g_default_segment_size = (1<<30); // in bytes
+  static const size_t g_direct_io_align = 4096; // in bytes, for O_DIRECT
 
   static inline bool
   IsPersistenceEnabled()
@@ -55,6 +68,49 @@ public:
   //
   // should only be called ONCE is not thread-safe.  if assignments_used is not
   // null, then fills it with a copy of the assignment actually computed
+  //
+  // each logfile names a sequence of segments (see SegmentName()). a logger
+  // moves on to its next segment once the current one holds at least
+  // segment_size bytes. any segments left over from a previous run are
+  // removed
+  //
+  // if pipeline_writes is set (and call_fsync is set), each logger overlaps
+  // the fdatasync() of one batch of buffers with gathering and writing the
+  // next batch
+  //
+  // if direct_io is set, segments are written with O_DIRECT (and O_DSYNC
+  // instead of fdatasync(), if call_fsync is set), bypassing the page
+  // cache. this pads every log buffer to g_direct_io_align bytes. it
+  // supersedes pipeline_writes, since each write is synchronous
+  //
+  // if use_compression is set, log buffers are LZ4 compressed. by default
+  // each core compresses its own txns as it commits them. if
+  // compress_nthreads > 0, cores instead hand their raw buffers to a pool of
+  // compress_nthreads threads per logger (running next to the logger), which
+  // compress them before they are written. the pool compresses with LZ4 if
+  // compress_level is 0, and otherwise with LZ4HC, which tries up to
+  // 2^(compress_level-1) matches per position (compress_level <= 16)
+  //
+  // if numa_aware is set (and libnuma is usable), core i is taken to run on
+  // CPU i (as the benchmarks pin them), each logger is pinned to a NUMA
+  // node, and the log buffers of each core are placed on the node of the
+  // logger which writes them out. if no assignments are given, they are
+  // computed with NumaAssignments(), so that a core is served by a logger
+  // on its own node
+  //
+  // if ship_sockfile is not empty, each logger also ships everything it
+  // writes to a follower listening on the UNIX domain socket ship_sockfile
+  // (see txn_log_follower), over a connection of its own. a logger ships
+  // each batch right after writing it, so a follower which cannot keep up
+  // slows down the logger (and so the cores it serves). a logger whose
+  // follower goes away carries on without it
+  //
+  // if rebalance is set, the assignment is only where the loggers start
+  // out: the persister measures how many bytes of log each worker writes
+  // per epoch, and every g_rebalance_interval_ms moves one worker off of
+  // the logger with the most bandwidth (see PickMigration()). a worker
+  // only moves between loggers on the same NUMA node, so its buffers stay
+  // local to the logger writing them
   static void Init(
       size_t nworkers,
       const std::vector<std::string> &logfiles,
@@ -62,23 +118,146 @@ public:
       std::vector<std::vector<unsigned>> *assignments_used = nullptr,
       bool call_fsync = true,
       bool use_compression = false,
-      bool fake_writes = false);
+      bool fake_writes = false,
+      size_t segment_size = g_default_segment_size,
+      bool pipeline_writes = false,
+      bool direct_io = false,
+      size_t compress_nthreads = 0,
+      int compress_level = 0,
+      bool numa_aware = false,
+      const std::string &ship_sockfile = "",
+      bool rebalance = false);
+
+  // assigns workers to nloggers loggers, where worker i runs on NUMA node
+  // worker_nodes[i]. each node with workers gets its own loggers (as long
+  // as there are enough of them, in proportion to its # of workers), and
+  // its workers are split evenly over them. sets logger_nodes[i] to the
+  // node logger i should run on.
+  //
+  // if there are more loggers than workers, some loggers are left without
+  // an assignment
+  static std::vector<std::vector<unsigned>>
+  NumaAssignments(size_t nloggers,
+                  const std::vector<int> &worker_nodes,
+                  std::vector<int> &logger_nodes);
+
+  // given the bytes of log each worker wrote per epoch lately, picks a
+  // worker to move from the busiest logger to the idlest logger on the
+  // same node (logger i runs on node logger_nodes[i]). a move is only
+  // worth it if the busier of the two writes at least
+  // g_rebalance_min_epoch_bytes per epoch, and more than
+  // g_rebalance_threshold_pct% more than the other. the worker picked
+  // leaves the two as even as possible, and is never so busy that the
+  // two would just trade places, so repeated moves cannot go back and
+  // forth. returns false if no move is worth it
+  static bool
+  PickMigration(const std::vector<std::vector<unsigned>> &assignments,
+                const std::vector<uint64_t> &worker_epoch_bytes,
+                const std::vector<int> &logger_nodes,
+                unsigned &worker, unsigned &to);
+
+  // the assignment the loggers are working with right now, which only
+  // differs from the one Init() started with if it was asked to rebalance
+  static std::vector<std::vector<unsigned>>
+  CurrentAssignments();
+
+  // the NUMA node logger id is pinned to, or -1 if it is not pinned
+  static inline int
+  LoggerNode(unsigned id)
+  {
+    INVARIANT(id < g_nmax_loggers);
+    return g_logger_nodes[id];
+  }
+
+  // the file holding segment segno of logfile
+  static std::string
+  SegmentName(const std::string &logfile, unsigned segno);
+
+  // the segments of logfile which exist on disk, in order
+  static std::vector<std::string>
+  ListSegments(const std::string &logfile);
+
+  // tells the logging subsystem that all txns with TID <= tid are covered
+  // by a checkpoint, so segments holding only such txns can be removed
+  static void
+  AdvanceCheckpointTid(uint64_t tid);
+
+  // on disk format:
+  //
+  // each log segment starts with a log_segment_header, followed by a
+  // sequence of log buffers. the segment being written to is preallocated,
+  // so it is followed by zeros. if FLAGS_DIRECT_IO is set, the segment
+  // header and each log buffer are followed by zeros up to the next
+  // multiple of g_direct_io_align bytes. a log buffer is a logbuf_header followed by
+  // nbytes_ bytes of txns (or if compressed, by a sequence of [uint32
+  // length, LZ4 block] chunks which each decompress into at most
+  // g_buffer_size bytes of txns). a txn is
+  //   [uint64 commit TID | varint nwrites | write * nwrites]
+  // and a write is
+  //   [varint table id | varint klen | key | varint vlen | value delta]
+  //
+  // a log buffer with nentries_ == 0 is a durable epoch marker: all txns
+  // (from all loggers) with epoch <= last_tid_ were durable when the marker
+  // was written. markers never carry data
+
+  static const uint32_t g_log_segment_magic = 0x4f4c4953; // "SILO"
+  static const uint16_t g_log_format_version = 1;
+
+  struct log_segment_header {
+    enum {
+      FLAGS_COMPRESSED = 0x1,
+      FLAGS_DIRECT_IO = 0x2,
+    };
+    uint32_t magic_;
+    uint16_t version_;
+    uint16_t flags_;
+    uint32_t logger_id_;
+    uint32_t checksum_; // XXH32 of the fields above
+  } PACKED;
 
   struct logbuf_header {
-    uint64_t nentries_; // > 0 for all valid log buffers
-    uint64_t last_tid_; // TID of the last commit
+    uint64_t nentries_; // > 0 for all valid log buffers, 0 for epoch markers
+    uint64_t last_tid_; // TID of the last commit (epoch for epoch markers)
+    uint32_t nbytes_;   // # of bytes following the header (set by the logger)
+    uint32_t checksum_; // XXH32 of the fields above + the following bytes
+  } PACKED;
+
+  // a log stream shipped to a follower starts with a log_stream_header,
+  // followed by the log buffers (and markers) which the logger writes to
+  // its segments, padded the same way. while it has nothing to write, the
+  // logger also ships markers which never make it to disk, so the follower
+  // learns of every epoch which becomes durable
+  struct log_stream_header {
+    log_segment_header seg_; // logger_id_ is the id of the stream
+    uint32_t nstreams_;      // # of streams shipped to the follower
   } PACKED;
 
+  // connects to the follower listening on sockfile (retrying for a while,
+  // in case it is just starting up), and sends it the header of stream id
+  // of nstreams. returns the connected fd
+  static int
+  ConnectFollower(const std::string &sockfile,
+                  unsigned id, unsigned nstreams, uint16_t flags);
+
+  static uint32_t
+  ComputeChecksum(const log_segment_header &hdr);
+
+  static uint32_t
+  ComputeChecksum(const logbuf_header &hdr, const uint8_t *data);
+
   struct pbuffer {
     uint64_t earliest_start_us_; // start time of the earliest txn
     bool io_scheduled_; // has the logger scheduled IO yet?
 
     unsigned curoff_; // current offset into buf_ for writing
 
-    const unsigned core_id_; // which core does this pbuffer belong to?
+    unsigned core_id_; // which core does this pbuffer belong to? (changes
+                       // each time a buffer_pool lends it out)
 
     const unsigned buf_sz_;
 
+    const bool pooled_; // belongs to a buffer_pool, rather than to core_id_
+
     // must be last field
     uint8_t buf_start_[0];
 
@@ -89,8 +268,8 @@ public:
     //
     // NOTE: it is not necessary to call the destructor for pbuffer, since
     // it only contains PODs
-    pbuffer(unsigned core_id, unsigned buf_sz)
-      : core_id_(core_id), buf_sz_(buf_sz)
+    pbuffer(unsigned core_id, unsigned buf_sz, bool pooled = false)
+      : core_id_(core_id), buf_sz_(buf_sz), pooled_(pooled)
     {
       INVARIANT(((char *)this) + sizeof(*this) == (char *) &buf_start_[0]);
       INVARIANT(buf_sz > sizeof(logbuf_header));
@@ -188,6 +367,14 @@ public:
   static void
   clear_ntxns_persisted_statistics();
 
+  // merged over all cores, by name:
+  //   durable_latency_us: see persist_stats::durable_latency_us_
+  //   log_stall_us: see persist_stats::stall_us_
+  //
+  // Init() also registers each of these with the histogram_registry
+  static std::map<std::string, log_linear_histogram>
+  compute_persist_histograms();
+
   // wait until the logging system appears to be idle.
   //
   // note that this isn't a guarantee, just a best effort attempt
@@ -198,6 +385,39 @@ public:
   static void
   wait_until_current_point_persisted();
 
+  // waits until all txns with epoch <= e are persisted
+  static void
+  wait_until_epoch_persisted(uint64_t e);
+
+  // names the epoch a committed txn depends on (see
+  // transaction_proto2::get_durability_token()): once that epoch is
+  // persisted, so is the txn, and everything it read
+  struct durability_token {
+    uint64_t epoch_;
+
+    durability_token() : epoch_(0) {}
+    explicit durability_token(uint64_t epoch) : epoch_(epoch) {}
+
+    inline bool
+    is_durable() const
+    {
+      return epoch_ <= system_sync_epoch_->load(std::memory_order_acquire);
+    }
+
+    inline void
+    wait() const
+    {
+      wait_until_epoch_persisted(epoch_);
+    }
+  };
+
+  // invokes fn once tok is durable (right away, if persistence is
+  // disabled). callbacks registered from the same core run in the order
+  // they were registered, in batches on the persister thread, so fn should
+  // be short and must not block
+  static void
+  on_durable(const durability_token &tok, std::function<void()> fn);
+
 private:
 
   // data structures
@@ -209,6 +429,23 @@ private:
     CACHE_PADOUT;
   };
 
+  // log buffers. each core reserves g_perthread_reserved_buffers buffers
+  // of its own, which cycle between it and its logger. once all of them
+  // are in flight, the core borrows more from the buffer_pool of its NUMA
+  // node (see Init()), and the logger returns borrowed buffers to the pool
+  // once they are written. the persister frees buffers which sat unused in
+  // a pool for g_buffer_pool_trim_ms, so the memory for log buffers tracks
+  // the rate at which the log is written, rather than the # of cores
+
+  struct buffer_pool {
+    spinlock lock_;
+    std::vector<pbuffer *> free_; // most recently returned last
+    size_t nallocated_; // free or lent out
+    size_t low_water_;  // min free_.size() since the last trim
+    int node_;          // NUMA node to allocate on, or -1 for the default
+    buffer_pool() : nallocated_(0), low_water_(0), node_(-1) {}
+  };
+
   struct persist_ctx {
     bool init_;
 
@@ -218,7 +455,19 @@ private:
     circbuf<pbuffer, g_perthread_buffers> all_buffers_;     // logger pushes to core
     circbuf<pbuffer, g_perthread_buffers> persist_buffers_; // core pushes to logger
 
-    persist_ctx() : init_(false), lz4ctx_(nullptr), horizon_(nullptr) {}
+    int node_; // NUMA node to place the buffers on, or -1 for the default
+
+    unsigned core_id_;
+    buffer_pool *pool_; // where to borrow buffers from
+
+    // futex word, bumped by the logger each time it takes a buffer off of
+    // persist_buffers_ (see wait_for_persist_space())
+    std::atomic<uint32_t> nreleased_;
+    std::atomic<bool> parked_; // the core is (about to be) asleep on nreleased_
+
+    persist_ctx()
+      : init_(false), lz4ctx_(nullptr), horizon_(nullptr), node_(-1),
+        core_id_(0), pool_(nullptr), nreleased_(0), parked_(false) {}
   };
 
   // context per one epoch
@@ -236,6 +485,23 @@ private:
     // us) for *persisted* txns (is conservative)
     std::atomic<uint64_t> latency_numer_;
 
+    // bytes of this core's log buffers written so far (before any
+    // compression by the logger). written only by the logger serving the
+    // core
+    std::atomic<uint64_t> nbytes_logged_;
+
+    // how long each commit which found persist_buffers_ full waited for the
+    // logger, in us (so count() is the # of txns delayed by logging).
+    // written only by the core itself
+    log_linear_histogram stall_us_;
+
+    // latency from commit to durability of the persisted txns, in us. fed
+    // one epoch at a time by advance_system_sync_epoch(), which charges
+    // every txn in an epoch with the latency of its earliest one (so, as
+    // with latency_numer_, this is conservative). written only by the
+    // persister
+    log_linear_histogram durable_latency_us_;
+
     // per last g_max_lag_epochs information
     struct per_epoch_stats {
       std::atomic<uint64_t> ntxns_;
@@ -246,22 +512,222 @@ private:
 
     persist_stats() :
       ntxns_persisted_(0), ntxns_pushed_(0),
-      ntxns_committed_(0), latency_numer_(0) {}
+      ntxns_committed_(0), latency_numer_(0), nbytes_logged_(0) {}
   };
 
   // helpers
 
+  // whether or not cores compress their own txns (see Init())
+  static inline bool
+  IsWorkerCompression()
+  {
+    return g_use_compression && !g_compress_nthreads;
+  }
+
+  // pins the calling thread (which works for logger id) to the logger's
+  // NUMA node, if it has one
+  static void
+  pin_logger_thread(unsigned id);
+
+  // hands px over to the logger of ctx's core. if the logger has fallen
+  // so far behind that persist_buffers_ is full, the core waits for it in
+  // wait_for_persist_space(). only called by the core itself (or with its
+  // ticker lock held)
+  static inline void
+  push_buffer(persist_ctx &ctx, pbuffer *px)
+  {
+    if (unlikely(ctx.persist_buffers_.full()))
+      wait_for_persist_space(ctx);
+    ctx.persist_buffers_.enq(px);
+  }
+
+  // spins for g_backpressure_spin_iters, then sleeps until the logger
+  // releases a buffer of ctx, so that a stalled core does not take CPU
+  // away from the logger it waits on
+  static void
+  wait_for_persist_space(persist_ctx &ctx);
+
+  // allocates nbytes on NUMA node node, to be freed with numa_free()
+  static char *
+  alloc_on_node(size_t nbytes, int node);
+
+  // # of bytes each pbuffer (with its data) takes up. with O_DIRECT, the
+  // data of each buffer must start on a block boundary, so each pbuffer
+  // header sits at the end of the block preceding its data
+  static inline size_t
+  buffer_stride()
+  {
+    return g_direct_io ?
+      g_buffer_size + g_direct_io_align :
+      sizeof(pbuffer) + g_buffer_size;
+  }
+
+  // lends a buffer from ctx's pool to ctx's core, allocating one if the
+  // pool is empty
+  static pbuffer *
+  borrow_buffer(persist_ctx &ctx);
+
+  // gives a (reset) borrowed buffer back to its pool
+  static void
+  return_buffer(pbuffer *px);
+
+  // frees the buffers which were not borrowed since the last trim
+  static void
+  trim_buffer_pools();
+
   static void
-  advance_system_sync_epoch(
-      const std::vector<std::vector<unsigned>> &assignments);
+  advance_system_sync_epoch();
 
-  // makes copy on purpose
-  static void writer(
-      unsigned id, int fd,
-      std::vector<unsigned> assignment);
+  // ship_fd is the connection to the follower, or -1 if not shipping
+  static void writer(unsigned id, int fd, int ship_fd);
 
-  static void persister(
-      std::vector<std::vector<unsigned>> assignments);
+  // sends all of iovs (which it consumes) down ship_fd. if the follower is
+  // gone, closes ship_fd and sets it to -1
+  static void
+  ship(unsigned id, int &ship_fd, struct iovec *iovs, size_t niovs);
+
+  // segment lifecycle. writers only ever switch to a segment which was
+  // already prepared (created, preallocated, and given its header), and
+  // hand the segment they leave to the segment manager, which closes it and
+  // eventually removes it once a checkpoint covers it. so the only segment
+  // work a writer does itself is swapping fds
+
+  struct segment {
+    unsigned segno_;
+    int fd_;
+    size_t nbytes_;   // bytes written, including the segment header
+    uint64_t max_tid_; // largest TID of any txn in the segment
+  };
+
+  struct segment_ctx {
+    std::string logfile_;
+    uint16_t flags_; // for the log_segment_header
+
+    // owned by the segment manager
+    unsigned next_segno_;
+    std::vector<segment> closed_;
+
+    // protected by g_segments_lock
+    int next_fd_; // -1 if the next segment is not ready yet
+    std::vector<segment> retired_;
+
+    segment_ctx() : flags_(0), next_segno_(0), next_fd_(-1) {}
+  };
+
+  // creates segment segno of ctx, and returns an fd positioned right past
+  // its header
+  static int
+  create_segment(const segment_ctx &ctx, unsigned id, unsigned segno);
+
+  // # of bytes the segment header takes up on disk
+  static inline size_t
+  segment_header_size()
+  {
+    return g_direct_io ? g_direct_io_align : sizeof(log_segment_header);
+  }
+
+  // called by writer id after its fd was synced. if seg is full and the
+  // next segment is ready, retires seg and starts a new one in its place
+  static void
+  maybe_rotate_segment(unsigned id, segment &seg);
+
+  static void segment_manager(size_t nloggers);
+
+  // write pipelining. a writer hands each batch it wrote to its syncer,
+  // which fdatasync()s the segment and then publishes the batch's epoch
+  // prefixes. at most one batch per logger is in flight, so the writer
+  // alternates between two sets of epoch prefixes (the sense). the
+  // buffers of a batch stay at the head of their persist_buffers_ until
+  // the writer sees the batch synced and returns them to their cores
+
+  struct sync_ctx {
+    std::mutex lock_;
+    std::condition_variable cv_;
+    bool pending_; // a batch was handed off, but is not synced yet
+    int fd_;
+    const uint64_t *epoch_prefixes_;
+    sync_ctx() : pending_(false), fd_(-1), epoch_prefixes_(nullptr) {}
+  };
+
+  static void syncer(unsigned id);
+
+  // logger id has persisted everything up through epoch_prefixes[k] for
+  // each core k. a core's entry may be stale if the core has since moved
+  // to another logger, which is fine, since it is still true
+  static void
+  publish_sync_epochs(
+      unsigned id,
+      const uint64_t *epoch_prefixes);
+
+  // the workers g_owners says logger id serves
+  static void
+  owned_workers(unsigned id, std::vector<unsigned> &workers);
+
+  // measures how many bytes of log each worker wrote per epoch since the
+  // last call, and asks for a migration if PickMigration() finds one.
+  // called by the persister, which keeps last_nbytes and last_epoch
+  static void
+  rebalance(std::vector<uint64_t> &last_nbytes, uint64_t &last_epoch);
+
+  // returns the buffers of a written (and if necessary, synced) batch to
+  // their cores, and clears pxs
+  static void
+  release_buffers(unsigned id, std::vector<pbuffer *> &pxs);
+
+  static void persister();
+
+  // logger-side compression. as the writer of logger id picks up raw
+  // buffers, it queues a job for each one on its compression pool, and
+  // before writing the batch it waits for all of them to finish. each job
+  // compresses the txns of one buffer into a single chunk, so the buffers
+  // of a core keep their order, and the raw buffer is released as usual
+  // once the compressed copy is written
+
+  struct compress_job {
+    pbuffer *px_;    // the raw buffer
+    uint8_t *out_;   // logbuf_header + one [uint32 length, LZ4 block] chunk
+    size_t outlen_;  // # of bytes of out_ to write, set by the pool
+    uint64_t queued_us_;
+    compress_job() : px_(nullptr), out_(nullptr), outlen_(0), queued_us_(0) {}
+  };
+
+  struct compress_pool {
+    std::mutex lock_;
+    std::condition_variable cv_;      // a job was queued
+    std::condition_variable done_cv_; // the last pending job finished
+    std::deque<compress_job *> q_;
+    size_t npending_; // queued or running
+    compress_pool() : npending_(0) {}
+  };
+
+  static void compressor(unsigned id);
+
+  // # of bytes a compress_job's output buffer needs
+  static size_t
+  compress_outbuf_size();
+
+  // # of bytes of scratch space each compression thread needs
+  static size_t
+  compress_state_size();
+
+  // compresses the txns of job.px_ into job.out_, using state as scratch
+  // space
+  static void
+  compress_buffer(compress_job &job, void *state);
+
+  // callbacks waiting for durability, registered from one core (see
+  // on_durable())
+  struct durable_callbacks {
+    spinlock lock_;
+    std::atomic<size_t> size_; // so the persister can skip empty queues
+    std::deque<std::pair<uint64_t, std::function<void()>>> q_;
+    durable_callbacks() : size_(0) {}
+  };
+
+  // runs the callbacks whose tokens are durable once system_sync_epoch_ is
+  // sync_epoch
+  static void
+  fire_durable_callbacks(uint64_t sync_epoch);
 
   enum InitMode {
     INITMODE_NONE, // no initialization
@@ -275,24 +741,34 @@ private:
     INVARIANT(core_id < g_persist_ctxs.size());
     persist_ctx &ctx = g_persist_ctxs[core_id];
     if (unlikely(!ctx.init_ && imode != INITMODE_NONE)) {
-      size_t needed = g_perthread_buffers * (sizeof(pbuffer) + g_buffer_size);
-      if (IsCompressionEnabled())
+      const size_t bufstride = buffer_stride();
+      size_t needed = g_perthread_reserved_buffers * bufstride;
+      if (g_direct_io)
+        needed += g_direct_io_align;
+      if (IsWorkerCompression())
         needed += size_t(LZ4_create_size()) +
           sizeof(pbuffer) + g_horizon_buffer_size;
       char *mem =
+        (ctx.node_ >= 0) ?
+          alloc_on_node(needed, ctx.node_) :
         (imode == INITMODE_REG) ?
           (char *) malloc(needed) :
           (char *) rcu::s_instance.alloc_static(needed);
-      if (IsCompressionEnabled()) {
+      if (IsWorkerCompression()) {
         ctx.lz4ctx_ = mem;
         mem += LZ4_create_size();
         ctx.horizon_ = new (mem) pbuffer(core_id, g_horizon_buffer_size);
         mem += sizeof(pbuffer) + g_horizon_buffer_size;
       }
-      for (size_t i = 0; i < g_perthread_buffers; i++) {
+      if (g_direct_io)
+        mem = (char *) util::iceil(
+            uintptr_t(mem + sizeof(pbuffer)), g_direct_io_align) -
+          sizeof(pbuffer);
+      for (size_t i = 0; i < g_perthread_reserved_buffers; i++) {
         ctx.all_buffers_.enq(new (mem) pbuffer(core_id, g_buffer_size));
-        mem += sizeof(pbuffer) + g_buffer_size;
+        mem += bufstride;
       }
+      ctx.core_id_ = core_id;
       ctx.init_ = true;
     }
     return ctx;
@@ -307,17 +783,45 @@ private:
 
   static bool g_use_compression; // whether or not to compress log buffers
 
+  static size_t g_compress_nthreads; // compression threads per logger, or 0
+                                     // if cores compress their own buffers
+
+  static int g_compress_level; // 0 for LZ4, > 0 for LZ4HC at that level
+
   static bool g_fake_writes; // whether or not to fake doing writes (to measure
                              // pure overhead of disk)
 
+  static bool g_pipeline_writes; // whether or not to overlap fdatasync() with
+                                 // writing the next batch
+
+  static bool g_direct_io; // whether or not segments are written with O_DIRECT
+
+  static int g_logger_nodes[g_nmax_loggers]; // see LoggerNode()
+
   static size_t g_nworkers; // assignments are computed based on g_nworkers
                             // but a logger responsible for core i is really
                             // responsible for cores i + k * g_nworkers, for k
                             // >= 0
 
+  static size_t g_nloggers;
+
+  static bool g_rebalance; // see Init()
+
+  // g_owners[w] is the logger serving worker w right now. if
+  // g_migrations[w] is not -1, the persister asked for w to move to that
+  // logger, and the owner hands w over (see writer()) once all of w's
+  // buffers it picked up are synced. g_assignment_gen is bumped after each
+  // handover, so the loggers know to look for workers which are new to
+  // them
+  static std::atomic<int> g_owners[NMAXCORES];
+  static std::atomic<int> g_migrations[NMAXCORES];
+  static std::atomic<uint64_t> g_assignment_gen;
+
   // v = per_thread_sync_epochs_[i].epochs_[j]: logger i has persisted up
-  // through (including) all transactions <= epoch v on core j. since core =>
-  // logger mapping is static, taking:
+  // through (including) all transactions <= epoch v on core j. a logger
+  // only hands a core over once everything it picked up of the core is
+  // synced, so every entry is true no matter which logger serves the core
+  // now, and taking:
   //   min_{core} max_{logger} per_thread_sync_epochs_[logger].epochs_[core]
   // yields the entire system's persistent epoch
   static epoch_array
@@ -332,6 +836,32 @@ private:
 
   static percore<persist_stats> g_persist_stats CACHE_ALIGNED;
 
+  static percore<durable_callbacks> g_durable_callbacks CACHE_ALIGNED;
+
+  static size_t g_segment_size;
+
+  static segment_ctx g_segment_ctxs[g_nmax_loggers];
+
+  static std::mutex g_segments_lock;
+
+  static std::condition_variable g_segments_cv;
+
+  // see AdvanceCheckpointTid()
+  static std::atomic<uint64_t> g_checkpoint_tid;
+
+  // g_nmax_loggers entries if g_pipeline_writes. never freed, since the
+  // syncers block on them until the process exits
+  static sync_ctx *g_sync_ctxs;
+
+  // g_nmax_loggers entries if g_compress_nthreads > 0. never freed, for the
+  // same reason
+  static compress_pool *g_compress_pools;
+
+  // g_nbuffer_pools entries: the default pool, followed by one pool per
+  // NUMA node if Init() was numa_aware
+  static buffer_pool *g_buffer_pools;
+  static size_t g_nbuffer_pools;
+
   // counters
 
   static event_counter g_evt_log_buffer_epoch_boundary;
@@ -340,17 +870,35 @@ private:
   static event_counter g_evt_log_buffer_bytes_after_compress;
   static event_counter g_evt_logger_writev_limit_met;
   static event_counter g_evt_logger_max_lag_wait;
+  static event_counter g_evt_logger_segment_rotations;
+  static event_counter g_evt_logger_segment_not_ready;
+  static event_counter g_evt_logger_segments_removed;
+  static event_counter g_evt_logger_pipeline_stalls;
+  static event_counter g_evt_durable_callbacks;
+  static event_counter g_evt_logger_idle_buffer_pushes;
+  static event_counter g_evt_log_buffer_pool_borrows;
+  static event_counter g_evt_log_buffer_pool_allocs;
+  static event_counter g_evt_log_buffer_pool_frees;
+  static event_counter g_evt_log_backpressure_stalls;
+  static event_counter g_evt_log_backpressure_parks;
+  static event_counter g_evt_logger_worker_migrations;
   static event_avg_counter g_evt_avg_log_entry_ntxns;
   static event_avg_counter g_evt_avg_log_buffer_compress_time_us;
+  static event_avg_counter g_evt_avg_log_buffer_compress_ratio_pct;
+  static event_avg_counter g_evt_avg_log_buffer_compress_queue_us;
   static event_avg_counter g_evt_avg_logger_bytes_per_writev;
   static event_avg_counter g_evt_avg_logger_bytes_per_sec;
+  static event_avg_counter g_evt_avg_logger_segment_prepare_ms;
+  static event_avg_counter g_evt_avg_logger_sync_ms;
+  static event_avg_counter g_evt_avg_log_backpressure_stall_us;
 };
 
 static inline std::ostream &
 operator<<(std::ostream &o, txn_logger::logbuf_header &hdr)
 {
   o << "{nentries_=" << hdr.nentries_ << ", last_tid_="
-    << g_proto_version_str(hdr.last_tid_) << "}";
+    << g_proto_version_str(hdr.last_tid_) << ", nbytes_="
+    << hdr.nbytes_ << ", checksum_=" << hdr.checksum_ << "}";
   return o;
 }
 
@@ -365,21 +913,39 @@ public:
   // subsystem's tick
 
 #ifdef CHECK_INVARIANTS
-  static const uint64_t ReadOnlyEpochMultiplier = 10; /* 10 * 1 ms */
+  static const uint64_t DefaultReadOnlyEpochMultiplier = 10; /* 10 * 1 ms */
 #else
-  static const uint64_t ReadOnlyEpochMultiplier = 25; /* 25 * 40 ms */
-  static_assert(ticker::tick_us * ReadOnlyEpochMultiplier == 1000000, "");
+  static const uint64_t DefaultReadOnlyEpochMultiplier = 25; /* 25 * 40 ms */
 #endif
 
-  static_assert(ReadOnlyEpochMultiplier >= 1, "XX");
+  static_assert(DefaultReadOnlyEpochMultiplier >= 1, "XX");
+
+  static inline ALWAYS_INLINE uint64_t
+  ReadOnlyEpochMultiplier()
+  {
+    return g_flags->g_read_only_epoch_multiplier.load(std::memory_order_relaxed);
+  }
+
+  // the number of ticks per read only (snapshot) epoch. unlike the tick
+  // length, this cannot change once txns have run, since it would move
+  // existing TIDs to different snapshots- set it at startup only
+  static void
+  SetReadOnlyEpochMultiplier(uint64_t m)
+  {
+    ALWAYS_ASSERT(m >= 1);
+    g_flags->g_read_only_epoch_multiplier.store(m, std::memory_order_release);
+  }
 
-  static const uint64_t ReadOnlyEpochUsec =
-    ticker::tick_us * ReadOnlyEpochMultiplier;
+  static inline uint64_t
+  ReadOnlyEpochUsec()
+  {
+    return ticker::tick_us() * ReadOnlyEpochMultiplier();
+  }
 
-  static inline uint64_t constexpr
+  static inline ALWAYS_INLINE uint64_t
   to_read_only_tick(uint64_t epoch_tick)
   {
-    return epoch_tick / ReadOnlyEpochMultiplier;
+    return epoch_tick / ReadOnlyEpochMultiplier();
   }
 
   // in this protocol, the version number is:
@@ -429,8 +995,9 @@ public:
   static uint64_t
   ComputeReadOnlyTid(uint64_t global_tick_ex)
   {
-    const uint64_t a = (global_tick_ex / ReadOnlyEpochMultiplier);
-    const uint64_t b = a * ReadOnlyEpochMultiplier;
+    const uint64_t m = ReadOnlyEpochMultiplier();
+    const uint64_t a = (global_tick_ex / m);
+    const uint64_t b = a * m;
 
     // want to read entries <= b-1, special casing for b=0
     if (!b)
@@ -573,31 +1140,33 @@ protected:
 
   // helper methods
   static inline txn_logger::pbuffer *
-  wait_for_head(txn_logger::pbuffer_circbuf &pull_buf)
+  wait_for_head(txn_logger::persist_ctx &ctx)
   {
-    // XXX(stephentu): spinning for now
-    txn_logger::pbuffer *px;
-    while (unlikely(!(px = pull_buf.peek()))) {
-      nop_pause();
+    txn_logger::pbuffer *px = ctx.all_buffers_.peek();
+    if (unlikely(!px)) {
+      // all of the core's buffers are with the logger, so rather than wait
+      // for one to come back, borrow one
       ++g_evt_worker_thread_wait_log_buffer;
+      ctx.all_buffers_.enq(txn_logger::borrow_buffer(ctx));
+      px = ctx.all_buffers_.peek();
+      INVARIANT(px);
     }
     INVARIANT(!px->io_scheduled_);
     return px;
   }
 
-  // pushes horizon to the front entry of pull_buf, pushing
-  // to push_buf if necessary
+  // pushes the horizon of ctx to the front entry of its all_buffers_,
+  // pushing to its persist_buffers_ if necessary
   //
   // horizon is reset after push_horizon_to_buffer() returns
   //
   // returns the number of txns pushed from buffer to *logger*
   // (if doing so was necessary)
   static inline size_t
-  push_horizon_to_buffer(txn_logger::pbuffer *horizon,
-                         void *lz4ctx,
-                         txn_logger::pbuffer_circbuf &pull_buf,
-                         txn_logger::pbuffer_circbuf &push_buf)
+  push_horizon_to_buffer(txn_logger::persist_ctx &ctx)
   {
+    txn_logger::pbuffer * const horizon = ctx.horizon_;
+    txn_logger::pbuffer_circbuf &pull_buf = ctx.all_buffers_;
     INVARIANT(txn_logger::IsCompressionEnabled());
     if (unlikely(!horizon->header()->nentries_))
       return 0;
@@ -606,7 +1175,7 @@ protected:
     size_t ntxns_pushed_to_logger = 0;
 
     // horizon out of space- try to push horizon to buffer
-    txn_logger::pbuffer *px = wait_for_head(pull_buf);
+    txn_logger::pbuffer *px = wait_for_head(ctx);
     const uint64_t compressed_space_needed =
       sizeof(uint32_t) + LZ4_compressBound(horizon->datasize());
 
@@ -618,8 +1187,8 @@ protected:
       ntxns_pushed_to_logger = px->header()->nentries_;
       txn_logger::pbuffer *px1 = pull_buf.deq();
       INVARIANT(px == px1);
-      push_buf.enq(px1);
-      px = wait_for_head(pull_buf);
+      txn_logger::push_buffer(ctx, px1);
+      px = wait_for_head(ctx);
       if (buffer_cond)
         ++txn_logger::g_evt_log_buffer_epoch_boundary;
       else
@@ -636,7 +1205,7 @@ protected:
     util::timer tt;
 #endif
     const int ret = LZ4_compress_heap_limitedOutput(
-        lz4ctx,
+        ctx.lz4ctx_,
         (const char *) horizon->datastart(),
         (char *) px->pointer() + sizeof(uint32_t),
         horizon->datasize(),
@@ -685,7 +1254,10 @@ protected:
   struct flags {
     std::atomic<bool> g_gc_init;
     std::atomic<bool> g_disable_snapshots;
-    constexpr flags() : g_gc_init(false), g_disable_snapshots(false) {}
+    std::atomic<uint64_t> g_read_only_epoch_multiplier;
+    constexpr flags()
+      : g_gc_init(false), g_disable_snapshots(false),
+        g_read_only_epoch_multiplier(DefaultReadOnlyEpochMultiplier) {}
   };
   static util::aligned_padded_elem<flags> g_flags;
 
@@ -734,6 +1306,9 @@ public:
       const uint64_t global_tick_ex =
         this->rcu_guard_->guard()->impl().global_last_tick_exclusive();
       u_.last_consistent_tid = ComputeReadOnlyTid(global_tick_ex);
+    } else {
+      // set by gen_commit_tid(), if the txn has writes
+      u_.commit_epoch = 0;
     }
 #ifdef TUPLE_LOCK_OWNERSHIP_CHECKING
     dbtuple::TupleLockRegionBegin();
@@ -805,6 +1380,8 @@ public:
     write_set_u32_vec value_sizes;
     for (unsigned idx = 0; idx < nwrites; idx++) {
       const transaction_base::write_record_t &rec = this->write_set[idx];
+      const uint32_t table_id = rec.get_table_id();
+      space_needed += vs_uint32_t.nbytes(&table_id);
       const uint32_t k_nbytes = rec.get_key().size();
       space_needed += vs_uint32_t.nbytes(&k_nbytes);
       space_needed += k_nbytes;
@@ -830,11 +1407,10 @@ public:
     txn_logger::persist_stats &stats =
       txn_logger::g_persist_stats[my_core_id];
     txn_logger::pbuffer_circbuf &pull_buf = ctx.all_buffers_;
-    txn_logger::pbuffer_circbuf &push_buf = ctx.persist_buffers_;
 
     util::non_atomic_fetch_add(stats.ntxns_committed_, 1UL);
 
-    const bool do_compress = txn_logger::IsCompressionEnabled();
+    const bool do_compress = txn_logger::IsWorkerCompression();
     if (do_compress) {
       // try placing in horizon
       bool horizon_cond = false;
@@ -847,8 +1423,7 @@ public:
         }
         INVARIANT(ctx.horizon_->datasize());
         // horizon out of space, so we push it
-        const uint64_t npushed =
-          push_horizon_to_buffer(ctx.horizon_, ctx.lz4ctx_, pull_buf, push_buf);
+        const uint64_t npushed = push_horizon_to_buffer(ctx);
         if (npushed)
           util::non_atomic_fetch_add(stats.ntxns_pushed_, npushed);
       }
@@ -862,7 +1437,7 @@ public:
     } else {
 
     retry:
-      txn_logger::pbuffer *px = wait_for_head(pull_buf);
+      txn_logger::pbuffer *px = wait_for_head(ctx);
       INVARIANT(px && px->core_id_ == my_core_id);
       bool cond = false;
       if (px->space_remaining() < space_needed ||
@@ -872,7 +1447,7 @@ public:
         INVARIANT(px == px0);
         INVARIANT(px0->header()->nentries_);
         util::non_atomic_fetch_add(stats.ntxns_pushed_, px0->header()->nentries_);
-        push_buf.enq(px0);
+        txn_logger::push_buffer(ctx, px0);
         if (cond)
           ++txn_logger::g_evt_log_buffer_epoch_boundary;
         else
@@ -921,6 +1496,7 @@ private:
 
     for (unsigned idx = 0; idx < nwrites; idx++) {
       const transaction_base::write_record_t &rec = this->write_set[idx];
+      p = vs_uint32_t.write(p, rec.get_table_id());
       const uint32_t k_nbytes = rec.get_key().size();
       p = vs_uint32_t.write(p, k_nbytes);
       NDB_MEMCPY(p, rec.get_key().data(), k_nbytes);
@@ -960,6 +1536,28 @@ public:
     return u_.last_consistent_tid;
   }
 
+  // only valid once commit() returned true. clients can acknowledge the
+  // txn once the token is durable, without blocking on it (see
+  // txn_logger::on_durable())
+  txn_logger::durability_token
+  get_durability_token() const
+  {
+    INVARIANT(this->state == transaction_base::TXN_COMMITED);
+    if (!txn_logger::IsPersistenceEnabled())
+      return txn_logger::durability_token();
+    if (this->is_snapshot()) {
+      if (snapshot_tid() != dbtuple::MAX_TID)
+        // only read values from epochs <= the snapshot's
+        return txn_logger::durability_token(EpochId(u_.last_consistent_tid));
+    } else if (u_.commit_epoch) {
+      return txn_logger::durability_token(u_.commit_epoch);
+    }
+    // a read-only txn may have read values written as late as the current
+    // epoch
+    return txn_logger::durability_token(
+        ticker::s_instance.global_current_tick());
+  }
+
   void
   dump_debug_info() const
   {
@@ -1224,12 +1822,10 @@ struct txn_epoch_sync<transaction_proto2> : public transaction_proto2_static {
     txn_logger::persist_stats &stats =
       txn_logger::g_persist_stats[my_core_id];
     txn_logger::pbuffer_circbuf &pull_buf = ctx.all_buffers_;
-    txn_logger::pbuffer_circbuf &push_buf = ctx.persist_buffers_;
-    if (txn_logger::IsCompressionEnabled() &&
+    if (txn_logger::IsWorkerCompression() &&
         ctx.horizon_->header()->nentries_) {
       INVARIANT(ctx.horizon_->datasize());
-      const uint64_t npushed =
-        push_horizon_to_buffer(ctx.horizon_, ctx.lz4ctx_, pull_buf, push_buf);
+      const uint64_t npushed = push_horizon_to_buffer(ctx);
       if (npushed)
         util::non_atomic_fetch_add(stats.ntxns_pushed_, npushed);
     }
@@ -1244,7 +1840,7 @@ struct txn_epoch_sync<transaction_proto2> : public transaction_proto2_static {
     txn_logger::pbuffer *px0 = pull_buf.deq();
     util::non_atomic_fetch_add(stats.ntxns_pushed_, px0->header()->nentries_);
     INVARIANT(px0 == px);
-    push_buf.enq(px0);
+    txn_logger::push_buffer(ctx, px0);
   }
   static std::tuple<uint64_t, uint64_t, double>
   compute_ntxn_persisted()
@@ -1260,6 +1856,13 @@ struct txn_epoch_sync<transaction_proto2> : public transaction_proto2_static {
       return;
     txn_logger::clear_ntxns_persisted_statistics();
   }
+  static std::map<std::string, log_linear_histogram>
+  compute_persist_histograms()
+  {
+    if (!txn_logger::IsPersistenceEnabled())
+      return std::map<std::string, log_linear_histogram>();
+    return txn_logger::compute_persist_histograms();
+  }
 };
 
 #endif /* _NDB_TXN_PROTO2_IMPL_H_ */
@@ -0,0 +1,414 @@
+#include <iostream>
+#include <algorithm>
+#include <thread>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <lz4.h>
+
+#include "txn_recovery.h"
+#include "record/serializer.h"
+#include "core.h"
+#include "util.h"
+
+using namespace std;
+using namespace util;
+
+typedef transaction_proto2_static proto;
+
+txn_log_recovery::stats
+txn_log_recovery::Recover(
+    const vector<string> &logfiles,
+    size_t npartitions,
+    const replay_fn &fn,
+    uint64_t checkpoint_tid,
+    uint64_t durable_epoch,
+    const is_full_fn &is_full)
+{
+  if (!npartitions)
+    npartitions = coreid::num_cpus_online();
+  INVARIANT(npartitions > 0);
+
+  stats s;
+  s.nfiles_ = logfiles.size();
+  timer t;
+
+  vector<scan_ctx *> ctxs;
+  vector<thread> scanners;
+  for (auto &fname : logfiles) {
+    ctxs.push_back(new scan_ctx(npartitions));
+    scanners.emplace_back(
+        &txn_log_recovery::scan_file,
+        &fname, ctxs.back());
+  }
+  for (auto &th : scanners)
+    th.join();
+  s.scan_ms_ = t.lap_ms();
+
+  for (auto ctx : ctxs) {
+    s.nbuffers_ += ctx->nbuffers_;
+    s.ntxns_ += ctx->ntxns_;
+    s.nwrites_ += ctx->nwrites_;
+    s.nbytes_truncated_ += ctx->nbytes_truncated_;
+  }
+
+  s.durable_epoch_ = (durable_epoch == ComputeDurableEpoch) ?
+    compute_durable_epoch(ctxs) : durable_epoch;
+
+  for (auto ctx : ctxs)
+    for (auto &p : ctx->epoch_ntxns_)
+      if (p.first > s.durable_epoch_)
+        s.ntxns_discarded_ += p.second;
+
+  vector<size_t> nkeys(npartitions, 0), nskipped(npartitions, 0);
+  vector<thread> replayers;
+  for (size_t i = 0; i < npartitions; i++)
+    replayers.emplace_back(
+        &txn_log_recovery::replay_partition,
+        i, &ctxs, checkpoint_tid, s.durable_epoch_,
+        &fn, &is_full, &nkeys[i], &nskipped[i]);
+  for (auto &th : replayers)
+    th.join();
+  s.replay_ms_ = t.lap_ms();
+
+  for (auto n : nkeys)
+    s.nkeys_replayed_ += n;
+  for (auto n : nskipped)
+    s.nwrites_skipped_ += n;
+  for (auto ctx : ctxs)
+    delete ctx;
+  return s;
+}
+
+static bool
+all_zeros(const uint8_t *p, const uint8_t *end)
+{
+  for (; p < end; p++)
+    if (*p)
+      return false;
+  return true;
+}
+
+void
+txn_log_recovery::scan_file(const string *fname, scan_ctx *ctx)
+{
+  const int fd = open(fname->c_str(), O_RDONLY);
+  if (fd == -1) {
+    perror("open");
+    ALWAYS_ASSERT(false);
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    perror("fstat");
+    ALWAYS_ASSERT(false);
+  }
+  const size_t fsize = st.st_size;
+  if (fsize < sizeof(txn_logger::log_segment_header)) {
+    // crashed before the segment header made it to disk
+    ctx->nbytes_truncated_ = fsize;
+    close(fd);
+    return;
+  }
+  void * const px = mmap(nullptr, fsize, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (px == MAP_FAILED) {
+    perror("mmap");
+    ALWAYS_ASSERT(false);
+  }
+  madvise(px, fsize, MADV_SEQUENTIAL);
+
+  const uint8_t * const begin = (const uint8_t *) px;
+  const uint8_t * const end = begin + fsize;
+  const uint8_t *p = begin;
+
+  if (all_zeros(begin, begin + sizeof(txn_logger::log_segment_header))) {
+    // crashed while the segment was being preallocated, so it was never
+    // written to
+    munmap(px, fsize);
+    close(fd);
+    return;
+  }
+
+  txn_logger::log_segment_header shdr;
+  NDB_MEMCPY(&shdr, p, sizeof(shdr));
+  if (shdr.magic_ != txn_logger::g_log_segment_magic ||
+      shdr.checksum_ != txn_logger::ComputeChecksum(shdr)) {
+    cerr << "[recovery] " << *fname << ": not a log segment" << endl;
+    ALWAYS_ASSERT(false);
+  }
+  if (shdr.version_ != txn_logger::g_log_format_version) {
+    cerr << "[recovery] " << *fname << ": unsupported log format version "
+         << shdr.version_ << endl;
+    ALWAYS_ASSERT(false);
+  }
+  const bool use_compression =
+    shdr.flags_ & txn_logger::log_segment_header::FLAGS_COMPRESSED;
+  // buffers written with O_DIRECT are padded out to a block
+  const size_t align =
+    (shdr.flags_ & txn_logger::log_segment_header::FLAGS_DIRECT_IO) ?
+      txn_logger::g_direct_io_align : 1;
+  auto next_buffer = [begin, end, align](const uint8_t *p) {
+    return min(begin + iceil(size_t(p - begin), align), end);
+  };
+  p = next_buffer(p + sizeof(shdr));
+
+  const size_t hdrsz = sizeof(txn_logger::logbuf_header);
+  unique_ptr<uint8_t[]> decompress_buf(
+      use_compression ? new uint8_t[txn_logger::g_buffer_size] : nullptr);
+  log_write_vec scratch;
+
+  // each iteration consumes one log buffer. a buffer which is cut short or
+  // fails its checksum can only be the result of a torn write at the tail of
+  // the file, so we stop there
+  while (size_t(end - p) >= hdrsz) {
+    txn_logger::logbuf_header hdr;
+    NDB_MEMCPY(&hdr, p, hdrsz);
+    const uint8_t * const q = p + hdrsz;
+    if (size_t(end - q) < hdr.nbytes_ ||
+        hdr.checksum_ != txn_logger::ComputeChecksum(hdr, q))
+      break;
+    const uint8_t * const qend = q + hdr.nbytes_;
+
+    if (!hdr.nentries_) {
+      // durable epoch marker
+      if (hdr.nbytes_)
+        break;
+      ctx->marker_epoch_ = max(ctx->marker_epoch_, hdr.last_tid_);
+      p = next_buffer(qend);
+      continue;
+    }
+
+    if (!proto::EpochId(hdr.last_tid_))
+      break;
+
+    // from here on, the buffer passed its checksum, so failing to decode it
+    // means it was written wrong
+    scratch.clear();
+    decode_buffer(hdr, q, decompress_buf.get(), scratch);
+
+    for (auto &w : scratch)
+      ctx->partitions_[partition_of(w, ctx->partitions_.size())].emplace_back(move(w));
+    const uint64_t epoch = proto::EpochId(hdr.last_tid_);
+    const uint64_t core = proto::CoreId(hdr.last_tid_);
+    ctx->core_max_epochs_[core] = max(ctx->core_max_epochs_[core], epoch);
+    ctx->epoch_ntxns_[epoch] += hdr.nentries_;
+    ctx->nbuffers_++;
+    ctx->ntxns_ += hdr.nentries_;
+    ctx->nwrites_ += scratch.size();
+    p = next_buffer(qend);
+  }
+
+  // the rest of a preallocated segment is zeros, which isn't a torn write
+  ctx->nbytes_truncated_ = all_zeros(p, end) ? 0 : end - p;
+  if (ctx->nbytes_truncated_)
+    cerr << "[recovery] " << *fname << ": ignoring "
+         << ctx->nbytes_truncated_ << " bytes of torn writes at offset "
+         << (p - begin) << endl;
+
+  munmap(px, fsize);
+  close(fd);
+}
+
+void
+txn_log_recovery::decode_buffer(
+    const txn_logger::logbuf_header &hdr, const uint8_t *data,
+    uint8_t *decompress_buf, log_write_vec &scratch)
+{
+  INVARIANT(hdr.nentries_);
+  const uint8_t * const end = data + hdr.nbytes_;
+  uint64_t decoded_last_tid = 0;
+  if (!decompress_buf) {
+    const uint8_t *d = data;
+    const ssize_t ret = decode_txns(
+        d, end, hdr.last_tid_, hdr.nentries_,
+        decoded_last_tid, scratch);
+    ALWAYS_ASSERT(ret == ssize_t(hdr.nentries_));
+    ALWAYS_ASSERT(d == end);
+  } else {
+    serializer<uint32_t, false> s_uint32_t;
+    const uint8_t *c = data;
+    size_t n = 0;
+    while (n < hdr.nentries_) {
+      uint32_t clen;
+      ALWAYS_ASSERT((c = s_uint32_t.failsafe_read(c, end - c, &clen)));
+      ALWAYS_ASSERT(size_t(end - c) >= clen);
+      const int dlen = LZ4_decompress_safe(
+          (const char *) c, (char *) decompress_buf,
+          clen, txn_logger::g_buffer_size);
+      ALWAYS_ASSERT(dlen > 0);
+      c += clen;
+      const uint8_t *d = decompress_buf;
+      const ssize_t ret = decode_txns(
+          d, d + dlen, hdr.last_tid_, hdr.nentries_ - n,
+          decoded_last_tid, scratch);
+      ALWAYS_ASSERT(ret > 0);
+      ALWAYS_ASSERT(d == decompress_buf + dlen);
+      n += ret;
+    }
+    ALWAYS_ASSERT(c == end);
+  }
+  ALWAYS_ASSERT(decoded_last_tid == hdr.last_tid_);
+}
+
+ssize_t
+txn_log_recovery::decode_txns(
+    const uint8_t *&p, const uint8_t *end,
+    uint64_t last_tid, size_t max_ntxns,
+    uint64_t &decoded_last_tid, log_write_vec &scratch)
+{
+  serializer<uint32_t, true> vs_uint32_t;
+  serializer<uint64_t, false> s_uint64_t;
+  const uint64_t epoch = proto::EpochId(last_tid);
+  const uint64_t core = proto::CoreId(last_tid);
+  size_t n = 0;
+  for (; n < max_ntxns && p < end; n++) {
+    uint64_t tid;
+    uint32_t nwrites;
+    if (!(p = s_uint64_t.failsafe_read(p, end - p, &tid)))
+      return -1;
+    // all txns in a buffer are from the same core and epoch
+    if (proto::EpochId(tid) != epoch || proto::CoreId(tid) != core)
+      return -1;
+    if (!(p = vs_uint32_t.failsafe_read(p, end - p, &nwrites)))
+      return -1;
+    for (uint32_t i = 0; i < nwrites; i++) {
+      uint32_t table_id, klen, vlen;
+      if (!(p = vs_uint32_t.failsafe_read(p, end - p, &table_id)))
+        return -1;
+      if (!(p = vs_uint32_t.failsafe_read(p, end - p, &klen)) ||
+          size_t(end - p) < klen)
+        return -1;
+      const uint8_t * const k = p;
+      p += klen;
+      if (!(p = vs_uint32_t.failsafe_read(p, end - p, &vlen)) ||
+          size_t(end - p) < vlen)
+        return -1;
+      scratch.emplace_back(tid, table_id, k, klen, p, vlen);
+      p += vlen;
+    }
+    decoded_last_tid = tid;
+  }
+  return n;
+}
+
+uint64_t
+txn_log_recovery::compute_durable_epoch(const vector<scan_ctx *> &ctxs)
+{
+  // the loggers periodically write durable epoch markers, which are the
+  // best source of truth. but since they are only written along with log
+  // buffers, we also compute two lower bounds on the epoch the system
+  // considered durable at crash time, any of which is safe to use:
+  //
+  //   (1) buffers of a core are written in order, and each buffer holds
+  //       exactly one epoch, so seeing epoch e from core c means all of
+  //       c's txns in epochs < e made it to disk. taking the min over all
+  //       cores gives a frontier (the same one the writers compute)
+  //
+  //   (2) a writer never writes a buffer with epoch >= system_sync_epoch_
+  //       + 1 + g_max_lag_epochs, so seeing epoch e anywhere means the
+  //       system had already made e - g_max_lag_epochs durable
+  //
+  // (1) is tighter for busy cores, (2) keeps cores which went idle early
+  // (e.g. loader threads) from dragging the frontier down
+  //
+  // all of these may still be slightly behind system_sync_epoch_ at crash
+  // time
+  uint64_t marker_epoch = 0;
+  for (auto ctx : ctxs)
+    marker_epoch = max(marker_epoch, ctx->marker_epoch_);
+  uint64_t min_prefix = numeric_limits<uint64_t>::max();
+  uint64_t max_epoch = 0;
+  for (size_t c = 0; c < NMAXCORES; c++) {
+    uint64_t e = 0;
+    for (auto ctx : ctxs)
+      e = max(e, ctx->core_max_epochs_[c]);
+    if (!e)
+      continue;
+    min_prefix = min(min_prefix, e - 1);
+    max_epoch = max(max_epoch, e);
+  }
+  if (!max_epoch)
+    return marker_epoch;
+  const uint64_t lag_bound =
+    (max_epoch > txn_logger::g_max_lag_epochs) ?
+      (max_epoch - txn_logger::g_max_lag_epochs) : 0;
+  return max(marker_epoch, max(min_prefix, lag_bound));
+}
+
+void
+txn_log_recovery::replay_partition(
+    unsigned partition,
+    const vector<scan_ctx *> *ctxs,
+    uint64_t checkpoint_tid,
+    uint64_t durable_epoch,
+    const replay_fn *fn,
+    const is_full_fn *is_full,
+    size_t *nkeys,
+    size_t *nskipped)
+{
+  // the replay thread owns this partition of every scan_ctx
+  vector<log_write *> writes;
+  size_t nskip = 0;
+  for (auto ctx : *ctxs) {
+    for (auto &w : ctx->partitions_[partition]) {
+      if (proto::EpochId(w.tid_) > durable_epoch)
+        continue;
+      if (w.tid_ <= checkpoint_tid) {
+        nskip++;
+        continue;
+      }
+      writes.push_back(&w);
+    }
+  }
+  *nkeys = replay_writes(partition, writes, *fn, *is_full);
+  *nskipped = nskip;
+}
+
+size_t
+txn_log_recovery::replay_writes(
+    unsigned partition,
+    const vector<log_write *> &writes,
+    const replay_fn &fn,
+    const is_full_fn &is_full)
+{
+  // the caller owns the writes, so we are free to steal the keys
+  unordered_map<unsigned, unordered_map<string, const log_write *>> latest;
+  unordered_map<unsigned, unordered_map<string, vector<const log_write *>>> chains;
+  for (auto w : writes) {
+    if (is_full) {
+      chains[w->table_id_][w->key_].push_back(w);
+      continue;
+    }
+    auto &m = latest[w->table_id_];
+    auto it = m.find(w->key_);
+    if (it == m.end())
+      m.emplace(move(w->key_), w);
+    else if (it->second->tid_ < w->tid_)
+      it->second = w;
+  }
+  size_t n = 0;
+  for (auto &t : latest) {
+    for (auto &p : t.second)
+      fn(partition, t.first, p.first, p.second->value_, p.second->tid_);
+    n += t.second.size();
+  }
+  for (auto &t : chains) {
+    for (auto &p : t.second) {
+      vector<const log_write *> &chain = p.second;
+      sort(chain.begin(), chain.end(),
+          [](const log_write *a, const log_write *b) { return a->tid_ < b->tid_; });
+      // everything before the latest full record is overwritten by it
+      size_t start = chain.size() - 1;
+      while (start > 0 &&
+             !chain[start]->value_.empty() &&
+             !is_full(t.first, chain[start]->value_))
+        start--;
+      for (size_t i = start; i < chain.size(); i++)
+        fn(partition, t.first, p.first, chain[i]->value_, chain[i]->tid_);
+      n += chain.size() - start;
+    }
+  }
+  return n;
+}
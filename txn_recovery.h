@@ -0,0 +1,340 @@
+#ifndef _NDB_TXN_RECOVERY_H_
+#define _NDB_TXN_RECOVERY_H_
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <functional>
+
+#include "macros.h"
+#include "txn.h"
+#include "txn_btree.h"
+#include "typed_txn_btree.h"
+#include "txn_proto2_impl.h"
+
+// crash recovery for the logging subsystem (see txn_logger)
+//
+// recovery happens in two parallel phases:
+//   (A) one scanner thread per log file verifies and decodes every complete
+//       log buffer in the file, routing each write to a replay partition by
+//       (table id, key) hash
+//   (B) once all files are scanned, the durable epoch frontier is computed,
+//       and one replay thread per partition keeps, for each (table id, key),
+//       the write with the highest TID whose epoch is <= the frontier, and
+//       hands it to the replay callback (or, for tables logging field
+//       deltas, every write since the key's last full record)
+//
+// the log segments must be recovered *before* txn_logger::Init() is called
+// on their log files, since Init() removes existing segments. use
+// txn_logger::ListSegments() to find the segments of a log file
+class txn_log_recovery {
+public:
+
+  // invoked once per recovered key (but see is_full_fn), from replay
+  // thread number partition. calls for the same (table_id, key) always
+  // come from the same partition. table_id is base_txn_btree::get_table_id()
+  // of the logging process. an empty value means the latest durable write
+  // removed the key.
+  //
+  // the value is handed back exactly as the tuple writer logged it
+  // (TUPLE_WRITER_DO_DELTA_WRITE)
+  typedef std::function<
+    void (unsigned partition,
+          unsigned table_id,
+          const std::string &key,
+          const std::string &value,
+          uint64_t tid)> replay_fn;
+
+  // whether a (non-empty) value logged for table_id is a full record, as
+  // opposed to a delta which only makes sense on top of the older version
+  // of its record (see typed_txn_btree_::IsFullDelta()).
+  //
+  // when one is given, fn is handed every write of a key starting from its
+  // latest full record (or the checkpoint, if there is none), in TID order,
+  // instead of just the latest write
+  typedef std::function<
+    bool (unsigned table_id, const std::string &value)> is_full_fn;
+
+  static const uint64_t ComputeDurableEpoch = uint64_t(-1);
+
+  struct stats {
+    size_t nfiles_;
+    size_t nbuffers_;         // complete log buffers read (excluding markers)
+    size_t ntxns_;            // txns read
+    size_t ntxns_discarded_;  // txns read, but past the durable epoch
+    size_t nwrites_skipped_;  // writes read, but covered by the checkpoint
+    size_t nwrites_;          // writes read
+    size_t nkeys_replayed_;   // # of replay callback invocations
+    size_t nbytes_truncated_; // bytes at file tails which were not decodable
+    uint64_t durable_epoch_;  // the frontier used for recovery
+    double scan_ms_;
+    double replay_ms_;
+
+    stats()
+      : nfiles_(0), nbuffers_(0), ntxns_(0), ntxns_discarded_(0),
+        nwrites_skipped_(0), nwrites_(0), nkeys_replayed_(0), nbytes_truncated_(0),
+        durable_epoch_(0), scan_ms_(0.0), replay_ms_(0.0) {}
+  };
+
+  // replay logfiles with npartitions replay threads (0 means one per
+  // online cpu).
+  //
+  // writes with TID <= checkpoint_tid are skipped, since they are already
+  // reflected by the checkpoint which was loaded before (see
+  // txn_checkpoint::Load())
+  //
+  // if durable_epoch is ComputeDurableEpoch, then the frontier is derived
+  // from the files themselves (see compute_durable_epoch())
+  static stats
+  Recover(const std::vector<std::string> &logfiles,
+          size_t npartitions,
+          const replay_fn &fn,
+          uint64_t checkpoint_tid = 0,
+          uint64_t durable_epoch = ComputeDurableEpoch,
+          const is_full_fn &is_full = is_full_fn());
+
+private:
+  // shares the decoding and replay of log buffers
+  friend class txn_log_follower;
+
+  struct log_write {
+    uint64_t tid_;
+    unsigned table_id_;
+    std::string key_;
+    std::string value_;
+    log_write(uint64_t tid, unsigned table_id,
+              const uint8_t *k, size_t klen,
+              const uint8_t *v, size_t vlen)
+      : tid_(tid), table_id_(table_id),
+        key_((const char *) k, klen), value_((const char *) v, vlen) {}
+  };
+
+  typedef std::vector<log_write> log_write_vec;
+
+  // the replay partition (of npartitions) which owns w's key
+  static inline size_t
+  partition_of(const log_write &w, size_t npartitions)
+  {
+    return (std::hash<std::string>()(w.key_) ^ w.table_id_) % npartitions;
+  }
+
+  struct scan_ctx {
+    std::vector<log_write_vec> partitions_;
+    // max epoch of a complete buffer, per core
+    std::vector<uint64_t> core_max_epochs_;
+    // # of txns read, per epoch
+    std::map<uint64_t, size_t> epoch_ntxns_;
+    // largest epoch from a durable epoch marker
+    uint64_t marker_epoch_;
+    size_t nbuffers_;
+    size_t ntxns_;
+    size_t nwrites_;
+    size_t nbytes_truncated_;
+    scan_ctx(size_t npartitions)
+      : partitions_(npartitions),
+        core_max_epochs_(NMAXCORES, 0),
+        marker_epoch_(0), nbuffers_(0), ntxns_(0), nwrites_(0), nbytes_truncated_(0) {}
+  };
+
+  static void
+  scan_file(const std::string *fname, scan_ctx *ctx);
+
+  // decodes up to max_ntxns txns starting at p (but not past end),
+  // belonging to a buffer whose last txn has TID last_tid. advances p past
+  // the decoded txns, and returns the number decoded, or -1 if the bytes
+  // are not a well formed sequence of txns
+  // appends the writes of the (checksummed) log buffer hdr, whose bytes
+  // start at data, to scratch. decompress_buf is a g_buffer_size bytes
+  // scratch buffer if the buffer is compressed, and null otherwise
+  static void
+  decode_buffer(const txn_logger::logbuf_header &hdr,
+                const uint8_t *data,
+                uint8_t *decompress_buf,
+                log_write_vec &scratch);
+
+  static ssize_t
+  decode_txns(const uint8_t *&p, const uint8_t *end,
+              uint64_t last_tid, size_t max_ntxns,
+              uint64_t &decoded_last_tid, log_write_vec &scratch);
+
+  // the largest epoch e such that all txns with epoch <= e are present in
+  // the files
+  static uint64_t
+  compute_durable_epoch(const std::vector<scan_ctx *> &ctxs);
+
+  static void
+  replay_partition(unsigned partition,
+                   const std::vector<scan_ctx *> *ctxs,
+                   uint64_t checkpoint_tid,
+                   uint64_t durable_epoch,
+                   const replay_fn *fn,
+                   const is_full_fn *is_full,
+                   size_t *nkeys,
+                   size_t *nskipped);
+
+  // hands writes (all of them owned by partition) to fn, the same way
+  // Recover() does: just the latest write of each key, or with is_full, its
+  // writes starting from its latest full record. returns the # of calls to
+  // fn. steals the keys of writes
+  static size_t
+  replay_writes(unsigned partition,
+                const std::vector<log_write *> &writes,
+                const replay_fn &fn,
+                const is_full_fn &is_full);
+};
+
+static inline std::ostream &
+operator<<(std::ostream &o, const txn_log_recovery::stats &s)
+{
+  o << "{nfiles=" << s.nfiles_
+    << ", nbuffers=" << s.nbuffers_
+    << ", ntxns=" << s.ntxns_
+    << ", ntxns_discarded=" << s.ntxns_discarded_
+    << ", nwrites_skipped=" << s.nwrites_skipped_
+    << ", nwrites=" << s.nwrites_
+    << ", nkeys_replayed=" << s.nkeys_replayed_
+    << ", nbytes_truncated=" << s.nbytes_truncated_
+    << ", durable_epoch=" << s.durable_epoch_
+    << ", scan_ms=" << s.scan_ms_
+    << ", replay_ms=" << s.replay_ms_ << "}";
+  return o;
+}
+
+// replays into txn_btrees, one txn per recovered key. the btrees must have
+// been constructed in the same order as in the logging process, so their
+// table ids match. values are assumed to be full records (as logged by
+// txn_btree's tuple writer).
+//
+// pass by std::ref() as the replay_fn, since this is not copyable
+template <template <typename> class Transaction,
+          typename Traits = default_transaction_traits>
+class txn_btree_replayer {
+public:
+  txn_btree_replayer(const std::vector<txn_btree<Transaction> *> &btrs,
+                     size_t npartitions)
+  {
+    for (auto btr : btrs)
+      btrs_[btr->get_table_id()] = btr;
+    for (size_t i = 0; i < npartitions; i++)
+      arenas_.emplace_back(new typename Traits::StringAllocator);
+  }
+
+  txn_btree_replayer(const txn_btree_replayer &) = delete;
+  txn_btree_replayer &operator=(const txn_btree_replayer &) = delete;
+
+  void
+  operator()(unsigned partition,
+             unsigned table_id,
+             const std::string &key,
+             const std::string &value,
+             uint64_t tid)
+  {
+    INVARIANT(partition < arenas_.size());
+    auto it = btrs_.find(table_id);
+    ALWAYS_ASSERT(it != btrs_.end());
+    typename Traits::StringAllocator &arena = *arenas_[partition];
+    arena.reset();
+    Transaction<Traits> t(0, arena);
+    if (value.empty())
+      it->second->remove(t, key);
+    else
+      it->second->put(t, key, value);
+    // partitions own disjoint keys, so replay txns cannot conflict
+    ALWAYS_ASSERT(t.commit(false));
+  }
+
+private:
+  std::map<unsigned, txn_btree<Transaction> *> btrs_;
+  std::vector<std::unique_ptr<typename Traits::StringAllocator>> arenas_;
+};
+
+// replays into typed_txn_btrees, whose values are logged as field deltas
+// (see typed_txn_btree_::ApplyDelta()). a partial update is applied on top
+// of the record as it stands in the btree, which is the checkpointed
+// version or the result of an earlier replay, so is_full() must be passed
+// to txn_log_recovery::Recover() along with this.
+//
+// as with txn_btree_replayer, the btrees must have been constructed in the
+// same order as in the logging process. pass by std::ref()
+template <template <typename> class Transaction,
+          typename Traits = default_transaction_traits>
+class typed_txn_btree_replayer {
+public:
+  typed_txn_btree_replayer(size_t npartitions)
+  {
+    for (size_t i = 0; i < npartitions; i++)
+      arenas_.emplace_back(new typename Traits::StringAllocator);
+  }
+
+  typed_txn_btree_replayer(const typed_txn_btree_replayer &) = delete;
+  typed_txn_btree_replayer &operator=(const typed_txn_btree_replayer &) = delete;
+
+  // not thread-safe, add all the btrees before recovering
+  template <typename Schema>
+  void
+  add(typed_txn_btree<Transaction, Schema> *btr)
+  {
+    typedef typed_txn_btree_<Schema> codec;
+    table &tbl = tables_[btr->get_table_id()];
+    tbl.is_full_ = &codec::IsFullDelta;
+    tbl.replay_ = [btr](Transaction<Traits> &t,
+                        const std::string &key,
+                        const std::string &value) {
+      const typename Schema::key_encoder_type key_encoder;
+      typename Schema::key_type k;
+      key_encoder.read(key, &k);
+      typename Schema::value_type v;
+      if (value.empty() || !codec::DeltaFields(value)) {
+        btr->remove(t, k);
+      } else {
+        if (!codec::IsFullDelta(value))
+          ALWAYS_ASSERT(btr->search(t, k, v));
+        codec::ApplyDelta(value, &v);
+        btr->put(t, k, v);
+      }
+      // commits before v goes away, as with Traits::stable_input_memory the
+      // txn only holds a pointer to it. partitions own disjoint keys, so
+      // replay txns cannot conflict
+      ALWAYS_ASSERT(t.commit(false));
+    };
+  }
+
+  bool
+  is_full(unsigned table_id, const std::string &value) const
+  {
+    auto it = tables_.find(table_id);
+    ALWAYS_ASSERT(it != tables_.end());
+    return it->second.is_full_(value);
+  }
+
+  void
+  operator()(unsigned partition,
+             unsigned table_id,
+             const std::string &key,
+             const std::string &value,
+             uint64_t tid)
+  {
+    INVARIANT(partition < arenas_.size());
+    auto it = tables_.find(table_id);
+    ALWAYS_ASSERT(it != tables_.end());
+    typename Traits::StringAllocator &arena = *arenas_[partition];
+    arena.reset();
+    Transaction<Traits> t(0, arena);
+    it->second.replay_(t, key, value);
+  }
+
+private:
+  struct table {
+    bool (*is_full_)(const std::string &);
+    std::function<
+      void (Transaction<Traits> &,
+            const std::string &,
+            const std::string &)> replay_;
+  };
+  std::map<unsigned, table> tables_;
+  std::vector<std::unique_ptr<typename Traits::StringAllocator>> arenas_;
+};
+
+#endif /* _NDB_TXN_RECOVERY_H_ */
@@ -3,7 +3,9 @@
 
 #include "base_txn_btree.h"
 #include "txn_btree.h"
+#include "core.h"
 #include "record/cursor.h"
+#include "record/serializer.h"
 
 template <typename Schema>
 struct typed_txn_btree_ {
@@ -15,9 +17,13 @@ struct typed_txn_btree_ {
   typedef typename Schema::key_encoder_type key_encoder_type;
   typedef typename Schema::value_encoder_type value_encoder_type;
 
-  static_assert(value_descriptor_type::nfields() <= 64, "xx");
+  static_assert(value_descriptor_type::nfields() < 64, "xx");
   static const uint64_t AllFieldsMask = (1UL << value_descriptor_type::nfields()) - 1;
 
+  // set in the fields mask of a delta record which adds its fields to the
+  // record, rather than setting them (see increment_writer())
+  static const uint64_t IncrementDeltaFlag = 1UL << 63;
+
   static inline constexpr bool
   IsAllFields(uint64_t m)
   {
@@ -305,6 +311,167 @@ struct typed_txn_btree_ {
     INVARIANT(buf - orig_buf == ptrdiff_t(sz));
   }
 
+  // a delta record (as written by do_delta_write_standalone()) is the
+  // fields mask, followed by the encodings of just those fields. deltas
+  // of inserts and full puts carry all fields, and removes carry none.
+  // increments (do_increment_delta_write()) carry the amounts added to
+  // their fields, with IncrementDeltaFlag set
+
+  static inline uint64_t
+  DeltaFields(const std::string &delta)
+  {
+    INVARIANT(delta.size() >= sizeof(uint64_t));
+    serializer<uint64_t, false> s_uint64_t;
+    uint64_t fields;
+    s_uint64_t.read((const uint8_t *) delta.data(), &fields);
+    return fields & ~IncrementDeltaFlag;
+  }
+
+  static inline bool
+  IsIncrementDelta(const std::string &delta)
+  {
+    INVARIANT(delta.size() >= sizeof(uint64_t));
+    serializer<uint64_t, false> s_uint64_t;
+    uint64_t fields;
+    s_uint64_t.read((const uint8_t *) delta.data(), &fields);
+    return fields & IncrementDeltaFlag;
+  }
+
+  // does the delta stand on its own, without an older version of the record?
+  static inline bool
+  IsFullDelta(const std::string &delta)
+  {
+    if (IsIncrementDelta(delta))
+      return false;
+    const uint64_t fields = DeltaFields(delta);
+    return fields == 0 || IsAllFields(fields);
+  }
+
+  // applies the fields of a (non-remove) delta to v
+  static inline void
+  ApplyDelta(const std::string &delta, value_type *v)
+  {
+    const uint64_t fields = DeltaFields(delta);
+    INVARIANT(fields);
+    const uint8_t *buf = (const uint8_t *) delta.data() + sizeof(uint64_t);
+    if (IsIncrementDelta(delta)) {
+      value_type amounts;
+      for (uint64_t i = 0; i < value_descriptor_type::nfields(); i++) {
+        if ((1UL << i) & fields) {
+          const size_t off = value_descriptor_type::cstruct_offsetof(i);
+          buf = value_descriptor_type::read_fn(i)(
+              buf, reinterpret_cast<uint8_t *>(&amounts) + off);
+        }
+      }
+      INVARIANT(buf == (const uint8_t *) delta.data() + delta.size());
+      AddFields(v, &amounts, fields);
+      return;
+    }
+    if (IsAllFields(fields)) {
+      const value_encoder_type value_encoder;
+      value_encoder.read(buf, v);
+      return;
+    }
+    for (uint64_t i = 0; i < value_descriptor_type::nfields(); i++) {
+      if ((1UL << i) & fields) {
+        uint8_t * const px = reinterpret_cast<uint8_t *>(v) +
+          value_descriptor_type::cstruct_offsetof(i);
+        buf = value_descriptor_type::read_fn(i)(buf, px);
+      }
+    }
+    INVARIANT(buf == (const uint8_t *) delta.data() + delta.size());
+  }
+
+  // adds the fields of amounts to those of v. the fields must be numeric
+  static inline void
+  AddFields(value_type *v, const value_type *amounts, uint64_t fields)
+  {
+    for (uint64_t i = 0; i < value_descriptor_type::nfields(); i++) {
+      if ((1UL << i) & fields) {
+        const size_t off = value_descriptor_type::cstruct_offsetof(i);
+        const generic_add_fn add = value_descriptor_type::add_fn(i);
+        ALWAYS_ASSERT(add);
+        add(reinterpret_cast<uint8_t *>(v) + off,
+            reinterpret_cast<const uint8_t *>(amounts) + off);
+      }
+    }
+  }
+
+  static inline size_t
+  compute_needed_increment_delta(const value_type *amounts, uint64_t fields)
+  {
+    size_t size_needed = sizeof(uint64_t);
+    for (uint64_t i = 0; i < value_descriptor_type::nfields(); i++) {
+      if ((1UL << i) & fields) {
+        const uint8_t * px = reinterpret_cast<const uint8_t *>(amounts) +
+          value_descriptor_type::cstruct_offsetof(i);
+        size_needed += value_descriptor_type::nbytes_fn(i)(px);
+      }
+    }
+    return size_needed;
+  }
+
+  static inline void
+  do_increment_delta_write(
+      const value_type *amounts, uint64_t fields,
+      uint8_t *buf, size_t sz)
+  {
+    serializer<uint64_t, false> s_uint64_t;
+#ifdef CHECK_INVARIANTS
+    const uint8_t * const orig_buf = buf;
+#endif
+    buf = s_uint64_t.write(buf, fields | IncrementDeltaFlag);
+    for (uint64_t i = 0; i < value_descriptor_type::nfields(); i++) {
+      if ((1UL << i) & fields) {
+        const uint8_t * px = reinterpret_cast<const uint8_t *>(amounts) +
+          value_descriptor_type::cstruct_offsetof(i);
+        buf = value_descriptor_type::write_fn(i)(buf, px);
+      }
+    }
+    INVARIANT(buf - orig_buf == ptrdiff_t(sz));
+  }
+
+  // the latest version of the record, [p, p+sz), with the amounts in
+  // Fields of v added to it
+  template <uint64_t Fields>
+  static inline void
+  incremented_record(const void *v, const uint8_t *p, size_t sz, value_type *sum)
+  {
+    INVARIANT(sz);
+    ALWAYS_ASSERT(do_record_read(p, sz, Fields, sum));
+    AddFields(sum, reinterpret_cast<const value_type *>(v), Fields);
+  }
+
+  // the writer of typed_txn_btree::increment(). v holds the amounts to add
+  // to Fields, which is only done at commit, to whatever the record is then
+  template <uint64_t Fields>
+  static inline size_t
+  increment_writer(dbtuple::TupleWriterMode mode, const void *v, uint8_t *p, size_t sz)
+  {
+    static_assert(Fields && !(Fields & ~AllFieldsMask), "xx");
+    value_type sum;
+    switch (mode) {
+    case dbtuple::TUPLE_WRITER_NEEDS_OLD_VALUE:
+      return 1;
+    case dbtuple::TUPLE_WRITER_COMPUTE_NEEDED:
+      incremented_record<Fields>(v, p, sz, &sum);
+      return compute_needed_standalone(&sum, Fields, p, sz);
+    case dbtuple::TUPLE_WRITER_COMPUTE_DELTA_NEEDED:
+      return compute_needed_increment_delta(
+          reinterpret_cast<const value_type *>(v), Fields);
+    case dbtuple::TUPLE_WRITER_DO_WRITE:
+      incremented_record<Fields>(v, p, sz, &sum);
+      do_write_standalone(&sum, Fields, p, sz);
+      return 0;
+    case dbtuple::TUPLE_WRITER_DO_DELTA_WRITE:
+      do_increment_delta_write(
+          reinterpret_cast<const value_type *>(v), Fields, p, sz);
+      return 0;
+    }
+    ALWAYS_ASSERT(false);
+    return 0;
+  }
+
   template <uint64_t Fields>
   static inline size_t
   tuple_writer(dbtuple::TupleWriterMode mode, const void *v, uint8_t *p, size_t sz)
@@ -453,6 +620,14 @@ public:
     : super_type(value_size_hint, mostly_append, name)
   {}
 
+  ~typed_txn_btree()
+  {
+    scoped_rcu_region guard;
+    for (auto &p : splits)
+      for (unsigned i = 0; i < p.second->nslices_; i++)
+        super_type::release_purged_tuple(p.second->slices_[i]);
+  }
+
   template <typename Traits, typename FieldsMask = AllFields>
   inline bool search(
       Transaction<Traits> &t, const key_type &k, value_type &v,
@@ -465,7 +640,8 @@ public:
       bool no_key_results = false /* skip decoding of keys? */,
       FieldsMask fm = FieldsMask());
 
-  // a lower-level variant which does not bother to decode the key/values
+  // a lower-level variant which does not bother to decode the key/values.
+  // the values of split() records are as stored, without their slices
   template <typename Traits>
   inline void bytes_search_range_call(
       Transaction<Traits> &t, const key_type &lower, const key_type *upper,
@@ -485,8 +661,103 @@ public:
   inline void remove(
       Transaction<Traits> &t, const key_type &k);
 
+  // adds the (numeric) fields fm of amounts to the record at k, as of
+  // commit. unlike a search() and put(), this reads nothing, so concurrent
+  // increments of a record never conflict with one another. returns false
+  // if there is no record at k.
+  //
+  // needs a txn which does not read its own writes. a txn may increment a
+  // record more than once, and put it afterwards, but not put it and then
+  // increment it
+  template <typename Traits, typename FieldsMask>
+  inline bool increment(
+      Transaction<Traits> &t, const key_type &k, const value_type &amounts,
+      FieldsMask fm);
+
+  // splits the (numeric) fields fm of the existing record at k, for
+  // counters which all cores increment() at once. the increments then go
+  // to a slice of the record private to the core, instead of all landing
+  // on one tuple, and readers of the fields add up the slices. the slices
+  // are tuples themselves, so a reader still conflicts with increments
+  // it misses, and readers of other fields do not look at them.
+  //
+  // split fields may only be changed by increment() afterwards, and the
+  // record may not be removed. not transactional, so call it before any
+  // txn uses k
+  template <typename FieldsMask>
+  void split(const key_type &k, FieldsMask fm);
+
 private:
 
+  // the amounts added to the fields_ of a split() record, by core. core i
+  // increments slices_[i % nslices_]
+  struct split_record {
+    // first, as the slices are cache aligned relative to the record,
+    // which plain new does not align
+    percore<dbtuple *> slices_;
+    uint64_t fields_;
+    unsigned nslices_;
+
+    static void *
+    operator new(size_t sz)
+    {
+      void *p = nullptr;
+      ALWAYS_ASSERT(!posix_memalign(&p, CACHELINE_SIZE, sz));
+      return p;
+    }
+    static void
+    operator delete(void *p)
+    {
+      free(p);
+    }
+  };
+
+  inline const split_record *
+  find_split(const std::string &k) const
+  {
+    if (likely(splits.empty()))
+      return nullptr;
+    auto it = splits.find(k);
+    return it == splits.end() ? nullptr : it->second.get();
+  }
+
+  template <typename Traits>
+  void add_split_slices(
+      Transaction<Traits> &t, const split_record &sr, uint64_t fields,
+      value_type &v) const;
+
+  // passes the records of a scan on with their split fields added up
+  template <typename Traits>
+  class split_search_range_callback : public search_range_callback {
+  public:
+    split_search_range_callback(
+        const typed_txn_btree *btr, Transaction<Traits> &t,
+        search_range_callback &callback, uint64_t fields)
+      : btr(btr), t(&t), callback(&callback), fields(fields) {}
+    virtual bool
+    invoke(const key_type &k, const value_type &v)
+    {
+      const split_record * const sr = btr->find_split(btr->key_encoder.write(&k));
+      if (!sr || !(sr->fields_ & fields))
+        return callback->invoke(k, v);
+      value_type sum = v;
+      btr->add_split_slices(*t, *sr, sr->fields_ & fields, sum);
+      return callback->invoke(k, sum);
+    }
+  private:
+    const typed_txn_btree *btr;
+    Transaction<Traits> *t;
+    search_range_callback *callback;
+    uint64_t fields;
+  };
+
+  template <uint64_t Fields>
+  static void
+  merge_increments(value_type *into, const value_type *amounts)
+  {
+    typed_txn_btree_<Schema>::AddFields(into, amounts, Fields);
+  }
+
   template <typename Traits>
   static inline const std::string *
   stablize(Transaction<Traits> &t, const key_type &k)
@@ -509,6 +780,9 @@ private:
 
   key_encoder_type key_encoder;
   value_encoder_type value_encoder;
+
+  // by encoded key. only changed by split()
+  std::map<std::string, std::unique_ptr<split_record>> splits;
 };
 
 template <template <typename> class Transaction, typename Schema>
@@ -520,7 +794,14 @@ typed_txn_btree<Transaction, Schema>::search(
 {
   // XXX: template single_value_reader with mask
   single_value_reader vr(v, FieldsMask::value);
-  return this->do_search(t, k, vr);
+  if (likely(splits.empty()))
+    return this->do_search(t, k, vr);
+  if (!this->do_search(t, k, vr))
+    return false;
+  const split_record * const sr = find_split(*stablize(t, k));
+  if (sr && (sr->fields_ & FieldsMask::value))
+    add_split_slices(t, *sr, sr->fields_ & FieldsMask::value, v);
+  return true;
 }
 
 template <template <typename> class Transaction, typename Schema>
@@ -533,9 +814,16 @@ typed_txn_btree<Transaction, Schema>::search_range_call(
     bool no_key_results,
     FieldsMask fm)
 {
-  key_reader kr(no_key_results);
   value_reader vr(FieldsMask::value);
-  this->do_search_range_call(t, lower, upper, callback, kr, vr);
+  if (likely(splits.empty())) {
+    key_reader kr(no_key_results);
+    this->do_search_range_call(t, lower, upper, callback, kr, vr);
+    return;
+  }
+  // the keys are needed to find split records
+  key_reader kr(false);
+  split_search_range_callback<Traits> c(this, t, callback, FieldsMask::value);
+  this->do_search_range_call(t, lower, upper, c, kr, vr);
 }
 
 template <template <typename> class Transaction, typename Schema>
@@ -563,7 +851,11 @@ typed_txn_btree<Transaction, Schema>::put(
   static_assert(IsSupportable<Traits>(), "xx");
   const dbtuple::tuple_writer_t tw =
     &typed_txn_btree_<Schema>::template tuple_writer<FieldsMask::value>;
-  this->do_tree_put(t, stablize(t, k), stablize(t, v), tw, false);
+  const std::string * const ks = stablize(t, k);
+  const split_record * const sr = find_split(*ks);
+  // the slices would be added to whatever is put
+  ALWAYS_ASSERT(!sr || !(sr->fields_ & FieldsMask::value));
+  this->do_tree_put(t, ks, stablize(t, v), tw, false);
 }
 
 template <template <typename> class Transaction, typename Schema>
@@ -575,7 +867,90 @@ typed_txn_btree<Transaction, Schema>::insert(
   static_assert(IsSupportable<Traits>(), "xx");
   const dbtuple::tuple_writer_t tw =
     &typed_txn_btree_<Schema>::template tuple_writer<AllFieldsMask>;
-  this->do_tree_put(t, stablize(t, k), stablize(t, v), tw, true);
+  const std::string * const ks = stablize(t, k);
+  ALWAYS_ASSERT(!find_split(*ks));
+  this->do_tree_put(t, ks, stablize(t, v), tw, true);
+}
+
+template <template <typename> class Transaction, typename Schema>
+template <typename Traits, typename FieldsMask>
+bool
+typed_txn_btree<Transaction, Schema>::increment(
+    Transaction<Traits> &t, const key_type &k, const value_type &amounts,
+    FieldsMask fm)
+{
+  static_assert(IsSupportable<Traits>(), "xx");
+  static_assert(!Traits::read_own_writes, "xx");
+  const dbtuple::tuple_writer_t tw =
+    &typed_txn_btree_<Schema>::template increment_writer<FieldsMask::value>;
+  // later increments of the record by the txn add up in this copy
+  std::string * const px = t.string_allocator()();
+  px->assign(reinterpret_cast<const char *>(&amounts), sizeof(amounts));
+  const std::string * const ks = stablize(t, k);
+  const value_type * const vx = reinterpret_cast<const value_type *>(&(*px)[0]);
+  const split_record * const sr = find_split(*ks);
+  if (unlikely(sr && (sr->fields_ & FieldsMask::value))) {
+    ALWAYS_ASSERT(!(FieldsMask::value & ~sr->fields_));
+    // split records are never removed, so there is nothing to check
+    t.ensure_active();
+    this->do_commutative_write(
+        t, sr->slices_[coreid::core_id() % sr->nslices_], ks, vx, tw,
+        &merge_increments<FieldsMask::value>, nullptr);
+    return true;
+  }
+  value_type exists;
+  single_value_reader vr(exists, 0);
+  return this->do_tree_commutative_put(
+      t, ks, vx, tw, &merge_increments<FieldsMask::value>, vr);
+}
+
+template <template <typename> class Transaction, typename Schema>
+template <typename FieldsMask>
+void
+typed_txn_btree<Transaction, Schema>::split(const key_type &k, FieldsMask fm)
+{
+  static_assert(FieldsMask::value && !(FieldsMask::value & ~AllFieldsMask), "xx");
+#ifdef DISABLE_OVERWRITE_IN_PLACE
+  // commit would replace the slices, which are in no tree, on every write
+  ALWAYS_ASSERT(false);
+#endif
+  const std::string ks = key_encoder.write(&k);
+  typename concurrent_btree::value_type bv = 0;
+  ALWAYS_ASSERT(this->underlying_btree.search(varkey(ks), bv));
+  ALWAYS_ASSERT(!reinterpret_cast<const dbtuple *>(bv)->is_deleting());
+  ALWAYS_ASSERT(!splits.count(ks));
+
+  value_type zero;
+  NDB_MEMSET(&zero, 0, sizeof(zero));
+  const size_t sz = value_encoder.nbytes(&zero);
+  std::unique_ptr<split_record> sr(new split_record);
+  sr->fields_ = FieldsMask::value;
+  sr->nslices_ = std::min(coreid::num_cpus_online(), coreid::NMaxCores);
+  for (unsigned i = 0; i < sr->nslices_; i++) {
+    // with room for any amounts, so that commit always writes a slice in
+    // place (see write_record_at())
+    dbtuple * const px = dbtuple::alloc_first(
+        sz, false, value_encoder_type::encode_max_nbytes());
+    value_encoder.write(px->get_value_start(), &zero);
+    px->version = dbtuple::MIN_TID;
+    sr->slices_[i] = px;
+  }
+  splits.emplace(ks, std::move(sr));
+}
+
+template <template <typename> class Transaction, typename Schema>
+template <typename Traits>
+void
+typed_txn_btree<Transaction, Schema>::add_split_slices(
+    Transaction<Traits> &t, const split_record &sr, uint64_t fields,
+    value_type &v) const
+{
+  for (unsigned i = 0; i < sr.nslices_; i++) {
+    value_type amounts;
+    single_value_reader vr(amounts, fields);
+    ALWAYS_ASSERT(super_type::do_outside_tuple_read(t, sr.slices_[i], vr));
+    typed_txn_btree_<Schema>::AddFields(&v, &amounts, fields);
+  }
 }
 
 template <template <typename> class Transaction, typename Schema>
@@ -587,7 +962,9 @@ typed_txn_btree<Transaction, Schema>::remove(
   static_assert(IsSupportable<Traits>(), "xx");
   const dbtuple::tuple_writer_t tw =
     &typed_txn_btree_<Schema>::template tuple_writer<0>;
-  this->do_tree_put(t, stablize(t, k), nullptr, tw, false);
+  const std::string * const ks = stablize(t, k);
+  ALWAYS_ASSERT(!find_split(*ks));
+  this->do_tree_put(t, ks, nullptr, tw, false);
 }
 
 #endif /* _NDB_TYPED_TXN_BTREE_H_ */
@@ -455,6 +455,11 @@ struct default_string_allocator {
   {
     // XXX: check px in strs
   }
+  inline void
+  reset()
+  {
+    strs.clear();
+  }
 private:
   std::vector<std::shared_ptr<std::string>> strs;
 };